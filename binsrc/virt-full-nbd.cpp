@@ -0,0 +1,92 @@
+/**
+ * @file
+ * @brief Serve a virtual full image by NBD while materializing it.
+ */
+#include "cybozu/option.hpp"
+#include "walb_diff_virt.hpp"
+#include "nbd_server.hpp"
+#include "walb_util.hpp"
+#include "easy_signal.hpp"
+
+using namespace walb;
+
+struct Option
+{
+    std::string inputPath;
+    StrVec inputWdiffs;
+    std::string outputPath;
+    std::string name;
+    std::string addr;
+    uint16_t port;
+    size_t maxConn;
+    std::string sizeStr;
+    std::string bufferSizeStr;
+    bool isDebug;
+
+    Option(int argc, char* argv[]) {
+        cybozu::Option opt;
+        opt.setDescription("Serve a virtual full image that consists of a base full image and wdiff files\n"
+                           "as a read-only NBD export without waiting for the whole image to be written.");
+        opt.appendMust(&inputPath, "i", "PATH: input full image path (seekable file or block device).");
+        opt.appendVec(&inputWdiffs, "d", "PATHS: input wdiff paths sorted by time.");
+        opt.appendOpt(&outputPath, "", "o", "PATH: materialize the image to the file or block device in background.");
+        opt.appendOpt(&name, "", "name", "NAME: export name. (default: '')");
+        opt.appendOpt(&addr, "localhost", "addr", "ADDR: listen address. '' means all the interfaces. (default: localhost)");
+        opt.appendOpt(&port, 10809, "p", "PORT: listen port. (default: 10809)");
+        opt.appendOpt(&maxConn, 4, "maxconn", "NUM: max number of connections. (default: 4)");
+        opt.appendOpt(&sizeStr, "0", "s", "SIZE: image size [byte]. (default: the input image size)");
+        opt.appendOpt(&bufferSizeStr, "1M", "b", "SIZE: IO size to materialize [byte]. (default: 1M)");
+        opt.appendBoolOpt(&isDebug, "debug", ": put debug messages to stderr.");
+        opt.appendHelp("h", ": show this message.");
+        if (!opt.parse(argc, argv)) {
+            opt.usage();
+            ::exit(1);
+        }
+    }
+    uint64_t sizeLb() const {
+        return cybozu::util::fromUnitIntString(sizeStr) / LOGICAL_BLOCK_SIZE;
+    }
+    size_t bufferSize() const {
+        return cybozu::util::fromUnitIntString(bufferSizeStr);
+    }
+};
+
+int doMain(int argc, char *argv[])
+{
+    Option opt(argc, argv);
+    util::setLogSetting("-", opt.isDebug);
+
+    VirtualFullImage image;
+    image.init(cybozu::util::File(opt.inputPath, O_RDONLY), opt.inputWdiffs, opt.sizeLb());
+    LOGs.info() << "virtual full image" << image.sizeLb() << image.getNrPieces() << image.statIn();
+
+    std::unique_ptr<VirtualFullMaterializer> matP;
+    nbd::ReadOnlyServer::ReadFunc readF = [&](uint64_t offset, size_t size, void *data) {
+        image.read(offset / LOGICAL_BLOCK_SIZE, size / LOGICAL_BLOCK_SIZE, data);
+    };
+    if (!opt.outputPath.empty()) {
+        matP.reset(new VirtualFullMaterializer(
+                       image, cybozu::util::File(opt.outputPath, O_RDWR | O_CREAT, 0644), opt.bufferSize()));
+        matP->start();
+        readF = [&](uint64_t offset, size_t size, void *data) {
+            matP->read(offset / LOGICAL_BLOCK_SIZE, size / LOGICAL_BLOCK_SIZE, data);
+        };
+    }
+
+    cybozu::signal::setSignalHandler({SIGINT, SIGQUIT, SIGTERM});
+    std::atomic<bool> isDoneLogged(false);
+    nbd::ReadOnlyServer server(opt.name, image.sizeLb() * LOGICAL_BLOCK_SIZE, readF);
+    server.run(opt.addr, opt.port, opt.maxConn, [&]() {
+            if (matP && matP->isDone() && !isDoneLogged.exchange(true)) {
+                LOGs.info() << "materialized" << opt.outputPath;
+            }
+            return cybozu::signal::gotSignal();
+        });
+    if (matP) {
+        matP->stop();
+        LOGs.info() << "materialize progress" << matP->progressLb() << image.sizeLb();
+    }
+    return 0;
+}
+
+DEFINE_ERROR_SAFE_MAIN("virt-full-nbd")
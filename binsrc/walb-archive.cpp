@@ -29,6 +29,7 @@ struct Option
     uint16_t port;
     std::string logFileStr;
     std::string discardTypeStr;
+    std::string aioBackendStr;
     bool isDebug;
     cybozu::Option opt;
 
@@ -54,6 +55,12 @@ struct Option
         opt.appendBoolOpt(&a.doAutoResize, "autoresize", ": resize base image automatically if necessary");
         opt.appendBoolOpt(&a.keepOneColdSnapshot, "keep-one-cold-snap", ": keep just one cold snapshot per volume.");
         opt.appendOpt(&a.maxOpenDiffs, DEFAULT_MAX_OPEN_DIFFS, "maxopen", "NUM : max number of wdiff files to open together.");
+        opt.appendOpt(&a.mergeThreads, DEFAULT_MERGE_THREADS, "mgthr", "NUM : num of threads to merge wdiffs for apply, restore and merge.");
+        opt.appendOpt(&a.mergePrefetchIos, DEFAULT_MERGE_PREFETCH_IOS, "mgpf", "NUM : num of IOs to read ahead per wdiff in merging (0: disabled).");
+        opt.appendOpt(&a.mergeMemSize, DEFAULT_MERGE_MEM_SIZE, "mgmem", "SIZE : max total size of IO data held by mergers [bytes] (0: unlimited).");
+        opt.appendOpt(&a.applyAioBufferSize, DEFAULT_APPLY_AIO_BUFFER_SIZE, "applyaio", "SIZE : max size of direct IOs in flight per merged range in apply [bytes] (0: buffered IOs).");
+        opt.appendOpt(&a.fullSyncStreams, DEFAULT_FULL_SYNC_STREAMS, "fss", "NUM : num of connections to send a volume in parallel for full-repl.");
+        opt.appendOpt(&aioBackendStr, DEFAULT_AIO_BACKEND_STR, "aio", ": asynchronous IO backend: libaio/iouring/iouring-sqpoll.");
 #ifdef ENABLE_EXEC_PROTOCOL
         opt.appendBoolOpt(&a.allowExec, "allow-exec", ": allow exec protocol for test. This is NOT SECURE.");
 #endif
@@ -70,7 +77,11 @@ struct Option
         util::verifyNotZero(a.maxForegroundTasks, "maxForegroundTasks");
         util::verifyNotZero(a.maxWdiffSendNr, "maxWdiffSendNr");
         util::verifyNotZero(a.fsyncIntervalSize, "fsyncIntervalSize");
+        util::verifyNotZero(a.mergeThreads, "mergeThreads");
+        verifyFullSyncStreams(a.fullSyncStreams, "fullSyncStreams");
+        a.mergeMemBudget.setMaxSize(a.mergeMemSize);
         a.discardType = parseDiscardType(discardTypeStr, __func__);
+        cybozu::aio::setDefaultAioBackend(cybozu::aio::parseAioBackend(aioBackendStr));
         a.keepAliveParams.verify();
     }
 };
@@ -92,7 +103,7 @@ void initArchiveData()
     LOGs.info() << "run lvs command (it may take long time)";
     const cybozu::lvm::LvList lvL = cybozu::lvm::listLv(ga.volumeGroup);
     LOGs.info() << "lvs command done.";
-    const size_t nr = removeTemporaryRestoredSnapshots(lvL);
+    const size_t nr = removeTemporaryRestoredSnapshots(lvL, ga.baseDirStr);
     if (nr > 0) LOGs.info() << "remove temporary snapshots" << nr;
     VolLvCacheMap map = getVolLvCacheMap(lvL, ga.thinpool, volIdV);
 
@@ -29,6 +29,7 @@ struct Option
     std::string logFileStr;
     bool isDebug;
     bool isStopped;
+    size_t indexedDiffCacheMb;
     cybozu::Option opt;
 
     Option(int argc, char *argv[]) {
@@ -49,6 +50,14 @@ struct Option
         opt.appendOpt(&p.retryTimeout, DEFAULT_RETRY_TIMEOUT_SEC, "rto", "PERIOD : retry timeout (total period) [sec].");
         opt.appendOpt(&p.baseDirStr, DEFAULT_BASE_DIR, "b", "PATH : base directory");
         opt.appendOpt(&p.maxConversionMb, DEFAULT_MAX_CONVERSION_MB, "wl", "SIZE : max memory size of wlog-wdiff conversion [MiB].");
+        opt.appendOpt(&p.wlogUncompressThreads, DEFAULT_WLOG_UNCOMPRESS_THREADS, "wlthr"
+                      , "NUM : num of threads to uncompress and verify wlogs for wlog-transfer.");
+        opt.appendOpt(&p.wdiffCompressThreads, DEFAULT_WDIFF_COMPRESS_THREADS, "wdthr"
+                      , "NUM : num of threads to compress received wdiffs for wlog-transfer.");
+        opt.appendOpt(&indexedDiffCacheMb, INDEXED_DIFF_CACHE_SIZE / MEBI, "idxcache"
+                      , "SIZE : max size of uncompressed IO data of indexed wdiffs cached in the process [MiB].");
+        opt.appendBoolOpt(&p.compactWdiffIndex, "compact-index"
+                          , ": use compact index blocks for wdiffs received by wlog-transfer.");
         std::string hostName = cybozu::net::getHostName();
         opt.appendOpt(&p.nodeId, hostName, "id", "STRING : node identifier");
         opt.appendOpt(&p.socketTimeout, DEFAULT_SOCKET_TIMEOUT_SEC, "to", "PERIOD : Socket timeout [sec].");
@@ -69,7 +78,10 @@ struct Option
         util::verifyNotZero(p.maxWdiffSendMb, "maxWdiffSendMb");
         util::verifyNotZero(p.maxWdiffSendNr, "maxWdiffSendNr");
         util::verifyNotZero(p.maxConversionMb, "maxConversionMb");
+        util::verifyNotZero(p.wlogUncompressThreads, "wlogUncompressThreads");
+        util::verifyNotZero(p.wdiffCompressThreads, "wdiffCompressThreads");
         p.keepAliveParams.verify();
+        getSharedIndexedDiffCache().setMaxSize(indexedDiffCacheMb * MEBI);
     }
 };
 
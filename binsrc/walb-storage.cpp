@@ -32,8 +32,14 @@ struct Option
     std::string logFileStr;
     std::string archiveDStr;
     std::string multiProxyDStr;
+    std::string aioBackendStr;
     bool isDebug;
     uint64_t defaultFullScanBytesPerSec;
+    size_t wlogReadAheadMaxBufferMb;
+    size_t wlogReadAheadMaxIoKb;
+    size_t wlogReadAheadTotalMb;
+    uint64_t wlogReadBytesPerSec;
+    uint64_t wlogSendBytesPerSec;
     cybozu::Option opt;
 
     Option(int argc, char *argv[]) {
@@ -53,12 +59,34 @@ struct Option
         std::string hostName = cybozu::net::getHostName();
         opt.appendOpt(&s.nodeId, hostName, "id", "STRING : node identifier");
         opt.appendOpt(&s.maxWlogSendMb, DEFAULT_MAX_WLOG_SEND_MB, "wl", "SIZE : max wlog size to send at once [MiB].");
+        opt.appendOpt(&s.wlogReadQueueSize, DEFAULT_WLOG_READ_QUEUE_SIZE, "wlrq"
+                      , "NUM : num of logpacks read ahead for wlog-transfer.");
+        opt.appendOpt(&s.wlogSendQueueSize, DEFAULT_WLOG_SEND_QUEUE_SIZE, "wlsq"
+                      , "NUM : num of compressed logpacks waiting to be sent for wlog-transfer.");
+        opt.appendOpt(&s.wlogCompressThreads, DEFAULT_WLOG_COMPRESS_THREADS, "wlthr"
+                      , "NUM : num of threads to verify and compress wlogs for wlog-transfer (default of set-wlog-cmpr).");
+        opt.appendBoolOpt(&s.wlogReadAheadAdaptive, "wlra"
+                          , ": adapt log device read-ahead of each volume to its throughput for wlog-transfer.");
+        opt.appendOpt(&wlogReadAheadMaxBufferMb, DEFAULT_WLOG_READ_AHEAD_MAX_BUFFER_MB, "wlrabuf"
+                      , "SIZE : max read-ahead buffer size of a volume for -wlra [MiB].");
+        opt.appendOpt(&wlogReadAheadMaxIoKb, DEFAULT_WLOG_READ_AHEAD_MAX_IO_KB, "wlraio"
+                      , "SIZE : max read-ahead IO size for -wlra [KiB].");
+        opt.appendOpt(&s.wlogReadAheadMax.queueDepth, DEFAULT_WLOG_READ_AHEAD_MAX_QUEUE_DEPTH, "wlraqd"
+                      , "NUM : max num of read-ahead IOs in flight of a volume for -wlra.");
+        opt.appendOpt(&wlogReadAheadTotalMb, DEFAULT_WLOG_READ_AHEAD_TOTAL_MB, "wlramem"
+                      , "SIZE : max total read-ahead buffer size of all the volumes [MiB].");
+        opt.appendOpt(&wlogReadBytesPerSec, 0, "wlrbps"
+                      , "SIZE : max log device read throughput of wlog-transfer for all the volumes [bytes/s]. 0 means unlimited.");
+        opt.appendOpt(&wlogSendBytesPerSec, 0, "wlsbps"
+                      , "SIZE : max network throughput of wlog-transfer for all the volumes [bytes/s]. 0 means unlimited.");
         opt.appendOpt(&s.implicitSnapshotIntervalSec, DEFAULT_IMPLICIT_SNAPSHOT_INTERVAL_SEC, "snapintvl"
                       , "PERIOD : implicit snapshot interval [sec].");
         opt.appendOpt(&s.delaySecForRetry, DEFAULT_DELAY_SEC_FOR_RETRY, "delay", "PERIOD : waiting time for next retry [sec].");
         opt.appendOpt(&s.socketTimeout, DEFAULT_SOCKET_TIMEOUT_SEC, "to", "PERIOD : socket timeout [sec].");
         opt.appendOpt(&defaultFullScanBytesPerSec, DEFAULT_FULL_SCAN_BYTES_PER_SEC, "fst", "SIZE : default full scan throughput [bytes/s]");
+        opt.appendOpt(&s.fullSyncStreams, DEFAULT_FULL_SYNC_STREAMS, "fss", "NUM : num of connections to send a volume in parallel for full-backup.");
         opt.appendOpt(&s.tsDeltaGetterIntervalSec, DEFAULT_TS_DELTA_INTERVAL_SEC, "tsdintvl", "PERIOD : ts-delta getter interval [sec].");
+        opt.appendOpt(&aioBackendStr, DEFAULT_AIO_BACKEND_STR, "aio", ": asynchronous IO backend: libaio/iouring/iouring-sqpoll.");
 #ifdef ENABLE_EXEC_PROTOCOL
         opt.appendBoolOpt(&s.allowExec, "allow-exec", ": allow exec protocol for test. This is NOT SECURE.");
 #endif
@@ -74,10 +102,21 @@ struct Option
         util::verifyNotZero(s.maxBackgroundTasks, "maxBackgroundTasks");
         util::verifyNotZero(s.maxForegroundTasks, "maxForegroundTasks");
         util::verifyNotZero(s.maxWlogSendMb, "maxWlogSendMb");
+        util::verifyNotZero(s.wlogCompressThreads, "wlogCompressThreads");
+        util::verifyQueueSize(s.wlogReadQueueSize, "wlogReadQueueSize");
+        util::verifyQueueSize(s.wlogSendQueueSize, "wlogSendQueueSize");
+        s.wlogReadAheadMax.bufferSize = wlogReadAheadMaxBufferMb * MEBI;
+        s.wlogReadAheadMax.maxIoSize = wlogReadAheadMaxIoKb * KIBI;
+        WldevReadAheadTuner::verifyParams(s.wlogReadAheadMax, "wlogReadAheadMax");
+        s.wlogReadAheadBudget.setCap(wlogReadAheadTotalMb * MEBI);
+        s.wlogReadScheduler.setBytesPerSec(wlogReadBytesPerSec);
+        s.wlogSendScheduler.setBytesPerSec(wlogSendBytesPerSec);
         util::verifyNotZero(s.implicitSnapshotIntervalSec, "implicitSnapshotIntervalSec");
         util::verifyNotZero(s.tsDeltaGetterIntervalSec, "tsDeltaGetterIntervalSec");
+        verifyFullSyncStreams(s.fullSyncStreams, "fullSyncStreams");
         s.keepAliveParams.verify();
         s.fullScanLbPerSec = defaultFullScanBytesPerSec / LOGICAL_BLOCK_SIZE;
+        cybozu::aio::setDefaultAioBackend(cybozu::aio::parseAioBackend(aioBackendStr));
     }
 };
 
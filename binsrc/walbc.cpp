@@ -106,6 +106,18 @@ void setupSetFullScanBps(cybozu::Option& opt)
     static uint64_t size;
     opt.appendParam(&size, "maxFullScanBps", "max full-scan throughput [bytes/sec] (0 means unlimited)");
 }
+void setupSetWlogBps(cybozu::Option& opt)
+{
+    static uint64_t readBps, sendBps;
+    opt.appendParam(&readBps, "maxReadBps", "max log device read throughput of wlog-transfer for all the volumes [bytes/sec] (0 means unlimited)");
+    opt.appendParam(&sendBps, "maxSendBps", "max network throughput of wlog-transfer for all the volumes [bytes/sec] (0 means unlimited)");
+}
+void setupSetWlogCmpr(cybozu::Option& opt)
+{
+    setupVolId(opt);
+    static std::string cmpr;
+    opt.appendParam(&cmpr, "compressOpt", ": TYPE:LEVEL:NR_CPU for wlog-transfer.");
+}
 void setupVirtualFullScan(cybozu::Option& opt)
 {
     setupVolIdGid(opt);
@@ -194,6 +206,8 @@ const CommandInfo g_cmdTbl[] = {
     { resizeCN, c2xResizeClient, setupResize, verifyResizeParam, "resize a volume in a storage or an archive." },
     { kickCN, c2xKickClient, setupKick, verifyKickParam, "kick background tasks if necessary." },
     { setFullScanBpsCN, c2sSetFullScanBpsClient, setupSetFullScanBps, verifySetFullScanBps, "set max full scan bytes per second parameter." },
+    { setWlogBpsCN, c2sSetWlogBpsClient, setupSetWlogBps, verifySetWlogBpsParam, "set max wlog-transfer bytes per second parameters." },
+    { setWlogCmprCN, c2sSetWlogCmprClient, setupSetWlogCmpr, verifySetWlogCmprParam, "set compression option of wlog-transfer for a volume in a storage." },
     { blockHashCN, c2aBlockHashClient, setupVirtualFullScan, verifyVirtualFullScanParam, "calculate block hash of a volume in an archive." },
     { virtualFullScanCN, c2aVirtualFullScanClient, setupVirtualFullScanCmd, verifyVirtualFullScanCmdParam, "virtual full scan of a volume in an archive." },
     { getCN, c2xGetClient, setupGet, verifyNoneParam, "get some information from a server." },
@@ -15,6 +15,7 @@ struct Option
     bool isDiscard;
     bool isZeroDiscard;
     bool dontUseAio;
+    std::string aioBackendStr;
     bool isVerbose;
     bool isDebug;
 
@@ -26,6 +27,7 @@ struct Option
         opt.appendBoolOpt(&isDiscard, "d", ": issue discard for discard logs.");
         opt.appendBoolOpt(&isZeroDiscard, "z", ": zero-clear for discard logs.");
         opt.appendBoolOpt(&dontUseAio, "noaio", ": do not use aio");
+        opt.appendOpt(&aioBackendStr, "libaio", "aio", ": aio backend: libaio/iouring/iouring-sqpoll.");
         opt.appendBoolOpt(&isVerbose, "v", ": verbose messages to stderr.");
         opt.appendBoolOpt(&isDebug, "debug", ": put debug messages to stderr.");
         opt.appendParam(&ldevPath, "LDEV_PATH");
@@ -35,6 +37,7 @@ struct Option
             opt.usage();
             ::exit(1);
         }
+        cybozu::aio::setDefaultAioBackend(cybozu::aio::parseAioBackend(aioBackendStr));
 
         if (isDiscard && isZeroDiscard) {
             throw RT_ERR("Do not specify both -d and -z together.");
@@ -0,0 +1,118 @@
+/**
+ * @file
+ * @brief Benchmark of DiffMerger with various number of input wdiffs.
+ */
+#include "cybozu/option.hpp"
+#include "walb_util.hpp"
+#include "walb_diff_merge.hpp"
+#include "tmp_file.hpp"
+#include "random.hpp"
+#include "time.hpp"
+
+using namespace walb;
+
+struct Option
+{
+    std::vector<size_t> nrWdiffV;
+    size_t nrIos;
+    uint32_t maxIoBlocks;
+    uint64_t devSizeLb;
+    std::string tmpDir;
+    bool isDebug;
+
+    Option(int argc, char *argv[]) {
+        cybozu::Option opt;
+        opt.setDescription("Measure merge throughput of DiffMerger with various number of input wdiffs.");
+        opt.appendVec(&nrWdiffV, "n", ": list of number of input wdiffs (default: 1 4 16 64 256).");
+        opt.appendOpt(&nrIos, 10000, "ios", ": number of IOs in each wdiff.");
+        opt.appendOpt(&maxIoBlocks, 64, "x", ": max IO size [logical block].");
+        opt.appendOpt(&devSizeLb, 4 * MEBI, "s", ": device size [logical block].");
+        opt.appendOpt(&tmpDir, ".", "d", ": directory to put temporary wdiff files.");
+        opt.appendBoolOpt(&isDebug, "debug", ": put debug messages.");
+        opt.appendHelp("h");
+        if (!opt.parse(argc, argv)) {
+            opt.usage();
+            ::exit(1);
+        }
+        if (nrWdiffV.empty()) nrWdiffV = {1, 4, 16, 64, 256};
+        util::verifyNotZero(nrIos, "nrIos");
+        util::verifyNotZero(maxIoBlocks, "maxIoBlocks");
+        if (devSizeLb < nrIos * maxIoBlocks) {
+            throw cybozu::Exception("too small device size") << devSizeLb << nrIos << maxIoBlocks;
+        }
+    }
+};
+
+/**
+ * Generate a sorted wdiff of which IOs are at random addresses.
+ * IO data are not compressed to measure merging only.
+ */
+void generateWdiff(cybozu::util::Random<uint64_t> &rand, int fd, const Option &opt)
+{
+    SortedDiffWriter writer(fd);
+    DiffFileHeader header;
+    writer.writeHeader(header);
+
+    const uint64_t avgGap = opt.devSizeLb / opt.nrIos;
+    uint64_t addr = rand() % avgGap;
+    AlignedArray buf(opt.maxIoBlocks * LOGICAL_BLOCK_SIZE, false);
+    for (size_t i = 0; i < opt.nrIos; i++) {
+        const uint32_t blks = rand() % opt.maxIoBlocks + 1;
+        if (addr + blks > opt.devSizeLb) break;
+        DiffRecord rec;
+        rec.init();
+        rec.io_address = addr;
+        rec.io_blocks = blks;
+        rec.setNormal();
+        rec.compression_type = ::WALB_DIFF_CMPR_NONE;
+        rec.data_size = blks * LOGICAL_BLOCK_SIZE;
+        rand.fill(buf.data(), rec.data_size);
+        rec.checksum = cybozu::util::calcChecksum(buf.data(), rec.data_size, 0);
+        writer.writeDiff(rec, buf.data());
+        addr += blks + rand() % (avgGap * 2);
+    }
+    writer.close();
+}
+
+void benchmark(const std::vector<std::unique_ptr<cybozu::TmpFile> > &fileV, size_t nrWdiff)
+{
+    std::vector<cybozu::util::File> inV;
+    uint64_t inSize = 0;
+    for (size_t i = 0; i < nrWdiff; i++) {
+        cybozu::util::File file(fileV[i]->fd());
+        file.lseek(0);
+        inSize += cybozu::FileStat(file.fd()).size();
+        inV.push_back(std::move(file));
+    }
+    cybozu::Stopwatch stopwatch;
+    DiffMerger merger;
+    merger.addWdiffs(std::move(inV));
+    merger.prepare();
+    DiffRecIo recIo;
+    size_t nrOut = 0;
+    while (merger.getAndRemove(recIo)) nrOut++;
+    const double sec = stopwatch.get();
+    ::printf("nrWdiff %4zu inputMiB %8.1f outputIos %9zu elapsed %7.3fs throughput %8.1fMiB/s memUsage %s\n"
+             , nrWdiff, inSize / double(MEBI), nrOut, sec
+             , sec > 0 ? inSize / double(MEBI) / sec : 0.0, merger.memUsageStr().c_str());
+}
+
+int doMain(int argc, char *argv[])
+{
+    Option opt(argc, argv);
+    util::setLogSetting("-", opt.isDebug);
+
+    const size_t maxNr = *std::max_element(opt.nrWdiffV.begin(), opt.nrWdiffV.end());
+    cybozu::util::Random<uint64_t> rand;
+    std::vector<std::unique_ptr<cybozu::TmpFile> > fileV;
+    for (size_t i = 0; i < maxNr; i++) {
+        fileV.emplace_back(new cybozu::TmpFile(opt.tmpDir));
+        generateWdiff(rand, fileV.back()->fd(), opt);
+    }
+    for (size_t nr : opt.nrWdiffV) {
+        benchmark(fileV, nr);
+    }
+    return 0;
+}
+
+DEFINE_ERROR_SAFE_MAIN("wdiff-merge-bench")
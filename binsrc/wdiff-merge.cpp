@@ -9,24 +9,33 @@
 #include "util.hpp"
 #include "walb_diff_merge.hpp"
 #include "host_info.hpp"
+#include "file_path.hpp"
 
 using namespace walb;
 
 struct Option : public cybozu::Option
 {
     uint32_t maxIoSize;
+    size_t prefetchIos;
+    size_t readAheadNr, readAheadThreads;
+    size_t maxMemSize;
     std::vector<std::string> inputWdiffs;
-    std::string outputWdiff, cmprStr;
+    std::string outputWdiff, cmprStr, tmpDir;
     bool doStat;
     CompressOpt cmpr;
 
     Option() {
         setDescription("Merge wdiff files.");
         appendOpt(&maxIoSize, 0, "x", "SIZE: max IO size [byte]. 0 means no limitation.");
+        appendOpt(&prefetchIos, 0, "pf", "NUM: num of IOs to read ahead per input wdiff. 0 means no prefetching.");
+        appendOpt(&readAheadNr, 0, "ra", "NUM: num of index records to read ahead per indexed input wdiff. 0 means no read-ahead.");
+        appendOpt(&readAheadThreads, 0, "rathr", "NUM: num of threads to uncompress the IOs read ahead per indexed input wdiff. 0 means no threads.");
+        appendOpt(&maxMemSize, 0, "m", "SIZE: max size of IO data held in merging [byte]. 0 means no limitation.");
         appendVec(&inputWdiffs, "i", "WDIFF_PATH_LIST: input wdiff paths.");
         appendOpt(&outputWdiff, "-", "o", "WDIFF_PATH: output wdiff path (default: stdout).");
         appendBoolOpt(&doStat, "stat", ": put statistics.");
         appendOpt(&cmprStr, "snappy:0:1", "cmpr", "type:level:concurrency : compression for output (default: snappy:0:1)");
+        appendOpt(&tmpDir, "", "t", "DIR: directory for temporary files (default: directory of output wdiff or current directory).");
         appendHelp("h", ": put this message.");
     }
     uint32_t maxIoBlocks() const {
@@ -44,6 +53,10 @@ struct Option : public cybozu::Option
             goto error;
         }
         cmpr.parse(cmprStr);
+        if (tmpDir.empty() && outputWdiff != "-") {
+            tmpDir = cybozu::FilePath(outputWdiff).dirName();
+        }
+        if (tmpDir.empty()) tmpDir = ".";
         return true;
       error:
         usage();
@@ -55,7 +68,7 @@ int doMain(int argc, char *argv[])
 {
     Option opt;
     if (!opt.parse(argc, argv)) return 1;
-    DiffMerger merger;
+    ParallelDiffMerger merger;
     for (std::string &path : opt.inputWdiffs) {
         merger.addWdiff(path);
     }
@@ -67,11 +80,11 @@ int doMain(int argc, char *argv[])
     }
     merger.setMaxIoBlocks(opt.maxIoBlocks());
     merger.setShouldValidateUuid(false);
-#if 0
-    merger.mergeToFd(file.fd());
-#else
-    merger.mergeToFdInParallel(file.fd(), opt.cmpr);
-#endif
+    merger.setNrThreads(opt.cmpr.numCpu);
+    merger.setPrefetchQueueSize(opt.prefetchIos);
+    merger.setReadAhead(opt.readAheadNr, opt.readAheadThreads);
+    merger.setMaxMemSize(opt.maxMemSize);
+    merger.mergeToFd(file.fd(), opt.cmpr, opt.tmpDir);
 #if 0
     /*
      * currently we prefer prompt quit of the command
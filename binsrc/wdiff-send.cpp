@@ -138,6 +138,7 @@ void runDummyProxy(const Option &opt)
     // transfer diff data if necessary.
     if (res != msgAccept) return;
     DiffMerger merger;
+    merger.setPassThroughCompressed(true);
     merger.addWdiffs({opt.wdiffPath});
     merger.prepare();
     const CompressOpt cmpr;
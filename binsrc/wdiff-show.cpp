@@ -119,13 +119,15 @@ int printIndexedWdiff(
     IndexedDiffRecord rec;
     AlignedArray data;
     int ret = 0;
+    // Records of compact index blocks have no rec_checksum.
+    const bool doChecksum = !reader.header().hasCompactIndex();
     while (reader.readDiffRecord(rec, false)) {
         std::string extra;
-        if (!rec.isValid()) {
+        if (!rec.isValid(doChecksum)) {
             extra += cybozu::util::formatString(" invalid record");
             ret = 1;
         }
-        if (rec.isValid() && opt.verifyCsum && !reader.isOnCache(rec)) {
+        if (rec.isValid(doChecksum) && opt.verifyCsum && !reader.isOnCache(rec)) {
             if (!reader.loadToCache(rec, false)) {
                 extra += cybozu::util::formatString(" invalid data checksum");
                 ret = 1;
@@ -11,8 +11,9 @@ using namespace walb;
 struct Option
 {
     uint32_t maxIoSize;
-    bool isDebug, isIndexed;
-    std::string input, output;
+    size_t maxMemMb;
+    bool isDebug, isIndexed, isCompactIndex;
+    std::string input, output, tmpDir;
 
     Option(int argc, char *argv[]) {
         cybozu::Option opt;
@@ -22,6 +23,10 @@ struct Option
         opt.appendOpt(&maxIoSize, DEFAULT_MAX_IO_LB * LBS
                       , "x", ": max IO size in the output wdiff (0 means unlimited) [byte].");
         opt.appendBoolOpt(&isIndexed, "indexed", ": use indexed format instead of sorted format.");
+        opt.appendBoolOpt(&isCompactIndex, "compact-index", ": use compact index blocks for indexed format.");
+        opt.appendOpt(&maxMemMb, 0, "m", ": max memory size to keep diff data for sorted format"
+                      " or the index for indexed format (0 means unlimited) [MiB].");
+        opt.appendOpt(&tmpDir, ".", "t", ": directory to put temporary files when exceeding the max memory size.");
         opt.appendBoolOpt(&isDebug, "debug", ": put debug messages.");
         opt.appendHelp("h");
         if (!opt.parse(argc, argv)) {
@@ -44,9 +49,8 @@ void setupFile(cybozu::util::File &file, const std::string &path, bool isRead)
 
 
 template <typename Converter>
-void convert(const Option &opt)
+void convert(const Option &opt, Converter &c)
 {
-    Converter c;
     cybozu::util::File inFile, outFile;
     setupFile(inFile, opt.input, true);
     setupFile(outFile, opt.output, false);
@@ -61,9 +65,14 @@ int doMain(int argc, char *argv[])
     Option opt(argc, argv);
     util::setLogSetting("-", opt.isDebug);
     if (opt.isIndexed) {
-        convert<IndexedDiffConverter>(opt);
+        IndexedDiffConverter c;
+        c.setSpill(opt.tmpDir, opt.maxMemMb * MEBI);
+        c.setCompactIndex(opt.isCompactIndex);
+        convert(opt, c);
     } else {
-        convert<DiffConverter>(opt);
+        DiffConverter c;
+        c.setSpill(opt.tmpDir, opt.maxMemMb * MEBI);
+        convert(opt, c);
     }
     return 0;
 }
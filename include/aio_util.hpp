@@ -20,6 +20,7 @@
 #include <cstdio>
 #include <cassert>
 #include <memory>
+#include <atomic>
 
 #include <unistd.h>
 #include <time.h>
@@ -35,10 +36,67 @@
 #include "util.hpp"
 #include "fileio.hpp"
 #include "memory_buffer.hpp"
+#include "io_uring_util.hpp"
 
 namespace cybozu {
 namespace aio {
 
+/**
+ * Kernel interfaces to issue asynchronous IOs.
+ */
+enum class AioBackend
+{
+    Libaio, IoUring, IoUringSqPoll,
+};
+
+struct {
+    AioBackend backend;
+    const char *name;
+} const aioBackendTbl_[] = {
+    {AioBackend::Libaio, "libaio"},
+    {AioBackend::IoUring, "iouring"},
+    {AioBackend::IoUringSqPoll, "iouring-sqpoll"},
+};
+
+inline AioBackend parseAioBackend(const std::string &s)
+{
+    for (const auto& p : aioBackendTbl_) {
+        if (s == p.name) return p.backend;
+    }
+    throw RT_ERR("bad aio backend: %s", s.c_str());
+}
+
+inline const char *aioBackendToStr(AioBackend backend)
+{
+    for (const auto& p : aioBackendTbl_) {
+        if (backend == p.backend) return p.name;
+    }
+    throw RT_ERR("bad aio backend: %d", int(backend));
+}
+
+namespace aio_local {
+
+inline std::atomic<AioBackend>& defaultBackend()
+{
+    static std::atomic<AioBackend> backend(AioBackend::Libaio);
+    return backend;
+}
+
+} // namespace aio_local
+
+/**
+ * Process-wide backend used by Aio instances created later.
+ */
+inline void setDefaultAioBackend(AioBackend backend)
+{
+    aio_local::defaultBackend().store(backend);
+}
+
+inline AioBackend getDefaultAioBackend()
+{
+    return aio_local::defaultBackend().load();
+}
+
 /**
  * Asynchronous IO wrapper.
  *
@@ -52,6 +110,11 @@ namespace aio {
  * Do not use prepareFlush().
  * Currently aio flush is not supported by Linux kernel.
  *
+ * With io_uring backend, all the prepared IOs are passed to the kernel
+ * by one system call (or none with SQPOLL), and IOs in buffers
+ * given by registerBuffer() use pre-mapped pages.
+ * If io_uring is not available, libaio will be used instead.
+ *
  * Thrown EofError and LibcError in waitFor()/waitOne()/wait(),
  * you can use the Aio instance continuously,
  * however, thrown other error(s),
@@ -94,7 +157,10 @@ private:
 
     const int fd_;
     const size_t queueSize_;
+    AioBackend backend_;
     io_context_t ctx_;
+    std::unique_ptr<IoUring> ring_;
+    std::vector<struct iovec> bufV_; // registered buffers.
 
     /*
      * submitQ_ contains prepared but not submitted IOs.
@@ -130,11 +196,14 @@ public:
      *   You must open the file/device with O_DIRECT
      *   to work it really asynchronously.
      * @queueSize queue size for aio.
-     * @isMeasureTime true if you want to measure IO begein/end time.
+     * @backend preferred backend.
      */
-    Aio(int fd, size_t queueSize)
+    Aio(int fd, size_t queueSize, AioBackend backend = getDefaultAioBackend())
         : fd_(fd)
         , queueSize_(std::min(MAX_AIO_REQ_NR(), queueSize))
+        , backend_(AioBackend::Libaio)
+        , ring_()
+        , bufV_()
         , submitQ_()
         , pendingIOs_()
         , completedIOs_()
@@ -145,6 +214,13 @@ public:
         , key_(1) {
         assert(fd_ >= 0);
         assert(queueSize > 0);
+        if (backend != AioBackend::Libaio) {
+            ring_ = createIoUring(queueSize_, backend == AioBackend::IoUringSqPoll);
+        }
+        if (ring_) {
+            backend_ = ring_->useSqPoll() ? AioBackend::IoUringSqPoll : AioBackend::IoUring;
+            return;
+        }
         const int err = ::io_queue_init(queueSize_, &ctx_);
         if (err < 0) {
             throwLibcErrorWithNo("Aio: io_queue_init failed.", -err);
@@ -156,6 +232,13 @@ public:
     }
     void release() {
         if (isReleased_) return;
+        if (ring_) {
+            /* Buffers must not be used by the kernel after releasing. */
+            while (!pendingIOs_.empty()) wait_(1);
+            ring_.reset();
+            isReleased_ = true;
+            return;
+        }
         int err = ::io_queue_release(ctx_);
         if (err < 0) {
             throwLibcErrorWithNo("Aio: io_queue_release failed.", -err);
@@ -178,6 +261,31 @@ public:
     bool empty() const {
         return submitQ_.empty() && pendingIOs_.empty() && completedIOs_.empty();
     }
+    /**
+     * Backend really used.
+     */
+    AioBackend backend() const {
+        return backend_;
+    }
+    /**
+     * Register a buffer that will be used for IOs repeatedly.
+     * Call this before submitting IOs.
+     * This is just a hint: nothing will be done with libaio.
+     *
+     * RETURN:
+     *   true if registered.
+     */
+    bool registerBuffer(const void *ptr, size_t size) {
+        if (!ring_ || !pendingIOs_.empty()) return false;
+        std::vector<struct iovec> v = bufV_;
+        v.push_back({const_cast<void *>(ptr), size});
+        if (ring_->registerBuffers(v)) {
+            bufV_ = std::move(v);
+            return true;
+        }
+        ring_->registerBuffers(bufV_);
+        return false;
+    }
     /**
      * Prepare a read IO.
      * RETURN:
@@ -239,7 +347,11 @@ public:
         for (size_t i = 0; i < nr; i++) {
             AioDataPtr iop = std::move(submitQ_.front());
             submitQ_.pop_front();
-            iocbs_[i] = &iop->iocb;
+            if (ring_) {
+                prepareSqe(*iop);
+            } else {
+                iocbs_[i] = &iop->iocb;
+            }
             iop->beginTime = beginTime;
             const uint key = iop->key;
             assert(pendingIOs_.find(key) == pendingIOs_.end());
@@ -247,6 +359,10 @@ public:
         }
         assert(submitQ_.empty());
 
+        if (ring_) {
+            ring_->submit();
+            return;
+        }
         size_t done = 0;
         while (done < nr) {
             int err = ::io_submit(ctx_, nr - done, &iocbs_[done]);
@@ -282,6 +398,7 @@ public:
             Umap::iterator it = pendingIOs_.find(key);
             if (it != pendingIOs_.end()) {
                 AioDataPtr& iop = it->second;
+                if (ring_) return false;
                 if (::io_cancel(ctx_, &iop->iocb, &ioEvents_[0]) == 0) {
                     pendingIOs_.erase(it);
                     return true;
@@ -361,7 +478,7 @@ public:
             } else if (iop->err < 0) {
                 isLibcError = true;
             }
-            assert(iop->iocb.u.c.nbytes == static_cast<uint>(iop->err));
+            assert(iop->err <= 0 || iop->size == static_cast<uint>(iop->err));
             queue.push(iop->key);
             nr--;
         }
@@ -416,6 +533,7 @@ private:
      */
     size_t wait_(size_t minNr) {
         assert(minNr <= queueSize_);
+        if (ring_) return waitRing(minNr);
         const int nr = ::io_getevents(ctx_, minNr, queueSize_, &ioEvents_[0], NULL);
         if (nr < 0) {
             throwLibcErrorWithNo("Aio: io_getevents failed.", -nr);
@@ -426,18 +544,89 @@ private:
         double endTime = 0;
         if (isMeasureTime_) endTime = util::getTime();
         for (int i = 0; i < nr; i++) {
-            const uint key = getKeyFromEvent(ioEvents_[i]);
-            Umap::iterator it = pendingIOs_.find(key);
-            assert(it != pendingIOs_.end());
-            AioDataPtr& iop = it->second;
-            assert(iop->key == key);
-            iop->endTime = endTime;
-            iop->err = ioEvents_[i].res;
-            completedIOs_.emplace(key, std::move(iop));
-            pendingIOs_.erase(it);
+            complete(getKeyFromEvent(ioEvents_[i]), ioEvents_[i].res, endTime);
+        }
+        return nr;
+    }
+    size_t waitRing(size_t minNr) {
+        ring_->waitCqe(minNr);
+        double endTime = 0;
+        if (isMeasureTime_) endTime = util::getTime();
+        size_t nr = 0;
+        uint64_t userData;
+        int32_t res;
+        while (ring_->peekCqe(userData, res)) {
+            complete(static_cast<uint>(userData), res, endTime);
+            nr++;
         }
         return nr;
     }
+    void complete(uint key, int err, double endTime) {
+        Umap::iterator it = pendingIOs_.find(key);
+        assert(it != pendingIOs_.end());
+        AioDataPtr& iop = it->second;
+        assert(iop->key == key);
+        iop->endTime = endTime;
+        iop->err = err;
+        completedIOs_.emplace(key, std::move(iop));
+        pendingIOs_.erase(it);
+    }
+    /**
+     * The ring may not use SQPOLL even if useSqPoll is true. See IoUring::IoUring().
+     * RETURN:
+     *   nullptr if io_uring or some of the required operations are not available.
+     */
+    static std::unique_ptr<IoUring> createIoUring(size_t queueSize, bool useSqPoll) {
+        std::unique_ptr<IoUring> ring;
+        try {
+            ring.reset(new IoUring(queueSize, useSqPoll));
+        } catch (util::LibcError&) {
+            /* SQPOLL may require privileges on old kernels. */
+            if (!useSqPoll) return nullptr;
+            return createIoUring(queueSize, false);
+        }
+        for (uint8_t op : {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED,
+                    IORING_OP_WRITE_FIXED, IORING_OP_FSYNC}) {
+            if (!ring->isSupported(op)) return nullptr;
+        }
+        return ring;
+    }
+    /**
+     * RETURN:
+     *   index of the registered buffer containing [buf, buf + size), or -1.
+     */
+    int findRegisteredBuffer(const char *buf, size_t size) const {
+        for (size_t i = 0; i < bufV_.size(); i++) {
+            const char *p = static_cast<const char *>(bufV_[i].iov_base);
+            if (p <= buf && buf + size <= p + bufV_[i].iov_len) return int(i);
+        }
+        return -1;
+    }
+    void prepareSqe(const AioData& io) {
+        struct io_uring_sqe *sqe = ring_->getSqe();
+        if (sqe == nullptr) {
+            throw RT_ERR("Aio: submission queue is full.");
+        }
+        sqe->fd = fd_;
+        sqe->user_data = io.key;
+        if (io.type == IOTYPE_FLUSH) {
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            return;
+        }
+        assert(io.size <= UINT32_MAX);
+        sqe->addr = reinterpret_cast<uintptr_t>(io.buf);
+        sqe->len = io.size;
+        sqe->off = io.oft;
+        const bool isRead = io.type == IOTYPE_READ;
+        const int idx = findRegisteredBuffer(io.buf, io.size);
+        if (idx < 0) {
+            sqe->opcode = isRead ? IORING_OP_READ : IORING_OP_WRITE;
+        } else {
+            sqe->opcode = isRead ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe->buf_index = idx;
+        }
+    }
     static uint getKeyFromEvent(struct io_event &event) {
         struct iocb &iocb = *static_cast<struct iocb *>(event.obj);
         return static_cast<uint>(reinterpret_cast<uintptr_t>(iocb.data));
@@ -487,7 +676,7 @@ private:
         if (io.err < 0) {
             throwLibcErrorWithNo("Aio: io failed.", -io.err);
         }
-        assert(io.iocb.u.c.nbytes == static_cast<uint>(io.err));
+        assert(io.size == static_cast<uint>(io.err));
     }
 };
 
@@ -0,0 +1,277 @@
+#pragma once
+/**
+ * @file
+ * @brief Minimal io_uring wrapper using the system calls directly.
+ */
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "util.hpp"
+
+#ifndef IORING_FEAT_SQPOLL_NONFIXED
+#define IORING_FEAT_SQPOLL_NONFIXED (1U << 7) // since linux 5.11.
+#endif
+
+namespace cybozu {
+namespace aio {
+
+/**
+ * Submission and completion queues shared with the kernel.
+ *
+ * (1) call getSqe() and fill the entry once or more.
+ * (2) call submit() to pass all the filled entries to the kernel at once.
+ * (3) call waitCqe() and peekCqe() to reap completions.
+ *
+ * With SQPOLL, a kernel thread polls the submission queue so that
+ * submit() does not need system calls while the thread is awake.
+ *
+ * This is not thread-safe class.
+ */
+class IoUring
+{
+private:
+    int fd_;
+    struct io_uring_params params_;
+
+    void *sqPtr_;
+    size_t sqSize_;
+    void *cqPtr_;
+    size_t cqSize_;
+    struct io_uring_sqe *sqes_;
+    size_t sqesSize_;
+
+    unsigned *sqHead_;
+    unsigned *sqTail_;
+    unsigned *sqMask_;
+    unsigned *sqFlags_;
+    unsigned *sqArray_;
+    unsigned *cqHead_;
+    unsigned *cqTail_;
+    unsigned *cqMask_;
+    struct io_uring_cqe *cqes_;
+
+    unsigned sqeTail_; // tail of filled entries, not published to the kernel yet.
+    bool hasBuffers_;
+
+    static constexpr unsigned SQ_THREAD_IDLE_MS = 1000;
+
+public:
+    /**
+     * @entries number of submission queue entries.
+     * @useSqPoll true to use a kernel thread to poll the submission queue.
+     *   SQPOLL will not be used if the kernel requires registered files for it
+     *   (IORING_FEAT_SQPOLL_NONFIXED is not supported). See useSqPoll().
+     */
+    IoUring(unsigned entries, bool useSqPoll)
+        : fd_(-1), params_()
+        , sqPtr_(MAP_FAILED), sqSize_(0), cqPtr_(MAP_FAILED), cqSize_(0)
+        , sqes_(static_cast<struct io_uring_sqe *>(MAP_FAILED)), sqesSize_(0)
+        , sqHead_(nullptr), sqTail_(nullptr), sqMask_(nullptr), sqFlags_(nullptr), sqArray_(nullptr)
+        , cqHead_(nullptr), cqTail_(nullptr), cqMask_(nullptr), cqes_(nullptr)
+        , sqeTail_(0), hasBuffers_(false) {
+        assert(entries > 0);
+        setup(entries, useSqPoll);
+        if (useSqPoll && (params_.features & IORING_FEAT_SQPOLL_NONFIXED) == 0) {
+            /* IOs to files not registered would fail. */
+            ::close(fd_);
+            fd_ = -1;
+            setup(entries, false);
+        }
+        try {
+            mapRings();
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+    ~IoUring() noexcept {
+        release();
+    }
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    unsigned sqEntries() const { return params_.sq_entries; }
+    bool useSqPoll() const { return (params_.flags & IORING_SETUP_SQPOLL) != 0; }
+    /**
+     * Check the kernel supports an operation.
+     */
+    bool isSupported(uint8_t opcode) const {
+        const size_t nr = IORING_OP_LAST;
+        std::vector<char> buf(sizeof(struct io_uring_probe) + sizeof(struct io_uring_probe_op) * nr);
+        struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(buf.data());
+        if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, nr) < 0) {
+            return false;
+        }
+        return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+    /**
+     * Get a zero-cleared submission queue entry to fill.
+     * RETURN:
+     *   nullptr if the submission queue is full.
+     */
+    struct io_uring_sqe *getSqe() {
+        const unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+        if (sqeTail_ - head >= params_.sq_entries) return nullptr;
+        const unsigned idx = sqeTail_ & *sqMask_;
+        sqArray_[idx] = idx;
+        sqeTail_++;
+        struct io_uring_sqe *sqe = &sqes_[idx];
+        ::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+    /**
+     * Submit all the filled entries.
+     *
+     * EXCEPTION:
+     *   LibcError
+     */
+    void submit() {
+        unsigned nr = sqeTail_ - *sqTail_;
+        if (nr == 0) return;
+        __atomic_store_n(sqTail_, sqeTail_, __ATOMIC_RELEASE);
+        if (useSqPoll()) {
+            /* The tail store must be visible before checking the flag. */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if ((__atomic_load_n(sqFlags_, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) != 0) {
+                enter(0, 0, IORING_ENTER_SQ_WAKEUP);
+            }
+            return;
+        }
+        while (nr > 0) {
+            const unsigned done = enter(nr, 0, 0);
+            if (done == 0) {
+                throw RT_ERR("IoUring: io_uring_enter submitted nothing: %u", nr);
+            }
+            nr -= std::min(nr, done);
+        }
+    }
+    /**
+     * Reap a completion if exists.
+     * @userData user_data of the completed entry will be set.
+     * @res result of the completed entry will be set.
+     * RETURN:
+     *   false if there is no completion.
+     */
+    bool peekCqe(uint64_t& userData, int32_t& res) {
+        const unsigned head = *cqHead_;
+        if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) return false;
+        const struct io_uring_cqe &cqe = cqes_[head & *cqMask_];
+        userData = cqe.user_data;
+        res = cqe.res;
+        __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    /**
+     * Wait for the completion queue to have minNr completions at least.
+     *
+     * EXCEPTION:
+     *   LibcError
+     */
+    void waitCqe(unsigned minNr) {
+        while (__atomic_load_n(cqTail_, __ATOMIC_ACQUIRE) - *cqHead_ < minNr) {
+            enter(0, minNr, IORING_ENTER_GETEVENTS);
+        }
+    }
+    /**
+     * Register buffers to use IORING_OP_READ_FIXED/WRITE_FIXED.
+     * Buffers registered before will be replaced.
+     * Call this while no IO is in flight.
+     * RETURN:
+     *   false if the kernel rejected them (e.g. over RLIMIT_MEMLOCK).
+     */
+    bool registerBuffers(const std::vector<struct iovec>& iovV) {
+        if (hasBuffers_) {
+            ::syscall(__NR_io_uring_register, fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+            hasBuffers_ = false;
+        }
+        if (iovV.empty()) return true;
+        if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS,
+                      iovV.data(), unsigned(iovV.size())) < 0) {
+            return false;
+        }
+        hasBuffers_ = true;
+        return true;
+    }
+private:
+    void setup(unsigned entries, bool useSqPoll) {
+        ::memset(&params_, 0, sizeof(params_));
+        if (useSqPoll) {
+            params_.flags |= IORING_SETUP_SQPOLL;
+            params_.sq_thread_idle = SQ_THREAD_IDLE_MS;
+        }
+        fd_ = ::syscall(__NR_io_uring_setup, entries, &params_);
+        if (fd_ < 0) {
+            throwLibcError("IoUring: io_uring_setup failed.");
+        }
+    }
+    void mapRings() {
+        const struct io_sqring_offsets &so = params_.sq_off;
+        const struct io_cqring_offsets &co = params_.cq_off;
+        sqSize_ = so.array + params_.sq_entries * sizeof(unsigned);
+        cqSize_ = co.cqes + params_.cq_entries * sizeof(struct io_uring_cqe);
+        const bool isSingleMmap = (params_.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (isSingleMmap) {
+            sqSize_ = std::max(sqSize_, cqSize_);
+            cqSize_ = sqSize_;
+        }
+        sqPtr_ = mapRing(sqSize_, IORING_OFF_SQ_RING);
+        cqPtr_ = isSingleMmap ? sqPtr_ : mapRing(cqSize_, IORING_OFF_CQ_RING);
+        sqesSize_ = params_.sq_entries * sizeof(struct io_uring_sqe);
+        sqes_ = static_cast<struct io_uring_sqe *>(mapRing(sqesSize_, IORING_OFF_SQES));
+
+        char *sq = static_cast<char *>(sqPtr_);
+        sqHead_ = reinterpret_cast<unsigned *>(sq + so.head);
+        sqTail_ = reinterpret_cast<unsigned *>(sq + so.tail);
+        sqMask_ = reinterpret_cast<unsigned *>(sq + so.ring_mask);
+        sqFlags_ = reinterpret_cast<unsigned *>(sq + so.flags);
+        sqArray_ = reinterpret_cast<unsigned *>(sq + so.array);
+        char *cq = static_cast<char *>(cqPtr_);
+        cqHead_ = reinterpret_cast<unsigned *>(cq + co.head);
+        cqTail_ = reinterpret_cast<unsigned *>(cq + co.tail);
+        cqMask_ = reinterpret_cast<unsigned *>(cq + co.ring_mask);
+        cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + co.cqes);
+        sqeTail_ = *sqTail_;
+    }
+    void *mapRing(size_t size, off_t offset) {
+        void *p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+        if (p == MAP_FAILED) {
+            throwLibcError("IoUring: mmap failed.");
+        }
+        return p;
+    }
+    /**
+     * RETURN:
+     *   number of consumed submission queue entries.
+     */
+    unsigned enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        for (;;) {
+            const int ret = ::syscall(__NR_io_uring_enter, fd_, toSubmit, minComplete, flags, nullptr, 0);
+            if (ret >= 0) return unsigned(ret);
+            if (errno != EINTR) {
+                throwLibcError("IoUring: io_uring_enter failed.");
+            }
+        }
+    }
+    void release() noexcept {
+        if (sqes_ != MAP_FAILED) ::munmap(sqes_, sqesSize_);
+        if (cqPtr_ != MAP_FAILED && cqPtr_ != sqPtr_) ::munmap(cqPtr_, cqSize_);
+        if (sqPtr_ != MAP_FAILED) ::munmap(sqPtr_, sqSize_);
+        sqes_ = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+        cqPtr_ = MAP_FAILED;
+        sqPtr_ = MAP_FAILED;
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+    }
+};
+
+}} // namespace cybozu::aio
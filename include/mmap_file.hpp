@@ -141,6 +141,19 @@ public:
     void setReadOnly(bool isReadOnly = true) {
         isReadOnly_ = isReadOnly;
     }
+    /**
+     * Give an advice on the range to the kernel. See madvise(2).
+     * The range will be extended to page boundaries.
+     * An advice is only a hint so this does not throw.
+     * RETURN:
+     *   false if madvise failed. See errno.
+     */
+    bool advise(uint64_t offset, uint64_t size, int advice) const noexcept {
+        const uint64_t bgn = offset / pageSize() * pageSize();
+        const uint64_t end = std::min(offset + size, mappedSize_);
+        if (!mapped_ || end <= bgn) return true;
+        return ::madvise((char *)mapped_ + bgn, end - bgn, advice) == 0;
+    }
 private:
     void init() {
         uint64_t fileSize = 0;
@@ -0,0 +1,45 @@
+#pragma once
+/**
+ * @file
+ * @brief Socket utility.
+ */
+#include <type_traits>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "cybozu/socket.hpp"
+#include "cybozu/exception.hpp"
+
+namespace cybozu {
+namespace net {
+
+/**
+ * Init a socket for a server listening on the address only.
+ * cybozu::Socket::bind() listens on all the addresses of the host.
+ *
+ * cybozu::Socket is a standard-layout class whose only member is the socket descriptor,
+ * so the descriptor is set through a pointer to the object.
+ */
+inline void bindAddr(cybozu::Socket &sock, const cybozu::SocketAddr &addr)
+{
+    typedef cybozu::socket_local::SocketHandle SocketHandle;
+    static_assert(std::is_standard_layout<cybozu::Socket>::value, "cybozu::Socket layout");
+    static_assert(sizeof(cybozu::Socket) == sizeof(SocketHandle), "cybozu::Socket layout");
+
+    const int fd = ::socket(addr.getFamily(), SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) {
+        throw cybozu::Exception(__func__) << "socket" << cybozu::NetErrorNo();
+    }
+    const int on = 1;
+    if (::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        ::bind(fd, addr.get(), addr.getSize()) != 0 ||
+        ::listen(fd, SOMAXCONN) != 0) {
+        cybozu::NetErrorNo keep;
+        ::close(fd);
+        throw cybozu::Exception(__func__) << addr.toStr() << keep;
+    }
+    sock.close();
+    *reinterpret_cast<SocketHandle *>(&sock) = fd;
+}
+
+}} //namespace cybozu::net
@@ -941,14 +941,18 @@ public:
     /**
      * You should call this when an error has ocurred.
      * Blockded threads will be waken up and will throw FailedError.
+     * Remaining items will be discarded.
      */
     void fail() noexcept {
+        std::queue<T> q;
         AutoLock lk(mutex_);
         if (isFailed_) return;
         isClosed_ = true;
         isFailed_ = true;
+        q.swap(queue_);
         condEmpty_.notify_all();
         condFull_.notify_all();
+        lk.unlock();
     }
 private:
     bool isFull() const {
@@ -1002,6 +1006,8 @@ inline std::string exceptionPtrToStr(std::exception_ptr ep) try
 /**
  * Parallel converter.
  * T1 and T2 must be movable and default constructible.
+ * Converted items are popped in the same order as pushed.
+ * An error thrown in a converter will be rethrown by push(), pop() and sync().
  */
 template <typename T1, typename T2>
 class ParallelConverter
@@ -1042,6 +1048,9 @@ class ParallelConverter
     BoundedQueue<Dst> outQ_;
     ThreadRunnerSet workerSet_;
 
+    std::mutex epMu_;
+    std::exception_ptr ep_; // the first error thrown by a converter.
+
 public:
     /**
      * Convrter must be function of type T2 (*)(T1&&).
@@ -1052,20 +1061,26 @@ public:
         , pushMu_(), pushId_(0)
         , popMu_(), popId_(0), map_()
         , inQ_(2), outQ_(2)
-        , workerSet_() {
+        , workerSet_()
+        , epMu_(), ep_() {
     }
     ~ParallelConverter() noexcept {
         // You called sync() before, this will not effect anything.
         fail();
     }
-    void start(size_t concurrency = 0) {
+    /**
+     * concurrency: number of worker threads. 0 means the number of cores.
+     * inQueueSize: max number of items waiting for a worker. 0 means concurrency * 2.
+     * outQueueSize: max number of converted items waiting for pop(). 0 means concurrency * 2.
+     */
+    void start(size_t concurrency = 0, size_t inQueueSize = 0, size_t outQueueSize = 0) {
         std::lock_guard<std::mutex> lock(pushMu_);
         if (concurrency == 0) {
             concurrency = std::thread::hardware_concurrency();
         }
         const size_t qs = concurrency * 2;
-        inQ_.resize(qs);
-        outQ_.resize(qs);
+        inQ_.resize(inQueueSize == 0 ? qs : inQueueSize);
+        outQ_.resize(outQueueSize == 0 ? qs : outQueueSize);
         for (size_t i = 0; i < concurrency; i++) {
             workerSet_.add([this]() { runWorker(); });
         }
@@ -1076,7 +1091,12 @@ public:
      */
     void push(T1&& t1) {
         std::lock_guard<std::mutex> lock(pushMu_);
-        inQ_.push(Src { pushId_, std::move(t1) });
+        try {
+            inQ_.push(Src { pushId_, std::move(t1) });
+        } catch (typename BoundedQueue<Src>::FailedError&) {
+            rethrowIfConverterFailed();
+            throw;
+        }
         pushId_++;
     }
     /**
@@ -1089,13 +1109,18 @@ public:
             popId_++;
             return true;
         }
-        while (outQ_.pop(dst)) {
-            if (dst.id == popId_) {
-                t2 = std::move(dst.t2);
-                popId_++;
-                return true;
+        try {
+            while (outQ_.pop(dst)) {
+                if (dst.id == popId_) {
+                    t2 = std::move(dst.t2);
+                    popId_++;
+                    return true;
+                }
+                map_.insert(std::make_pair(dst.id, std::move(dst.t2)));
             }
-            map_.insert(std::make_pair(dst.id, std::move(dst.t2)));
+        } catch (typename BoundedQueue<Dst>::FailedError&) {
+            rethrowIfConverterFailed();
+            throw;
         }
         return false;
     }
@@ -1105,15 +1130,20 @@ public:
     void sync() {
         inQ_.sync();
         joinWorkerSet();
+        rethrowIfConverterFailed();
         outQ_.sync();
     }
     /**
      * This is thread-safe.
+     * Items not popped yet will be discarded.
      */
     void fail() noexcept {
         inQ_.fail();
         outQ_.fail();
         joinWorkerSet();
+        std::map<uint64_t, T2> m;
+        std::lock_guard<std::mutex> lock(popMu_);
+        m.swap(map_);
     }
 private:
     /**
@@ -1131,12 +1161,26 @@ private:
         std::lock_guard<std::mutex> lock(pushMu_);
         workerSet_.join();
     }
+    void rethrowIfConverterFailed() {
+        std::exception_ptr ep;
+        {
+            std::lock_guard<std::mutex> lock(epMu_);
+            ep = ep_;
+        }
+        if (ep) std::rethrow_exception(ep);
+    }
     void runWorker() noexcept try {
         Src src;
         Dst dst;
         while (inQ_.pop(src)) {
             dst.id = src.id;
-            dst.t2 = holderP_->convert(std::move(src.t1));
+            try {
+                dst.t2 = holderP_->convert(std::move(src.t1));
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(epMu_);
+                if (!ep_) ep_ = std::current_exception();
+                throw;
+            }
             outQ_.push(std::move(dst));
         }
     } catch (...) {
@@ -24,6 +24,11 @@
 
 #include <sys/time.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CYBOZU_UTIL_USE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #ifdef _MSC_VER
 #define UNUSED
 #define DEPRECATED
@@ -420,12 +425,11 @@ void printList(const C &c)
     printList(std::cout, c);
 }
 
-inline bool isAllZero(const void *data, size_t size)
+namespace zero_local {
+
+inline bool isAllZeroScalar(const char *p, size_t size)
 {
-#if 1
-    // Faster implementation.
     uint64_t x;
-    const char *p = (const char *)data;
     while (sizeof(x) <= size) {
         ::memcpy(&x, p, sizeof(x));
         if (x != 0) return false;
@@ -437,13 +441,67 @@ inline bool isAllZero(const void *data, size_t size)
         size--;
     }
     return true;
-#else
-    const char *p = (const char *)data;
-    while (size > 0) {
-        if (*(p++)) return false;
-        size--;
+}
+
+#ifdef CYBOZU_UTIL_USE_X86_SIMD
+/**
+ * SSE2 is always available on x86_64.
+ * 64 bytes are ORed and tested at once.
+ */
+inline bool isAllZeroSse2(const char *p, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    while (64 <= size) {
+        const __m128i *q = (const __m128i *)p;
+        const __m128i x = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128(q), _mm_loadu_si128(q + 1)),
+            _mm_or_si128(_mm_loadu_si128(q + 2), _mm_loadu_si128(q + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xffff) return false;
+        p += 64;
+        size -= 64;
     }
-    return true;
+    return isAllZeroScalar(p, size);
+}
+
+/**
+ * 128 bytes are ORed and tested at once.
+ * Call this only if the CPU supports AVX2.
+ */
+__attribute__((target("avx2")))
+inline bool isAllZeroAvx2(const char *p, size_t size)
+{
+    while (128 <= size) {
+        const __m256i *q = (const __m256i *)p;
+        const __m256i x = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256(q), _mm256_loadu_si256(q + 1)),
+            _mm256_or_si256(_mm256_loadu_si256(q + 2), _mm256_loadu_si256(q + 3)));
+        if (!_mm256_testz_si256(x, x)) return false;
+        p += 128;
+        size -= 128;
+    }
+    return isAllZeroSse2(p, size);
+}
+
+inline bool hasAvx2()
+{
+    static const bool ret = __builtin_cpu_supports("avx2");
+    return ret;
+}
+#endif
+
+} //namespace zero_local
+
+/**
+ * The kernel is selected by the CPU at runtime.
+ */
+inline bool isAllZero(const void *data, size_t size)
+{
+    const char *p = (const char *)data;
+#ifdef CYBOZU_UTIL_USE_X86_SIMD
+    if (zero_local::hasAvx2()) return zero_local::isAllZeroAvx2(p, size);
+    return zero_local::isAllZeroSse2(p, size);
+#else
+    return zero_local::isAllZeroScalar(p, size);
 #endif
 }
 
@@ -1690,6 +1690,34 @@ class Controller(object):
         args = ['set-full-scan-bps', throughputU]
         self.run_ctl(sx, args)
 
+    def set_wlog_bps(self, sx, readThroughputU, sendThroughputU):
+        '''
+        Set max throughput of wlog-transfer shared by all the volumes.
+        sx :: ServerParams - storage server.
+        readThroughputU :: str - log device read throughput [bytes/sec]
+        sendThroughputU :: str - network throughput [bytes/sec]
+            0 means unlimited.
+            Unit suffix like '100M' is allowed.
+        '''
+        verify_server_kind(sx, [K_STORAGE])
+        verify_size_unit(readThroughputU)
+        verify_size_unit(sendThroughputU)
+        args = ['set-wlog-bps', readThroughputU, sendThroughputU]
+        self.run_ctl(sx, args)
+
+    def set_wlog_cmpr(self, sx, vol, cmprOpt):
+        '''
+        Set compression option of wlog-transfer for a volume.
+        sx :: ServerParams   - storage server.
+        vol :: str           - volume name.
+        cmprOpt :: CompressOpt - nrCpu is the number of compression threads.
+        '''
+        verify_server_kind(sx, [K_STORAGE])
+        verify_type(vol, str)
+        verify_type(cmprOpt, CompressOpt)
+        args = ['set-wlog-cmpr', vol, str(cmprOpt)]
+        self.run_ctl(sx, args)
+
     def is_overflow(self, sx, vol):
         '''
         Check a storage is overflow or not.
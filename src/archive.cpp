@@ -67,45 +67,102 @@ void verifyApplicable(const std::string& volId, uint64_t gid)
     }
 }
 
+/**
+ * Writer of merged diff IOs to a volume.
+ */
+class DiffIoWriter
+{
+    std::unique_ptr<AsyncDiffApplier> applier_;
+    cybozu::util::File file_;
+    AlignedArray zero_;
+public:
+    DiffIoWriter(const std::string& lvPathStr, bool useAio)
+        : applier_(), file_(), zero_() {
+        if (useAio) {
+            applier_.reset(new AsyncDiffApplier(lvPathStr, ga.discardType, ga.applyAioBufferSize));
+        } else {
+            file_.open(lvPathStr, O_RDWR);
+        }
+    }
+    static bool canUseAio(const std::string& lvPathStr) {
+        return ga.applyAioBufferSize > 0 && AsyncDiffApplier::isApplicable(lvPathStr);
+    }
+    void write(const DiffRecord& rec, const char *data) {
+        if (applier_) {
+            applier_->add(rec, data);
+        } else {
+            issueIo(file_, ga.discardType, rec, data, zero_);
+        }
+    }
+    /**
+     * Make the written IOs persistent.
+     */
+    void sync() {
+        if (applier_) {
+            applier_->sync();
+        } else {
+            file_.fdatasync();
+        }
+    }
+    void close() {
+        if (applier_) {
+            applier_->finalize();
+        } else {
+            file_.fdatasync();
+            file_.close();
+        }
+    }
+};
+
 bool applyOpenedDiffs(std::vector<cybozu::util::File>&& fileV, cybozu::lvm::Lv& lv,
                       const std::atomic<int>& stopState,
                       DiffStatistics& statIn, DiffStatistics& statOut, std::string& memUsageStr)
 {
     const char *const FUNC = __func__;
-    statOut.clear();
-    DiffMerger merger;
+    ParallelDiffMerger merger;
+    merger.setNrThreads(ga.mergeThreads);
+    merger.setMaxOpenFiles(ga.maxOpenDiffs);
+    merger.setPrefetchQueueSize(ga.mergePrefetchIos);
+    merger.setMemoryBudget(getArchiveGlobal().mergeMemBudget);
     merger.addWdiffs(std::move(fileV));
     merger.prepare();
-    DiffRecIo recIo;
     const std::string lvPathStr = lv.path().str();
-    cybozu::util::File file(lvPathStr, O_RDWR);
-    AlignedArray zero;
     const uint64_t lvSnapSizeLb = lv.sizeLb();
-    double t0 = cybozu::util::getTime();
-    while (merger.getAndRemove(recIo)) {
-        if (stopState == ForceStopping || ga.ps.isForceShutdown()) {
-            return false;
-        }
-        const DiffRecord& rec = recIo.record();
-        statOut.update(rec);
-        assert(!rec.isCompressed());
-        const uint64_t ioAddress = rec.io_address;
-        const uint64_t ioBlocks = rec.io_blocks;
-        //LOGs.debug() << "ioAddress" << ioAddress << "ioBlocks" << ioBlocks;
-        if (ioAddress + ioBlocks > lvSnapSizeLb) {
-            throw cybozu::Exception(FUNC) << "out of range" << ioAddress << ioBlocks << lvSnapSizeLb;
-        }
-        issueIo(file, ga.discardType, rec, recIo.io().data(), zero);
-
-        const double t1 = cybozu::util::getTime();
-        if (t1 - t0 > PROGRESS_INTERVAL_SEC) {
-            LOGs.info() << FUNC << "progress" << lvPathStr
-                        << cybozu::util::formatString("%" PRIu64 "/%" PRIu64 "", ioAddress, lvSnapSizeLb);
-            t0 = t1;
-        }
-    }
-    file.fdatasync();
-    file.close();
+    const bool useAio = DiffIoWriter::canUseAio(lvPathStr);
+    std::vector<DiffStatistics> statV(merger.getNrRanges());
+    /* Each address range is applied independently. */
+    const bool ret = merger.run([&](size_t rangeIdx, DiffMerger &rangeMerger) {
+            DiffRecIo recIo;
+            DiffIoWriter writer(lvPathStr, useAio);
+            double t0 = cybozu::util::getTime();
+            while (rangeMerger.getAndRemove(recIo)) {
+                if (stopState == ForceStopping || ga.ps.isForceShutdown() || merger.isStopping()) {
+                    return false;
+                }
+                const DiffRecord& rec = recIo.record();
+                statV[rangeIdx].update(rec);
+                assert(!rec.isCompressed());
+                const uint64_t ioAddress = rec.io_address;
+                const uint64_t ioBlocks = rec.io_blocks;
+                //LOGs.debug() << "ioAddress" << ioAddress << "ioBlocks" << ioBlocks;
+                if (ioAddress + ioBlocks > lvSnapSizeLb) {
+                    throw cybozu::Exception(FUNC) << "out of range" << ioAddress << ioBlocks << lvSnapSizeLb;
+                }
+                writer.write(rec, recIo.io().data());
+
+                const double t1 = cybozu::util::getTime();
+                if (t1 - t0 > PROGRESS_INTERVAL_SEC) {
+                    LOGs.info() << FUNC << "progress" << lvPathStr << rangeIdx
+                                << cybozu::util::formatString("%" PRIu64 "/%" PRIu64 "", ioAddress, lvSnapSizeLb);
+                    t0 = t1;
+                }
+            }
+            writer.close();
+            return true;
+        });
+    if (!ret) return false;
+    statOut.clear();
+    for (const DiffStatistics &stat : statV) statOut.update(stat);
     statIn = merger.statIn();
     statOut.wdiffNr = -1;
     statOut.dataSize = -1;
@@ -253,23 +310,17 @@ bool mergeDiffs(const std::string &volId, uint64_t gidB, bool isSize, uint64_t p
     LOGs.debug() << "merge-diffs" << mergedDiff << diffV;
     const cybozu::FilePath diffPath = volInfo.getDiffPath(mergedDiff);
     cybozu::TmpFile tmpFile(volInfo.volDir.str());
-    DiffMerger merger;
+    ParallelDiffMerger merger;
+    merger.setNrThreads(ga.mergeThreads);
+    merger.setMaxOpenFiles(ga.maxOpenDiffs);
+    merger.setPrefetchQueueSize(ga.mergePrefetchIos);
+    merger.setMemoryBudget(getArchiveGlobal().mergeMemBudget);
     merger.addWdiffs(std::move(fileV));
-    merger.prepare();
-
-    SortedDiffWriter writer;
-    writer.setFd(tmpFile.fd());
-    DiffFileHeader wdiffH = merger.header();
-    writer.writeHeader(wdiffH);
-    DiffRecIo recIo;
-    while (merger.getAndRemove(recIo)) {
-        if (volSt.stopState == ForceStopping || ga.ps.isForceShutdown()) {
-            return false;
-        }
-        // TODO: currently we can use snappy only.
-        writer.compressAndWriteDiff(recIo.record(), recIo.io().data());
-    }
-    writer.close();
+    // TODO: currently we can use snappy only.
+    const bool ret = merger.mergeToFd(tmpFile.fd(), CompressOpt(), volInfo.volDir.str(), [&]() {
+            return volSt.stopState == ForceStopping || ga.ps.isForceShutdown();
+        });
+    if (!ret) return false;
 
     mergedDiff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
     tmpFile.save(diffPath.str());
@@ -277,21 +328,26 @@ bool mergeDiffs(const std::string &volId, uint64_t gidB, bool isSize, uint64_t p
     volInfo.removeDiffs(diffV);
 
     LOGs.info() << "merge-mergeIn " << volId << merger.statIn();
-    LOGs.info() << "merge-mergeOut" << volId << writer.getStat();
+    LOGs.info() << "merge-mergeOut" << volId << merger.statOut();
     LOGs.info() << "merge-mergeMemUsage" << volId << merger.memUsageStr();
     LOGs.info() << "merged" << volId << diffV.size() << mergedDiff;
     return true;
 }
 
 
+/**
+ * Remove the temporary restored snapshot and its restore state file.
+ */
 struct TmpSnapshotDeleter
 {
-    std::string vgName;
-    std::string name;
+    ArchiveVolInfo &volInfo;
+    uint64_t gid;
+    bool doKeep; // keep them to resume.
     ~TmpSnapshotDeleter()
         try
     {
-        removeLv(vgName, name);
+        if (doKeep) return;
+        volInfo.removeKeptRestore(gid);
     } catch (...) {
     }
 };
@@ -332,31 +388,187 @@ static void removeColdSnapshotsExceptTheLatestOne(ArchiveVolInfo &volInfo)
 }
 
 
-static bool applyDiffsToRestore(
-    const std::string& volId, cybozu::lvm::Lv& tmpLv,
-    const MetaState& st0, uint64_t gid, MetaState& st1)
+using SaveRestoreShard = std::function<void(size_t, const RestoreShardState&, const DiffStatistics&)>;
+
+/**
+ * Apply a batch of diffs to the remaining area of a shard from shard.progressLb.
+ *
+ * RETURN:
+ *   false if stopped.
+ */
+static bool restoreShardBatch(
+    std::vector<cybozu::util::File>&& fileV, const std::string& lvPathStr, uint64_t lvSizeLb,
+    size_t shardIdx, RestoreShardState& shard, const SaveRestoreShard& saveShard,
+    const std::function<bool()>& shouldStop)
+{
+    const char *const FUNC = __func__;
+    DiffMerger merger;
+    merger.setPrefetchQueueSize(ga.mergePrefetchIos);
+    merger.setMemoryBudget(getArchiveGlobal().mergeMemBudget);
+    merger.setAddressRange(shard.progressLb, shard.endLb);
+    merger.addWdiffs(std::move(fileV));
+    merger.prepare();
+
+    DiffIoWriter writer(lvPathStr, DiffIoWriter::canUseAio(lvPathStr));
+    DiffStatistics statOut;
+    DiffRecIo recIo;
+    uint64_t doneLb = shard.progressLb;
+    double t0 = cybozu::util::getTime();
+    double tSaved = t0;
+    while (merger.getAndRemove(recIo)) {
+        if (shouldStop()) {
+            writer.close();
+            shard.progressLb = doneLb;
+            saveShard(shardIdx, shard, statOut);
+            return false;
+        }
+        const DiffRecord& rec = recIo.record();
+        statOut.update(rec);
+        assert(!rec.isCompressed());
+        const uint64_t ioAddress = rec.io_address;
+        const uint64_t ioBlocks = rec.io_blocks;
+        if (ioAddress + ioBlocks > lvSizeLb) {
+            throw cybozu::Exception(FUNC) << "out of range" << ioAddress << ioBlocks << lvSizeLb;
+        }
+        writer.write(rec, recIo.io().data());
+        doneLb = ioAddress + ioBlocks;
+
+        const double t1 = cybozu::util::getTime();
+        if (t1 - tSaved > RESTORE_STATE_SAVE_INTERVAL_SEC) {
+            writer.sync();
+            shard.progressLb = doneLb;
+            saveShard(shardIdx, shard, statOut);
+            statOut.clear();
+            tSaved = t1;
+        }
+        if (t1 - t0 > PROGRESS_INTERVAL_SEC) {
+            LOGs.info() << FUNC << "progress" << lvPathStr << shardIdx
+                        << cybozu::util::formatString("%" PRIu64 "/%" PRIu64 "", ioAddress, lvSizeLb);
+            t0 = t1;
+        }
+    }
+    writer.close();
+    shard.progressLb = shard.endLb;
+    saveShard(shardIdx, shard, statOut);
+    return true;
+}
+
+
+/**
+ * Apply diffs to a shard of a restored snapshot batch by batch until it reaches gid.
+ * The shard state is saved when the applied IOs are persistent.
+ *
+ * RETURN:
+ *   false if stopped.
+ */
+static bool restoreShard(
+    const std::string& volId, uint64_t gid, const std::string& lvPathStr, uint64_t lvSizeLb,
+    size_t shardIdx, RestoreShardState& shard, const SaveRestoreShard& saveShard,
+    size_t maxOpenDiffs, const std::atomic<bool>& quit)
 {
     ArchiveVolState &volSt = getArchiveVolState(volId);
     ArchiveVolInfo volInfo = getArchiveVolInfo(volId);
-
-    std::vector<cybozu::util::File> fileV;
-    MetaDiffVec diffV = tryOpenDiffs(
-        fileV, volInfo, !allowEmpty, st0, [&](const MetaState &st) {
-            return volSt.diffMgr.getDiffListToRestore(st, gid, ga.maxOpenDiffs);
-        });
-    LOGs.debug() << "restore-diffs" << volId << st0 << diffV;
-    DiffStatistics statIn, statOut;
-    std::string memUsageStr;
-    if (!applyOpenedDiffs(std::move(fileV), tmpLv, volSt.stopState, statIn, statOut, memUsageStr)) {
-        return false;
+    const auto shouldStop = [&]() {
+        return quit || volSt.stopState == ForceStopping || ga.ps.isForceShutdown();
+    };
+
+    while (!shard.isDone) {
+        std::vector<cybozu::util::File> fileV;
+        if (!shard.batchV.empty() && !openDiffs(fileV, volInfo, shard.batchV)) {
+            /*
+             * The diffs have been merged or removed.
+             * Applying the diffs from shard.metaSt again is safe
+             * because all the diffs after them will be applied in order.
+             */
+            LOGs.warn() << "restore-batch restarted" << volId << shardIdx << shard;
+            shard.batchV.clear();
+            shard.progressLb = shard.bgnLb;
+        }
+        if (shard.batchV.empty()) {
+            shard.batchV = tryOpenDiffs(
+                fileV, volInfo, !allowEmpty, shard.metaSt, [&](const MetaState &st) {
+                    return volSt.diffMgr.getDiffListToRestore(st, gid, maxOpenDiffs);
+                });
+        }
+        const MetaDiffVec diffV = shard.batchV;
+        LOGs.debug() << "restore-diffs" << volId << shardIdx << shard << diffV;
+        /* The area may have been completed just before stopped. */
+        if (shard.progressLb < shard.endLb &&
+            !restoreShardBatch(std::move(fileV), lvPathStr, lvSizeLb, shardIdx, shard, saveShard, shouldStop)) {
+            return false;
+        }
+        shard.metaSt = apply(shard.metaSt, diffV);
+        shard.progressLb = shard.bgnLb;
+        shard.batchV.clear();
+        shard.isDone = isRestoreDone(shard.metaSt, gid);
+        saveShard(shardIdx, shard, DiffStatistics());
     }
-    st1 = apply(st0, diffV);
+    return true;
+}
 
-    LOGs.info() << "restore-mergeIn " << volId << statIn;
-    LOGs.info() << "restore-mergeOut" << volId << statOut;
-    LOGs.info() << "restore-mergeMemUsage" << volId << memUsageStr;
-    LOGs.info() << "restore-status" << volId << st0 << st1;
 
+/**
+ * Apply diffs to the shards of a restored snapshot in parallel.
+ * Each thread takes the remaining shards in order and applies them with its own writer.
+ *
+ * RETURN:
+ *   false if force stopped.
+ */
+static bool applyDiffsToRestore(
+    const std::string& volId, cybozu::lvm::Lv& tmpLv, uint64_t gid, RestoreState& restoreSt)
+{
+    ArchiveVolInfo volInfo = getArchiveVolInfo(volId);
+    const std::string lvPathStr = tmpLv.path().str();
+    const uint64_t lvSizeLb = tmpLv.sizeLb();
+    const size_t nrShards = restoreSt.shardV.size();
+
+    std::mutex mu;
+    DiffStatistics statOut;
+    const SaveRestoreShard saveShard = [&](size_t idx, const RestoreShardState& shard, const DiffStatistics& stat) {
+        std::lock_guard<std::mutex> lk(mu);
+        restoreSt.shardV[idx] = shard;
+        restoreSt.timestamp = ::time(0);
+        volInfo.setRestoreState(gid, restoreSt);
+        statOut.update(stat);
+    };
+    std::atomic<size_t> nextIdx(0);
+    std::atomic<bool> quit(false);
+    cybozu::thread::ThreadRunnerSet thS;
+    const size_t nrThreads = std::min(ga.mergeThreads, nrShards);
+    /* The threads open diffs at the same time. */
+    const size_t maxOpenDiffs = getRestoreMaxOpenDiffs(ga.maxOpenDiffs, nrThreads);
+    for (size_t i = 0; i < nrThreads; i++) {
+        thS.add([&]() {
+                try {
+                    size_t idx;
+                    while ((idx = nextIdx++) < nrShards) {
+                        RestoreShardState shard;
+                        {
+                            std::lock_guard<std::mutex> lk(mu);
+                            shard = restoreSt.shardV[idx];
+                        }
+                        if (!restoreShard(volId, gid, lvPathStr, lvSizeLb, idx, shard, saveShard,
+                                          maxOpenDiffs, quit)) {
+                            quit = true;
+                            return;
+                        }
+                    }
+                } catch (...) {
+                    quit = true;
+                    throw;
+                }
+            });
+    }
+    thS.start();
+    for (std::exception_ptr ep : thS.join()) {
+        if (ep) std::rethrow_exception(ep);
+    }
+    if (quit) return false;
+
+    statOut.wdiffNr = -1;
+    statOut.dataSize = -1;
+    LOGs.info() << "restore-mergeOut" << volId << statOut;
+    LOGs.info() << "restore-status" << volId << restoreSt.metaSt << restoreSt.shardV[0].metaSt;
     return true;
 }
 
@@ -364,9 +576,13 @@ static bool applyDiffsToRestore(
 /**
  * Restore a snapshot.
  * (1) create lvm snapshot of base lv. (with temporary lv name)
- * (2) apply appropriate wdiff files.
+ * (2) apply appropriate wdiff files to the shards of the snapshot in parallel.
  * (3) rename the lvm snapshot.
  *
+ * Progress of the shards is saved in the volume directory.
+ * If force stopped, the temporary snapshot is kept and
+ * the next restore of the gid resumes from the saved progress.
+ *
  * RETURN:
  *   false if force stopped.
  */
@@ -379,38 +595,57 @@ bool restore(const std::string &volId, uint64_t gid)
     cybozu::lvm::Lv baseLv = lvC.getLv();
     const std::string targetName = volInfo.restoredSnapshotName(gid);
     const std::string tmpLvName = volInfo.tmpRestoredSnapshotName(gid);
-    removeLv(baseLv.vgName(), tmpLvName);
 
     bool useCold;
-    MetaState st0 = volInfo.getMetaStateForRestore(gid, useCold);
+    const MetaState st0 = volInfo.getMetaStateForRestore(gid, useCold);
 
     cybozu::lvm::Lv tmpLv;
-    if (isThinpool()) {
-        if (useCold) {
-            /* Here the cold lv must exist. */
-            cybozu::lvm::Lv coldLv = lvC.getCold(st0.snapB.gidB);
-            tmpLv = coldLv.createTvSnap(tmpLvName, true);
-            if (tmpLv.sizeLb() < baseLv.sizeLb()) {
-                tmpLv.resize(baseLv.sizeLb());
+    RestoreState restoreSt;
+    bool doResume = volInfo.getRestoreState(gid, restoreSt)
+        && cybozu::lvm::existsFile(baseLv.vgName(), tmpLvName);
+    if (doResume) {
+        tmpLv = cybozu::lvm::locate(baseLv.vgName(), tmpLvName);
+        doResume = restoreSt.canResume(st0, tmpLv.sizeLb());
+    }
+    if (doResume) {
+        LOGs.info() << "restore resumed" << volId << gid << restoreSt;
+    } else {
+        removeLv(baseLv.vgName(), tmpLvName);
+        if (isThinpool()) {
+            if (useCold) {
+                /* Here the cold lv must exist. */
+                cybozu::lvm::Lv coldLv = lvC.getCold(st0.snapB.gidB);
+                tmpLv = coldLv.createTvSnap(tmpLvName, true);
+                if (tmpLv.sizeLb() < baseLv.sizeLb()) {
+                    tmpLv.resize(baseLv.sizeLb());
+                }
+            } else {
+                /* Use base image for snapshot origin. */
+                tmpLv = baseLv.createTvSnap(tmpLvName, true);
             }
         } else {
-            /* Use base image for snapshot origin. */
-            tmpLv = baseLv.createTvSnap(tmpLvName, true);
+            assert(!useCold);
+            const uint64_t snapSizeLb = uint64_t((double)(baseLv.sizeLb()) * 1.2);
+            tmpLv = baseLv.createLvSnap(tmpLvName, true, snapSizeLb);
         }
-    } else {
-        assert(!useCold);
-        const uint64_t snapSizeLb = uint64_t((double)(baseLv.sizeLb()) * 1.2);
-        tmpLv = baseLv.createLvSnap(tmpLvName, true, snapSizeLb);
+        restoreSt.metaSt = st0;
+        restoreSt.sizeLb = tmpLv.sizeLb();
+        restoreSt.shardV = makeRestoreShards(
+            st0, gid, restoreSt.sizeLb, ga.mergeThreads * RESTORE_SHARDS_PER_THREAD, RESTORE_SHARD_ALIGN_LB);
+        restoreSt.timestamp = ::time(0);
+        volInfo.setRestoreState(gid, restoreSt);
     }
-    TmpSnapshotDeleter deleter{baseLv.vgName(), tmpLvName};
+    TmpSnapshotDeleter deleter{volInfo, gid, false};
 
-    bool noNeedToApply =
-        !st0.isApplying && st0.snapB.isClean() && st0.snapB.gidB == gid;
-    MetaState st1 = st0;
-    while (!noNeedToApply) {
-        if (!applyDiffsToRestore(volId, tmpLv, st0, gid, st1)) return false;
-        noNeedToApply = !st1.isApplying && st1.snapB.isClean() && st1.snapB.gidB == gid;
-        st0 = st1;
+    if (!applyDiffsToRestore(volId, tmpLv, gid, restoreSt)) {
+        deleter.doKeep = true;
+        return false;
+    }
+    const MetaState st1 = restoreSt.shardV[0].metaSt;
+    for (const RestoreShardState& shard : restoreSt.shardV) {
+        if (!shard.isDone || shard.metaSt != st1) {
+            throw cybozu::Exception(__func__) << "BUG: bad restore shard" << volId << gid << shard;
+        }
     }
     if (isThinpool()) {
         util::flushBdevBufs(tmpLv.path().str());
@@ -424,6 +659,7 @@ bool restore(const std::string &volId, uint64_t gid)
         }
     }
     cybozu::lvm::Lv snapLv = cybozu::lvm::renameLv(baseLv.vgName(), tmpLvName, targetName);
+    volInfo.removeRestoreState(gid);
     lvC.addRestored(gid, snapLv);
     util::flushBdevBufs(snapLv.path().str());
     if (isThinpool() && ga.keepOneColdSnapshot) {
@@ -440,6 +676,11 @@ void delSnapshot(const std::string &volId, uint64_t gid, bool isCold)
     VolLvCache &lvC = volSt.lvCache;
     ArchiveVolInfo volInfo = getArchiveVolInfo(volId);
 
+    if (!isCold && volInfo.existsRestoreState(gid)) {
+        /* A force-stopped restore of the gid has not been resumed. */
+        volInfo.removeKeptRestore(gid);
+        if (!lvC.hasRestored(gid)) return;
+    }
     if ((isCold && !lvC.hasCold(gid)) || (!isCold && !lvC.hasRestored(gid))) {
         throw cybozu::Exception(FUNC)
             << "volume not found" << volId << gid << (isCold ? "cold" : "restored");
@@ -514,7 +755,23 @@ void dbgVerifyLatestMetaState(const std::string &volId)
 }
 
 
-void backupServer(protocol::ServerParams &p, bool isFull)
+/**
+ * Receive the ranges of a full sync by the primary connection and the additional ones.
+ *
+ * RETURN:
+ *   false if force stopped.
+ */
+bool receiveFullSync(FullSyncSession &sess, packet::Packet &pkt, const std::string &lvPath)
+{
+    sess.start(lvPath);
+    const std::vector<size_t> idxV = sess.getPendingIndexes();
+    if (idxV.empty()) return true;
+    if (!sess.receive(pkt, idxV[0])) return false;
+    return sess.waitForAll(ga.socketTimeout);
+}
+
+
+void backupServer(protocol::ServerParams &p, bool isFull, bool isMulti)
 {
     const char *const FUNC = __func__;
     ProtocolLogger logger(ga.nodeId, p.clientId);
@@ -559,6 +816,8 @@ void backupServer(protocol::ServerParams &p, bool isFull)
     pkt.flush();
     cybozu::Uuid uuid;
     pkt.read(uuid);
+    size_t nrStreams = 1;
+    if (isMulti) pkt.read(nrStreams);
     packet::Ack(p.sock).send();
     pkt.flush();
 
@@ -575,11 +834,20 @@ void backupServer(protocol::ServerParams &p, bool isFull)
     bool isOk;
     std::unique_ptr<cybozu::TmpFile> tmpFileP;
     if (isFull) {
-        volInfo.createLv(sizeLb);
-        const std::string lvPath = volSt.lvCache.getLv().path().str();
+        const FullSyncRangeVec rangeV =
+            splitFullSyncRange(sizeLb, bulkLb, std::min(nrStreams, MAX_FULL_SYNC_STREAMS));
         const bool skipZero = isThinpool();
-        isOk = dirtyFullSyncServer(pkt, lvPath, 0, sizeLb, bulkLb, volSt.stopState, ga.ps, volSt.progressLb,
-                                   skipZero, ga.fsyncIntervalSize);
+        std::shared_ptr<FullSyncSession> sessP(new FullSyncSession(
+            rangeV, bulkLb, skipZero, ga.fsyncIntervalSize, volSt.stopState, ga.ps, volSt.progressLb));
+        FullSyncSessionRegistration reg(getArchiveGlobal().fullSyncSessionMap, sessP);
+        if (isMulti) {
+            pkt.write(reg.getId());
+            pkt.write(rangeV);
+            pkt.flush();
+        }
+        logger.debug() << FUNC << "full sync ranges" << volId << reg.getId() << rangeV.size();
+        volInfo.createLv(sizeLb);
+        isOk = receiveFullSync(reg.get(), pkt, volSt.lvCache.getLv().path().str());
     } else {
         doAutoResizeIfNecessary(volSt, volInfo, sizeLb);
         const uint32_t hashSeed = curTime;
@@ -686,7 +954,7 @@ void verifyVolumeSize(ArchiveVolState &volSt, ArchiveVolInfo &volInfo, uint64_t
 
 bool runFullReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, uint64_t bulkLb, Logger &logger)
+    packet::Packet &pkt, const AddrPort &addrPort, uint64_t bulkLb, bool isMulti, Logger &logger)
 {
     const char *const FUNC = __func__;
     cybozu::lvm::Lv lv = volSt.lvCache.getLv();
@@ -697,19 +965,41 @@ bool runFullReplClient(
     pkt.write(bulkLb);
     pkt.write(metaSt);
     pkt.write(uuid);
+    if (isMulti) pkt.write(ga.fullSyncStreams);
     pkt.flush();
-    logger.debug() << "full-repl-client" << sizeLb << bulkLb << metaSt << uuid;
+    logger.debug() << "full-repl-client" << sizeLb << bulkLb << metaSt << uuid << isMulti;
 
     std::string res;
     pkt.read(res);
     if (res != msgOk) throw cybozu::Exception(FUNC) << "not ok" << res;
-    uint64_t startLb;
-    pkt.read(startLb);
-    logger.info() << "full-repl-client startLb" << startLb;
 
     const std::string lvPath = lv.path().str();
     const std::atomic<uint64_t> fullScanLbPerSec(0);
-    if (!dirtyFullSyncClient(pkt, lvPath, startLb, sizeLb, bulkLb, volSt.stopState, ga.ps, fullScanLbPerSec)) {
+    bool isOk;
+    if (isMulti) {
+        uint64_t sessionId;
+        FullSyncRangeVec rangeV;
+        pkt.read(sessionId);
+        pkt.read(rangeV);
+        if (!isValidFullSyncRange(rangeV, sizeLb)) {
+            throw cybozu::Exception(FUNC) << "bad ranges" << volId << sizeLb << rangeV.size();
+        }
+        logger.info() << "full-repl-client progressLb" << getFullSyncDoneLb(rangeV) << rangeV.size();
+        const cybozu::SocketAddr server = addrPort.getSocketAddr();
+        const FullSyncConnectFunc connectF = [&](cybozu::Socket &sock) {
+            util::connectWithTimeout(sock, server, ga.socketTimeout);
+            ga.setSocketParams(sock);
+            protocol::run1stNegotiateAsClient(sock, ga.nodeId, dirtyFullSyncStreamPN);
+        };
+        isOk = dirtyFullSyncClientMulti(pkt, connectF, sessionId, rangeV, lvPath, bulkLb,
+                                        volSt.stopState, ga.ps, fullScanLbPerSec);
+    } else {
+        uint64_t startLb;
+        pkt.read(startLb);
+        logger.info() << "full-repl-client startLb" << startLb;
+        isOk = dirtyFullSyncClient(pkt, lvPath, startLb, sizeLb, bulkLb, volSt.stopState, ga.ps, fullScanLbPerSec);
+    }
+    if (!isOk) {
         logger.warn() << "full-repl-client force-stopped" << volId;
         return false;
     }
@@ -721,18 +1011,20 @@ bool runFullReplClient(
 
 bool runFullReplServer(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
-    packet::Packet &pkt, const cybozu::Uuid &archiveUuid, UniqueLock &ul, Logger &logger)
+    packet::Packet &pkt, const cybozu::Uuid &archiveUuid, bool isMulti, UniqueLock &ul, Logger &logger)
 {
     const char *const FUNC = __func__;
     uint64_t sizeLb, bulkLb;
     MetaState metaSt;
     cybozu::Uuid uuid;
+    size_t nrStreams = 1;
     try {
         pkt.read(sizeLb);
         pkt.read(bulkLb);
         pkt.read(metaSt);
         pkt.read(uuid);
-        logger.debug() << "full-repl-server" << sizeLb << bulkLb << metaSt << uuid;
+        if (isMulti) pkt.read(nrStreams);
+        logger.debug() << "full-repl-server" << sizeLb << bulkLb << metaSt << uuid << nrStreams;
         if (sizeLb == 0) throw cybozu::Exception(FUNC) << "sizeLb must not be 0";
         if (bulkLb == 0) throw cybozu::Exception(FUNC) << "bulkLb must not be 0";
         doAutoResizeIfNecessary(volSt, volInfo, sizeLb);
@@ -742,13 +1034,37 @@ bool runFullReplServer(
         throw;
     }
     FullReplState fullReplSt;
-    const uint64_t startLb = volInfo.initFullReplResume(sizeLb, archiveUuid, metaSt, fullReplSt);
-    logger.info() << "full-repl-server startLb" << startLb;
-    volSt.progressLb = startLb;
+    if (!isMulti && volInfo.getFullReplState(fullReplSt)
+        && (fullReplSt.rangeV.size() != 1 || fullReplSt.rangeV[0].isDone())) {
+        /* A single connection can resume only a single range that has not been done. */
+        logger.info() << "full-repl-server restart" << volId << fullReplSt.rangeV.size();
+        volInfo.removeFullReplState();
+    }
+    volInfo.initFullReplResume(sizeLb, bulkLb, std::min(nrStreams, MAX_FULL_SYNC_STREAMS),
+                               archiveUuid, metaSt, fullReplSt);
+    logger.info() << "full-repl-server progressLb" << fullReplSt.progressLb << fullReplSt.rangeV.size();
+    volSt.progressLb = fullReplSt.progressLb;
     ZeroResetter resetter(volSt.progressLb);
 
+    const cybozu::FilePath stDir = volInfo.volDir;
+    const std::string stFileName = volInfo.getFullReplStateFileName();
+    const FullSyncSession::SaveFunc saveF = [stDir, stFileName, fullReplSt](const FullSyncRangeVec &rangeV) mutable {
+        fullReplSt.rangeV = rangeV;
+        fullReplSt.progressLb = getFullSyncDoneLb(rangeV);
+        util::saveFile(stDir, stFileName, fullReplSt);
+    };
+    const bool skipZero = isThinpool();
+    std::shared_ptr<FullSyncSession> sessP(new FullSyncSession(
+        fullReplSt.rangeV, bulkLb, skipZero, ga.fsyncIntervalSize, volSt.stopState, ga.ps, volSt.progressLb, saveF));
+    FullSyncSessionRegistration reg(getArchiveGlobal().fullSyncSessionMap, sessP);
+
     pkt.write(msgOk);
-    pkt.write(startLb);
+    if (isMulti) {
+        pkt.write(reg.getId());
+        pkt.write(fullReplSt.rangeV);
+    } else {
+        pkt.write(fullReplSt.progressLb);
+    }
     pkt.flush();
 
     cybozu::Stopwatch stopwatch;
@@ -756,11 +1072,7 @@ bool runFullReplServer(
     ul.unlock();
     volInfo.setArchiveUuid(archiveUuid);
     volInfo.createLv(sizeLb);
-    const std::string lvPath = volSt.lvCache.getLv().path().str();
-    const bool skipZero = isThinpool();
-    if (!dirtyFullSyncServer(pkt, lvPath, startLb, sizeLb, bulkLb, volSt.stopState, ga.ps,
-                             volSt.progressLb, skipZero, ga.fsyncIntervalSize,
-                             &fullReplSt, volInfo.volDir, volInfo.getFullReplStateFileName())) {
+    if (!receiveFullSync(reg.get(), pkt, volSt.lvCache.getLv().path().str())) {
         logger.warn() << "full-repl-server force-stopped" << volId;
         return false;
     }
@@ -946,6 +1258,8 @@ bool runDiffReplClient(
     const MetaDiff mergedDiff = merge(diffV);
     LOGs.debug() << "diff-repl-diffs" << st0 << mergedDiff << diffV;
     DiffMerger merger;
+    merger.setPassThroughCompressed(true);
+    merger.setMemoryBudget(getArchiveGlobal().mergeMemBudget);
     merger.addWdiffs(std::move(fileV));
     merger.prepare();
 
@@ -1015,7 +1329,7 @@ bool runDiffReplServer(
     const cybozu::FilePath fPath = volInfo.getDiffPath(diff);
     cybozu::TmpFile tmpFile(volInfo.volDir.str());
     cybozu::util::File fileW(tmpFile.fd());
-    writeDiffFileHeader(fileW, uuid);
+    writeDiffFileHeader(fileW, uuid, true);
     if (!wdiffTransferServer(pkt, tmpFile.fd(), volSt.stopState, ga.ps, ga.fsyncIntervalSize)) {
         logger.warn() << "diff-repl-server force-stopped" << volId;
         return false;
@@ -1152,7 +1466,7 @@ bool runResyncReplServer(
 
 
 bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const HostInfoForRepl &hostInfo,
-                       bool isSize, uint64_t param, const std::string &dstId, Logger &logger)
+                       bool isSize, uint64_t param, const std::string &dstId, bool isMulti, Logger &logger)
 {
     const char *const FUNC = __func__;
     packet::Packet pkt(sock);
@@ -1175,7 +1489,7 @@ bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const Hos
     int kind;
     pkt.read(kind);
     if (kind == DO_FULL_SYNC) {
-        if (!runFullReplClient(volId, volSt, volInfo, dstId, pkt, hostInfo.bulkLb, logger)) {
+        if (!runFullReplClient(volId, volSt, volInfo, dstId, pkt, hostInfo.addrPort, hostInfo.bulkLb, isMulti, logger)) {
             return false;
         }
         runAtLeastOnce = true;
@@ -1238,7 +1552,7 @@ bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const Hos
 /**
  * ul is locked at the function beginning.
  */
-bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLock &ul, Logger &logger)
+bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, bool isMulti, UniqueLock &ul, Logger &logger)
 {
     const char *const FUNC = __func__;
     packet::Packet pkt(sock);
@@ -1275,7 +1589,7 @@ bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLoc
     pkt.flush();
 
     if (kind == DO_FULL_SYNC) {
-        if (!runFullReplServer(volId, volSt, volInfo, pkt, archiveUuid, ul, logger)) {
+        if (!runFullReplServer(volId, volSt, volInfo, pkt, archiveUuid, isMulti, ul, logger)) {
             return false;
         }
     } else if (kind == DO_RESYNC) {
@@ -1319,6 +1633,13 @@ StrVec getAllStatusAsStrVec()
     }
     v.push_back(fmt("maxConnections %zu", ga.maxConnections));
     v.push_back(fmt("maxForegroundTasks %zu", ga.maxForegroundTasks));
+    v.push_back(fmt("mergeThreads %zu", ga.mergeThreads));
+    v.push_back(fmt("mergePrefetchIos %zu", ga.mergePrefetchIos));
+    v.push_back(fmt("mergeMemSize %zu", ga.mergeMemSize));
+    v.push_back(fmt("applyAioBufferSize %zu", ga.applyAioBufferSize));
+    v.push_back(fmt("aioBackend %s", cybozu::aio::aioBackendToStr(cybozu::aio::getDefaultAioBackend())));
+    v.push_back(fmt("mergeMemUsage %zu", ga.mergeMemBudget.getSize()));
+    v.push_back(fmt("mergeMemPeak %zu", ga.mergeMemBudget.getPeakSize()));
     v.push_back(fmt("socketTimeout %zu", ga.socketTimeout));
     v.push_back(fmt("keepAlive %s", ga.keepAliveParams.toStr().c_str()));
     v.push_back(fmt("doAutoResize %d", ga.doAutoResize));
@@ -2288,7 +2609,7 @@ void p2aWdiffTransferServer(protocol::ServerParams &p)
         const cybozu::FilePath fPath = volInfo.getDiffPath(diff);
         cybozu::TmpFile tmpFile(volInfo.volDir.str());
         cybozu::util::File fileW(tmpFile.fd());
-        writeDiffFileHeader(fileW, uuid);
+        writeDiffFileHeader(fileW, uuid, true);
         if (!wdiffTransferServer(pkt, tmpFile.fd(), volSt.stopState, ga.ps, ga.fsyncIntervalSize)) {
             logger.warn() << FUNC << "force stopped" << volId;
             return;
@@ -2347,12 +2668,12 @@ void c2aReplicateServer(protocol::ServerParams &p)
         ul.unlock();
         cybozu::Socket aSock;
         std::string dstId;
-        archive_local::runReplSync1stNegotiation(volId, hostInfo.addrPort, aSock, dstId);
+        const bool isMulti = archive_local::runReplSync1stNegotiation(volId, hostInfo.addrPort, aSock, dstId);
         pkt.writeFin(msgAccept);
         sendErr = false;
         logger.info() << "replication as client started"
                       << volId << param.isSize << param.param2 << hostInfo;
-        if (!archive_local::runReplSyncClient(volId, aSock, hostInfo, isSize, param2, dstId, logger)) {
+        if (!archive_local::runReplSyncClient(volId, aSock, hostInfo, isSize, param2, dstId, isMulti, logger)) {
             logger.warn() << FUNC << "replication as client force stopped" << volId << hostInfo;
             return;
         }
@@ -2364,7 +2685,9 @@ void c2aReplicateServer(protocol::ServerParams &p)
 }
 
 
-void a2aReplSyncServer(protocol::ServerParams &p)
+namespace archive_local {
+
+void replSyncServer(protocol::ServerParams &p, bool isMulti)
 {
     const char *const FUNC = __func__;
     ProtocolLogger logger(ga.nodeId, p.clientId);
@@ -2390,7 +2713,7 @@ void a2aReplSyncServer(protocol::ServerParams &p)
 
         logger.info() << "replication as server started" << volId;
         cybozu::Stopwatch stopwatch;
-        if (!archive_local::runReplSyncServer(volId, p.sock, ul, logger)) {
+        if (!runReplSyncServer(volId, p.sock, isMulti, ul, logger)) {
             logger.warn() << FUNC << "replication as server force stopped" << volId;
             return;
         }
@@ -2403,6 +2726,8 @@ void a2aReplSyncServer(protocol::ServerParams &p)
     }
 }
 
+} // archive_local
+
 
 void c2aApplyServer(protocol::ServerParams &p)
 {
@@ -2790,6 +3115,14 @@ void c2aGarbageCollectDiffServer(protocol::ServerParams &p)
 }
 
 
+void s2aDirtyFullSyncStreamServer(protocol::ServerParams &p)
+{
+    ProtocolLogger logger(ga.nodeId, p.clientId);
+    packet::Packet pkt(p.sock);
+    dirtyFullSyncStreamServer(pkt, ga.fullSyncSessionMap, logger);
+}
+
+
 void s2aGatherLatestSnapServer(protocol::ServerParams &p)
 {
     const char *const FUNC = __func__;
@@ -19,6 +19,7 @@
 #include "walb_diff_io.hpp"
 #include "snap_info.hpp"
 #include "ts_delta.hpp"
+#include "memory_budget.hpp"
 
 namespace walb {
 
@@ -155,6 +156,11 @@ struct ArchiveSingleton
     bool doAutoResize;
     bool keepOneColdSnapshot;
     size_t maxOpenDiffs; // 0 means unlimited.
+    size_t mergeThreads;
+    size_t mergePrefetchIos;
+    size_t mergeMemSize; // 0 means unlimited.
+    size_t applyAioBufferSize; // 0 means buffered IOs.
+    size_t fullSyncStreams; // connections per full-repl as a client.
     bool allowExec;
 
     /**
@@ -164,6 +170,8 @@ struct ArchiveSingleton
     AtomicMap<ArchiveVolState> stMap;
     archive_local::RemoteSnapshotManager remoteSnapshotManager;
     protocol::HandlerStatMgr handlerStatMgr;
+    MemoryBudget mergeMemBudget; // IO data held by mergers for apply, restore, merge and diff-repl.
+    FullSyncSessionMap fullSyncSessionMap; // full-backup and full-repl receiving by multiple connections.
 
     void setSocketParams(cybozu::Socket& sock) const {
         util::setSocketParams(sock, keepAliveParams, socketTimeout);
@@ -232,6 +240,26 @@ inline MetaDiffVec tryOpenDiffs(
     return diffV;
 }
 
+/**
+ * Open the wdiff files of diffV.
+ *
+ * RETURN:
+ *   false if any of them could not be opened.
+ */
+inline bool openDiffs(std::vector<cybozu::util::File>& fileV, ArchiveVolInfo& volInfo, const MetaDiffVec& diffV)
+{
+    fileV.clear();
+    for (const MetaDiff& diff : diffV) {
+        cybozu::util::File op;
+        if (!op.open(volInfo.getDiffPath(diff).str(), O_RDONLY)) {
+            fileV.clear();
+            return false;
+        }
+        fileV.push_back(std::move(op));
+    }
+    return true;
+}
+
 const bool allowEmpty = true;
 
 void prepareRawFullScanner(
@@ -290,17 +318,35 @@ struct ZeroResetterT
 using ZeroResetter = ZeroResetterT<std::atomic<uint64_t>>;
 
 
-void backupServer(protocol::ServerParams &p, bool isFull);
+void backupServer(protocol::ServerParams &p, bool isFull, bool isMulti);
 void delSnapshotServer(protocol::ServerParams &p, bool isCold);
 
 
-inline void runReplSync1stNegotiation(const std::string &volId, const AddrPort &addrPort, cybozu::Socket &sock, std::string &dstId)
+/**
+ * RETURN:
+ *   true if the server accepts multiple connections for a full-repl.
+ */
+inline bool runReplSync1stNegotiation(const std::string &volId, const AddrPort &addrPort, cybozu::Socket &sock, std::string &dstId)
 {
     const cybozu::SocketAddr server = addrPort.getSocketAddr();
-    util::connectWithTimeout(sock, server, ga.socketTimeout);
-    ga.setSocketParams(sock);
-    dstId = protocol::run1stNegotiateAsClient(sock, ga.nodeId, replSyncPN);
+    bool isMulti = false;
+    if (ga.fullSyncStreams > 1) {
+        util::connectWithTimeout(sock, server, ga.socketTimeout);
+        ga.setSocketParams(sock);
+        isMulti = protocol::run1stNegotiateAsClientIfSupported(sock, ga.nodeId, replSyncMultiPN, dstId);
+        if (!isMulti) {
+            LOGs.warn() << __func__ << "server does not support" << replSyncMultiPN
+                        << "use a single stream" << volId << dstId;
+            sock.close();
+        }
+    }
+    if (!isMulti) {
+        util::connectWithTimeout(sock, server, ga.socketTimeout);
+        ga.setSocketParams(sock);
+        dstId = protocol::run1stNegotiateAsClient(sock, ga.nodeId, replSyncPN);
+    }
     protocol::sendStrVec(sock, {volId}, 1, __func__, msgAccept);
+    return isMulti;
 }
 
 
@@ -316,10 +362,10 @@ inline TsDelta generateTsDelta(const std::string &volId, const std::string &dstI
 
 bool runFullReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, uint64_t bulkLb, Logger &logger);
+    packet::Packet &pkt, const AddrPort &addrPort, uint64_t bulkLb, bool isMulti, Logger &logger);
 bool runFullReplServer(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
-    packet::Packet &pkt, const cybozu::Uuid &archiveUuid, UniqueLock &ul, Logger &logger);
+    packet::Packet &pkt, const cybozu::Uuid &archiveUuid, bool isMulti, UniqueLock &ul, Logger &logger);
 bool runHashReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
     packet::Packet &pkt, uint64_t bulkLb, const MetaDiff &diff, Logger &logger);
@@ -349,8 +395,9 @@ enum {
 };
 
 bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const HostInfoForRepl &hostInfo,
-                       bool isSize, uint64_t param, const std::string &dstId, Logger &logger);
-bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLock &ul, Logger &logger);
+                       bool isSize, uint64_t param, const std::string &dstId, bool isMulti, Logger &logger);
+bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, bool isMulti, UniqueLock &ul, Logger &logger);
+void replSyncServer(protocol::ServerParams &p, bool isMulti);
 
 StrVec getAllStatusAsStrVec();
 StrVec getVolStatusAsStrVec(const std::string &volId);
@@ -530,17 +577,32 @@ void c2aStopServer(protocol::ServerParams &p);
  */
 inline void s2aDirtyFullSyncServer(protocol::ServerParams &p)
 {
-    const bool isFull = true;
-    archive_local::backupServer(p, isFull);
+    const bool isFull = true, isMulti = false;
+    archive_local::backupServer(p, isFull, isMulti);
 }
 
+/**
+ * Execute dirty full sync protocol as server
+ * where the client sends ranges by multiple connections.
+ */
+inline void s2aDirtyFullSyncMultiServer(protocol::ServerParams &p)
+{
+    const bool isFull = true, isMulti = true;
+    archive_local::backupServer(p, isFull, isMulti);
+}
+
+/**
+ * Receive a range of full-backup or full-repl by an additional connection.
+ */
+void s2aDirtyFullSyncStreamServer(protocol::ServerParams &p);
+
 /**
  * Execute dirty hash sync protocol as server.
  */
 inline void s2aDirtyHashSyncServer(protocol::ServerParams &p)
 {
-    const bool isFull = false;
-    archive_local::backupServer(p, isFull);
+    const bool isFull = false, isMulti = false;
+    archive_local::backupServer(p, isFull, isMulti);
 }
 
 void c2aRestoreServer(protocol::ServerParams &p);
@@ -560,7 +622,22 @@ inline void c2aDelColdServer(protocol::ServerParams &p)
 void c2aReloadMetadataServer(protocol::ServerParams &p);
 void p2aWdiffTransferServer(protocol::ServerParams &p);
 void c2aReplicateServer(protocol::ServerParams &p);
-void a2aReplSyncServer(protocol::ServerParams &p);
+
+inline void a2aReplSyncServer(protocol::ServerParams &p)
+{
+    const bool isMulti = false;
+    archive_local::replSyncServer(p, isMulti);
+}
+
+/**
+ * The client may send a full-repl by multiple connections.
+ */
+inline void a2aReplSyncMultiServer(protocol::ServerParams &p)
+{
+    const bool isMulti = true;
+    archive_local::replSyncServer(p, isMulti);
+}
+
 void c2aApplyServer(protocol::ServerParams &p);
 void c2aMergeServer(protocol::ServerParams &p);
 void c2aResizeServer(protocol::ServerParams &p);
@@ -661,9 +738,12 @@ const protocol::Str2ServerHandler archiveHandlerMap = {
 #endif
     // protocols.
     { dirtyFullSyncPN, s2aDirtyFullSyncServer },
+    { dirtyFullSyncMultiPN, s2aDirtyFullSyncMultiServer },
+    { dirtyFullSyncStreamPN, s2aDirtyFullSyncStreamServer },
     { dirtyHashSyncPN, s2aDirtyHashSyncServer },
     { wdiffTransferPN, p2aWdiffTransferServer },
     { replSyncPN, a2aReplSyncServer },
+    { replSyncMultiPN, a2aReplSyncMultiServer },
     { gatherLatestSnapPN, s2aGatherLatestSnapServer },
 };
 
@@ -237,8 +237,21 @@ void ArchiveVolInfo::init()
 }
 
 
+void ArchiveVolInfo::removeKeptRestore(uint64_t gid)
+{
+    const std::string name = tmpRestoredSnapshotName(gid);
+    if (cybozu::lvm::existsFile(vgName, name)) {
+        cybozu::lvm::remove(cybozu::lvm::getLvStr(vgName, name));
+    }
+    removeRestoreState(gid);
+}
+
+
 void ArchiveVolInfo::clearAllSnapLv()
 {
+    for (uint64_t gid : getRestoreStateGidList()) {
+        removeKeptRestore(gid);
+    }
     {
         VolLvCache::LvMap snapM = lvC_.getRestoredMap();
         for (VolLvCache::LvMap::value_type &p : snapM) {
@@ -334,22 +347,20 @@ void ArchiveVolInfo::setState(const std::string& newState)
 }
 
 
-uint64_t ArchiveVolInfo::initFullReplResume(
-    uint64_t sizeLb, const cybozu::Uuid& archiveUuid, const MetaState& metaSt, FullReplState& fullReplSt)
+void ArchiveVolInfo::initFullReplResume(
+    uint64_t sizeLb, uint64_t bulkLb, size_t nrStreams, const cybozu::Uuid& archiveUuid,
+    const MetaState& metaSt, FullReplState& fullReplSt)
 {
-    uint64_t startLb;
     if (getFullReplState(fullReplSt) && archiveUuid == getArchiveUuid()
-        && metaSt == fullReplSt.metaSt && fullReplSt.progressLb <= sizeLb) {
+        && metaSt == fullReplSt.metaSt && isValidFullSyncRange(fullReplSt.rangeV, sizeLb)) {
         // resume.
-        startLb = fullReplSt.progressLb;
     } else {
         // restart.
-        startLb = 0;
-        fullReplSt.progressLb = 0;
+        fullReplSt.rangeV = splitFullSyncRange(sizeLb, bulkLb, nrStreams);
         fullReplSt.metaSt = metaSt;
     }
+    fullReplSt.progressLb = getFullSyncDoneLb(fullReplSt.rangeV);
     fullReplSt.timestamp = ::time(0);
-    return startLb;
 }
 
 
@@ -26,6 +26,7 @@
 #include "archive_constant.hpp"
 #include "random.hpp"
 #include "full_repl_state.hpp"
+#include "restore_state.hpp"
 
 namespace walb {
 
@@ -194,9 +195,17 @@ inline size_t removeSnapshotIf(const cybozu::lvm::LvList &lvL, F cond)
     return nr;
 }
 
-inline size_t removeTemporaryRestoredSnapshots(const cybozu::lvm::LvList &lvL)
+/**
+ * Temporary restored snapshots with restore state files are kept to resume.
+ */
+inline size_t removeTemporaryRestoredSnapshots(const cybozu::lvm::LvList &lvL, const std::string &baseDirStr)
 {
-    return removeSnapshotIf(lvL, isTmpRestoredLvName);
+    return removeSnapshotIf(lvL, [&](const std::string &name) {
+            std::string volId;
+            uint64_t gid;
+            if (!parseSnapLvName(name, volId, gid, false, true)) return false;
+            return !(cybozu::FilePath(baseDirStr) + volId + getRestoreStateFileName(gid)).stat().isFile();
+        });
 }
 
 inline size_t removeTemporaryColdToBaseSnapshots(const cybozu::lvm::LvList &lvL)
@@ -342,10 +351,19 @@ public:
     cybozu::FilePath getFullReplStateFilePath() const {
         return volDir + cybozu::FilePath(getFullReplStateFileName());
     }
+    /**
+     * RETURN:
+     *   false if the state does not exist or can not be loaded,
+     *   for example, written by an old version without ranges.
+     */
     bool getFullReplState(FullReplState& fullReplSt) const {
         const cybozu::FilePath path = getFullReplStateFilePath();
         if (!path.stat().exists()) return false;
-        util::loadFile(volDir, getFullReplStateFileName(), fullReplSt);
+        try {
+            util::loadFile(volDir, getFullReplStateFileName(), fullReplSt);
+        } catch (std::exception&) {
+            return false;
+        }
         return true;
     }
     void removeFullReplState() {
@@ -359,8 +377,41 @@ public:
     void setFullReplState(const FullReplState& fullReplSt) {
         util::saveFile(volDir, getFullReplStateFileName(), fullReplSt);
     }
-    uint64_t initFullReplResume(uint64_t sizeLb, const cybozu::Uuid& archiveUuid,
-                                const MetaState& metaSt, FullReplState& fullReplSt);
+    /**
+     * Resume the ranges in the saved state if possible,
+     * otherwise split the volume into nrStreams ranges.
+     */
+    void initFullReplResume(uint64_t sizeLb, uint64_t bulkLb, size_t nrStreams, const cybozu::Uuid& archiveUuid,
+                            const MetaState& metaSt, FullReplState& fullReplSt);
+    bool getRestoreState(uint64_t gid, RestoreState& restoreSt) const {
+        const cybozu::FilePath path = volDir + getRestoreStateFileName(gid);
+        if (!path.stat().isFile()) return false;
+        util::loadFile(volDir, getRestoreStateFileName(gid), restoreSt);
+        return true;
+    }
+    void setRestoreState(uint64_t gid, const RestoreState& restoreSt) {
+        util::saveFile(volDir, getRestoreStateFileName(gid), restoreSt);
+    }
+    void removeRestoreState(uint64_t gid) {
+        cybozu::FilePath p = volDir + getRestoreStateFileName(gid);
+        removeFile(p);
+    }
+    bool existsRestoreState(uint64_t gid) const {
+        cybozu::FilePath p = volDir + getRestoreStateFileName(gid);
+        return p.stat().isFile();
+    }
+    std::vector<uint64_t> getRestoreStateGidList() const {
+        std::vector<uint64_t> gidV;
+        for (std::string &fname : util::getFileNameList(volDir.str(), "restore")) {
+            gidV.push_back(cybozu::atoi(cybozu::util::removeSuffix(fname, ".restore")));
+        }
+        return gidV;
+    }
+    /**
+     * Remove the temporary restored snapshot and the restore state file
+     * kept by a force-stopped restore.
+     */
+    void removeKeptRestore(uint64_t gid);
     bool existsVolDir() const {
         return volDir.stat().isDirectory();
     }
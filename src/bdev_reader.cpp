@@ -4,14 +4,15 @@ namespace walb {
 
 size_t RingBufferForSeqRead::getFreeSize() const
 {
+    const size_t freeOff = (readOff_ + buf_.size() - lentSize_) % buf_.size();
     if (isFull_) {
         return 0;
-    } else if (aheadOff_ == readOff_) {
+    } else if (aheadOff_ == freeOff) {
         return buf_.size();
-    } else if (aheadOff_ > readOff_) {
-        return readOff_ + buf_.size() - aheadOff_;
+    } else if (aheadOff_ > freeOff) {
+        return freeOff + buf_.size() - aheadOff_;
     } else {
-        return readOff_ - aheadOff_;
+        return freeOff - aheadOff_;
     }
 }
 
@@ -21,20 +22,35 @@ char *RingBufferForSeqRead::prepare(size_t size)
     assert(size <= getAvailableSize());
     char *data = &buf_[aheadOff_];
     proceedOff(aheadOff_, size);
-    if (aheadOff_ == readOff_) isFull_ = true;
+    if (aheadOff_ == (readOff_ + buf_.size() - lentSize_) % buf_.size()) isFull_ = true;
     return data;
 }
 
 size_t RingBufferForSeqRead::consume(void *data, size_t size, bool doCopy)
 {
-    const size_t s = std::min(size, readableSize_);
+    const size_t s = std::min(std::min(size, readableSize_), buf_.size() - readOff_);
     if (doCopy) {
         assert(data);
         ::memcpy(data, &buf_[readOff_], s);
     }
     proceedOff(readOff_, s);
     readableSize_ -= s;
-    if (isFull_) isFull_ = false;
+    if (lentSize_ > 0) {
+        lentSize_ += s; // will be freed with the preceding lent area.
+    } else if (isFull_) {
+        isFull_ = false;
+    }
+    return s;
+}
+
+size_t RingBufferForSeqRead::lend(size_t size, const char **data)
+{
+    assert(data);
+    const size_t s = std::min(std::min(size, readableSize_), buf_.size() - readOff_);
+    *data = &buf_[readOff_];
+    proceedOff(readOff_, s);
+    readableSize_ -= s;
+    lentSize_ += s;
     return s;
 }
 
@@ -21,6 +21,9 @@ namespace walb {
  *   call s2 = getReadableSize()
  *   prepare s3 (<= s2)
  *   call read(buf, s3) or consume(s3)
+ *
+ * Instead of read(), you can call lend() to refer the data without copying.
+ * The lent area will not be reused until release() is called.
  */
 class RingBufferForSeqRead
 {
@@ -30,22 +33,26 @@ private:
     size_t readOff_;
     bool isFull_;
     size_t readableSize_;
+    size_t lentSize_;
 
     /*
      * Ring buffer layout.
      *
-     * |___XXXXXXYYYYYYYYYY______|
-     *     ^     ^         ^
-     *     |     |         |
-     *     |     |         aheadOffset_
-     *     |     completeOffset
-     *     readOffset_
+     * |___ZZZZXXXXXXYYYYYYYYYY______|
+     *     ^   ^     ^         ^
+     *     |   |     |         |
+     *     |   |     |         aheadOffset_
+     *     |   |     completeOffset
+     *     |   readOffset_
+     *     freeOffset
      *
      * ___: free area.
+     * ZZZ: lent area (and consumed area following it) not be released.
      * XXX: completed IOs but not be read.
      * YYY: submitted IOs but not be completed.
      *
      * (readOffset_ + readableSize) % bufferSize is completeOffset.
+     * (freeOffset + lentSize_) % bufferSize is readOffset_.
      */
 
 public:
@@ -62,7 +69,10 @@ public:
         readOff_ = 0;
         isFull_ = false;
         readableSize_ = 0;
+        lentSize_ = 0;
     }
+    size_t getBufferSize() const { return buf_.size(); }
+    const char *getBuffer() const { return buf_.data(); }
     size_t getFreeSize() const;
 
     /**
@@ -86,6 +96,31 @@ public:
     size_t skip(size_t size) {
         return consume(nullptr, size, false);
     }
+    /**
+     * Readable data are contiguous in the buffer.
+     * If true, the next completion will extend them contiguously.
+     */
+    bool canExtendReadableContiguously() const {
+        return readOff_ + readableSize_ < buf_.size();
+    }
+    /**
+     * Consume readable data without copying.
+     * The area [*data, *data + returned size) is valid until release() of the area.
+     * Data consumed by read()/skip() while there are lent areas
+     * will be kept and must be released also.
+     */
+    size_t lend(size_t size, const char **data);
+    /**
+     * Release the oldest lent area.
+     */
+    void release(size_t size) {
+        assert(size <= lentSize_);
+        lentSize_ -= size;
+        if (size > 0) isFull_ = false;
+    }
+    size_t getLentSize() const {
+        return lentSize_;
+    }
 private:
     void proceedOff(size_t &off, size_t value) {
         off = (off + value) % buf_.size();
@@ -144,6 +179,7 @@ public:
         verifyMultiple(maxIoSize_, pbs_, "bad maxIoSize");
         verifyMultiple(bufferSize, pbs_, "bad bufferSize");
         ringBuf_.init(bufferSize);
+        aio_.registerBuffer(ringBuf_.getBuffer(), ringBuf_.getBufferSize());
         readAhead();
     }
     ~AsyncBdevReader() noexcept {
@@ -307,6 +307,26 @@ uint64_t parseSetFullScanBps(const StrVec &args)
     return cybozu::util::fromUnitIntString(sizeStr);
 }
 
+SetWlogBpsParam parseSetWlogBpsParam(const StrVec &args)
+{
+    std::string readStr, sendStr;
+    cybozu::util::parseStrVec(args, 0, 2, {&readStr, &sendStr});
+    SetWlogBpsParam param;
+    param.readBps = cybozu::util::fromUnitIntString(readStr);
+    param.sendBps = cybozu::util::fromUnitIntString(sendStr);
+    return param;
+}
+
+SetWlogCmprParam parseSetWlogCmprParam(const StrVec &args)
+{
+    SetWlogCmprParam param;
+    std::string cmprStr;
+    cybozu::util::parseStrVec(args, 0, 2, {&param.volId, &cmprStr});
+    verifyVolIdFormat(param.volId);
+    param.cmpr = parseCompressOpt(cmprStr);
+    return param;
+}
+
 
 BackupParam parseBackupParam(const StrVec &args)
 {
@@ -215,6 +215,26 @@ KickParam parseVolIdAndArchiveNameParamForGet(const StrVec &args);
 uint64_t parseSetFullScanBps(const StrVec &args);
 
 
+struct SetWlogBpsParam
+{
+    uint64_t readBps;
+    uint64_t sendBps;
+};
+
+
+SetWlogBpsParam parseSetWlogBpsParam(const StrVec &args);
+
+
+struct SetWlogCmprParam
+{
+    std::string volId;
+    CompressOpt cmpr;
+};
+
+
+SetWlogCmprParam parseSetWlogCmprParam(const StrVec &args);
+
+
 struct BackupParam
 {
     std::string volId;
@@ -250,6 +270,8 @@ inline void verifyChangeSnapshotParam(const StrVec &args) { parseChangeSnapshotP
 inline void verifyArchiveInfoParam(const StrVec &args) { parseArchiveInfoParam(args); }
 inline void verifyKickParam(const StrVec &args) { parseKickParam(args); }
 inline void verifySetFullScanBps(const StrVec &args) { parseSetFullScanBps(args); }
+inline void verifySetWlogBpsParam(const StrVec &args) { parseSetWlogBpsParam(args); }
+inline void verifySetWlogCmprParam(const StrVec &args) { parseSetWlogCmprParam(args); }
 inline void verifyBackupParam(const StrVec &args) { parseBackupParam(args); }
 inline void verifyShutdownParam(const StrVec &args) { parseShutdownParam(args); }
 inline void verifyDumpLogpackHeader(const StrVec &args) { parseVolIdAndLsidParam(args); }
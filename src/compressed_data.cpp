@@ -4,11 +4,11 @@ namespace walb {
 
 namespace cmpr_local {
 
-bool compressToVec(const void *data, size_t size, AlignedArray &outV)
+bool compressToVec(const void *data, size_t size, AlignedArray &outV, Compressor &cmpr)
 {
     outV.resize(size * 2); // margin to encode
     size_t outSize;
-    if (getSnappyCompressor().run(outV.data(), &outSize, outV.size(), data, size) && outSize < size) {
+    if (cmpr.run(outV.data(), &outSize, outV.size(), data, size) && outSize < size) {
         outV.resize(outSize);
         return true;
     } else {
@@ -18,10 +18,10 @@ bool compressToVec(const void *data, size_t size, AlignedArray &outV)
     }
 }
 
-void uncompressToVec(const void *data, size_t size, AlignedArray &outV, size_t outSize)
+void uncompressToVec(const void *data, size_t size, AlignedArray &outV, size_t outSize, Uncompressor &uncmpr)
 {
     outV.resize(outSize);
-    const size_t s = getSnappyUncompressor().run(&outV[0], outV.size(), data, size);
+    const size_t s = uncmpr.run(&outV[0], outV.size(), data, size);
     if (s != outSize) throw cybozu::Exception(__func__) << "invalid outSize" << outSize << s;
 }
 
@@ -33,18 +33,25 @@ inline Uncompressor &getSnappyUncompressor() {
  * RETURN:
  *   true when successfully compressed, false when copied.
  */
-bool compressToVec(const void *data, size_t size, AlignedArray &outV);
+bool compressToVec(const void *data, size_t size, AlignedArray &outV,
+                   Compressor &cmpr = getSnappyCompressor());
 
 /**
  * Assume uncompressed size must be outSize.
  */
-void uncompressToVec(const void *data, size_t size, AlignedArray &outV, size_t outSize);
+void uncompressToVec(const void *data, size_t size, AlignedArray &outV, size_t outSize,
+                     Uncompressor &uncmpr = getSnappyUncompressor());
 
 } // namespace cmpr_local
 
 /**
  * Compressed and uncompressed data.
- * This uses snappy only.
+ * This uses snappy by default.
+ * The codec is not recorded in the data so both sides must agree on it.
+ * Compressor and Uncompressor engines are stateless
+ * so that they can be shared by multiple threads.
+ *
+ * Uncompressed data can be lent by others instead of being owned (see setLent()).
  */
 class CompressedData
 {
@@ -52,9 +59,12 @@ private:
     uint32_t cmpSize_; /* compressed size [byte]. 0 means not compressed. */
     uint32_t orgSize_; /* original size [byte]. must not be 0. */
     AlignedArray data_;
+    std::shared_ptr<const char> lent_; /* if set, data_ is not used. */
 public:
-    const char *rawData() const { return &data_[0]; }
-    size_t rawSize() const { return data_.size(); }
+    CompressedData() : cmpSize_(0), orgSize_(0), data_(), lent_() {}
+    const char *rawData() const { return lent_ ? lent_.get() : &data_[0]; }
+    size_t rawSize() const { return lent_ ? orgSize_ : data_.size(); }
+    bool isLent() const { return bool(lent_); }
     bool isCompressed() const { return cmpSize_ != 0; }
     size_t originalSize() const { return orgSize_; }
     void swap(CompressedData& rhs) noexcept
@@ -62,6 +72,7 @@ public:
         std::swap(cmpSize_, rhs.cmpSize_);
         std::swap(orgSize_, rhs.orgSize_);
         data_.swap(rhs.data_);
+        lent_.swap(rhs.lent_);
     }
     /**
      * Send data to the remote host.
@@ -70,7 +81,7 @@ public:
         verify();
         packet.write(cmpSize_);
         packet.write(orgSize_);
-        packet.write(&data_[0], data_.size());
+        packet.write(rawData(), rawSize());
     }
     /**
      * Receive data from the remote host.
@@ -78,6 +89,7 @@ public:
     void recv(packet::Packet &packet) {
         packet.read(cmpSize_);
         packet.read(orgSize_);
+        lent_.reset();
         data_.resize(dataSize());
         packet.read(&data_[0], data_.size());
         verify();
@@ -85,53 +97,78 @@ public:
     void setUncompressed(AlignedArray &&data) {
         if (data.empty()) throw cybozu::Exception(__func__) << "empty";
         setSizes(0, data.size());
+        lent_.reset();
         data_ = std::move(data);
         verify();
     }
     void setUncompressed(const void *data, uint32_t size) {
         if (size == 0) throw cybozu::Exception(__func__) << "empty";
         setSizes(0, size);
+        lent_.reset();
         data_.resize(size);
         ::memcpy(&data_[0], data, size);
         verify();
     }
-    void compressFrom(const void *data, uint32_t size) {
-        if (cmpr_local::compressToVec(data, size, data_)) {
+    /**
+     * Refer uncompressed data without copying.
+     * The data will be kept until this is compressed, overwritten or destroyed.
+     */
+    void setLent(std::shared_ptr<const char> &&data, uint32_t size) {
+        if (!data || size == 0) throw cybozu::Exception(__func__) << "empty";
+        setSizes(0, size);
+        data_.clear();
+        lent_ = std::move(data);
+        verify();
+    }
+    void compressFrom(const void *data, uint32_t size,
+                      Compressor &cmpr = cmpr_local::getSnappyCompressor()) {
+        const bool isCompressed = cmpr_local::compressToVec(data, size, data_, cmpr);
+        lent_.reset();
+        if (isCompressed) {
             setSizes(data_.size(), size);
         } else {
             setSizes(0, size);
         }
         verify();
     }
-    void getUncompressed(AlignedArray &outV) const {
+    void getUncompressed(AlignedArray &outV,
+                         Uncompressor &uncmpr = cmpr_local::getSnappyUncompressor()) const {
         if (isCompressed()) {
-            cmpr_local::uncompressToVec(&data_[0], data_.size(), outV, orgSize_);
+            cmpr_local::uncompressToVec(&data_[0], data_.size(), outV, orgSize_, uncmpr);
         } else {
-            outV.resize(data_.size());
-            ::memcpy(&outV[0], &data_[0], outV.size());
+            outV.resize(rawSize());
+            ::memcpy(&outV[0], rawData(), outV.size());
         }
     }
-    void compress() {
+    /**
+     * Incompressible data will be kept as it is (lent data also).
+     */
+    void compress(Compressor &cmpr = cmpr_local::getSnappyCompressor()) {
         if (isCompressed()) return;
         CompressedData tmp;
-        tmp.compressFrom(&data_[0], data_.size());
-        swap(tmp);
+        tmp.compressFrom(rawData(), rawSize(), cmpr);
+        if (tmp.isCompressed()) swap(tmp);
     }
-    void uncompress() {
+    void uncompress(Uncompressor &uncmpr = cmpr_local::getSnappyUncompressor()) {
         if (!isCompressed()) return;
         AlignedArray dst;
-        getUncompressed(dst);
+        getUncompressed(dst, uncmpr);
         setUncompressed(std::move(dst));
     }
     void moveTo(AlignedArray &outV) {
+        if (lent_) {
+            getUncompressed(outV);
+            lent_.reset();
+            return;
+        }
         outV = std::move(data_);
     }
 private:
     void verify() const {
         if (orgSize_ == 0) throw RT_ERR("orgSize must not be 0.");
-        if (dataSize() != data_.size()) {
+        if (dataSize() != rawSize()) {
             throw RT_ERR("data size must be %zu but really %zu."
-                         , dataSize(), data_.size());
+                         , dataSize(), rawSize());
         }
     }
     void setSizes(uint32_t cmpSize, uint32_t orgSize) {
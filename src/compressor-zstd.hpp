@@ -6,14 +6,20 @@ struct CompressorZstd : walb::compressor_local::CompressorIF
 {
     constexpr static const char *NAME() { return "CompressorZstd"; };
     size_t level_;
-    CompressorZstd(size_t level) : level_(level == 0 ? 3 : level) {
+    bool usesLevel_;
+    /**
+     * Wdiffs are compressed at level 1 always regardless of the level.
+     * usesLevel: true to compress at the level (wlog-transfer uses it).
+     */
+    CompressorZstd(size_t level, bool usesLevel = false)
+        : level_(level == 0 ? 3 : level), usesLevel_(usesLevel) {
         if (level >= 20) {
             throw cybozu::Exception(NAME()) << "bad compression level" << level;
         }
     }
     bool run(void *out, size_t *outSize, size_t maxOutSize, const void *in, size_t inSize) {
         assert(outSize != nullptr);
-        const int level = 1;
+        const int level = usesLevel_ ? int(level_) : 1;
         const size_t ret = ::ZSTD_compress(out, maxOutSize, in, inSize, level);
         if (::ZSTD_isError(ret)) {
             LOGs.warn() << NAME() << ::ZSTD_getErrorName(ret);
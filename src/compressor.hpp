@@ -45,8 +45,9 @@ public:
      * @param compressionLevel [in] compression level
      *                  not used for AsIs, Snappy, Lz4
      *                  [0, 9] (default 6) for Zlib, Xz
+     * @param usesZstdLevel [in] Zstd compresses at level 1 unless this is true.
      */
-    explicit Compressor(int mode, size_t compressionLevel = 0)
+    explicit Compressor(int mode, size_t compressionLevel = 0, bool usesZstdLevel = false)
         : engine_(nullptr)
     {
         switch (mode) {
@@ -66,7 +67,7 @@ public:
             engine_ = new CompressorLz4(compressionLevel);
             break;
         case WALB_DIFF_CMPR_ZSTD:
-            engine_ = new CompressorZstd(compressionLevel);
+            engine_ = new CompressorZstd(compressionLevel, usesZstdLevel);
             break;
         default:
             throw cybozu::Exception("Compressor:invalid mode") << mode;
@@ -23,10 +23,24 @@ const size_t DEFAULT_MAX_WDIFF_SEND_MB = 128;
 const size_t DEFAULT_MAX_WDIFF_SEND_NR = 1000;
 const size_t DEFAULT_MAX_WDIFF_MERGE_MB = 1024;
 const size_t DEFAULT_MAX_WLOG_SEND_MB = 128;
+const size_t DEFAULT_WLOG_READ_QUEUE_SIZE = 16; // logpacks.
+const size_t DEFAULT_WLOG_SEND_QUEUE_SIZE = 16; // logpacks.
+const size_t DEFAULT_WLOG_COMPRESS_THREADS = 2;
+const size_t DEFAULT_WLOG_UNCOMPRESS_THREADS = 2;
+const size_t DEFAULT_WDIFF_COMPRESS_THREADS = 2;
+const size_t DEFAULT_WLOG_READ_AHEAD_MAX_BUFFER_MB = 64;
+const size_t DEFAULT_WLOG_READ_AHEAD_MAX_IO_KB = 1024;
+const size_t DEFAULT_WLOG_READ_AHEAD_MAX_QUEUE_DEPTH = 512;
+const size_t DEFAULT_WLOG_READ_AHEAD_TOTAL_MB = 256;
 const size_t DEFAULT_MAX_CONVERSION_MB = 1024;
 const size_t DEFAULT_DELAY_SEC_FOR_RETRY = 20;
 const size_t DEFAULT_RETRY_TIMEOUT_SEC = 1800;
 const size_t DEFAULT_MAX_OPEN_DIFFS = 0; // 0 means unlimited.
+const size_t DEFAULT_MERGE_THREADS = 1;
+const size_t DEFAULT_MERGE_PREFETCH_IOS = 0; // 0 means no prefetching.
+const size_t DEFAULT_MERGE_MEM_SIZE = 0; // 0 means unlimited.
+const size_t DEFAULT_APPLY_AIO_BUFFER_SIZE = 16 * MEBI; // per range applied in parallel. 0 means buffered IOs.
+const size_t DIFF_APPLY_MAX_IO_SIZE = MEBI; // adjacent diff IOs are coalesced up to this in applying.
 
 const size_t PROXY_HEARTBEAT_INTERVAL_SEC = 10;
 const size_t PROXY_HEARTBEAT_SOCKET_TIMEOUT_SEC = 3; // seconds.
@@ -34,14 +48,17 @@ const size_t PROXY_HEARTBEAT_SOCKET_TIMEOUT_SEC = 3; // seconds.
 const size_t DEFAULT_SOCKET_TIMEOUT_SEC = 10;
 
 const uint64_t DEFAULT_FULL_SCAN_BYTES_PER_SEC = 0; // unlimited.
+const size_t DEFAULT_FULL_SYNC_STREAMS = 1; // connections per full sync.
+const size_t MAX_FULL_SYNC_STREAMS = 64;
 
 const uint64_t DEFAULT_FSYNC_INTERVAL_SIZE = 128 * MEBI;
-const size_t DEFAULT_MERGE_BUFFER_LB = 4 * MEBI / LBS;
 
 const char DEFAULT_DISCARD_TYPE_STR[] = "ignore";
+const char DEFAULT_AIO_BACKEND_STR[] = "libaio";
 
 const uint64_t DIRTY_HASH_SYNC_READ_AHEAD_LB = 256 * MEBI / LBS;
 const uint64_t DIRTY_HASH_SYNC_MAX_PACK_AREA_LB = 256 * MEBI / LBS;
+const uint32_t DIFF_PACK_MIN_ZERO_RUN_LB = 4 * KIBI / LBS; // shorter zero runs in IOs are not split in diff packs.
 
 const int DEFAULT_TCP_KEEPIDLE = 60 * 30;
 const int DEFAULT_TCP_KEEPINTVL = 60;
@@ -51,6 +68,9 @@ const int MAX_TCP_KEEPINTVL = 60 * 60;
 const int MAX_TCP_KEEPCNT = 100;
 
 const size_t PROGRESS_INTERVAL_SEC = 60;
+const size_t RESTORE_STATE_SAVE_INTERVAL_SEC = 60; // progress of restore shards is saved at this interval.
+const size_t RESTORE_SHARDS_PER_THREAD = 4; // restore shards are taken by the merge threads in order.
+const uint64_t RESTORE_SHARD_ALIGN_LB = MEBI / LBS;
 
 const size_t DEFAULT_TS_DELTA_INTERVAL_SEC = 60;
 
@@ -58,6 +78,9 @@ const uint32_t DEFAULT_MAX_IO_LB = MEBI / LBS; // used as max diff IO size.
 
 const size_t DEFAULT_IMPLICIT_SNAPSHOT_INTERVAL_SEC = 10;
 
-const size_t INDEXED_DIFF_CACHE_SIZE = 32 * MEBI;
+const size_t INDEXED_DIFF_CACHE_SIZE = 128 * MEBI; // shared by all the indexed diff readers in a process.
+const size_t INDEXED_DIFF_READ_AHEAD_NR = 64; // index records of which IO data are read ahead.
+
+const size_t DIFF_INDEX_SPILL_SIZE = 64 * MEBI; // DiffIndexMem larger than this will be spilled to a file.
 
 } // walb
@@ -246,6 +246,24 @@ inline void c2sSetFullScanBpsClient(protocol::ClientParams &p)
     protocol::sendStrVec(p.sock, p.params, 0, __func__, msgOk);
 }
 
+/**
+ * params[0]: max log device read throughput [bytes/sec]
+ * params[1]: max network throughput [bytes/sec]
+ */
+inline void c2sSetWlogBpsClient(protocol::ClientParams &p)
+{
+    protocol::sendStrVec(p.sock, p.params, 2, __func__, msgOk);
+}
+
+/**
+ * params[0]: volId
+ * params[1]: compressOpt string
+ */
+inline void c2sSetWlogCmprClient(protocol::ClientParams &p)
+{
+    protocol::sendStrVec(p.sock, p.params, 2, __func__, msgOk);
+}
+
 /**
  * params[0]: volId
  * params[1]: gidStr
@@ -1,27 +1,36 @@
 #include "dirty_full_sync.hpp"
+#include "protocol.hpp"
+#include "thread_util.hpp"
 
 namespace walb {
 
 bool dirtyFullSyncClient(
     packet::Packet &pkt, const std::string &bdevPath,
-    uint64_t startLb, uint64_t sizeLb, uint64_t bulkLb,
+    uint64_t startLb, uint64_t endLb, uint64_t bulkLb,
     const std::atomic<int> &stopState, const ProcessStatus &ps,
-    const std::atomic<uint64_t>& maxLbPerSec)
+    const std::atomic<uint64_t>& maxLbPerSec, size_t nrStreams,
+    const std::atomic<bool> *abort)
 {
-    assert(startLb <= sizeLb);
+    assert(startLb <= endLb);
+    assert(nrStreams > 0);
     AlignedArray buf(bulkLb * LOGICAL_BLOCK_SIZE);
     AsyncBdevReader reader(bdevPath, startLb);
     std::string encBuf;
     ThroughputStabilizer thStab;
 
     uint64_t c = 0;
-    uint64_t remainingLb = sizeLb - startLb;
+    uint64_t remainingLb = endLb - startLb;
     while (0 < remainingLb) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
             return false;
         }
+        if (abort && abort->load()) {
+            LOGs.warn() << __func__ << "aborted" << startLb << endLb << remainingLb;
+            return false;
+        }
         const uint32_t lb = std::min<uint64_t>(bulkLb, remainingLb);
         const size_t size = lb * LOGICAL_BLOCK_SIZE;
+        buf.resize(size, false);
         reader.read(&buf[0], size);
         if (cybozu::util::isAllZero(buf.data(), buf.size())) {
             pkt.write(0);
@@ -32,7 +41,8 @@ bool dirtyFullSyncClient(
         }
         remainingLb -= lb;
         c++;
-        thStab.setMaxLbPerSec(maxLbPerSec.load());
+        const uint64_t maxLb = maxLbPerSec.load();
+        thStab.setMaxLbPerSec(maxLb == 0 ? 0 : std::max<uint64_t>(1, maxLb / nrStreams));
         thStab.addAndSleepIfNecessary(lb, 10, 100);
     }
     pkt.flush();
@@ -43,18 +53,14 @@ bool dirtyFullSyncClient(
 
 bool dirtyFullSyncServer(
     packet::Packet &pkt, const std::string &bdevPath,
-    uint64_t startLb, uint64_t sizeLb, uint64_t bulkLb,
+    uint64_t startLb, uint64_t endLb, uint64_t bulkLb,
     const std::atomic<int> &stopState, const ProcessStatus &ps, std::atomic<uint64_t> &progressLb,
     bool skipZero, uint64_t fsyncIntervalSize,
-    FullReplState *fullReplSt, const cybozu::FilePath &fullReplStDir,
-    const std::string &fullReplStFileName)
+    const std::function<void(uint64_t lb)> &syncedF,
+    const std::atomic<bool> *abort)
 {
     const char *const FUNC = __func__;
-    assert(startLb <= sizeLb);
-    if (fullReplSt) {
-        assert(fullReplStDir.stat().isDirectory());
-        assert(!fullReplStFileName.empty());
-    }
+    assert(startLb <= endLb);
     cybozu::util::File file(bdevPath, O_RDWR);
     if (startLb != 0) {
         file.lseek(startLb * LOGICAL_BLOCK_SIZE);
@@ -63,14 +69,16 @@ bool dirtyFullSyncServer(
     AlignedArray buf(bulkLb * LOGICAL_BLOCK_SIZE);
     AlignedArray encBuf;
 
-    progressLb = startLb;
     uint64_t c = 0;
-    uint64_t remainingLb = sizeLb - startLb;
+    uint64_t remainingLb = endLb - startLb;
     uint64_t writeSize = 0;
     while (0 < remainingLb) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
             return false;
         }
+        if (abort && abort->load()) {
+            throw cybozu::Exception(FUNC) << "aborted" << startLb << endLb << remainingLb;
+        }
         const uint32_t lb = std::min<uint64_t>(bulkLb, remainingLb);
         const size_t size = lb * LOGICAL_BLOCK_SIZE;
         size_t encSize;
@@ -94,20 +102,252 @@ bool dirtyFullSyncServer(
         if (writeSize >= fsyncIntervalSize) {
             file.fdatasync();
             writeSize = 0;
-            if (fullReplSt) {
-                fullReplSt->progressLb = progressLb;
-                util::saveFile(fullReplStDir, fullReplStFileName, *fullReplSt);
-            }
+            if (syncedF) syncedF(endLb - remainingLb);
         }
         c++;
     }
     LOGs.debug() << "fdatasync start";
     file.fdatasync();
     LOGs.debug() << "fdatasync end";
+    if (syncedF) syncedF(endLb);
     packet::Ack(pkt.sock()).send();
     pkt.flush();
     LOGs.debug() << "number of received packets" << c;
     return true;
 }
 
+
+bool dirtyFullSyncClientMulti(
+    packet::Packet &pkt, const FullSyncConnectFunc &connectF,
+    uint64_t sessionId, const FullSyncRangeVec &rangeV,
+    const std::string &bdevPath, uint64_t bulkLb,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    const std::atomic<uint64_t>& maxLbPerSec)
+{
+    const char *const FUNC = __func__;
+    std::vector<size_t> idxV;
+    for (size_t i = 0; i < rangeV.size(); i++) {
+        if (!rangeV[i].isDone()) idxV.push_back(i);
+    }
+    if (idxV.empty()) return true;
+    const size_t nrStreams = idxV.size();
+
+    std::vector<char> isOkV(nrStreams, false);
+    std::atomic<bool> abort(false); // to stop the other connections when one fails.
+    cybozu::thread::ThreadRunnerSet thS;
+    for (size_t i = 1; i < nrStreams; i++) {
+        thS.add([&, i]() {
+                const size_t idx = idxV[i];
+                const FullSyncRange &r = rangeV[idx];
+                try {
+                    cybozu::Socket sock;
+                    connectF(sock);
+                    packet::Packet sPkt(sock);
+                    sPkt.write(sessionId);
+                    sPkt.write(idx);
+                    sPkt.flush();
+                    std::string res;
+                    sPkt.read(res);
+                    if (res != msgAccept) {
+                        throw cybozu::Exception(FUNC) << "not accepted" << sessionId << idx << res;
+                    }
+                    isOkV[i] = dirtyFullSyncClient(
+                        sPkt, bdevPath, r.progressLb, r.endLb, bulkLb, stopState, ps, maxLbPerSec,
+                        nrStreams, &abort);
+                } catch (...) {
+                    abort = true;
+                    throw;
+                }
+                if (!isOkV[i]) abort = true;
+            });
+    }
+    thS.start();
+    std::exception_ptr ep;
+    try {
+        const FullSyncRange &r = rangeV[idxV[0]];
+        isOkV[0] = dirtyFullSyncClient(
+            pkt, bdevPath, r.progressLb, r.endLb, bulkLb, stopState, ps, maxLbPerSec, nrStreams, &abort);
+    } catch (...) {
+        ep = std::current_exception();
+    }
+    if (ep || !isOkV[0]) abort = true;
+    for (std::exception_ptr e : thS.join()) {
+        LOGs.error() << FUNC << cybozu::thread::exceptionPtrToStr(e);
+        if (!ep) ep = e;
+    }
+    if (ep) std::rethrow_exception(ep);
+    for (char isOk : isOkV) {
+        if (!isOk) return false;
+    }
+    return true;
+}
+
+
+FullSyncSession::FullSyncSession(
+    const FullSyncRangeVec &rangeV, uint64_t bulkLb, bool skipZero, uint64_t fsyncIntervalSize,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    std::atomic<uint64_t> &progressLb, const SaveFunc &saveF)
+    : initRangeV_(rangeV), bulkLb_(bulkLb), skipZero_(skipZero), fsyncIntervalSize_(fsyncIntervalSize)
+    , stopState_(stopState), ps_(ps), progressLb_(progressLb), saveF_(saveF)
+    , mu_(), cv_(), bdevPath_(), isCanceled_(false), isAborted_(false)
+    , rangeV_(rangeV), stateV_(), errMsg_()
+{
+    for (const FullSyncRange &r : rangeV_) {
+        stateV_.push_back(r.isDone() ? RangeState::Done : RangeState::Waiting);
+    }
+}
+
+
+std::vector<size_t> FullSyncSession::getPendingIndexes() const
+{
+    std::vector<size_t> v;
+    for (size_t i = 0; i < initRangeV_.size(); i++) {
+        if (!initRangeV_[i].isDone()) v.push_back(i);
+    }
+    return v;
+}
+
+
+void FullSyncSession::start(const std::string &bdevPath)
+{
+    assert(!bdevPath.empty());
+    UniqueLock lk(mu_);
+    bdevPath_ = bdevPath;
+    cv_.notify_all();
+}
+
+
+void FullSyncSession::cancel()
+{
+    UniqueLock lk(mu_);
+    isCanceled_ = true;
+    isAborted_ = true;
+    cv_.notify_all();
+}
+
+
+bool FullSyncSession::receive(packet::Packet &pkt, size_t idx)
+{
+    const char *const FUNC = __func__;
+    {
+        UniqueLock lk(mu_);
+        if (idx >= stateV_.size() || stateV_[idx] != RangeState::Waiting) {
+            throw cybozu::Exception(FUNC) << "bad range index" << idx << stateV_.size();
+        }
+        stateV_[idx] = RangeState::Running;
+    }
+    try {
+        if (!waitForStart(idx)) return false;
+        const FullSyncRange &r = initRangeV_[idx];
+        const bool isOk = dirtyFullSyncServer(
+            pkt, bdevPath_, r.progressLb, r.endLb, bulkLb_, stopState_, ps_, progressLb_,
+            skipZero_, fsyncIntervalSize_, [&](uint64_t lb) { setProgress(idx, lb); }, &isAborted_);
+        if (!isOk) {
+            setState(idx, RangeState::Failed, "force stopped");
+            return false;
+        }
+        setState(idx, RangeState::Done);
+        return true;
+    } catch (std::exception &e) {
+        setState(idx, RangeState::Failed, e.what());
+        throw;
+    }
+}
+
+
+bool FullSyncSession::waitForStart(size_t idx)
+{
+    UniqueLock lk(mu_);
+    while (bdevPath_.empty()) {
+        if (isCanceled_) {
+            lk.unlock();
+            setState(idx, RangeState::Failed, "canceled");
+            throw cybozu::Exception(__func__) << "canceled" << idx;
+        }
+        if (isForceStopping()) {
+            lk.unlock();
+            setState(idx, RangeState::Failed, "force stopped");
+            return false;
+        }
+        cv_.wait_for(lk, std::chrono::seconds(1));
+    }
+    return true;
+}
+
+
+bool FullSyncSession::waitForAll(size_t waitTimeoutSec)
+{
+    const char *const FUNC = __func__;
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(waitTimeoutSec);
+    UniqueLock lk(mu_);
+    for (;;) {
+        bool isDone = true;
+        for (size_t i = 0; i < stateV_.size(); i++) {
+            switch (stateV_[i]) {
+            case RangeState::Failed:
+                if (isForceStopping()) return false;
+                throw cybozu::Exception(FUNC) << "range failed" << i << errMsg_;
+            case RangeState::Waiting:
+                if (std::chrono::steady_clock::now() > deadline) {
+                    throw cybozu::Exception(FUNC) << "range not started" << i << waitTimeoutSec;
+                }
+                isDone = false;
+                break;
+            case RangeState::Running:
+                isDone = false;
+                break;
+            case RangeState::Done:
+                break;
+            }
+        }
+        if (isDone) return true;
+        if (isForceStopping()) return false;
+        cv_.wait_for(lk, std::chrono::seconds(1));
+    }
+}
+
+
+void FullSyncSession::setProgress(size_t idx, uint64_t lb)
+{
+    UniqueLock lk(mu_);
+    rangeV_[idx].progressLb = lb;
+    if (saveF_) saveF_(rangeV_);
+}
+
+
+void FullSyncSession::setState(size_t idx, RangeState st, const std::string &errMsg)
+{
+    UniqueLock lk(mu_);
+    stateV_[idx] = st;
+    if (st == RangeState::Failed) isAborted_ = true;
+    if (!errMsg.empty() && errMsg_.empty()) errMsg_ = errMsg;
+    cv_.notify_all();
+}
+
+
+void dirtyFullSyncStreamServer(packet::Packet &pkt, const FullSyncSessionMap &map, Logger &logger)
+{
+    const char *const FUNC = __func__;
+    uint64_t sessionId;
+    size_t idx;
+    pkt.read(sessionId);
+    pkt.read(idx);
+    std::shared_ptr<FullSyncSession> sessP = map.get(sessionId);
+    if (!sessP) {
+        cybozu::Exception e(FUNC);
+        e << "session not found" << sessionId << idx;
+        pkt.writeFin(e.what());
+        throw e;
+    }
+    pkt.write(msgAccept);
+    pkt.flush();
+    logger.debug() << FUNC << "started" << sessionId << idx;
+    if (!sessP->receive(pkt, idx)) {
+        logger.warn() << FUNC << "force stopped" << sessionId << idx;
+        return;
+    }
+    logger.debug() << FUNC << "done" << sessionId << idx;
+}
+
 } // namespace walb
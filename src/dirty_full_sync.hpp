@@ -3,6 +3,11 @@
 #include <atomic>
 #include <deque>
 #include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <snappy.h>
 #include "packet.hpp"
 #include "fileio.hpp"
@@ -17,32 +22,200 @@
 namespace walb {
 
 /**
- * sizeLb is total size.
+ * Blocks in [startLb, endLb) will be sent.
+ * maxLbPerSec is shared by nrStreams connections.
+ * abort will be set by another connection of the same full sync when it fails.
  *
  * RETURN:
- *   false if force stopped.
+ *   false if force stopped or aborted.
  */
 bool dirtyFullSyncClient(
     packet::Packet &pkt, const std::string &bdevPath,
-    uint64_t startLb, uint64_t sizeLb, uint64_t bulkLb,
+    uint64_t startLb, uint64_t endLb, uint64_t bulkLb,
     const std::atomic<int> &stopState, const ProcessStatus &ps,
-    const std::atomic<uint64_t>& maxLbPerSec);
+    const std::atomic<uint64_t>& maxLbPerSec, size_t nrStreams = 1,
+    const std::atomic<bool> *abort = nullptr);
 
 /**
- * sizeLb is total size.
- * fullReplSt, fullReplStDir, and fullREplStFileName must be specified together.
+ * Blocks in [startLb, endLb) will be received.
+ * The received size will be added to progressLb.
+ * syncedF(lb) will be called when blocks before lb have been made durable.
+ *
+ * An exception will be thrown when abort is set.
  *
  * fsyncIntervalSize [bytes]
  *
  * RETURN:
  *   false if force stopped.
  */
- bool dirtyFullSyncServer(
+bool dirtyFullSyncServer(
     packet::Packet &pkt, const std::string &bdevPath,
-    uint64_t startLb, uint64_t sizeLb, uint64_t bulkLb,
+    uint64_t startLb, uint64_t endLb, uint64_t bulkLb,
     const std::atomic<int> &stopState, const ProcessStatus &ps, std::atomic<uint64_t> &progressLb,
     bool skipZero, uint64_t fsyncIntervalSize,
-    FullReplState *fullReplSt = nullptr, const cybozu::FilePath &fullReplStDir = cybozu::FilePath(),
-    const std::string &fullReplStFileName = "");
+    const std::function<void(uint64_t lb)> &syncedF = nullptr,
+    const std::atomic<bool> *abort = nullptr);
+
+/**
+ * Open a connection for a range of a full sync and finish the 1st negotiation.
+ */
+using FullSyncConnectFunc = std::function<void(cybozu::Socket &sock)>;
+
+/**
+ * Send the ranges that have not been done yet.
+ * The first one will be sent by pkt and each of the others by a connection
+ * opened by connectF() in parallel.
+ * When a connection fails, the others will stop sending.
+ *
+ * RETURN:
+ *   false if force stopped.
+ */
+bool dirtyFullSyncClientMulti(
+    packet::Packet &pkt, const FullSyncConnectFunc &connectF,
+    uint64_t sessionId, const FullSyncRangeVec &rangeV,
+    const std::string &bdevPath, uint64_t bulkLb,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    const std::atomic<uint64_t>& maxLbPerSec);
+
+/**
+ * Receiver side of a full sync by multiple connections.
+ * The primary connection receives the first range that has not been done,
+ * and each of the others is received by a dirty-full-sync-stream connection.
+ * When a connection fails or the session is canceled, the others will fail.
+ */
+class FullSyncSession
+{
+public:
+    /**
+     * This will be called with the ranges
+     * whenever a progress of a range has been made durable.
+     */
+    using SaveFunc = std::function<void(const FullSyncRangeVec &rangeV)>;
+private:
+    enum class RangeState { Waiting, Running, Done, Failed };
+
+    const FullSyncRangeVec initRangeV_;
+    const uint64_t bulkLb_;
+    const bool skipZero_;
+    const uint64_t fsyncIntervalSize_;
+    const std::atomic<int> &stopState_;
+    const ProcessStatus &ps_;
+    std::atomic<uint64_t> &progressLb_;
+    const SaveFunc saveF_;
+
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    std::string bdevPath_; // empty until start() is called.
+    bool isCanceled_;
+    std::atomic<bool> isAborted_; // to stop the running connections.
+    FullSyncRangeVec rangeV_;
+    std::vector<RangeState> stateV_;
+    std::string errMsg_;
+
+    using UniqueLock = std::unique_lock<std::mutex>;
+public:
+    FullSyncSession(const FullSyncRangeVec &rangeV, uint64_t bulkLb, bool skipZero, uint64_t fsyncIntervalSize,
+                    const std::atomic<int> &stopState, const ProcessStatus &ps,
+                    std::atomic<uint64_t> &progressLb, const SaveFunc &saveF = nullptr);
+    const FullSyncRangeVec& getInitialRanges() const { return initRangeV_; }
+    /**
+     * Indexes of the ranges to receive.
+     */
+    std::vector<size_t> getPendingIndexes() const;
+    /**
+     * Allow the connections to write the device.
+     */
+    void start(const std::string &bdevPath);
+    /**
+     * Connections waiting for start() or receiving will fail.
+     */
+    void cancel();
+    /**
+     * Receive a range by a connection.
+     *
+     * RETURN:
+     *   false if force stopped.
+     */
+    bool receive(packet::Packet &pkt, size_t idx);
+    /**
+     * Wait for all the ranges to be received.
+     * A range not started by waitTimeoutSec after the call is regarded as an error.
+     *
+     * RETURN:
+     *   false if force stopped.
+     */
+    bool waitForAll(size_t waitTimeoutSec);
+private:
+    bool isForceStopping() const {
+        return stopState_ == ForceStopping || ps_.isForceShutdown();
+    }
+    bool waitForStart(size_t idx);
+    void setProgress(size_t idx, uint64_t lb);
+    void setState(size_t idx, RangeState st, const std::string &errMsg = "");
+};
+
+/**
+ * Sessions in progress to be found by dirty-full-sync-stream connections.
+ * This is thread-safe.
+ */
+class FullSyncSessionMap
+{
+    using Map = std::map<uint64_t, std::shared_ptr<FullSyncSession> >;
+    using AutoLock = std::lock_guard<std::mutex>;
+    mutable std::mutex mu_;
+    Map map_;
+    uint64_t nextId_;
+public:
+    FullSyncSessionMap() : map_(), nextId_(1) {}
+    /**
+     * RETURN:
+     *   session id.
+     */
+    uint64_t add(const std::shared_ptr<FullSyncSession> &sessP) {
+        AutoLock lk(mu_);
+        const uint64_t id = nextId_++;
+        map_.emplace(id, sessP);
+        return id;
+    }
+    /**
+     * RETURN:
+     *   nullptr if not found.
+     */
+    std::shared_ptr<FullSyncSession> get(uint64_t id) const {
+        AutoLock lk(mu_);
+        Map::const_iterator it = map_.find(id);
+        if (it == map_.end()) return nullptr;
+        return it->second;
+    }
+    void remove(uint64_t id) {
+        AutoLock lk(mu_);
+        map_.erase(id);
+    }
+};
+
+/**
+ * Register a session while it is alive.
+ * The session will be canceled at the end of the scope.
+ */
+class FullSyncSessionRegistration
+{
+    FullSyncSessionMap &map_;
+    std::shared_ptr<FullSyncSession> sessP_;
+    uint64_t id_;
+public:
+    FullSyncSessionRegistration(FullSyncSessionMap &map, const std::shared_ptr<FullSyncSession> &sessP)
+        : map_(map), sessP_(sessP), id_(map.add(sessP)) {}
+    ~FullSyncSessionRegistration() noexcept {
+        map_.remove(id_);
+        sessP_->cancel();
+    }
+    uint64_t getId() const { return id_; }
+    FullSyncSession& get() { return *sessP_; }
+};
+
+/**
+ * Server side of dirty-full-sync-stream protocol.
+ */
+void dirtyFullSyncStreamServer(packet::Packet &pkt, const FullSyncSessionMap &map, Logger &logger);
 
 } // namespace walb
@@ -1,26 +1,117 @@
 #pragma once
 #include "meta.hpp"
 #include "walb_util.hpp"
+#include "constant.hpp"
 #include "cybozu/serializer.hpp"
 #include <sstream>
 #include <iostream>
+#include <vector>
 
 namespace walb {
 
+/**
+ * A range of a full sync sent by a connection.
+ * bgnLb <= progressLb <= endLb.
+ */
+struct FullSyncRange
+{
+    uint64_t bgnLb;
+    uint64_t endLb;
+    uint64_t progressLb;
+
+    FullSyncRange() : bgnLb(0), endLb(0), progressLb(0) {}
+    FullSyncRange(uint64_t bgnLb, uint64_t endLb)
+        : bgnLb(bgnLb), endLb(endLb), progressLb(bgnLb) {}
+    bool isDone() const { return progressLb == endLb; }
+    uint64_t doneLb() const { return progressLb - bgnLb; }
+
+    template <typename InputStream>
+    void load(InputStream &is) {
+        cybozu::load(bgnLb, is);
+        cybozu::load(endLb, is);
+        cybozu::load(progressLb, is);
+    }
+    template <typename OutputStream>
+    void save(OutputStream &os) const {
+        cybozu::save(os, bgnLb);
+        cybozu::save(os, endLb);
+        cybozu::save(os, progressLb);
+    }
+    std::string str() const {
+        return cybozu::util::formatString("%" PRIu64 "-%" PRIu64 ":%" PRIu64, bgnLb, endLb, progressLb);
+    }
+    friend inline std::ostream& operator<<(std::ostream& os, const FullSyncRange& range) {
+        os << range.str();
+        return os;
+    }
+};
+
+using FullSyncRangeVec = std::vector<FullSyncRange>;
+
+/**
+ * Split [0, sizeLb) into nr ranges whose boundaries are aligned to bulkLb.
+ * The number of ranges may be less than nr for a small device.
+ */
+inline FullSyncRangeVec splitFullSyncRange(uint64_t sizeLb, uint64_t bulkLb, size_t nr)
+{
+    assert(bulkLb > 0);
+    const uint64_t nrBulks = (sizeLb + bulkLb - 1) / bulkLb;
+    nr = std::max<uint64_t>(1, std::min<uint64_t>(nr, nrBulks));
+    FullSyncRangeVec v;
+    uint64_t bgnLb = 0;
+    for (size_t i = 0; i < nr; i++) {
+        const uint64_t endLb = std::min(sizeLb, nrBulks * (i + 1) / nr * bulkLb);
+        v.emplace_back(bgnLb, endLb);
+        bgnLb = endLb;
+    }
+    return v;
+}
+
+inline void verifyFullSyncStreams(size_t nr, const char *msg)
+{
+    if (nr == 0 || nr > MAX_FULL_SYNC_STREAMS) {
+        throw cybozu::Exception(msg) << "must be 1 to" << MAX_FULL_SYNC_STREAMS << nr;
+    }
+}
+
+/**
+ * RETURN:
+ *   true if the ranges cover [0, sizeLb) in order.
+ */
+inline bool isValidFullSyncRange(const FullSyncRangeVec &v, uint64_t sizeLb)
+{
+    uint64_t lb = 0;
+    for (const FullSyncRange &r : v) {
+        if (r.bgnLb != lb || r.progressLb < r.bgnLb || r.endLb < r.progressLb) return false;
+        lb = r.endLb;
+    }
+    return !v.empty() && lb == sizeLb;
+}
+
+inline uint64_t getFullSyncDoneLb(const FullSyncRangeVec &v)
+{
+    uint64_t lb = 0;
+    for (const FullSyncRange &r : v) lb += r.doneLb();
+    return lb;
+}
+
 /**
  * For full replication resume.
+ * progressLb is the total size of the received blocks in rangeV.
  */
 struct FullReplState
 {
     MetaState metaSt;
     uint64_t progressLb;
     uint64_t timestamp;
+    FullSyncRangeVec rangeV;
 
     template <typename InputStream>
     void load(InputStream &is) {
         cybozu::load(metaSt, is);
         cybozu::load(progressLb, is);
         cybozu::load(timestamp, is);
+        cybozu::load(rangeV, is);
         metaSt.verify();
     }
     template <typename OutputStream>
@@ -28,10 +119,12 @@ struct FullReplState
         cybozu::save(os, metaSt);
         cybozu::save(os, progressLb);
         cybozu::save(os, timestamp);
+        cybozu::save(os, rangeV);
     }
     std::string str() const {
         std::stringstream ss;
         ss << metaSt << " " << progressLb << " " << util::timeToPrintable(timestamp);
+        for (const FullSyncRange &r : rangeV) ss << " " << r;
         return ss.str();
     }
     friend inline std::ostream& operator<<(std::ostream& os, const FullReplState& fullReplSt) {
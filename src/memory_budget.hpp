@@ -0,0 +1,120 @@
+#pragma once
+/**
+ * @file
+ * @brief Memory accounting with a limit shared by threads.
+ */
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cassert>
+
+namespace walb {
+
+/**
+ * Thread-safe counter of memory usage in bytes with an optional limit.
+ *
+ * Producers that can wait call acquire(), which blocks while the limit would be exceeded.
+ * Consumers that must not wait call add(), which never blocks and may exceed the limit.
+ * Both must call release() when the memory is freed.
+ *
+ * A budget may have a parent to share a larger budget among several users.
+ * Sizes are counted by both and acquire() waits for both limits.
+ * The remaining size is released from the parent at destruction.
+ */
+class MemoryBudget /* final */
+{
+private:
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    size_t maxSize_; // 0 means unlimited.
+    size_t curSize_;
+    size_t peakSize_;
+    MemoryBudget *parent_;
+
+    using AutoLock = std::unique_lock<std::mutex>;
+
+public:
+    explicit MemoryBudget(size_t maxSize = 0)
+        : mu_(), cv_(), maxSize_(maxSize), curSize_(0), peakSize_(0), parent_(nullptr) {
+    }
+    ~MemoryBudget() noexcept {
+        if (parent_) parent_->release(curSize_);
+    }
+    MemoryBudget(const MemoryBudget &) = delete;
+    MemoryBudget &operator=(const MemoryBudget &) = delete;
+
+    void setMaxSize(size_t maxSize) {
+        AutoLock lk(mu_);
+        maxSize_ = maxSize;
+        cv_.notify_all();
+    }
+    /**
+     * Call this before counting any size.
+     */
+    void setParent(MemoryBudget *parent) {
+        assert(curSize_ == 0);
+        parent_ = parent;
+    }
+    /**
+     * Wait until the size can be acquired within the limit or canExceed() returns true.
+     * canExceed() is called with the lock held,
+     * so call notify() after changing the condition it depends on.
+     */
+    template <typename Pred>
+    void acquire(size_t size, Pred canExceed) {
+        {
+            AutoLock lk(mu_);
+            cv_.wait(lk, [&]() {
+                    return maxSize_ == 0 || curSize_ + size <= maxSize_ || canExceed();
+                });
+            addNolock(size);
+        }
+        if (parent_) parent_->acquire(size, canExceed);
+    }
+    void add(size_t size) {
+        {
+            AutoLock lk(mu_);
+            addNolock(size);
+        }
+        if (parent_) parent_->add(size);
+    }
+    void release(size_t size) noexcept {
+        if (size == 0) return;
+        {
+            AutoLock lk(mu_);
+            assert(size <= curSize_);
+            curSize_ -= std::min(size, curSize_);
+            cv_.notify_all();
+        }
+        if (parent_) parent_->release(size);
+    }
+    /**
+     * Wake up waiting acquire() calls to check their conditions again.
+     */
+    void notify() {
+        {
+            AutoLock lk(mu_);
+            cv_.notify_all();
+        }
+        if (parent_) parent_->notify();
+    }
+    size_t getMaxSize() const {
+        AutoLock lk(mu_);
+        return maxSize_;
+    }
+    size_t getSize() const {
+        AutoLock lk(mu_);
+        return curSize_;
+    }
+    size_t getPeakSize() const {
+        AutoLock lk(mu_);
+        return peakSize_;
+    }
+private:
+    void addNolock(size_t size) {
+        curSize_ += size;
+        peakSize_ = std::max(peakSize_, curSize_);
+    }
+};
+
+} // namespace walb
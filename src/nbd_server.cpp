@@ -0,0 +1,283 @@
+#include "nbd_server.hpp"
+#include "thread_util.hpp"
+#include "walb_logger.hpp"
+#include "socket_util.hpp"
+#include <endian.h>
+#include <netinet/tcp.h>
+
+namespace walb {
+namespace nbd {
+
+namespace nbd_local {
+
+/**
+ * Big-endian encoder to send a message by a write.
+ */
+class Encoder
+{
+    std::string buf_;
+public:
+    Encoder& u16(uint16_t v) { v = htobe16(v); return raw(&v, sizeof(v)); }
+    Encoder& u32(uint32_t v) { v = htobe32(v); return raw(&v, sizeof(v)); }
+    Encoder& u64(uint64_t v) { v = htobe64(v); return raw(&v, sizeof(v)); }
+    Encoder& raw(const void *data, size_t size) {
+        buf_.append((const char *)data, size);
+        return *this;
+    }
+    const std::string& str() const { return buf_; }
+    void send(cybozu::Socket &sock) const { sock.write(buf_.data(), buf_.size()); }
+};
+
+uint16_t recvU16(cybozu::Socket &sock)
+{
+    uint16_t v;
+    sock.read(&v, sizeof(v));
+    return be16toh(v);
+}
+
+uint32_t recvU32(cybozu::Socket &sock)
+{
+    uint32_t v;
+    sock.read(&v, sizeof(v));
+    return be32toh(v);
+}
+
+uint64_t recvU64(cybozu::Socket &sock)
+{
+    uint64_t v;
+    sock.read(&v, sizeof(v));
+    return be64toh(v);
+}
+
+void sendOptReply(cybozu::Socket &sock, uint32_t opt, uint32_t type, const std::string &data = "")
+{
+    Encoder().u64(OPT_REPLY_MAGIC).u32(opt).u32(type).u32(data.size()).raw(data.data(), data.size()).send(sock);
+}
+
+void sendSimpleReply(cybozu::Socket &sock, uint32_t error, const char *handle)
+{
+    Encoder().u32(SIMPLE_REPLY_MAGIC).u32(error).raw(handle, 8).send(sock);
+}
+
+/**
+ * RETURN:
+ *   false if shouldStop() returned true.
+ */
+bool waitForReadable(cybozu::Socket &sock, const ReadOnlyServer::ShouldStopFunc &shouldStop)
+{
+    for (;;) {
+        if (shouldStop()) return false;
+        const int ret = sock.queryAcceptNoThrow();
+        if (ret > 0) return true;
+        if (ret == 0 || ret == -EINTR) continue;
+        throw cybozu::Exception(__func__) << cybozu::NetErrorNo(-ret);
+    }
+}
+
+struct ConnectionWorker
+{
+    ReadOnlyServer &server;
+    cybozu::Socket sock;
+    ReadOnlyServer::ShouldStopFunc shouldStop;
+
+    ConnectionWorker(ReadOnlyServer &server, cybozu::Socket &&sock, const ReadOnlyServer::ShouldStopFunc &shouldStop)
+        : server(server), sock(std::move(sock)), shouldStop(shouldStop) {}
+    ConnectionWorker(ConnectionWorker &&rhs)
+        : server(rhs.server), sock(std::move(rhs.sock)), shouldStop(std::move(rhs.shouldStop)) {}
+    void operator()() {
+        server.serve(sock, shouldStop);
+    }
+};
+
+} // namespace nbd_local
+
+using namespace nbd_local;
+
+void ReadOnlyServer::run(const std::string &addr, uint16_t port, size_t maxConnections, const ShouldStopFunc &shouldStop)
+{
+    const char *const FUNC = __func__;
+    cybozu::Socket ssock;
+    if (addr.empty()) {
+        ssock.bind(port);
+    } else {
+        cybozu::net::bindAddr(ssock, cybozu::SocketAddr(addr, port));
+    }
+    cybozu::thread::ThreadRunnerFixedPool pool;
+    pool.start(maxConnections);
+    LOGs.info() << FUNC << "Ready to accept NBD connections" << addr << port << name_ << sizeB_;
+    while (waitForReadable(ssock, shouldStop)) {
+        cybozu::Socket sock;
+        ssock.accept(sock);
+        /* Replies are small and a client waits for each of them. */
+        sock.setSocketOption(TCP_NODELAY, 1, IPPROTO_TCP);
+        for (std::exception_ptr ep : pool.gc()) {
+            LOGs.error() << FUNC << cybozu::thread::exceptionPtrToStr(ep);
+        }
+        if (!pool.add(ConnectionWorker(*this, std::move(sock), shouldStop))) {
+            LOGs.warn() << FUNC << "exceeds max connections" << maxConnections;
+            // The socket will be closed.
+        }
+    }
+    pool.stop();
+    for (std::exception_ptr ep : pool.gc()) {
+        LOGs.error() << FUNC << cybozu::thread::exceptionPtrToStr(ep);
+    }
+}
+
+void ReadOnlyServer::serve(cybozu::Socket &sock, const ShouldStopFunc &shouldStop)
+{
+    nrConn_++;
+    try {
+        if (negotiate(sock)) transmit(sock, shouldStop);
+    } catch (...) {
+        nrConn_--;
+        throw;
+    }
+    nrConn_--;
+}
+
+bool ReadOnlyServer::negotiate(cybozu::Socket &sock)
+{
+    const char *const FUNC = __func__;
+    Encoder().u64(NBDMAGIC).u64(IHAVEOPT).u16(FLAG_FIXED_NEWSTYLE | FLAG_NO_ZEROES).send(sock);
+    const uint32_t clientFlags = recvU32(sock);
+    if ((clientFlags & FLAG_FIXED_NEWSTYLE) == 0) {
+        throw cybozu::Exception(FUNC) << "client does not support fixed newstyle" << clientFlags;
+    }
+    const bool noZeroes = (clientFlags & FLAG_NO_ZEROES) != 0;
+
+    for (;;) {
+        const uint64_t magic = recvU64(sock);
+        if (magic != IHAVEOPT) {
+            throw cybozu::Exception(FUNC) << "bad option magic" << magic;
+        }
+        const uint32_t opt = recvU32(sock);
+        const uint32_t len = recvU32(sock);
+        if (len > LOGICAL_BLOCK_SIZE * 8) {
+            throw cybozu::Exception(FUNC) << "too long option" << opt << len;
+        }
+        std::string data(len, '\0');
+        if (len > 0) sock.read(&data[0], len);
+
+        switch (opt) {
+        case OPT_EXPORT_NAME:
+            if (!data.empty() && data != name_) {
+                throw cybozu::Exception(FUNC) << "unknown export" << data;
+            }
+        {
+            Encoder enc;
+            enc.u64(sizeB_).u16(FLAG_HAS_FLAGS | FLAG_READ_ONLY | FLAG_CAN_MULTI_CONN);
+            if (!noZeroes) enc.raw(std::string(124, '\0').data(), 124);
+            enc.send(sock);
+            return true;
+        }
+        case OPT_ABORT:
+            sendOptReply(sock, opt, REP_ACK);
+            return false;
+        case OPT_LIST: {
+            sendOptReply(sock, opt, REP_SERVER, Encoder().u32(name_.size()).raw(name_.data(), name_.size()).str());
+            sendOptReply(sock, opt, REP_ACK);
+            break;
+        }
+        case OPT_INFO:
+        case OPT_GO: {
+            /* name length, name, number of info requests, and info requests. */
+            uint32_t nameLen = 0;
+            if (len >= sizeof(nameLen)) {
+                ::memcpy(&nameLen, &data[0], sizeof(nameLen));
+                nameLen = be32toh(nameLen);
+            }
+            if (len < sizeof(uint32_t) + sizeof(uint16_t) || len - sizeof(uint32_t) - sizeof(uint16_t) < nameLen) {
+                sendOptReply(sock, opt, REP_ERR_INVALID);
+                break;
+            }
+            const std::string name = data.substr(sizeof(uint32_t), nameLen);
+            if (!name.empty() && name != name_) {
+                sendOptReply(sock, opt, REP_ERR_UNKNOWN);
+                break;
+            }
+            sendExportInfo(sock, opt);
+            sendOptReply(sock, opt, REP_ACK);
+            if (opt == OPT_GO) return true;
+            break;
+        }
+        default:
+            sendOptReply(sock, opt, REP_ERR_UNSUP);
+        }
+    }
+}
+
+void ReadOnlyServer::sendExportInfo(cybozu::Socket &sock, uint32_t opt)
+{
+    const std::string rep = Encoder().u16(INFO_EXPORT).u64(sizeB_)
+        .u16(FLAG_HAS_FLAGS | FLAG_READ_ONLY | FLAG_CAN_MULTI_CONN).str();
+    sendOptReply(sock, opt, REP_INFO, rep);
+}
+
+void ReadOnlyServer::transmit(cybozu::Socket &sock, const ShouldStopFunc &shouldStop)
+{
+    const char *const FUNC = __func__;
+    AlignedArray buf;
+    while (waitForReadable(sock, shouldStop)) {
+        const uint32_t magic = recvU32(sock);
+        if (magic != REQUEST_MAGIC) {
+            throw cybozu::Exception(FUNC) << "bad request magic" << magic;
+        }
+        recvU16(sock); // command flags are ignored.
+        const uint16_t type = recvU16(sock);
+        char handle[8];
+        sock.read(handle, sizeof(handle));
+        const uint64_t offset = recvU64(sock);
+        const uint32_t len = recvU32(sock);
+
+        switch (type) {
+        case CMD_READ:
+            if (len > MAX_READ_SIZE || offset > sizeB_ || sizeB_ - offset < len) {
+                sendSimpleReply(sock, ERR_INVAL, handle);
+                break;
+            }
+            try {
+                read(offset, len, buf);
+            } catch (std::exception &e) {
+                LOGs.error() << FUNC << "read failed" << offset << len << e.what();
+                sendSimpleReply(sock, ERR_IO, handle);
+                break;
+            }
+            sendSimpleReply(sock, 0, handle);
+            sock.write(buf.data() + offset % LOGICAL_BLOCK_SIZE, len);
+            break;
+        case CMD_WRITE: {
+            /* Discard the payload. */
+            size_t remaining = len;
+            buf.resize(std::min<size_t>(len, MAX_READ_SIZE), false);
+            while (remaining > 0) {
+                const size_t s = std::min(remaining, buf.size());
+                sock.read(buf.data(), s);
+                remaining -= s;
+            }
+            sendSimpleReply(sock, ERR_PERM, handle);
+            break;
+        }
+        case CMD_DISC:
+            return;
+        case CMD_FLUSH:
+            sendSimpleReply(sock, 0, handle);
+            break;
+        default:
+            sendSimpleReply(sock, ERR_INVAL, handle);
+        }
+    }
+}
+
+/**
+ * The read range is extended to be aligned to LOGICAL_BLOCK_SIZE.
+ */
+void ReadOnlyServer::read(uint64_t offset, uint32_t size, AlignedArray &buf)
+{
+    const uint64_t bgn = offset / LOGICAL_BLOCK_SIZE * LOGICAL_BLOCK_SIZE;
+    const uint64_t end = (offset + size + LOGICAL_BLOCK_SIZE - 1) / LOGICAL_BLOCK_SIZE * LOGICAL_BLOCK_SIZE;
+    buf.resize(end - bgn, false);
+    readF_(bgn, end - bgn, buf.data());
+}
+
+}} // namespace walb::nbd
@@ -0,0 +1,110 @@
+#pragma once
+/**
+ * @file
+ * @brief Read-only NBD server.
+ */
+#include <string>
+#include <functional>
+#include <atomic>
+#include "cybozu/socket.hpp"
+#include "walb_types.hpp"
+#include "constant.hpp"
+
+namespace walb {
+namespace nbd {
+
+const uint64_t NBDMAGIC = 0x4e42444d41474943ULL;
+const uint64_t IHAVEOPT = 0x49484156454f5054ULL;
+const uint64_t OPT_REPLY_MAGIC = 0x3e889045565a9ULL;
+const uint32_t REQUEST_MAGIC = 0x25609513;
+const uint32_t SIMPLE_REPLY_MAGIC = 0x67446698;
+
+/* Handshake flags. */
+const uint16_t FLAG_FIXED_NEWSTYLE = 1 << 0;
+const uint16_t FLAG_NO_ZEROES = 1 << 1;
+
+/* Transmission flags. */
+const uint16_t FLAG_HAS_FLAGS = 1 << 0;
+const uint16_t FLAG_READ_ONLY = 1 << 1;
+const uint16_t FLAG_CAN_MULTI_CONN = 1 << 8;
+
+/* Options. */
+const uint32_t OPT_EXPORT_NAME = 1;
+const uint32_t OPT_ABORT = 2;
+const uint32_t OPT_LIST = 3;
+const uint32_t OPT_INFO = 6;
+const uint32_t OPT_GO = 7;
+
+/* Option replies. */
+const uint32_t REP_ACK = 1;
+const uint32_t REP_SERVER = 2;
+const uint32_t REP_INFO = 3;
+const uint32_t REP_ERR_UNSUP = (1U << 31) + 1;
+const uint32_t REP_ERR_INVALID = (1U << 31) + 3;
+const uint32_t REP_ERR_UNKNOWN = (1U << 31) + 6;
+
+const uint16_t INFO_EXPORT = 0;
+
+/* Commands. */
+const uint16_t CMD_READ = 0;
+const uint16_t CMD_WRITE = 1;
+const uint16_t CMD_DISC = 2;
+const uint16_t CMD_FLUSH = 3;
+
+/* Errors in replies. */
+const uint32_t ERR_PERM = 1;
+const uint32_t ERR_IO = 5;
+const uint32_t ERR_INVAL = 22;
+
+const uint32_t MAX_READ_SIZE = 32 * MEBI;
+
+/**
+ * NBD server exporting an image read-only.
+ * Only the fixed newstyle negotiation and simple replies are supported,
+ * which the kernel nbd client and qemu-nbd use.
+ *
+ * Each connection is served by a thread in order of the requests.
+ */
+class ReadOnlyServer
+{
+public:
+    /**
+     * @offset [byte]
+     * @size [byte]
+     * offset and size are multiples of LOGICAL_BLOCK_SIZE.
+     * This will be called by multiple threads.
+     */
+    using ReadFunc = std::function<void(uint64_t offset, size_t size, void *data)>;
+    using ShouldStopFunc = std::function<bool()>;
+private:
+    std::string name_;
+    uint64_t sizeB_;
+    ReadFunc readF_;
+    std::atomic<size_t> nrConn_;
+public:
+    ReadOnlyServer(const std::string &name, uint64_t sizeB, const ReadFunc &readF)
+        : name_(name), sizeB_(sizeB), readF_(readF), nrConn_(0) {}
+    /**
+     * Accept connections until shouldStop() returns true.
+     * It will be checked every second.
+     * addr: address to listen on. Empty means all the interfaces.
+     *   There is no authentication, so the export is readable by anyone who can connect.
+     */
+    void run(const std::string &addr, uint16_t port, size_t maxConnections, const ShouldStopFunc &shouldStop);
+    /**
+     * Serve an accepted connection.
+     */
+    void serve(cybozu::Socket &sock, const ShouldStopFunc &shouldStop);
+    size_t getNrConnections() const { return nrConn_; }
+private:
+    /**
+     * RETURN:
+     *   false if the client aborted.
+     */
+    bool negotiate(cybozu::Socket &sock);
+    void transmit(cybozu::Socket &sock, const ShouldStopFunc &shouldStop);
+    void sendExportInfo(cybozu::Socket &sock, uint32_t opt);
+    void read(uint64_t offset, uint32_t size, AlignedArray &buf);
+};
+
+}} // namespace walb::nbd
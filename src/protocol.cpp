@@ -27,9 +27,17 @@ std::vector<cybozu::SocketAddr> parseMultiSocketAddr(const std::string &multiAdd
 namespace protocol {
 
 
-std::string run1stNegotiateAsClient(
+namespace protocol_local {
+
+const char *const badProtocolMsg = "bad protocol";
+
+/**
+ * RETURN:
+ *   msgOk or error message from the server.
+ */
+std::string run1stNegotiateAsClientDetail(
     cybozu::Socket &sock,
-    const std::string &clientId, const std::string &protocolName)
+    const std::string &clientId, const std::string &protocolName, std::string &serverId)
 {
     packet::Packet pkt(sock);
     pkt.write(clientId);
@@ -37,17 +45,42 @@ std::string run1stNegotiateAsClient(
     packet::Version ver(sock);
     ver.send();
     pkt.flush();
-    std::string serverId;
     pkt.read(serverId);
 
     ProtocolLogger logger(clientId, serverId);
     std::string msg;
     pkt.read(msg);
+    return msg;
+}
+
+} // namespace protocol_local
+
+
+std::string run1stNegotiateAsClient(
+    cybozu::Socket &sock,
+    const std::string &clientId, const std::string &protocolName)
+{
+    std::string serverId;
+    const std::string msg = protocol_local::run1stNegotiateAsClientDetail(
+        sock, clientId, protocolName, serverId);
     if (msg != msgOk) throw cybozu::Exception(__func__) << msg;
     return serverId;
 }
 
 
+bool run1stNegotiateAsClientIfSupported(
+    cybozu::Socket &sock,
+    const std::string &clientId, const std::string &protocolName, std::string &serverId)
+{
+    const std::string msg = protocol_local::run1stNegotiateAsClientDetail(
+        sock, clientId, protocolName, serverId);
+    if (msg == msgOk) return true;
+    /* The message is made by findServerHandler() of the server. */
+    if (msg.find(protocol_local::badProtocolMsg) != std::string::npos) return false;
+    throw cybozu::Exception(__func__) << msg;
+}
+
+
 void run1stNegotiateAsServer(
     cybozu::Socket &sock, const std::string &serverId,
     std::string &protocolName, std::string &clientId)
@@ -139,7 +172,7 @@ ServerHandler findServerHandler(
     }
     Str2ServerHandler::const_iterator it = handlers.find(protocolName);
     if (it == handlers.cend()) {
-        throw cybozu::Exception(__func__) << "bad protocol" << protocolName;
+        throw cybozu::Exception(__func__) << protocol_local::badProtocolMsg << protocolName;
     }
     return it->second;
 }
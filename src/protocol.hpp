@@ -77,6 +77,8 @@ const char *const disableSnapshotCN = "disable-snapshot";
 const char *const enableSnapshotCN = "enable-snapshot";
 const char *const dbgDumpLogpackHeaderCN = "dbg-dump-logpack-header";
 const char *const setFullScanBpsCN = "set-full-scan-bps";
+const char *const setWlogBpsCN = "set-wlog-bps";
+const char *const setWlogCmprCN = "set-wlog-cmpr";
 const char *const gcDiffCN = "gc-diff";
 const char *const debugCN = "debug";
 
@@ -120,10 +122,14 @@ const char *const getHandlerStatTN = "handler-stat";
  * Internal protocol name.
  */
 const char *const dirtyFullSyncPN = "dirty-full-sync";
+const char *const dirtyFullSyncMultiPN = "dirty-full-sync-multi";
+const char *const dirtyFullSyncStreamPN = "dirty-full-sync-stream";
 const char *const dirtyHashSyncPN = "dirty-hash-sync";
 const char *const wlogTransferPN = "wlog-transfer";
+const char *const wlogTransferCmprPN = "wlog-transfer-cmpr";
 const char *const wdiffTransferPN = "wdiff-transfer";
 const char *const replSyncPN = "repl-sync";
+const char *const replSyncMultiPN = "repl-sync-multi";
 const char *const gatherLatestSnapPN = "gather-latest-snap";
 
 
@@ -142,6 +148,18 @@ std::string run1stNegotiateAsClient(
     cybozu::Socket &sock,
     const std::string &clientId, const std::string &protocolName);
 
+/**
+ * Servers of older versions do not know newer protocols.
+ * Use this to negotiate an optional feature by its protocol name
+ * and fall back to another protocol on a new connection.
+ *
+ * RETURN:
+ *   false if the server does not know the protocol.
+ */
+bool run1stNegotiateAsClientIfSupported(
+    cybozu::Socket &sock,
+    const std::string &clientId, const std::string &protocolName, std::string &serverId);
+
 /**
  * Parameters for commands as a client.
  */
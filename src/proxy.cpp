@@ -231,6 +231,8 @@ void c2pClearVolServer(protocol::ServerParams &p)
 }
 
 
+namespace proxy_local {
+
 /**
  * protocol
  *   recv parameters.
@@ -239,14 +241,20 @@ void c2pClearVolServer(protocol::ServerParams &p)
  *     pbs (uint32_t)
  *     salt (uint32_t)
  *     sizeLb (uint64_t)
+ *     maxLogSizePb (uint64_t)
+ *     cmpr (walb::CompressOpt): codec and level of wlog data.
+ *                               only for wlog-transfer-cmpr protocol.
  *   send "ok" or error message.
  *   recv wlog data
  *   recv diff (walb::MetaDiff)
  *   send ack.
  *
  * State transition: Started --> WlogRecv --> Started
+ *
+ * wlog-transfer protocol does not send cmpr and uses snappy always
+ * so that it works with storage servers of older versions.
  */
-void s2pWlogTransferServer(protocol::ServerParams &p)
+void recvWlogTransfer(protocol::ServerParams &p, bool recvsCmpr)
 {
     const char *const FUNC = __func__;
     ProtocolLogger logger(gp.nodeId, p.clientId);
@@ -254,6 +262,7 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
     cybozu::Uuid uuid;
     uint32_t pbs, salt;
     uint64_t volSizeLb, maxLogSizePb;
+    CompressOpt cmpr;
 
     packet::Packet pkt(p.sock);
     pkt.read(volId);
@@ -262,7 +271,8 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
     pkt.read(salt);
     pkt.read(volSizeLb);
     pkt.read(maxLogSizePb);
-    LOGs.debug() << "recv" << volId << uuid << pbs << salt << volSizeLb << maxLogSizePb;
+    if (recvsCmpr) pkt.read(cmpr);
+    LOGs.debug() << "recv" << volId << uuid << pbs << salt << volSizeLb << maxLogSizePb << cmpr;
 
     /* Decide to receive ok or not. */
     ProxyVolState &volSt = getProxyVolState(volId);
@@ -296,10 +306,11 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
     if (savesWlog) wlogTmpFile.prepare(volInfo.getReceivedDir().str());
 #if 0 /* deprecated */
     const bool ret = proxy_local::recvWlogAndWriteDiff(
-        p.sock, tmpFile.fd(), uuid, pbs, salt, volSt.stopState, gp.ps, wlogTmpFile.fd());
+        p.sock, tmpFile.fd(), uuid, pbs, salt, cmpr.type, volSt.stopState, gp.ps, wlogTmpFile.fd());
 #else /* QQQ */
     const bool ret = proxy_local::recvWlogAndWriteDiff2(
-        p.sock, tmpFile.fd(), uuid, pbs, salt, volSt.stopState, gp.ps, wlogTmpFile.fd());
+        p.sock, tmpFile.fd(), uuid, pbs, salt, cmpr.type, volSt.stopState, gp.ps, wlogTmpFile.fd(),
+        volInfo.getReceivedDir().str());
 #endif
     if (!ret) {
         logger.warn() << FUNC << "force stopped wlog receiving" << volId;
@@ -345,6 +356,20 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
     logger.debug() << "wlog-transfer succeeded" << volId << elapsed;
 }
 
+} // namespace proxy_local
+
+
+void s2pWlogTransferServer(protocol::ServerParams &p)
+{
+    proxy_local::recvWlogTransfer(p, false);
+}
+
+
+void s2pWlogTransferCmprServer(protocol::ServerParams &p)
+{
+    proxy_local::recvWlogTransfer(p, true);
+}
+
 
 void ProxyWorker::setupMerger(DiffMerger& merger, MetaDiffVec& diffV, MetaDiff& mergedDiff,
                               const ProxyVolInfo& volInfo, const std::string& archiveName)
@@ -386,7 +411,8 @@ retry:
             fileV.push_back(std::move(file));
         }
     }
-    merger.setMaxCacheSize(INDEXED_DIFF_CACHE_SIZE);
+    merger.setPassThroughCompressed(true);
+    merger.setReadAhead(INDEXED_DIFF_READ_AHEAD_NR);
     merger.addWdiffs(std::move(fileV));
     merger.prepare();
 }
@@ -674,6 +700,10 @@ StrVec getAllStatusAsStrVec()
     ret.push_back(fmt("maxForegroundTasks %zu", gp.maxForegroundTasks));
     ret.push_back(fmt("maxBackgroundTasks %zu", gp.maxBackgroundTasks));
     ret.push_back(fmt("maxConversionMb %zu", gp.maxConversionMb));
+    ret.push_back(fmt("wlogUncompressThreads %zu", gp.wlogUncompressThreads));
+    ret.push_back(fmt("wdiffCompressThreads %zu", gp.wdiffCompressThreads));
+    ret.push_back(fmt("compactWdiffIndex %d", gp.compactWdiffIndex));
+    ret.push_back(fmt("indexedDiffCache %s", getSharedIndexedDiffCache().getStat().str().c_str()));
     ret.push_back(fmt("socketTimeout %zu", gp.socketTimeout));
     ret.push_back(fmt("keepAlive %s", gp.keepAliveParams.toStr().c_str()));
 
@@ -978,14 +1008,15 @@ void deleteArchiveInfo(const std::string &volId, const std::string &archiveName)
  *   false if force stopped.
  */
 bool recvWlogAndWriteDiff(
-    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
+    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt, int cmprType,
     const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd)
 {
     DiffMemory diffMem;
     diffMem.header().setUuid(uuid);
 
     LogPackHeader packH(pbs, salt);
-    WlogReceiver receiver(sock, pbs, salt);
+    WlogReceiver receiver(sock, pbs, salt, cmprType);
+    receiver.start(gp.wlogUncompressThreads);
 
     bool isWlogHeaderWritten = false;
     std::unique_ptr<WlogWriter> wlogW;
@@ -1009,11 +1040,10 @@ bool recvWlogAndWriteDiff(
             WlogRecord &lrec = packH.record(i);
             receiver.popIo(lrec, buf);
             if (wlogW) wlogW->writePackIo(buf);
-            DiffRecord drec;
-            if (convertLogToDiff(lrec, buf.data(), drec)) {
-                if (!drec.isNormal()) buf.clear();
-                diffMem.add(drec, std::move(buf));
-            }
+            convertLogToDiffSplittingZeroRuns<DiffRecord>(
+                lrec, std::move(buf), [&](const DiffRecord &drec, AlignedArray &&data) {
+                    diffMem.add(drec, std::move(data));
+                });
             buf.clear();
         }
     }
@@ -1024,23 +1054,28 @@ bool recvWlogAndWriteDiff(
 
 /**
  * Use IndexedDiffWriter
+ * Index runs will be put in tmpDir while receiving large wlogs.
  */
 bool recvWlogAndWriteDiff2(
-    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd)
+    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt, int cmprType,
+    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd, const std::string &tmpDir)
 {
     unusedVar(wlogFd);
 
     IndexedDiffWriter writer;
     writer.setFd(fd);
+    writer.setIndexSpill(tmpDir, DIFF_INDEX_SPILL_SIZE);
+    writer.setCompactIndex(gp.compactWdiffIndex);
 
     DiffFileHeader header;
     header.setUuid(uuid);
     header.type = WALB_DIFF_TYPE_INDEXED;
     writer.writeHeader(header);
+    writer.start(gp.wdiffCompressThreads);
 
     LogPackHeader packH(pbs, salt);
-    WlogReceiver receiver(sock, pbs, salt);
+    WlogReceiver receiver(sock, pbs, salt, cmprType);
+    receiver.start(gp.wlogUncompressThreads);
 
     while (receiver.popHeader(packH)) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
@@ -1050,10 +1085,10 @@ bool recvWlogAndWriteDiff2(
         for (size_t i = 0; i < packH.header().n_records; i++) {
             WlogRecord &lrec = packH.record(i);
             receiver.popIo(lrec, data);
-            IndexedDiffRecord drec;
-            if (convertLogToDiff(lrec, data.data(), drec)) {
-                writer.compressAndWriteDiff(drec, data.data());
-            }
+            convertLogToDiffSplittingZeroRuns<IndexedDiffRecord>(
+                lrec, std::move(data), [&](const IndexedDiffRecord &drec, AlignedArray &&runData) {
+                    writer.compressAndWriteDiff(drec, std::move(runData));
+                });
         }
     }
     writer.finalize();
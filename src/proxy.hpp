@@ -162,6 +162,9 @@ struct ProxySingleton
     size_t maxForegroundTasks;
     size_t maxBackgroundTasks;
     size_t maxConversionMb;
+    size_t wlogUncompressThreads;
+    size_t wdiffCompressThreads;
+    bool compactWdiffIndex;
     size_t socketTimeout;
     KeepAliveParams keepAliveParams;
     bool allowExec;
@@ -255,6 +258,7 @@ void c2pStopServer(protocol::ServerParams &p);
 void c2pArchiveInfoServer(protocol::ServerParams &p);
 void c2pClearVolServer(protocol::ServerParams &p);
 void s2pWlogTransferServer(protocol::ServerParams &p);
+void s2pWlogTransferCmprServer(protocol::ServerParams &p);
 void c2pResizeServer(protocol::ServerParams &p);
 void c2pKickServer(protocol::ServerParams &p);
 
@@ -272,11 +276,11 @@ void addArchiveInfo(const std::string &volId, const std::string &archiveName, co
 void deleteArchiveInfo(const std::string &volId, const std::string &archiveName);
 
 bool recvWlogAndWriteDiff(
-    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
+    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt, int cmprType,
     const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd);
 bool recvWlogAndWriteDiff2(
-    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd);
+    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt, int cmprType,
+    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd, const std::string &tmpDir);
 
 
 inline void getState(protocol::GetCommandParams &p)
@@ -347,6 +351,7 @@ const protocol::Str2ServerHandler proxyHandlerMap = {
 #endif
     // protocols.
     { wlogTransferPN, s2pWlogTransferServer },
+    { wlogTransferCmprPN, s2pWlogTransferCmprServer },
 };
 
 } // namespace walb
@@ -0,0 +1,167 @@
+#pragma once
+#include "meta.hpp"
+#include "walb_util.hpp"
+#include "cybozu/serializer.hpp"
+#include <sstream>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+namespace walb {
+
+/**
+ * Progress of a shard of a restore.
+ * All the diffs before metaSt have been applied to [bgnLb, endLb),
+ * and the diffs of batchV from metaSt have been applied to [bgnLb, progressLb).
+ * batchV is empty between batches.
+ */
+struct RestoreShardState
+{
+    uint64_t bgnLb;
+    uint64_t endLb;
+    MetaState metaSt;
+    uint64_t progressLb;
+    bool isDone;
+    MetaDiffVec batchV;
+
+    template <typename InputStream>
+    void load(InputStream &is) {
+        cybozu::load(bgnLb, is);
+        cybozu::load(endLb, is);
+        cybozu::load(metaSt, is);
+        cybozu::load(progressLb, is);
+        cybozu::load(isDone, is);
+        batchV.clear();
+        cybozu::load(batchV, is);
+        metaSt.verify();
+    }
+    template <typename OutputStream>
+    void save(OutputStream &os) const {
+        cybozu::save(os, bgnLb);
+        cybozu::save(os, endLb);
+        cybozu::save(os, metaSt);
+        cybozu::save(os, progressLb);
+        cybozu::save(os, isDone);
+        cybozu::save(os, batchV);
+    }
+    std::string str() const {
+        std::stringstream ss;
+        ss << "[" << bgnLb << "," << endLb << ") " << metaSt << " " << progressLb
+           << " " << batchV.size() << (isDone ? " done" : "");
+        return ss.str();
+    }
+    friend inline std::ostream& operator<<(std::ostream& os, const RestoreShardState& shard) {
+        os << shard.str();
+        return os;
+    }
+};
+
+/**
+ * For restore resume.
+ * The shards cover the whole temporary snapshot and are applied independently.
+ *
+ * This is saved as <gid>.restore in the volume directory while restoring the gid.
+ * A force-stopped restore keeps the file and its temporary snapshot to resume.
+ * They are removed when the restore completes or fails,
+ * or by del-restored of the gid, reset-vol, and clear-vol.
+ */
+struct RestoreState
+{
+    MetaState metaSt; // state of the snapshot origin.
+    uint64_t sizeLb;
+    std::vector<RestoreShardState> shardV;
+    uint64_t timestamp;
+
+    template <typename InputStream>
+    void load(InputStream &is) {
+        cybozu::load(metaSt, is);
+        cybozu::load(sizeLb, is);
+        shardV.clear();
+        cybozu::load(shardV, is);
+        cybozu::load(timestamp, is);
+        metaSt.verify();
+    }
+    template <typename OutputStream>
+    void save(OutputStream &os) const {
+        cybozu::save(os, metaSt);
+        cybozu::save(os, sizeLb);
+        cybozu::save(os, shardV);
+        cybozu::save(os, timestamp);
+    }
+    /**
+     * The saved progress is usable if the restore starts from the same state with the same snapshot size.
+     * The progress in a shard needs the batch of diffs being applied.
+     */
+    bool canResume(const MetaState &st0, uint64_t sizeLb0) const {
+        if (metaSt != st0 || sizeLb != sizeLb0 || shardV.empty()) return false;
+        uint64_t lb = 0;
+        for (const RestoreShardState &shard : shardV) {
+            if (shard.bgnLb != lb || shard.endLb <= shard.bgnLb) return false;
+            if (shard.progressLb < shard.bgnLb || shard.endLb < shard.progressLb) return false;
+            if (shard.batchV.empty()) {
+                if (shard.progressLb != shard.bgnLb) return false;
+            } else {
+                if (!canApply(shard.metaSt.snapB, shard.batchV)) return false;
+            }
+            lb = shard.endLb;
+        }
+        return lb == UINT64_MAX;
+    }
+    std::string str() const {
+        std::stringstream ss;
+        ss << metaSt << " " << sizeLb << " " << shardV.size() << " " << util::timeToPrintable(timestamp);
+        return ss.str();
+    }
+    friend inline std::ostream& operator<<(std::ostream& os, const RestoreState& restoreSt) {
+        os << restoreSt.str();
+        return os;
+    }
+};
+
+inline std::string getRestoreStateFileName(uint64_t gid)
+{
+    return cybozu::util::formatString("%" PRIu64 ".restore", gid);
+}
+
+inline bool isRestoreDone(const MetaState& st, uint64_t gid)
+{
+    return !st.isApplying && st.snapB.isClean() && st.snapB.gidB == gid;
+}
+
+/**
+ * Max number of diffs opened by each of nrThreads restore threads at once.
+ * 0 means unlimited as maxOpenDiffs.
+ */
+inline size_t getRestoreMaxOpenDiffs(size_t maxOpenDiffs, size_t nrThreads)
+{
+    assert(nrThreads > 0);
+    if (maxOpenDiffs == 0) return 0;
+    return std::max<size_t>(maxOpenDiffs / nrThreads, 1);
+}
+
+/**
+ * Split the address space of a restored snapshot into shards.
+ * Shards are aligned to alignLb and there are nrShards of them at most.
+ * The last shard has no end to detect IOs out of the snapshot.
+ */
+inline std::vector<RestoreShardState> makeRestoreShards(
+    const MetaState& st0, uint64_t gid, uint64_t sizeLb, size_t nrShards, uint64_t alignLb)
+{
+    assert(nrShards > 0);
+    assert(alignLb > 0);
+    const uint64_t unitNr = std::max<uint64_t>((sizeLb + alignLb - 1) / alignLb, 1);
+    const uint64_t nr = std::min<uint64_t>(nrShards, unitNr);
+    std::vector<RestoreShardState> shardV(nr);
+    for (uint64_t i = 0; i < nr; i++) {
+        RestoreShardState& shard = shardV[i];
+        shard.bgnLb = unitNr * i / nr * alignLb;
+        shard.endLb = (i + 1 == nr ? UINT64_MAX : unitNr * (i + 1) / nr * alignLb);
+        shard.metaSt = st0;
+        shard.progressLb = shard.bgnLb;
+        shard.isDone = isRestoreDone(st0, gid);
+    }
+    return shardV;
+}
+
+} // namespace walb
@@ -81,6 +81,7 @@ void c2sClearVolServer(protocol::ServerParams &p)
 
         StorageVolInfo volInfo(gs.baseDirStr, volId);
         volInfo.clear();
+        storage_local::removeWlogFlows(volId);
         tran.commit(sClear);
         pkt.writeFin(msgOk);
         logger.info() << "clearVol succeeded" << volId;
@@ -483,6 +484,51 @@ void c2sSetFullScanBpsServer(protocol::ServerParams &p)
 }
 
 
+void c2sSetWlogBpsServer(protocol::ServerParams &p)
+{
+    const char *const FUNC = __func__;
+    ProtocolLogger logger(gs.nodeId, p.clientId);
+    packet::Packet pkt(p.sock);
+
+    try {
+        const SetWlogBpsParam param = parseSetWlogBpsParam(protocol::recvStrVec(p.sock, 2, FUNC));
+        StorageSingleton& g = getStorageGlobal();
+        g.wlogReadScheduler.setBytesPerSec(param.readBps);
+        g.wlogSendScheduler.setBytesPerSec(param.sendBps);
+        pkt.writeFin(msgOk);
+        logger.info() << "set-wlog-bps" << param.readBps << param.sendBps;
+    } catch (std::exception &e) {
+        logger.error() << e.what();
+        pkt.write(e.what());
+    }
+}
+
+
+void c2sSetWlogCmprServer(protocol::ServerParams &p)
+{
+    const char *const FUNC = __func__;
+    ProtocolLogger logger(gs.nodeId, p.clientId);
+    packet::Packet pkt(p.sock);
+
+    try {
+        const SetWlogCmprParam param = parseSetWlogCmprParam(protocol::recvStrVec(p.sock, 2, FUNC));
+        const std::string &volId = param.volId;
+
+        StorageVolState &volSt = getStorageVolState(volId);
+        UniqueLock ul(volSt.mu);
+        if (volSt.sm.get() == sClear) throw cybozu::Exception(FUNC) << "not found" << volId;
+
+        StorageVolInfo volInfo(gs.baseDirStr, volId);
+        volInfo.setWlogCmpr(param.cmpr);
+        pkt.writeFin(msgOk);
+        logger.info() << "set-wlog-cmpr" << volId << param.cmpr;
+    } catch (std::exception &e) {
+        logger.error() << e.what();
+        pkt.write(e.what());
+    }
+}
+
+
 void c2sDumpLogpackHeaderServer(protocol::ServerParams &p)
 {
     const char *const FUNC = __func__;
@@ -536,6 +582,27 @@ void c2sDebugServer(protocol::ServerParams &p)
 namespace storage_local {
 
 
+/**
+ * The default is snappy with wlogCompressThreads.
+ */
+CompressOpt getWlogCmpr(const StorageVolInfo &volInfo)
+{
+    CompressOpt cmpr(::WALB_DIFF_CMPR_SNAPPY, 0, uint8_t(std::min<size_t>(gs.wlogCompressThreads, UINT8_MAX)));
+    volInfo.getWlogCmpr(cmpr);
+    return cmpr;
+}
+
+
+/**
+ * Proxies of older versions know wlog-transfer protocol only,
+ * which always uses snappy.
+ */
+bool isDefaultWlogCmprType(const CompressOpt &cmpr)
+{
+    return cmpr.type == ::WALB_DIFF_CMPR_SNAPPY;
+}
+
+
 void startMonitoring(const std::string& wdevPath, const std::string& volId)
 {
     const char *const FUNC = __func__;
@@ -555,12 +622,21 @@ void stopMonitoring(const std::string& wdevPath, const std::string& volId)
     const std::string wdevName = device::getWdevNameFromWdevPath(wdevPath);
     g.logDevMonitor.del(wdevName);
     g.delWdevName(wdevName);
+    removeWlogFlows(volId);
     g.taskQueue.remove([&](const std::string &volId2) {
             return volId == volId2;
         });
 }
 
 
+void removeWlogFlows(const std::string& volId)
+{
+    StorageSingleton &g = getStorageGlobal();
+    g.wlogReadScheduler.removeFlow(volId);
+    g.wlogSendScheduler.removeFlow(volId);
+}
+
+
 StrVec getAllStatusAsStrVec()
 {
     StrVec v;
@@ -570,12 +646,23 @@ StrVec getAllStatusAsStrVec()
     v.push_back(fmt("nodeId %s", gs.nodeId.c_str()));
     v.push_back(fmt("baseDir %s", gs.baseDirStr.c_str()));
     v.push_back(fmt("maxWlogSendMb %" PRIu64, gs.maxWlogSendMb));
+    v.push_back(fmt("wlogReadQueueSize %zu", gs.wlogReadQueueSize));
+    v.push_back(fmt("wlogSendQueueSize %zu", gs.wlogSendQueueSize));
+    v.push_back(fmt("wlogCompressThreads %zu", gs.wlogCompressThreads));
+    v.push_back(fmt("wlogReadAheadAdaptive %d", gs.wlogReadAheadAdaptive));
+    if (gs.wlogReadAheadAdaptive) {
+        v.push_back(fmt("wlogReadAheadMax %s", gs.wlogReadAheadMax.str().c_str()));
+    }
+    v.push_back(fmt("wlogReadAheadMemory %s", gs.wlogReadAheadBudget.str().c_str()));
+    v.push_back(fmt("wlogReadBandwidth %s", gs.wlogReadScheduler.str().c_str()));
+    v.push_back(fmt("wlogSendBandwidth %s", gs.wlogSendScheduler.str().c_str()));
     v.push_back(fmt("delaySecForRetry %zu", gs.delaySecForRetry));
     v.push_back(fmt("maxConnections %zu", gs.maxConnections));
     v.push_back(fmt("maxForegroundTasks %zu", gs.maxForegroundTasks));
     v.push_back(fmt("maxBackgroundTasks %zu", gs.maxBackgroundTasks));
     v.push_back(fmt("socketTimeout %zu", gs.socketTimeout));
     v.push_back(fmt("keepAlive %s", gs.keepAliveParams.toStr().c_str()));
+    v.push_back(fmt("aioBackend %s", cybozu::aio::aioBackendToStr(cybozu::aio::getDefaultAioBackend())));
 
     v.push_back("-----Archive-----");
     v.push_back(fmt("host %s:%u", gs.archive.toStr().c_str(), gs.archive.getPort()));
@@ -637,8 +724,16 @@ StrVec getVolStatusAsStrVec(const std::string &volId, bool isVerbose)
 
     v.push_back(formatActions("action", volSt.ac, allActionVec));
     v.push_back(fmt("stopState %s", stopStateToStr(StopState(volSt.stopState.load()))));
+    if (!volSt.wlogPipelineStat.empty()) {
+        v.push_back(fmt("wlogPipeline %s", volSt.wlogPipelineStat.c_str()));
+        v.push_back(fmt("wlogReadAhead %s", volSt.wlogReadAhead.str().c_str()));
+    }
+    if (volSt.wlogReadAheadTuner) {
+        v.push_back(fmt("wlogReadAheadTuner %s", volSt.wlogReadAheadTuner->str().c_str()));
+    }
     StorageVolInfo volInfo(gs.baseDirStr, volId);
     v.push_back(fmt("isUnderMonitoring %d", isUnderMonitoring(volInfo.getWdevPath())));
+    v.push_back(fmt("wlogCmpr %s", getWlogCmpr(volInfo).str().c_str()));
     for (std::string& s : volInfo.getStatusAsStrVec(isVerbose)) {
         v.push_back(std::move(s));
     }
@@ -687,10 +782,24 @@ void backupClient(protocol::ServerParams &p, bool isFull)
     const cybozu::SocketAddr& archive = gs.archive;
     {
         cybozu::Socket aSock;
-        util::connectWithTimeout(aSock, archive, gs.socketTimeout);
-        gs.setSocketParams(aSock);
-        const std::string &protocolName = isFull ? dirtyFullSyncPN : dirtyHashSyncPN;
-        archiveId = protocol::run1stNegotiateAsClient(aSock, gs.nodeId, protocolName);
+        bool isMulti = false;
+        if (isFull && gs.fullSyncStreams > 1) {
+            util::connectWithTimeout(aSock, archive, gs.socketTimeout);
+            gs.setSocketParams(aSock);
+            isMulti = protocol::run1stNegotiateAsClientIfSupported(
+                aSock, gs.nodeId, dirtyFullSyncMultiPN, archiveId);
+            if (!isMulti) {
+                logger.warn() << FUNC << "archive does not support" << dirtyFullSyncMultiPN
+                              << "use a single stream" << volId << archiveId;
+                aSock.close();
+            }
+        }
+        if (!isMulti) {
+            util::connectWithTimeout(aSock, archive, gs.socketTimeout);
+            gs.setSocketParams(aSock);
+            const std::string &protocolName = isFull ? dirtyFullSyncPN : dirtyHashSyncPN;
+            archiveId = protocol::run1stNegotiateAsClient(aSock, gs.nodeId, protocolName);
+        }
         packet::Packet aPkt(aSock);
         aPkt.write(storageHT);
         aPkt.write(volId);
@@ -718,6 +827,7 @@ void backupClient(protocol::ServerParams &p, bool isFull)
         volInfo.resetWlog(gidB);
         const cybozu::Uuid uuid = volInfo.getUuid();
         aPkt.write(uuid);
+        if (isMulti) aPkt.write(gs.fullSyncStreams);
         aPkt.flush();
         packet::Ack(aSock).recv();
         monitorMgr.start();
@@ -725,9 +835,29 @@ void backupClient(protocol::ServerParams &p, bool isFull)
         // (7) in storage-daemon.txt
         logger.info() << (isFull ? dirtyFullSyncPN : dirtyHashSyncPN)
                       << "started" << volId << archiveId;
-        if (isFull) {
+        if (isMulti) {
+            uint64_t sessionId;
+            FullSyncRangeVec rangeV;
+            aPkt.read(sessionId);
+            aPkt.read(rangeV);
+            if (!isValidFullSyncRange(rangeV, sizeLb)) {
+                throw cybozu::Exception(FUNC) << "bad ranges" << volId << sizeLb << rangeV.size();
+            }
+            logger.debug() << FUNC << "full sync ranges" << volId << sessionId << rangeV.size();
+            const FullSyncConnectFunc connectF = [&](cybozu::Socket &sock) {
+                util::connectWithTimeout(sock, archive, gs.socketTimeout);
+                gs.setSocketParams(sock);
+                protocol::run1stNegotiateAsClient(sock, gs.nodeId, dirtyFullSyncStreamPN);
+            };
             const std::string bdevPath = volInfo.getWdevPath();
-            if (!dirtyFullSyncClient(aPkt, bdevPath, 0, sizeLb, bulkLb, volSt.stopState, gs.ps, gs.fullScanLbPerSec)) {
+            if (!dirtyFullSyncClientMulti(aPkt, connectF, sessionId, rangeV, bdevPath, bulkLb,
+                                          volSt.stopState, gs.ps, gs.fullScanLbPerSec)) {
+                logger.warn() << FUNC << "force stopped" << volId;
+                return;
+            }
+        } else if (isFull) {
+            if (!dirtyFullSyncClient(aPkt, volInfo.getWdevPath(), 0, sizeLb, bulkLb,
+                                     volSt.stopState, gs.ps, gs.fullScanLbPerSec)) {
                 logger.warn() << FUNC << "force stopped" << volId;
                 return;
             }
@@ -805,6 +935,74 @@ void dumpLogPackHeader(const std::string &volId, uint64_t lsid, const LogPackHea
 }
 
 
+/**
+ * RETURN:
+ *   false if the logpack at the lsid must be sent at the next time.
+ */
+bool readWlogPackHeader(device::AsyncWldevReader &reader, LogPackHeader &packH,
+                        const std::string &volId, uint64_t lsid, uint64_t maxWlogSendPb, uint64_t lsidLimit)
+{
+    const char *const FUNC = __func__;
+    if (!readLogPackHeader(reader, packH, lsid)) {
+        dumpLogPackHeader(volId, lsid, packH); // for analysis.
+        throw cybozu::Exception(FUNC) << "invalid logpack header" << volId << lsid;
+    }
+    verifyMaxWlogSendPbIsNotTooSmall(maxWlogSendPb, packH.header().total_io_size + 1, FUNC);
+    return packH.nextLogpackLsid() <= lsidLimit;
+}
+
+
+/**
+ * Refer the reader's buffer directly if possible.
+ * The data will not be verified here. WlogSender will do it.
+ */
+void readWlogIo(device::AsyncWldevReader &reader, const LogPackHeader &packH, size_t idx, CompressedData &cd)
+{
+    const WlogRecord &rec = packH.record(idx);
+    if (!rec.hasData()) return;
+    const size_t size = rec.ioSizePb(packH.pbs()) * packH.pbs();
+    std::shared_ptr<const char> lent = reader.lend(size);
+    if (lent) {
+        cd.setLent(std::move(lent), size);
+        return;
+    }
+    AlignedArray buf;
+    const bool doVerify = false;
+    readLogIo(reader, packH, idx, buf, doVerify);
+    cd.setUncompressed(std::move(buf));
+}
+
+
+/**
+ * Read-ahead parameters of the log device for the next wlog-transfer of a volume.
+ * maxBufferSize: see WldevReadAheadTuner::get().
+ */
+device::WldevReadAheadParams getWlogReadAhead(StorageVolState &volSt, size_t maxBufferSize = SIZE_MAX)
+{
+    if (!gs.wlogReadAheadAdaptive) return WldevReadAheadTuner::getDefaultParams();
+    UniqueLock ul(volSt.mu);
+    if (!volSt.wlogReadAheadTuner) {
+        volSt.wlogReadAheadTuner.reset(new WldevReadAheadTuner(gs.wlogReadAheadMax));
+    }
+    return volSt.wlogReadAheadTuner->get(maxBufferSize);
+}
+
+
+/**
+ * Weight of a volume for the wlog-transfer bandwidth schedulers.
+ * Volumes whose log devices are getting full will get more bandwidth,
+ * up to MAX_WEIGHT times of the share of almost empty ones.
+ */
+double getWlogTransferWeight(const std::string &wdevPath)
+{
+    const double MAX_WEIGHT = 4.0;
+    const uint64_t capacityPb = device::getLogCapacityPb(wdevPath);
+    if (capacityPb == 0) return 1.0;
+    const uint64_t usagePb = std::min(device::getLogUsagePb(wdevPath), capacityPb);
+    return 1.0 + (MAX_WEIGHT - 1.0) * usagePb / capacityPb;
+}
+
+
 /**
  * RETURN:
  *   true if there is remaining to send or delete.
@@ -833,7 +1031,15 @@ bool extractAndSendAndDeleteWlog(const std::string &volId)
     const std::string wdevPath = volInfo.getWdevPath();
     const std::string wdevName = device::getWdevNameFromWdevPath(wdevPath);
     const std::string wldevPath = device::getWldevPathFromWdevName(wdevName);
-    device::AsyncWldevReader reader(wldevPath);
+    device::WldevReadAheadParams raParams = getWlogReadAhead(volSt);
+    WldevReadAheadBudget::Reservation raMem(
+        getStorageGlobal().wlogReadAheadBudget, raParams.bufferSize,
+        device::AsyncWldevReader::DEFAULT_BUFFER_SIZE);
+    if (raMem.size() < raParams.bufferSize) {
+        raParams = getWlogReadAhead(volSt, raMem.size());
+        raMem.shrink(raParams.bufferSize);
+    }
+    device::AsyncWldevReader reader(wldevPath, raParams);
     const uint32_t pbs = reader.super().getPhysicalBlockSize();
     const uint32_t salt = reader.super().getLogChecksumSalt();
     const uint64_t maxWlogSendPb = gs.maxWlogSendMb * MEBI / pbs;
@@ -841,24 +1047,45 @@ bool extractAndSendAndDeleteWlog(const std::string &volId)
     const cybozu::Uuid uuid = volInfo.getUuid();
     const uint64_t volSizeLb = device::getSizeLb(wdevPath);
     const uint64_t maxLogSizePb = lsidLimit - lsidB;
+    const CompressOpt volCmpr = getWlogCmpr(volInfo);
+    const double weight = getWlogTransferWeight(wdevPath);
 
     cybozu::Socket sock;
     packet::Packet pkt(sock);
     std::string serverId;
+    CompressOpt cmpr;
     bool isAvailable = false;
     for (const cybozu::SocketAddr &proxy : gs.proxyManager.getAvailableList()) {
         try {
-            util::connectWithTimeout(sock, proxy, gs.socketTimeout);
-            gs.setSocketParams(sock);
-            serverId = protocol::run1stNegotiateAsClient(sock, gs.nodeId, wlogTransferPN);
+            cmpr = volCmpr;
+            bool sendsCmpr = false;
+            if (!isDefaultWlogCmprType(cmpr)) {
+                util::connectWithTimeout(sock, proxy, gs.socketTimeout);
+                gs.setSocketParams(sock);
+                sendsCmpr = protocol::run1stNegotiateAsClientIfSupported(
+                    sock, gs.nodeId, wlogTransferCmprPN, serverId);
+                if (!sendsCmpr) {
+                    LOGs.warn() << FUNC << "proxy does not support" << wlogTransferCmprPN
+                                << "use snappy" << volId << serverId;
+                    sock.close();
+                    cmpr.type = ::WALB_DIFF_CMPR_SNAPPY;
+                    cmpr.level = 0;
+                }
+            }
+            if (!sendsCmpr) {
+                util::connectWithTimeout(sock, proxy, gs.socketTimeout);
+                gs.setSocketParams(sock);
+                serverId = protocol::run1stNegotiateAsClient(sock, gs.nodeId, wlogTransferPN);
+            }
             pkt.write(volId);
             pkt.write(uuid);
             pkt.write(pbs);
             pkt.write(salt);
             pkt.write(volSizeLb);
             pkt.write(maxLogSizePb);
+            if (sendsCmpr) pkt.write(cmpr);
             pkt.flush();
-            LOGs.debug() << "send" << volId << uuid << pbs << salt << volSizeLb << maxLogSizePb;
+            LOGs.debug() << "send" << volId << uuid << pbs << salt << volSizeLb << maxLogSizePb << cmpr;
             std::string res;
             pkt.read(res);
             if (res == msgAccept) {
@@ -875,42 +1102,85 @@ bool extractAndSendAndDeleteWlog(const std::string &volId)
     }
 
     ProtocolLogger logger(gs.nodeId, serverId);
-    WlogSender sender(sock, logger, pbs, salt);
+    WlogSender sender(sock, logger, pbs, salt, cmpr.type, cmpr.level);
+    reader.reset(lsidB, maxLogSizePb);
 
+    /*
+     * Three stages run concurrently:
+     * (1) this thread reads logpacks from the log device,
+     * (2) worker threads of the sender verify and compress them,
+     * (3) the writer thread of the sender sends them in order.
+     */
+    sender.start(cmpr.numCpu, gs.wlogReadQueueSize, gs.wlogSendQueueSize);
+    StageStat readStat;
     LogPackHeader packH(pbs, salt);
-    reader.reset(lsidB, maxLogSizePb);
 
-    LOGs.debug() << FUNC << "start" << volId << lsidB << lsidLimit;
-    AlignedArray buf;
+    LOGs.debug() << FUNC << "start" << volId << lsidB << lsidLimit << raParams << weight;
+    cybozu::Stopwatch stopwatch;
+    StorageSingleton &g = getStorageGlobal();
+    auto isForceStopped = [&]() {
+        return volSt.stopState == ForceStopping || gs.ps.isForceShutdown();
+    };
     uint64_t lsid = lsidB;
+    uint64_t sentSize = 0; // charged to wlogSendScheduler.
     try {
         for (;;) {
-            if (volSt.stopState == ForceStopping || gs.ps.isForceShutdown()) {
+            if (isForceStopped()) {
                 throw cybozu::Exception(FUNC) << "force stopped" << volId;
             }
             if (lsid == lsidLimit) break;
-            if (!readLogPackHeader(reader, packH, lsid)) {
-                dumpLogPackHeader(volId, lsid, packH); // for analysis.
-                throw cybozu::Exception(FUNC) << "invalid logpack header" << volId << lsid;
+            {
+                StageStat::Scope scope(readStat);
+                if (!readWlogPackHeader(reader, packH, volId, lsid, maxWlogSendPb, lsidLimit)) break;
+                scope.add(pbs);
             }
-            verifyMaxWlogSendPbIsNotTooSmall(maxWlogSendPb, packH.header().total_io_size + 1, FUNC);
-            const uint64_t nextLsid =  packH.nextLogpackLsid();
-            if (lsidLimit < nextLsid) break;
+            /*
+             * Wait for the turns of this volume to read the logpack and to send the data
+             * that have been sent since the previous logpack.
+             * The bounded queues of the sender propagate this waiting to the network.
+             */
+            const uint64_t sentSize1 = sender.sendStat().bytes();
+            if (!g.wlogReadScheduler.acquire(volId, uint64_t(packH.totalIoSize() + 1) * pbs, weight, isForceStopped) ||
+                !g.wlogSendScheduler.acquire(volId, sentSize1 - sentSize, weight, isForceStopped)) {
+                throw cybozu::Exception(FUNC) << "force stopped" << volId;
+            }
+            sentSize = sentSize1;
             sender.pushHeader(packH);
-            for (size_t i = 0; i < packH.header().n_records; i++) {
-                if (!readLogIo(reader, packH, i, buf)) {
-                    throw cybozu::Exception(FUNC) << "invalid logpack IO" << volId << lsid << i;
+            /*
+             * Push each IO just after reading it
+             * because the lent data must be released by the sender to read ahead.
+             */
+            for (size_t i = 0; i < packH.nRecords(); i++) {
+                CompressedData cd;
+                {
+                    StageStat::Scope scope(readStat);
+                    readWlogIo(reader, packH, i, cd);
+                    scope.add(packH.record(i).hasData() ? cd.rawSize() : 0);
                 }
-                sender.pushIo(packH, i, buf.data());
-                buf.clear();
+                sender.pushIo(packH, i, std::move(cd));
             }
-            lsid = nextLsid;
+            lsid = packH.nextLogpackLsid();
         }
+        sender.sync();
     } catch (...) {
+        sender.fail();
         LOGs.info() << FUNC << volId << lsidB << lsid << lsidLimit;
         throw;
     }
-    sender.sync();
+    {
+        const std::string stat = cybozu::util::formatString(
+            "read %s compress %s send %s"
+            , readStat.str().c_str(), sender.compressStat().str().c_str()
+            , sender.sendStat().str().c_str());
+        const double elapsedSec = stopwatch.get();
+        LOGs.debug() << FUNC << "pipeline" << volId << stat;
+        UniqueLock ul(volSt.mu);
+        volSt.wlogPipelineStat = stat;
+        volSt.wlogReadAhead = raParams;
+        if (volSt.wlogReadAheadTuner) {
+            volSt.wlogReadAheadTuner->add(raParams, (lsid - lsidB) * pbs, elapsedSec);
+        }
+    }
     const uint64_t lsidE = lsid;
     const MetaDiff diff = volInfo.getTransferDiff(rec0, rec1, lsidE);
     pkt.write(diff);
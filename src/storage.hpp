@@ -19,6 +19,8 @@
 #include "command_param_parser.hpp"
 #include "snap_info.hpp"
 #include "ts_delta.hpp"
+#include "wlog_read_ahead.hpp"
+#include "wfq_scheduler.hpp"
 
 namespace walb {
 
@@ -27,9 +29,12 @@ struct StorageVolState {
     std::atomic<int> stopState;
     StateMachine sm;
     ActionCounters ac; // key is action identifier.
+    std::string wlogPipelineStat; // stage statistics of the last wlog-transfer.
+    device::WldevReadAheadParams wlogReadAhead; // read-ahead parameters of the last wlog-transfer.
+    std::unique_ptr<WldevReadAheadTuner> wlogReadAheadTuner; // used in the adaptive mode.
 
     explicit StorageVolState(const std::string& volId)
-        : stopState(NotStopping), sm(mu), ac(mu) {
+        : stopState(NotStopping), sm(mu), ac(mu), wlogReadAhead() {
         sm.init(statePairTbl);
         initInner(volId);
     }
@@ -172,6 +177,11 @@ struct StorageSingleton
     std::string nodeId;
     std::string baseDirStr;
     uint64_t maxWlogSendMb;
+    size_t wlogReadQueueSize;
+    size_t wlogSendQueueSize;
+    size_t wlogCompressThreads;
+    bool wlogReadAheadAdaptive;
+    device::WldevReadAheadParams wlogReadAheadMax; // caps in the adaptive mode.
     size_t implicitSnapshotIntervalSec;
     size_t delaySecForRetry;
     size_t maxConnections;
@@ -180,6 +190,7 @@ struct StorageSingleton
     size_t socketTimeout;
     KeepAliveParams keepAliveParams;
     size_t tsDeltaGetterIntervalSec;
+    size_t fullSyncStreams; // connections per full-backup.
     bool allowExec;
 
     /**
@@ -199,6 +210,13 @@ struct StorageSingleton
     std::atomic<bool> quitTsDeltaGetter;
     storage_local::TsDeltaManager tsDeltaManager;
     std::atomic<uint64_t> fullScanLbPerSec; // 0 means unlimited.
+    WldevReadAheadBudget wlogReadAheadBudget;
+    /*
+     * Log device read and network bandwidth shared by wlog-transfers of all the volumes.
+     * Flow id is volId.
+     */
+    WfqScheduler wlogReadScheduler;
+    WfqScheduler wlogSendScheduler;
     protocol::HandlerStatMgr handlerStatMgr;
 
     using Str2Str = std::map<std::string, std::string>;
@@ -263,6 +281,7 @@ namespace storage_local {
 
 void startMonitoring(const std::string& wdevPath, const std::string& volId);
 void stopMonitoring(const std::string& wdevPath, const std::string& volId);
+void removeWlogFlows(const std::string& volId);
 
 
 inline bool isUnderMonitoring(const std::string& wdevPath)
@@ -348,6 +367,8 @@ void c2sResetVolServer(protocol::ServerParams &p);
 void c2sResizeServer(protocol::ServerParams &p);
 void c2sKickServer(protocol::ServerParams &p);
 void c2sSetFullScanBpsServer(protocol::ServerParams &p);
+void c2sSetWlogBpsServer(protocol::ServerParams &p);
+void c2sSetWlogCmprServer(protocol::ServerParams &p);
 void c2sDumpLogpackHeaderServer(protocol::ServerParams &p);
 
 
@@ -439,6 +460,8 @@ const protocol::Str2ServerHandler storageHandlerMap = {
     { snapshotCN, c2sSnapshotServer },
     { kickCN, c2sKickServer },
     { setFullScanBpsCN, c2sSetFullScanBpsServer },
+    { setWlogBpsCN, c2sSetWlogBpsServer },
+    { setWlogCmprCN, c2sSetWlogCmprServer },
     { dbgDumpLogpackHeaderCN, c2sDumpLogpackHeaderServer },
     { getCN, c2sGetServer },
     { execCN, c2sExecServer },
@@ -13,6 +13,7 @@
 #include "wdev_util.hpp"
 #include "wdev_log.hpp"
 #include "storage_constant.hpp"
+#include "host_info.hpp"
 
 namespace walb {
 
@@ -93,6 +94,20 @@ public:
     void setUuid(const cybozu::Uuid &uuid) {
         util::saveFile(volDir_, "uuid", uuid);
     }
+    /**
+     * Compression option for wlog-transfer.
+     * numCpu is the number of compression threads.
+     * RETURN:
+     *   false if it has not been set. cmpr will not be changed.
+     */
+    bool getWlogCmpr(CompressOpt &cmpr) const {
+        if (!(volDir_ + "wlog_cmpr").stat().exists()) return false;
+        util::loadFile(volDir_, "wlog_cmpr", cmpr);
+        return true;
+    }
+    void setWlogCmpr(const CompressOpt &cmpr) {
+        util::saveFile(volDir_, "wlog_cmpr", cmpr);
+    }
     std::string getWdevPath() const { return wdevPath_.str(); }
     std::string getWdevName() const {
         return device::getWdevNameFromWdevPath(wdevPath_.str());
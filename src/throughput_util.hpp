@@ -2,6 +2,11 @@
 #include <chrono>
 #include <deque>
 #include <algorithm>
+#include <atomic>
+#include <string>
+#include <cinttypes>
+#include <thread>
+#include "util.hpp"
 
 /**
  * You can get moving average throughput using this class.
@@ -98,3 +103,59 @@ public:
         }
     }
 };
+
+/**
+ * Processed size and busy time of a pipeline stage.
+ * Workers of a stage can share an instance.
+ */
+class StageStat
+{
+    using Clock = std::chrono::steady_clock;
+    using Us = std::chrono::microseconds;
+
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> busyUs_;
+    size_t concurrency_;
+
+public:
+    explicit StageStat(size_t concurrency = 1)
+        : bytes_(0), busyUs_(0), concurrency_(std::max<size_t>(concurrency, 1)) {
+    }
+    /**
+     * Measure busy time of a scope.
+     */
+    class Scope
+    {
+        StageStat& stat_;
+        typename Clock::time_point begin_;
+        uint64_t bytes_;
+    public:
+        explicit Scope(StageStat& stat) : stat_(stat), begin_(Clock::now()), bytes_(0) {
+        }
+        void add(uint64_t bytes) { bytes_ += bytes; }
+        ~Scope() noexcept {
+            stat_.add(bytes_, std::chrono::duration_cast<Us>(Clock::now() - begin_).count());
+        }
+    };
+    void setConcurrency(size_t concurrency) { concurrency_ = std::max<size_t>(concurrency, 1); }
+    void add(uint64_t bytes, uint64_t busyUs) {
+        bytes_ += bytes;
+        busyUs_ += busyUs;
+    }
+    uint64_t bytes() const { return bytes_; }
+    uint64_t busyMs() const { return busyUs_ / 1000; }
+    /**
+     * Throughput of the stage while it is busy [byte/sec].
+     * This tells which stage is the bottleneck.
+     */
+    uint64_t bytesPerSec() const {
+        const uint64_t us = busyUs_ / concurrency_;
+        if (us == 0) return 0;
+        return bytes_ * 1000000 / us;
+    }
+    std::string str() const {
+        return cybozu::util::formatString(
+            "%" PRIu64 "B %" PRIu64 "ms %" PRIu64 "B/s"
+            , bytes(), busyMs(), bytesPerSec());
+    }
+};
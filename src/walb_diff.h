@@ -14,6 +14,10 @@ extern "C" {
 #endif
 
 #define WALB_DIFF_VERSION 2
+#define WALB_DIFF_VERSION_COMPACT_INDEX 3 /* indexed wdiff with a compact index. */
+
+/* Flags of walb_diff_file_header. */
+#define WALB_DIFF_FILE_FLAG_PACK_INDEX (1U << 0) /* sorted wdiff with a pack index. */
 
 /**
  * Sorted wdiff file format.
@@ -25,6 +29,16 @@ extern "C" {
  *
  * All IOs are sorted by address.
  * There is no overlap of IO range.
+ *
+ * A file with WALB_DIFF_FILE_FLAG_PACK_INDEX has a pack index after the end pack:
+ *
+ * [4KiB: walb_diff_pack: end flag on]
+ * [[sizeof: walb_diff_pack_index_record], ...]
+ * [sizeof: walb_diff_pack_index_super]
+ *
+ * The version is still 2. Readers that do not know the flag
+ * stop at the end pack so they can ignore the index.
+ * Empty packs are not indexed.
  */
 
 /**
@@ -39,6 +53,16 @@ extern "C" {
  * All uncompressed IO data size are aligned to 2^N (N >= 9).
  * Compressed ones are of course not.
  * IO data may not be sorted by address while index records must be sorted.
+ *
+ * Version 3 has compact index blocks instead of the index records:
+ *
+ * [[walb_diff_compact_index_block, [uint64_t packed column data, ...]], ...]
+ * [sizeof: walb_diff_index_super]
+ *
+ * Each block encodes up to WALB_DIFF_COMPACT_INDEX_BLOCK_RECORDS records column by column.
+ * Column values of the records are bit-packed in the bits of the column
+ * after subtracting the base value of the column.
+ * The rec_checksum field is not stored. The block checksum covers the records instead.
  */
 
 /**
@@ -86,7 +110,7 @@ struct walb_diff_file_header
     uint32_t checksum;       /* header block checksum. salt is 0. */
     uint16_t version;        /* WalB diff version */
     uint8_t type;            /* WALB_DIFF_TYPE_XXX */
-    uint8_t reserved1;
+    uint8_t flags;           /* WALB_DIFF_FILE_FLAG_XXX. This was reserved and 0. */
     uint32_t reserved2;
     uint32_t reserved3;
     uint8_t uuid[UUID_SIZE]; /* Identifier of the target block device. */
@@ -177,6 +201,62 @@ struct walb_diff_index_super
 } __attribute__((packed, aligned(8)));
 
 
+/**
+ * Columns of compact index blocks.
+ */
+enum {
+    WALB_DIFF_COMPACT_INDEX_ADDR_GAP = 0, /* io_address - end address of the previous record. */
+    WALB_DIFF_COMPACT_INDEX_IO_BLOCKS,
+    WALB_DIFF_COMPACT_INDEX_FLAGS, /* flags | (compression_type << 8). */
+    WALB_DIFF_COMPACT_INDEX_DATA_OFFSET, /* zigzag of data_offset - end offset of the previous data. */
+    WALB_DIFF_COMPACT_INDEX_DATA_SIZE,
+    WALB_DIFF_COMPACT_INDEX_IO_OFFSET,
+    WALB_DIFF_COMPACT_INDEX_ORIG_BLOCKS,
+    WALB_DIFF_COMPACT_INDEX_IO_CHECKSUM,
+    WALB_DIFF_COMPACT_INDEX_N_COLUMNS
+};
+
+#define WALB_DIFF_COMPACT_INDEX_BLOCK_RECORDS 128
+
+/**
+ * Header of a compact index block.
+ * The previous record of the first one is regarded as
+ * the one ending at io_address and data_offset.
+ */
+struct walb_diff_compact_index_block
+{
+    uint64_t io_address; /* [logical block] address of the first record. */
+    uint64_t data_offset; /* [byte] base of the data offset of the first record. */
+    uint64_t base[WALB_DIFF_COMPACT_INDEX_N_COLUMNS]; /* minimum values of the columns. */
+    uint32_t size; /* [byte] block size including this header. */
+    uint32_t checksum; /* checksum of the whole block with salt 0. */
+    uint16_t n_records;
+    uint8_t bits[WALB_DIFF_COMPACT_INDEX_N_COLUMNS]; /* bit width of the columns. */
+    uint16_t reserved1;
+    uint32_t reserved2;
+} __attribute__((packed, aligned(8)));
+
+
+/**
+ * Pack index record of sorted wdiff files.
+ */
+struct walb_diff_pack_index_record
+{
+    uint64_t io_address; /* [logical block] address of the first IO in the pack. */
+    uint64_t offset; /* [byte] offset of the pack header in the whole file. */
+} __attribute__((packed, aligned(8)));
+
+
+struct walb_diff_pack_index_super
+{
+    uint64_t index_offset; /* [byte] in the whole file. */
+    uint32_t n_records; /* number of pack index records. */
+    uint32_t index_checksum; /* checksum of the pack index records with salt 0. */
+    uint32_t reserved1;
+    uint32_t checksum; /* self checksum */
+} __attribute__((packed, aligned(8)));
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -102,6 +102,35 @@ std::vector<AlignedArray> splitIoDataAll(const AlignedArray &buf, uint32_t ioBlo
 }
 
 
+std::vector<DiffIoRun> splitZeroRuns(const char *data, uint32_t ioBlocks, uint32_t minZeroRunLb)
+{
+    auto isZeroBlock = [&](uint32_t idx) {
+        return cybozu::util::isAllZero(data + idx * LOGICAL_BLOCK_SIZE, LOGICAL_BLOCK_SIZE);
+    };
+    std::vector<DiffIoRun> v;
+    if (minZeroRunLb == 0 || ioBlocks <= minZeroRunLb) return v;
+    uint32_t normalBgn = 0;
+    uint32_t i = 0;
+    while (i < ioBlocks) {
+        if (!isZeroBlock(i)) {
+            i++;
+            continue;
+        }
+        uint32_t j = i + 1;
+        while (j < ioBlocks && isZeroBlock(j)) j++;
+        if (minZeroRunLb <= j - i) {
+            if (normalBgn < i) v.push_back({normalBgn, i - normalBgn, false});
+            v.push_back({i, j - i, true});
+            normalBgn = j;
+        }
+        i = j;
+    }
+    if (v.empty()) return v;
+    if (normalBgn < ioBlocks) v.push_back({normalBgn, ioBlocks - normalBgn, false});
+    return v;
+}
+
+
 int compressData(const char *inData, size_t inSize,
                  AlignedArray &outData, size_t &outSize, int type, int level)
 {
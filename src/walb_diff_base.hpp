@@ -113,6 +113,25 @@ inline bool calcDiffIoIsAllZero(const AlignedArray &io)
 std::vector<AlignedArray> splitIoDataAll(const AlignedArray &buf, uint32_t ioBlocks);
 
 
+/**
+ * A part of an IO.
+ */
+struct DiffIoRun
+{
+    uint32_t offLb; // offset in the IO [logical block].
+    uint32_t ioBlocks;
+    bool isAllZero;
+};
+
+/**
+ * Split an IO into normal runs and all-zero runs.
+ * Zero runs shorter than minZeroRunLb are included in normal runs.
+ * RETURN:
+ *   empty if the IO has no zero run to split.
+ */
+std::vector<DiffIoRun> splitZeroRuns(const char *data, uint32_t ioBlocks, uint32_t minZeroRunLb);
+
+
 inline void printOnelineDiffIo(const AlignedArray &buf, ::FILE *fp = ::stdout)
 {
     ::fprintf(fp, "size %zu checksum %08x\n"
@@ -220,6 +239,26 @@ struct DiffIndexSuper : walb_diff_index_super
     }
 };
 
+/**
+ * sizeof(DiffPackIndexSuper) == sizeof(walb_diff_pack_index_super)
+ */
+struct DiffPackIndexSuper : walb_diff_pack_index_super
+{
+    constexpr static const char *NAME = "DiffPackIndexSuper";
+    void init() {
+        ::memset(this, 0, sizeof(*this));
+    }
+    void updateChecksum() {
+        checksum = 0;
+        checksum = cybozu::util::calcChecksum(this, sizeof(*this), 0);
+    }
+    void verify() {
+        if (cybozu::util::calcChecksum(this, sizeof(*this), 0) != 0) {
+            throw cybozu::Exception(NAME) << "invalid checksum";
+        }
+    }
+};
+
 
 enum class DiffRecType : uint8_t
 {
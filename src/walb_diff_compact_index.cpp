@@ -0,0 +1,194 @@
+#include <algorithm>
+#include "walb_diff_compact_index.hpp"
+
+namespace walb {
+
+namespace {
+
+const char *const NAME = "DiffCompactIndex";
+const size_t N_COLUMNS = WALB_DIFF_COMPACT_INDEX_N_COLUMNS;
+const size_t BLOCK_RECORDS = WALB_DIFF_COMPACT_INDEX_BLOCK_RECORDS;
+
+using Block = walb_diff_compact_index_block;
+using Columns = uint64_t[N_COLUMNS][BLOCK_RECORDS];
+
+size_t getNrWords(size_t nr, uint8_t bits)
+{
+    return (nr * bits + 63) / 64;
+}
+
+uint8_t getBitWidth(uint64_t value)
+{
+    return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+uint64_t encodeZigzag(uint64_t delta)
+{
+    return (delta << 1) ^ uint64_t(int64_t(delta) >> 63);
+}
+
+uint64_t decodeZigzag(uint64_t value)
+{
+    return (value >> 1) ^ -(value & 1);
+}
+
+void packColumn(const uint64_t *in, size_t nr, uint8_t bits, uint64_t base, uint64_t *out)
+{
+    if (bits == 0) return;
+    for (size_t i = 0; i < nr; i++) {
+        const uint64_t v = in[i] - base;
+        const size_t pos = i * bits;
+        const size_t k = pos / 64;
+        const size_t s = pos % 64;
+        out[k] |= v << s;
+        if (s + bits > 64) out[k + 1] |= v >> (64 - s);
+    }
+}
+
+/**
+ * in must have a readable word after the column.
+ * The loop has no branch and no dependency between iterations
+ * so that compilers can vectorize it.
+ */
+void unpackColumn(const uint64_t *in, size_t nr, uint8_t bits, uint64_t base, uint64_t *out)
+{
+    if (bits == 0) {
+        std::fill(out, out + nr, base);
+        return;
+    }
+    const uint64_t mask = ~uint64_t(0) >> (64 - bits);
+    for (size_t i = 0; i < nr; i++) {
+        const size_t pos = i * bits;
+        const size_t k = pos / 64;
+        const size_t s = pos % 64;
+        const uint64_t lo = in[k] >> s;
+        const uint64_t hi = (in[k + 1] << 1) << (63 - s);
+        out[i] = base + ((lo | hi) & mask);
+    }
+}
+
+} // namespace
+
+void DiffCompactIndexEncoder::encode()
+{
+    const size_t nr = recV_.size();
+    assert(0 < nr && nr <= BLOCK_RECORDS);
+
+    Block blk;
+    ::memset(&blk, 0, sizeof(blk));
+    blk.io_address = recV_[0].io_address;
+    blk.data_offset = recV_[0].data_offset;
+    blk.n_records = nr;
+
+    Columns col;
+    uint64_t addrEnd = blk.io_address;
+    uint64_t dataEnd = blk.data_offset;
+    for (size_t i = 0; i < nr; i++) {
+        const IndexedDiffRecord &rec = recV_[i];
+        if (rec.io_address < addrEnd) {
+            throw cybozu::Exception(NAME)
+                << "records must be sorted and not overlapped" << rec.io_address << addrEnd;
+        }
+        col[WALB_DIFF_COMPACT_INDEX_ADDR_GAP][i] = rec.io_address - addrEnd;
+        col[WALB_DIFF_COMPACT_INDEX_IO_BLOCKS][i] = rec.io_blocks;
+        col[WALB_DIFF_COMPACT_INDEX_FLAGS][i] = rec.flags | (uint64_t(rec.compression_type) << 8);
+        col[WALB_DIFF_COMPACT_INDEX_DATA_OFFSET][i] = encodeZigzag(rec.data_offset - dataEnd);
+        col[WALB_DIFF_COMPACT_INDEX_DATA_SIZE][i] = rec.data_size;
+        col[WALB_DIFF_COMPACT_INDEX_IO_OFFSET][i] = rec.io_offset;
+        col[WALB_DIFF_COMPACT_INDEX_ORIG_BLOCKS][i] = rec.orig_blocks;
+        col[WALB_DIFF_COMPACT_INDEX_IO_CHECKSUM][i] = rec.io_checksum;
+        addrEnd = rec.endIoAddress();
+        dataEnd = rec.data_offset + rec.data_size;
+    }
+
+    size_t nrWords = 0;
+    for (size_t c = 0; c < N_COLUMNS; c++) {
+        const auto mm = std::minmax_element(&col[c][0], &col[c][nr]);
+        blk.base[c] = *mm.first;
+        blk.bits[c] = getBitWidth(*mm.second - *mm.first);
+        nrWords += getNrWords(nr, blk.bits[c]);
+    }
+
+    const size_t hdrWords = sizeof(blk) / sizeof(uint64_t);
+    buf_.assign(hdrWords + nrWords, 0);
+    uint64_t *out = &buf_[hdrWords];
+    for (size_t c = 0; c < N_COLUMNS; c++) {
+        packColumn(&col[c][0], nr, blk.bits[c], blk.base[c], out);
+        out += getNrWords(nr, blk.bits[c]);
+    }
+
+    blk.size = buf_.size() * sizeof(uint64_t);
+    blk.checksum = 0;
+    ::memcpy(buf_.data(), &blk, sizeof(blk));
+    blk.checksum = cybozu::util::calcChecksum(buf_.data(), blk.size, 0);
+    ::memcpy(buf_.data(), &blk, sizeof(blk));
+}
+
+walb_diff_compact_index_block readDiffCompactIndexBlockHeader(const char *p, size_t size)
+{
+    Block blk;
+    if (size < sizeof(blk)) {
+        throw cybozu::Exception(NAME) << "too small block" << size;
+    }
+    ::memcpy(&blk, p, sizeof(blk));
+    if (blk.n_records == 0 || blk.n_records > BLOCK_RECORDS) {
+        throw cybozu::Exception(NAME) << "invalid n_records" << blk.n_records;
+    }
+    size_t nrWords = 0;
+    for (size_t c = 0; c < N_COLUMNS; c++) {
+        if (blk.bits[c] > 64) {
+            throw cybozu::Exception(NAME) << "invalid bits" << c << int(blk.bits[c]);
+        }
+        nrWords += getNrWords(blk.n_records, blk.bits[c]);
+    }
+    const size_t blkSize = sizeof(blk) + nrWords * sizeof(uint64_t);
+    if (blk.size != blkSize || blk.size > size) {
+        throw cybozu::Exception(NAME) << "invalid block size" << blk.size << blkSize << size;
+    }
+    return blk;
+}
+
+size_t decodeDiffCompactIndexBlock(const char *p, size_t size, std::vector<IndexedDiffRecord> &recV)
+{
+    const Block blk = readDiffCompactIndexBlockHeader(p, size);
+    if (cybozu::util::calcChecksum(p, blk.size, 0) != 0) {
+        throw cybozu::Exception(NAME) << "invalid checksum";
+    }
+    const size_t nr = blk.n_records;
+
+    /* Copy to aligned words with an extra word for unpackColumn(). */
+    const size_t nrWords = (blk.size - sizeof(blk)) / sizeof(uint64_t);
+    std::vector<uint64_t> words(nrWords + 1);
+    ::memcpy(words.data(), p + sizeof(blk), nrWords * sizeof(uint64_t));
+    words[nrWords] = 0;
+
+    Columns col;
+    const uint64_t *in = words.data();
+    for (size_t c = 0; c < N_COLUMNS; c++) {
+        unpackColumn(in, nr, blk.bits[c], blk.base[c], &col[c][0]);
+        in += getNrWords(nr, blk.bits[c]);
+    }
+
+    recV.resize(nr);
+    uint64_t addrEnd = blk.io_address;
+    uint64_t dataEnd = blk.data_offset;
+    for (size_t i = 0; i < nr; i++) {
+        IndexedDiffRecord &rec = recV[i];
+        rec.init();
+        const uint64_t flags = col[WALB_DIFF_COMPACT_INDEX_FLAGS][i];
+        rec.io_address = addrEnd + col[WALB_DIFF_COMPACT_INDEX_ADDR_GAP][i];
+        rec.io_blocks = col[WALB_DIFF_COMPACT_INDEX_IO_BLOCKS][i];
+        rec.flags = flags & 0xff;
+        rec.compression_type = flags >> 8;
+        rec.data_offset = dataEnd + decodeZigzag(col[WALB_DIFF_COMPACT_INDEX_DATA_OFFSET][i]);
+        rec.data_size = col[WALB_DIFF_COMPACT_INDEX_DATA_SIZE][i];
+        rec.io_offset = col[WALB_DIFF_COMPACT_INDEX_IO_OFFSET][i];
+        rec.orig_blocks = col[WALB_DIFF_COMPACT_INDEX_ORIG_BLOCKS][i];
+        rec.io_checksum = col[WALB_DIFF_COMPACT_INDEX_IO_CHECKSUM][i];
+        addrEnd = rec.endIoAddress();
+        dataEnd = rec.data_offset + rec.data_size;
+    }
+    return blk.size;
+}
+
+} // namespace walb
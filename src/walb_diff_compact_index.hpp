@@ -0,0 +1,68 @@
+#pragma once
+/**
+ * @file
+ * @brief Compact index blocks of indexed wdiff files.
+ */
+#include <vector>
+#include "walb_diff_base.hpp"
+
+namespace walb {
+
+/**
+ * Encode sorted and not overlapped index records to compact index blocks.
+ * See the indexed wdiff file format in walb_diff.h.
+ */
+class DiffCompactIndexEncoder /* final */
+{
+private:
+    std::vector<IndexedDiffRecord> recV_; // records of the current block.
+    std::vector<uint64_t> buf_; // the encoded block.
+    size_t nBlocks_;
+
+public:
+    DiffCompactIndexEncoder() : recV_(), buf_(), nBlocks_(0) {
+        recV_.reserve(WALB_DIFF_COMPACT_INDEX_BLOCK_RECORDS);
+    }
+    template <class Writer>
+    void add(Writer &writer, const IndexedDiffRecord *recs, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            recV_.push_back(recs[i]);
+            if (recV_.size() == WALB_DIFF_COMPACT_INDEX_BLOCK_RECORDS) writeBlock(writer);
+        }
+    }
+    /**
+     * Write the remaining records as the last block.
+     */
+    template <class Writer>
+    void flush(Writer &writer) {
+        if (!recV_.empty()) writeBlock(writer);
+    }
+    size_t getNrBlocks() const { return nBlocks_; }
+private:
+    template <class Writer>
+    void writeBlock(Writer &writer) {
+        encode();
+        writer.write(buf_.data(), buf_.size() * sizeof(uint64_t));
+        recV_.clear();
+        nBlocks_++;
+    }
+    void encode();
+};
+
+/**
+ * Read the header of a compact index block and verify its fields except for the checksum.
+ * @size available size from p [byte].
+ */
+walb_diff_compact_index_block readDiffCompactIndexBlockHeader(const char *p, size_t size);
+
+/**
+ * Verify the checksum of a compact index block and decode the records.
+ * @p the block, which need not be aligned.
+ * @size available size from p [byte].
+ * @recV decoded records will be set. Their rec_checksum fields are 0.
+ * RETURN:
+ *   size of the block [byte].
+ */
+size_t decodeDiffCompactIndexBlock(const char *p, size_t size, std::vector<IndexedDiffRecord> &recV);
+
+} // namespace walb
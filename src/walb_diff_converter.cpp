@@ -43,8 +43,10 @@ bool convertLogToDiff(
 void DiffConverter::convert(int inputLogFd, int outputWdiffFd, uint32_t maxIoBlocks)
 {
     /* Prepare walb diff. */
-    DiffMemory diffMem;
+    SpillingDiffMemory diffMem;
     diffMem.setMaxIoBlocks(maxIoBlocks);
+    diffMem.setTmpDir(tmpDir_);
+    diffMem.setMaxMemSize(maxMemSize_);
 
     /* Loop */
     uint64_t lsid = -1;
@@ -66,14 +68,15 @@ void DiffConverter::convert(int inputLogFd, int outputWdiffFd, uint32_t maxIoBlo
           "Written blocks: %" PRIu64 "\n"
           "nBlocks: %" PRIu64 "\n"
           "nIos: %" PRIu64 "\n"
-          "lsid: %" PRIu64 "\n",
+          "lsid: %" PRIu64 "\n"
+          "nRuns: %zu\n",
           writtenBlocks, diffMem.getNBlocks(),
-          diffMem.getNIos(), lsid);
+          diffMem.getNIos(), lsid, diffMem.getNRuns());
 
     diffMem.writeTo(outputWdiffFd, ::WALB_DIFF_CMPR_SNAPPY);
 }
 
-bool DiffConverter::convertWlog(uint64_t &lsid, uint64_t &writtenBlocks, int fd, DiffMemory &diffMem)
+bool DiffConverter::convertWlog(uint64_t &lsid, uint64_t &writtenBlocks, int fd, SpillingDiffMemory &diffMem)
 {
     WlogReader reader(fd);
 
@@ -110,12 +113,11 @@ bool DiffConverter::convertWlog(uint64_t &lsid, uint64_t &writtenBlocks, int fd,
     WlogRecord lrec;
     AlignedArray buf;
     while (reader.readLog(lrec, buf)) {
-        DiffRecord drec;
-        if (convertLogToDiff(lrec, buf.data(), drec)) {
-            if (!drec.isNormal()) buf.clear();
-            diffMem.add(drec, std::move(buf));
-            writtenBlocks += drec.io_blocks;
-        }
+        convertLogToDiffSplittingZeroRuns<DiffRecord>(
+            lrec, std::move(buf), [&](const DiffRecord &drec, AlignedArray &&data) {
+                diffMem.add(drec, std::move(data));
+                writtenBlocks += drec.io_blocks;
+            });
     }
 
     lsid = reader.endLsid();
@@ -128,6 +130,8 @@ void IndexedDiffConverter::convert(int inputLogFd, int outputWdiffFd, uint32_t m
     IndexedDiffWriter writer;
     writer.setFd(outputWdiffFd);
     writer.setMaxIoBlocks(maxIoBlocks);
+    writer.setIndexSpill(tmpDir_, maxMemSize_);
+    writer.setCompactIndex(isCompactIndex_);
     DiffFileHeader wdiffH;
 
     /* Loop */
@@ -196,11 +200,11 @@ bool IndexedDiffConverter::convertWlog(
     WlogRecord lrec;
     AlignedArray buf;
     while (reader.readLog(lrec, buf)) {
-        IndexedDiffRecord drec;
-        if (convertLogToDiff(lrec, buf.data(), drec)) {
-            writer.compressAndWriteDiff(drec, buf.data());
-            writtenBlocks += drec.io_blocks;
-        }
+        convertLogToDiffSplittingZeroRuns<IndexedDiffRecord>(
+            lrec, std::move(buf), [&](const IndexedDiffRecord &drec, AlignedArray &&data) {
+                writer.compressAndWriteDiff(drec, std::move(data));
+                writtenBlocks += drec.io_blocks;
+            });
     }
     lsid = reader.endLsid();
     ::fprintf(::stderr, "converted until lsid %" PRIu64 "\n", lsid);
@@ -20,6 +20,7 @@
 #include "walb_log_file.hpp"
 #include "walb_diff_base.hpp"
 #include "walb_diff_mem.hpp"
+#include "walb_diff_spill.hpp"
 #include "walb_diff_file.hpp"
 
 namespace walb {
@@ -39,7 +40,18 @@ bool convertLogToDiff(const WlogRecord &rec, const void *data, DiffRecord& drec)
  */
 class DiffConverter /* final */
 {
+    std::string tmpDir_;
+    size_t maxMemSize_;
 public:
+    DiffConverter() : tmpDir_(), maxMemSize_(0) {}
+    /**
+     * Sorted runs will be put in tmpDir while the memory usage exceeds maxMemSize.
+     * maxMemSize: 0 means unlimited.
+     */
+    void setSpill(const std::string &tmpDir, size_t maxMemSize) {
+        tmpDir_ = tmpDir;
+        maxMemSize_ = maxMemSize;
+    }
     void convert(int inputLogFd, int outputWdiffFd,
                  uint32_t maxIoBlocks = DEFAULT_MAX_IO_LB);
 private:
@@ -54,16 +66,74 @@ private:
      * RETURN:
      *   true if wlog is remaining, or false.
      */
-    bool convertWlog(uint64_t &lsid, uint64_t &writtenBlocks, int fd, DiffMemory &diffMem);
+    bool convertWlog(uint64_t &lsid, uint64_t &writtenBlocks, int fd, SpillingDiffMemory &diffMem);
 };
 
 
 bool convertLogToDiff(const WlogRecord &lrec, const void *data, IndexedDiffRecord& drec);
 
 
+/**
+ * Convert a log IO to diff records.
+ * Zero runs of DIFF_PACK_MIN_ZERO_RUN_LB or more in a normal IO are split
+ * into all-zero records as DiffPacker does, so they are neither stored nor compressed.
+ *
+ * DiffRec: DiffRecord or IndexedDiffRecord.
+ * buf: IO data. It will be moved to func if the IO is not split.
+ * func: called as func(const DiffRec &drec, AlignedArray &&buf) for each record.
+ *   buf is empty for non-normal records.
+ */
+template <typename DiffRec, typename Func>
+void convertLogToDiffSplittingZeroRuns(const WlogRecord &lrec, AlignedArray &&buf, Func &&func)
+{
+    DiffRec drec;
+    if (!convertLogToDiff(lrec, buf.data(), drec)) return;
+    std::vector<DiffIoRun> runV;
+    if (drec.isNormal()) {
+        runV = splitZeroRuns(buf.data(), lrec.io_size, DIFF_PACK_MIN_ZERO_RUN_LB);
+    }
+    if (runV.empty()) {
+        if (!drec.isNormal()) buf.clear();
+        func(drec, std::move(buf));
+        return;
+    }
+    for (const DiffIoRun &run : runV) {
+        WlogRecord runRec = lrec;
+        runRec.offset += run.offLb;
+        runRec.io_size = run.ioBlocks;
+        const char *data = buf.data() + run.offLb * LOGICAL_BLOCK_SIZE;
+        const bool r = convertLogToDiff(runRec, data, drec);
+        unusedVar(r);
+        assert(r);
+        AlignedArray runBuf;
+        if (drec.isNormal()) {
+            runBuf.resize(drec.data_size, false);
+            ::memcpy(runBuf.data(), data, drec.data_size);
+        }
+        func(drec, std::move(runBuf));
+    }
+}
+
+
 class IndexedDiffConverter /* final */
 {
+    std::string tmpDir_;
+    size_t maxMemSize_;
+    bool isCompactIndex_;
 public:
+    IndexedDiffConverter() : tmpDir_(), maxMemSize_(0), isCompactIndex_(false) {}
+    /**
+     * Index runs will be put in tmpDir while the index exceeds maxMemSize.
+     * maxMemSize: 0 means unlimited.
+     */
+    void setSpill(const std::string &tmpDir, size_t maxMemSize) {
+        tmpDir_ = tmpDir;
+        maxMemSize_ = maxMemSize;
+    }
+    /**
+     * See IndexedDiffWriter::setCompactIndex().
+     */
+    void setCompactIndex(bool isCompactIndex) { isCompactIndex_ = isCompactIndex; }
     void convert(int inputLogFd, int outputWdiffFd,
                  uint32_t maxIoBlocks = DEFAULT_MAX_IO_LB);
 private:
@@ -1,4 +1,8 @@
+#include <set>
+#include <algorithm>
+#include <sys/stat.h>
 #include "walb_diff_file.hpp"
+#include "walb_logger.hpp"
 
 namespace walb {
 
@@ -10,7 +14,7 @@ bool DiffFileHeader::verify(bool throwError) const
         }
         return false;
     }
-    if (version != WALB_DIFF_VERSION) {
+    if (version != WALB_DIFF_VERSION && !hasCompactIndex()) {
         if (throwError) {
             throw cybozu::Exception(__func__)
                 << "invalid walb diff version" << version << WALB_DIFF_VERSION;
@@ -55,6 +59,44 @@ std::string DiffFileHeader::typeStr() const
     }
 }
 
+void DiffPackIndex::readFrom(cybozu::util::File &fileR)
+{
+    const off_t pos = fileR.lseek(0, SEEK_CUR);
+    const uint64_t fileSize = fileR.lseek(0, SEEK_END);
+    if (fileSize < sizeof(walb_diff_file_header) + WALB_DIFF_PACK_SIZE + sizeof(DiffPackIndexSuper)) {
+        throw cybozu::Exception(__func__) << "too small file" << fileSize;
+    }
+    DiffPackIndexSuper super;
+    fileR.lseek(fileSize - sizeof(super));
+    fileR.read(&super, sizeof(super));
+    super.verify();
+    const size_t size = super.n_records * sizeof(walb_diff_pack_index_record);
+    if (super.index_offset + size + sizeof(super) != fileSize) {
+        throw cybozu::Exception(__func__)
+            << "invalid index offset" << super.index_offset << super.n_records << fileSize;
+    }
+    recV_.resize(super.n_records);
+    fileR.lseek(super.index_offset);
+    if (size > 0) fileR.read(recV_.data(), size);
+    fileR.lseek(pos);
+    if (cybozu::util::calcChecksum(recV_.data(), size, 0) != super.index_checksum) {
+        recV_.clear();
+        throw cybozu::Exception(__func__) << "invalid index checksum";
+    }
+}
+
+size_t DiffPackIndex::find(uint64_t addr) const
+{
+    /* The first pack of which first IO address > addr. */
+    const auto it = std::upper_bound(
+        recV_.begin(), recV_.end(), addr,
+        [](uint64_t a, const walb_diff_pack_index_record &rec) {
+            return a < rec.io_address;
+        });
+    if (it == recV_.begin()) return 0;
+    return it - recV_.begin() - 1;
+}
+
 void SortedDiffWriter::close()
 {
     if (!isClosed_) {
@@ -71,7 +113,10 @@ void SortedDiffWriter::writeHeader(DiffFileHeader &header)
         throw RT_ERR("Do not call writeHeader() more than once.");
     }
     header.type = ::WALB_DIFF_TYPE_SORTED;
+    header.version = WALB_DIFF_VERSION;
+    header.flags |= WALB_DIFF_FILE_FLAG_PACK_INDEX;
     header.writeTo(fileW_);
+    offset_ = header.getSize();
     isWrittenHeader_ = true;
 }
 
@@ -118,6 +163,8 @@ void SortedDiffWriter::init()
 {
     isWrittenHeader_ = false;
     isClosed_ = true;
+    offset_ = 0;
+    packIdx_.clear();
     pack_.clear();
     while (!ioQ_.empty()) ioQ_.pop();
     stat_.clear();
@@ -155,6 +202,7 @@ void SortedDiffWriter::writePack()
     }
 
     stat_.update(pack_);
+    packIdx_.add(pack_, offset_);
     pack_.writeTo(fileW_);
 
     assert(pack_.n_records == ioQ_.size());
@@ -167,6 +215,7 @@ void SortedDiffWriter::writePack()
         total += buf.size();
     }
     assert(total == pack_.total_size);
+    offset_ += pack_.wholePackSize();
     pack_.clear();
 }
 
@@ -225,6 +274,45 @@ bool SortedDiffReader::prepareRead()
     return ret;
 }
 
+void SortedDiffReader::seek(uint64_t addr)
+{
+    if (packIdx_.size() > 0) {
+        const walb_diff_pack_index_record &rec = packIdx_[packIdx_.find(addr)];
+        if (uint64_t(fileR_.lseek(0, SEEK_CUR)) < rec.offset) {
+            fileR_.lseek(rec.offset);
+            readPackHeader();
+        }
+    }
+    while (prepareRead()) {
+        if (recIdx_ == pack_.n_records) continue; // empty pack.
+        if (recIdx_ == 0 && pack_[pack_.n_records - 1].endIoAddress() <= addr) {
+            fileR_.skip(pack_.total_size);
+            recIdx_ = pack_.n_records;
+            totalSize_ = pack_.total_size;
+            continue;
+        }
+        const DiffRecord &rec = pack_[recIdx_];
+        if (addr < rec.endIoAddress()) return;
+        if (rec.data_offset != totalSize_) {
+            throw cybozu::Exception(__func__)
+                << "data offset invalid" << rec.data_offset << totalSize_;
+        }
+        fileR_.skip(rec.data_size);
+        totalSize_ += rec.data_size;
+        recIdx_++;
+    }
+}
+
+const DiffPackHeader* SortedDiffReader::readNextPackHeader()
+{
+    if (pack_.isEnd()) return nullptr;
+    fileR_.skip(pack_.total_size - totalSize_);
+    recIdx_ = pack_.n_records;
+    totalSize_ = pack_.total_size;
+    if (!readPackHeader()) return nullptr;
+    return &pack_;
+}
+
 void SortedDiffReader::readDiffIo(const DiffRecord &rec, AlignedArray &buf, bool verifyChecksum)
 {
     if (rec.data_offset != totalSize_) {
@@ -269,16 +357,17 @@ void SortedDiffReader::init()
     isReadHeader_ = false;
     recIdx_ = 0;
     totalSize_ = 0;
+    packIdx_.clear();
     stat_.clear();
     stat_.wdiffNr = 1;
 }
 
 void DiffIndexMem::checkNoOverlappedAndSorted() const
 {
-    auto it = index_.cbegin();
+    resolve();
     const IndexedDiffRecord *prev = nullptr;
-    while (it != index_.cend()) {
-        const IndexedDiffRecord *curr = &it->second;
+    for (const IndexedDiffRecord& rec : recV_) {
+        const IndexedDiffRecord *curr = &rec;
         if (prev) {
             if (!(prev->io_address < curr->io_address)) {
                 throw RT_ERR("Not sorted.");
@@ -288,67 +377,251 @@ void DiffIndexMem::checkNoOverlappedAndSorted() const
             }
         }
         prev = curr;
-        ++it;
     }
 }
 
-std::vector<IndexedDiffRecord> DiffIndexMem::getAsVec() const
+void DiffIndexMem::resolve() const
 {
-    std::vector<IndexedDiffRecord> ret;
-    ret.reserve(index_.size());
-    for (const Map::value_type& pair : index_) {
-        ret.push_back(pair.second);
+    if (isResolved_) return;
+
+    /* Indexes of recV_ sorted by address. A larger index means a newer record. */
+    std::vector<uint32_t> idxV(recV_.size());
+    for (size_t i = 0; i < idxV.size(); i++) idxV[i] = i;
+    std::sort(idxV.begin(), idxV.end(), [this](uint32_t a, uint32_t b) {
+            const uint64_t addrA = recV_[a].io_address, addrB = recV_[b].io_address;
+            return addrA < addrB || (addrA == addrB && a < b);
+        });
+
+    std::vector<IndexedDiffRecord> outV;
+    outV.reserve(recV_.size());
+    auto emit = [&](const IndexedDiffRecord& rec, uint64_t addr0, uint64_t addr1) {
+        IndexedDiffRecord r = rec;
+        r.io_address = addr0;
+        r.io_blocks = addr1 - addr0;
+        r.io_offset += addr0 - rec.io_address;
+        for (const IndexedDiffRecord& r1 : r.split(maxIoBlocks_)) {
+            outV.push_back(r1);
+        }
+    };
+
+    /*
+     * Sweep addresses from the lowest.
+     * The top of the heap is the newest record covering the current address.
+     * Records in the heap that have been passed are removed lazily.
+     */
+    std::priority_queue<uint32_t> heap;
+    size_t i = 0;
+    uint64_t addr = 0;
+    uint32_t owner = 0; // valid if hasOwner is true.
+    uint64_t ownerAddr = 0; // the address where owner started to be the owner.
+    bool hasOwner = false;
+    for (;;) {
+        while (!heap.empty() && recV_[heap.top()].endIoAddress() <= addr) heap.pop();
+        if (heap.empty()) {
+            if (i == idxV.size()) break;
+            addr = recV_[idxV[i]].io_address;
+        }
+        while (i < idxV.size() && recV_[idxV[i]].io_address == addr) {
+            heap.push(idxV[i]);
+            i++;
+        }
+        const uint32_t top = heap.top();
+        if (!hasOwner || owner != top) {
+            if (hasOwner && ownerAddr < addr) emit(recV_[owner], ownerAddr, addr);
+            owner = top;
+            ownerAddr = addr;
+            hasOwner = true;
+        }
+        uint64_t next = recV_[top].endIoAddress();
+        if (i < idxV.size()) next = std::min(next, recV_[idxV[i]].io_address);
+        addr = next;
+        if (recV_[owner].endIoAddress() == addr) {
+            emit(recV_[owner], ownerAddr, addr);
+            hasOwner = false;
+        }
     }
-    return ret;
+    assert(!hasOwner);
+    recV_.swap(outV);
+    isResolved_ = true;
 }
 
-void DiffIndexMem::addDetail(const IndexedDiffRecord &rec)
+void DiffIndexMem::spill()
 {
-    assert(isAlignedIo(rec.io_address, rec.io_blocks));
+    if (tmpDir_.empty()) {
+        throw cybozu::Exception("DiffIndexMem:spill:tmpDir is not set");
+    }
+    resolve();
+    if (!runFile_) runFile_.reset(new cybozu::TmpFile(tmpDir_));
+    cybozu::util::File file(runFile_->fd());
+    file.pwrite(recV_.data(), sizeof(IndexedDiffRecord) * recV_.size(),
+                sizeof(IndexedDiffRecord) * nRunRecs_);
+    runV_.push_back({nRunRecs_, recV_.size()});
+    nRunRecs_ += recV_.size();
+    recV_.clear();
+    isResolved_ = true;
+}
 
-    /* Decide the first item to search. */
-    auto it = index_.lower_bound(rec.io_address);
-    if (it == index_.end()) {
-        if (index_.empty()) {
-            index_.emplace(rec.io_address, rec);
-            return;
-        }
-        --it; // the last item.
-    } else {
-        if (rec.io_address < it->first && it != index_.begin()) {
-            --it; // previous item.
+namespace {
+
+/**
+ * Sequential reader of a run.
+ */
+class IndexRunReader
+{
+    cybozu::util::File file_;
+    uint64_t offset_; // [record] the next record to read from the file.
+    uint64_t end_; // [record]
+    std::vector<IndexedDiffRecord> buf_;
+    size_t pos_;
+
+    static constexpr size_t CHUNK_RECORDS = 1024;
+public:
+    IndexRunReader(int fd, uint64_t offset, uint64_t nr)
+        : file_(fd), offset_(offset), end_(offset + nr), buf_(), pos_(0) {
+    }
+    bool get(IndexedDiffRecord &rec) {
+        if (pos_ == buf_.size()) {
+            if (offset_ == end_) return false;
+            const size_t chunk = CHUNK_RECORDS; // to avoid undefined reference.
+            buf_.resize(std::min<uint64_t>(chunk, end_ - offset_));
+            file_.pread(buf_.data(), sizeof(IndexedDiffRecord) * buf_.size(),
+                        sizeof(IndexedDiffRecord) * offset_);
+            offset_ += buf_.size();
+            pos_ = 0;
         }
+        rec = buf_[pos_++];
+        return true;
     }
+};
 
-    /* Search overlapped items. */
-    uint64_t addr1 = rec.endIoAddress();
-    std::queue<IndexedDiffRecord> q;
-    while (it != index_.end() && it->first < addr1) {
-        IndexedDiffRecord &r = it->second;
-        if (r.isOverlapped(rec)) {
-            q.push(r);
-            it = index_.erase(it);
-        } else {
-            ++it;
-        }
+} // namespace
+
+/**
+ * K-way merge of the runs.
+ * Each run is sorted and not overlapped so each run has at most one record covering an address.
+ * Events are the begin and end addresses of the current record of each run.
+ * The owner of an address is the newest run of which the current record covers the address.
+ */
+void DiffIndexMem::mergeRuns(const Output& output) const
+{
+    const size_t nRuns = runV_.size();
+    std::vector<IndexRunReader> readerV;
+    readerV.reserve(nRuns);
+    std::vector<IndexedDiffRecord> curV(nRuns);
+    std::vector<bool> isActiveV(nRuns, false);
+    using Event = std::pair<uint64_t, uint32_t>; // address and run index.
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event> > evQ;
+    std::set<uint32_t> activeS;
+    for (size_t i = 0; i < nRuns; i++) {
+        readerV.emplace_back(runFile_->fd(), runV_[i].offset, runV_[i].nr);
+        if (readerV[i].get(curV[i])) evQ.push(Event(uint64_t(curV[i].io_address), i));
     }
 
-    /* Eliminate overlaps. */
-    while (!q.empty()) {
-        for (const IndexedDiffRecord &r0 : q.front().minus(rec)) {
-            for (const IndexedDiffRecord &r1 : r0.split(maxIoBlocks_)) {
-                index_.emplace(r1.io_address, r1);
+    std::vector<IndexedDiffRecord> outV;
+    const size_t flushSize = 1024;
+    auto emit = [&](const IndexedDiffRecord& rec, uint64_t addr0, uint64_t addr1) {
+        IndexedDiffRecord r = rec;
+        r.io_address = addr0;
+        r.io_blocks = addr1 - addr0;
+        r.io_offset += addr0 - rec.io_address;
+        for (const IndexedDiffRecord& r1 : r.split(maxIoBlocks_)) {
+            outV.push_back(r1);
+        }
+        if (outV.size() >= flushSize) {
+            output(outV.data(), outV.size());
+            outV.clear();
+        }
+    };
+
+    uint32_t owner = 0; // valid if hasOwner is true.
+    uint64_t ownerAddr = 0; // the address where owner started to be the owner.
+    IndexedDiffRecord ownerRec;
+    bool hasOwner = false;
+    while (!evQ.empty()) {
+        const uint64_t addr = evQ.top().first;
+        bool isOwnerEnded = false;
+        while (!evQ.empty() && evQ.top().first == addr) {
+            const uint32_t i = evQ.top().second;
+            evQ.pop();
+            if (isActiveV[i]) {
+                isActiveV[i] = false;
+                activeS.erase(i);
+                if (hasOwner && owner == i) isOwnerEnded = true;
+                if (readerV[i].get(curV[i])) evQ.push(Event(uint64_t(curV[i].io_address), i));
+            } else {
+                isActiveV[i] = true;
+                activeS.insert(i);
+                evQ.push(Event(curV[i].endIoAddress(), i));
             }
         }
-        q.pop();
+        const bool hasNext = !activeS.empty();
+        const uint32_t next = hasNext ? *activeS.rbegin() : 0;
+        if (hasOwner && (isOwnerEnded || !hasNext || next != owner)) {
+            emit(ownerRec, ownerAddr, addr);
+            hasOwner = false;
+        }
+        if (hasNext && !hasOwner) {
+            owner = next;
+            ownerAddr = addr;
+            ownerRec = curV[next];
+            hasOwner = true;
+        }
     }
+    assert(!hasOwner);
+    if (!outV.empty()) output(outV.data(), outV.size());
+}
 
-    index_.emplace(rec.io_address, rec);
+IndexedDiffWriter::~IndexedDiffWriter() noexcept
+{
+    if (isClosed_) return;
+    const char *const name = NAME; // to avoid undefined reference.
+    if (convP_) {
+        LOGs.warn() << name << "finalize() has not been called. wait for IOs in flight.";
+    }
+    try {
+        finalize();
+        return;
+    } catch (std::exception &e) {
+        LOGs.error() << name << "IOs not written and the index are lost" << e.what();
+    } catch (...) {
+        LOGs.error() << name << "IOs not written and the index are lost" << "unknown error";
+    }
+    fail();
+}
+
+void IndexedDiffWriter::start(size_t concurrency, size_t queueSize)
+{
+    if (convP_) throw cybozu::Exception(NAME) << "already started";
+    checkWrittenHeader();
+    convP_.reset(new indexed_diff_local::Converter([](Task &&task) {
+                if (task.doCompress) compressTask(task);
+                return std::move(task);
+            }));
+    convP_->start(concurrency, queueSize, queueSize);
+    writerTh_.set([this]() { runWriter(); });
+    writerTh_.start();
+}
+
+void IndexedDiffWriter::fail() noexcept
+{
+    if (!convP_) return;
+    convP_->fail();
+    writerTh_.joinNoThrow();
+    convP_.reset();
 }
 
 void IndexedDiffWriter::finalize()
 {
     if (isClosed_) return;
+    if (convP_) {
+        try {
+            convP_->sync();
+        } catch (...) {
+            throwWriterErrorOrRethrow();
+        }
+        writerTh_.join();
+        convP_.reset();
+    }
 
     /* Insert padding data for index records to be aligned to 8 bytes. */
     const size_t delta = offset_ % 8;
@@ -359,8 +632,8 @@ void IndexedDiffWriter::finalize()
         offset_ += padding;
     }
 
-    indexMem_.writeTo(fileW_, &stat_);
-    writeSuper();
+    const size_t nRecords = indexMem_.writeTo(fileW_, &stat_, isCompactIndex_);
+    writeSuper(nRecords);
 
     fileW_.close();
     isClosed_ = true;
@@ -373,6 +646,8 @@ void IndexedDiffWriter::writeHeader(DiffFileHeader &header)
             << "do not call writeHeader() more than once.";
     }
     header.type = ::WALB_DIFF_TYPE_INDEXED;
+    header.version = isCompactIndex_ ? WALB_DIFF_VERSION_COMPACT_INDEX : WALB_DIFF_VERSION;
+    header.flags &= ~WALB_DIFF_FILE_FLAG_PACK_INDEX;
     header.writeTo(fileW_);
     assert(offset_ == 0);
     offset_ += header.getSize();
@@ -382,18 +657,19 @@ void IndexedDiffWriter::writeHeader(DiffFileHeader &header)
 void IndexedDiffWriter::writeDiff(const IndexedDiffRecord &rec, const char *data)
 {
     checkWrittenHeader();
-    IndexedDiffRecord r = rec;
-    r.data_offset = offset_;
+    if (!convP_) {
+        writeDiffDetail(rec, data);
+        return;
+    }
+    Task task;
+    task.rec = rec;
+    task.doCompress = false;
     if (rec.isNormal()) {
         assert(data != nullptr);
-        // r.io_checksum must be up-to-date.
-        r.updateRecChecksum();
-        fileW_.write(data, rec.data_size);
-        stat_.dataSize += rec.data_size;
-        offset_ += rec.data_size;
+        task.data.resize(rec.data_size);
+        ::memcpy(task.data.data(), data, rec.data_size);
     }
-    indexMem_.add(r);
-    n_data_++;
+    push(std::move(task));
 }
 
 void IndexedDiffWriter::compressAndWriteDiff(
@@ -407,6 +683,13 @@ void IndexedDiffWriter::compressAndWriteDiff(
         writeDiff(rec, data);
         return;
     }
+    if (convP_) {
+        const size_t size = rec.io_blocks * LOGICAL_BLOCK_SIZE;
+        AlignedArray buf(size, false);
+        ::memcpy(buf.data(), data, size);
+        compressAndWriteDiff(rec, std::move(buf), type, level);
+        return;
+    }
     size_t outSize = 0;
     type = compressData(data, rec.io_blocks * LOGICAL_BLOCK_SIZE,
                         buf_, outSize, type, level);
@@ -417,6 +700,23 @@ void IndexedDiffWriter::compressAndWriteDiff(
     writeDiff(r, buf_.data());
 }
 
+void IndexedDiffWriter::compressAndWriteDiff(
+    const IndexedDiffRecord &rec, AlignedArray &&data, int type, int level)
+{
+    if (!convP_ || !rec.isNormal()) {
+        compressAndWriteDiff(rec, data.data(), type, level);
+        return;
+    }
+    checkWrittenHeader();
+    Task task;
+    task.rec = rec;
+    task.data = std::move(data);
+    task.doCompress = !rec.isCompressed();
+    task.type = type;
+    task.level = level;
+    push(std::move(task));
+}
+
 void IndexedDiffWriter::init()
 {
     indexMem_.clear();
@@ -428,63 +728,174 @@ void IndexedDiffWriter::init()
     stat_.wdiffNr = 1;
 }
 
-void IndexedDiffWriter::writeSuper()
+void IndexedDiffWriter::writeSuper(size_t nRecords)
 {
     DiffIndexSuper super;
     super.init();
     super.index_offset = offset_;
-    super.n_records = indexMem_.size();
+    super.n_records = nRecords;
     super.n_data = n_data_;
     super.updateChecksum();
 
     fileW_.write(&super, sizeof(super));
 }
 
-AlignedArray* IndexedDiffCache::find(Key key)
+void IndexedDiffWriter::push(Task &&task)
 {
-    auto it = map_.find(key);
-    if (it == map_.end()) return nullptr;
-    ListIt lit = it->second;
-
-    std::unique_ptr<AlignedArray> dataPtr = std::move(lit->dataPtr);
-    AlignedArray *ret = dataPtr.get();
+    try {
+        convP_->push(std::move(task));
+    } catch (...) {
+        throwWriterErrorOrRethrow();
+    }
+}
 
-    lruList_.erase(lit);
-    lruList_.push_front({key, std::move(dataPtr)});
-    map_[key] = lruList_.begin(); // update.
+void IndexedDiffWriter::compressTask(Task &task)
+{
+    AlignedArray out;
+    size_t outSize = 0;
+    task.rec.compression_type = compressData(
+        task.data.data(), task.rec.io_blocks * LOGICAL_BLOCK_SIZE,
+        out, outSize, task.type, task.level);
+    task.rec.data_size = outSize;
+    task.rec.io_checksum = calcDiffIoChecksum(out);
+    task.data = std::move(out);
+}
 
-    return ret;
+void IndexedDiffWriter::writeDiffDetail(const IndexedDiffRecord &rec, const char *data)
+{
+    IndexedDiffRecord r = rec;
+    r.data_offset = offset_;
+    if (rec.isNormal()) {
+        assert(data != nullptr);
+        // r.io_checksum must be up-to-date.
+        r.updateRecChecksum();
+        fileW_.write(data, rec.data_size);
+        stat_.dataSize += rec.data_size;
+        offset_ += rec.data_size;
+    }
+    indexMem_.add(r);
+    n_data_++;
 }
 
-void IndexedDiffCache::add(Key key, std::unique_ptr<AlignedArray> &&dataPtr)
+void IndexedDiffWriter::runWriter()
 {
-    if (map_.find(key) != map_.end()) {
-        throw cybozu::Exception("already in cache") << key;
+    try {
+        Task task;
+        while (convP_->pop(task)) {
+            writeDiffDetail(task.rec, task.data.data());
+        }
+    } catch (...) {
+        convP_->fail();
+        throw;
     }
+}
 
-    curBytes_ += dataPtr->size();
-    lruList_.push_front({key, std::move(dataPtr)});
-    map_[key] = lruList_.begin();
+/**
+ * Call this in a catch block.
+ * The error of the writer thread is preferred because it is the cause.
+ */
+void IndexedDiffWriter::throwWriterErrorOrRethrow()
+{
+    convP_->fail();
+    std::exception_ptr ep = writerTh_.joinNoThrow();
+    convP_.reset();
+    if (ep) std::rethrow_exception(ep);
+    throw;
+}
+
+std::string IndexedDiffCache::Stat::str() const
+{
+    return cybozu::util::formatString(
+        "hits %" PRIu64 " misses %" PRIu64 " evictions %" PRIu64 " size %zu maxSize %zu"
+        , hits, misses, evictions, size, maxSize);
+}
 
-    while (curBytes_ > maxBytes_ && map_.size() > 1) {
-        evictOne();
+void IndexedDiffCache::setMaxSize(size_t bytes)
+{
+    maxBytes_ = bytes;
+    const size_t maxShardSize = getMaxShardSize();
+    for (Shard &shard : shards_) {
+        AutoLock lk(shard.mu);
+        evict(shard, maxShardSize);
+    }
+}
+
+IndexedDiffCache::DataPtr IndexedDiffCache::find(const Key &key)
+{
+    Shard &shard = getShard(key);
+    AutoLock lk(shard.mu);
+    auto it = shard.map.find(key);
+    if (it == shard.map.end()) {
+        misses_++;
+        return nullptr;
     }
+    hits_++;
+    shard.lruList.splice(shard.lruList.begin(), shard.lruList, it->second);
+    return it->second->dataPtr;
+}
+
+bool IndexedDiffCache::contains(const Key &key) const
+{
+    const Shard &shard = getShard(key);
+    AutoLock lk(shard.mu);
+    return shard.map.find(key) != shard.map.end();
+}
+
+void IndexedDiffCache::add(const Key &key, DataPtr &&dataPtr)
+{
+    Shard &shard = getShard(key);
+    AutoLock lk(shard.mu);
+    if (shard.map.find(key) != shard.map.end()) return;
+
+    shard.curBytes += dataPtr->size();
+    shard.lruList.push_front({key, std::move(dataPtr)});
+    shard.map.emplace(key, shard.lruList.begin());
+    evict(shard, getMaxShardSize());
 }
 
 void IndexedDiffCache::clear()
 {
-    lruList_.clear();
-    map_.clear();
-    curBytes_ = 0;
+    for (Shard &shard : shards_) {
+        AutoLock lk(shard.mu);
+        shard.lruList.clear();
+        shard.map.clear();
+        shard.curBytes = 0;
+    }
+}
+
+IndexedDiffCache::Stat IndexedDiffCache::getStat() const
+{
+    Stat stat;
+    stat.hits = hits_;
+    stat.misses = misses_;
+    stat.evictions = evictions_;
+    stat.size = 0;
+    for (const Shard &shard : shards_) {
+        AutoLock lk(shard.mu);
+        stat.size += shard.curBytes;
+    }
+    stat.maxSize = maxBytes_;
+    return stat;
+}
+
+/**
+ * The most recently used item is always kept.
+ */
+void IndexedDiffCache::evict(Shard &shard, size_t maxShardSize)
+{
+    while (shard.curBytes > maxShardSize && shard.map.size() > 1) {
+        Item &item = shard.lruList.back();
+        shard.map.erase(item.key);
+        shard.curBytes -= item.dataPtr->size();
+        shard.lruList.pop_back();
+        evictions_++;
+    }
 }
 
-void IndexedDiffCache::evictOne()
+IndexedDiffCache& getSharedIndexedDiffCache()
 {
-    if (lruList_.empty()) return;
-    Item &item = lruList_.back();
-    map_.erase(item.key);
-    curBytes_ -= item.dataPtr->size();
-    lruList_.pop_back();
+    static IndexedDiffCache cache(INDEXED_DIFF_CACHE_SIZE);
+    return cache;
 }
 
 void IndexedDiffReader::setFile(cybozu::util::File &&fileR, IndexedDiffCache &cache)
@@ -493,6 +904,12 @@ void IndexedDiffReader::setFile(cybozu::util::File &&fileR, IndexedDiffCache &ca
         throw cybozu::Exception(NAME)
             << "non-seekable file descriptor is not supported" << fileR.fd();
     }
+    struct stat st;
+    if (::fstat(fileR.fd(), &st) < 0) {
+        throw cybozu::Exception(NAME) << "fstat failed" << cybozu::ErrorNo();
+    }
+    dev_ = st.st_dev;
+    ino_ = st.st_ino;
     cache_ = &cache;
     memFile_.setReadOnly();
     memFile_.reset(std::move(fileR));
@@ -510,39 +927,70 @@ void IndexedDiffReader::setFile(cybozu::util::File &&fileR, IndexedDiffCache &ca
     ::memcpy(&super, &memFile_[idxEndOffset_], sizeof(super));
     super.verify();
     idxBgnOffset_ = super.index_offset;
-    idxOffset_ = idxBgnOffset_;
+    if (idxBgnOffset_ > idxEndOffset_) {
+        throw cybozu::Exception(NAME) << "invalid index offset" << idxBgnOffset_ << idxEndOffset_;
+    }
+    if (header_.hasCompactIndex()) {
+        readCompactBlocks(super.n_records);
+    } else {
+        nrRecords_ = (idxEndOffset_ - idxBgnOffset_) / sizeof(IndexedDiffRecord);
+    }
+    idx_ = 0;
 
     stat_.clear();
     stat_.wdiffNr = 1;
     stat_.dataSize = idxBgnOffset_ - sizeof(header_);
+
+    readAheadNr_ = 0;
+    raIdx_ = 0;
+    decompP_.reset();
+}
+
+void IndexedDiffReader::setReadAhead(size_t nr, size_t nrThreads)
+{
+    readAheadNr_ = nr;
+    raIdx_ = idx_;
+    decompP_.reset();
+    if (nr == 0 || nrThreads == 0) return;
+    decompP_.reset(new Decompressor([this](IndexedDiffRecord &&rec) {
+                return loadData(rec, true);
+            }));
+    // A batch never blocks push() since it has at most nr + 1 records.
+    decompP_->start(nrThreads, nr + 1, nr + 1);
 }
 
 bool IndexedDiffReader::readDiffRecord(IndexedDiffRecord &rec, bool doVerify)
 {
     if (!getNextRec(rec)) return false;
-    if (doVerify) rec.verify();
+    if (readAheadNr_ > 0) adviseReadAhead();
+    // Records decoded from compact index blocks have no rec_checksum. The block checksum was verified instead.
+    if (doVerify) rec.verify(!header_.hasCompactIndex());
     stat_.update(rec);
     return true;
 }
 
 bool IndexedDiffReader::isOnCache(const IndexedDiffRecord &rec) const
 {
-    const IndexedDiffCache::Key key{this, rec.data_offset};
-    return cache_->find(key) != nullptr;
+    return cache_->find(getCacheKey(rec)) != nullptr;
 }
 
 bool IndexedDiffReader::loadToCache(const IndexedDiffRecord &rec, bool throwError)
 {
-    assert(!isOnCache(rec));
+    IndexedDiffCache::DataPtr p = loadData(rec, throwError);
+    if (!p) return false;
+    cache_->add(getCacheKey(rec), std::move(p));
+    return true;
+}
+
+IndexedDiffCache::DataPtr IndexedDiffReader::loadData(const IndexedDiffRecord &rec, bool throwError) const
+{
     if (!verifyIoData(rec.data_offset, rec.data_size, rec.io_checksum, throwError)) {
-        return false;
+        return nullptr;
     }
-    std::unique_ptr<AlignedArray> p(new AlignedArray());
+    std::shared_ptr<AlignedArray> p = std::make_shared<AlignedArray>();
     p->resize(rec.orig_blocks * LOGICAL_BLOCK_SIZE);
     uncompressData(&memFile_[rec.data_offset], rec.data_size, *p, rec.compression_type);
-    const IndexedDiffCache::Key key{this, rec.data_offset};
-    cache_->add(key, std::move(p));
-    return true;
+    return p;
 }
 
 /**
@@ -555,27 +1003,173 @@ void IndexedDiffReader::readDiffIo(const IndexedDiffRecord &rec, AlignedArray &d
         throw cybozu::Exception(NAME) << "BUG: cache_ must be set.";
     }
 
-    const IndexedDiffCache::Key key{this, rec.data_offset};
-    AlignedArray *aryPtr = cache_->find(key);
-    if (aryPtr == nullptr) {
-        loadToCache(rec);
-        aryPtr = cache_->find(key);
+    const IndexedDiffCache::Key key = getCacheKey(rec);
+    IndexedDiffCache::DataPtr p = cache_->find(key);
+    if (!p && decompP_) {
+        p = loadDataBatch(rec);
+    } else if (!p) {
+        p = loadData(rec, true);
+        cache_->add(key, IndexedDiffCache::DataPtr(p));
     }
 
     const size_t offset = rec.io_offset * LOGICAL_BLOCK_SIZE;
     const size_t size = rec.io_blocks * LOGICAL_BLOCK_SIZE;
     data.resize(size);
-    ::memcpy(data.data(), &(*aryPtr)[offset], size);
+    ::memcpy(data.data(), &(*p)[offset], size);
+}
+
+bool IndexedDiffReader::readStoredDiffIo(const IndexedDiffRecord &rec, AlignedArray &data) const
+{
+    assert(rec.isNormal());
+    if (rec.io_offset != 0 || rec.io_blocks != rec.orig_blocks) return false;
+    verifyIoData(rec.data_offset, rec.data_size, rec.io_checksum, true);
+    data.resize(rec.data_size, false);
+    ::memcpy(data.data(), &memFile_[rec.data_offset], rec.data_size);
+    return true;
+}
+
+void IndexedDiffReader::seek(uint64_t addr)
+{
+    size_t bgn = 0, end = getNrRecords();
+    while (bgn < end) {
+        const size_t mid = (bgn + end) / 2;
+        if (getRec(mid).endIoAddress() <= addr) {
+            bgn = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    idx_ = bgn;
+    raIdx_ = idx_;
 }
 
 bool IndexedDiffReader::getNextRec(IndexedDiffRecord& rec)
 {
-    if (idxOffset_ >= idxEndOffset_) return false;
-    ::memcpy(&rec, &memFile_[idxOffset_], sizeof(rec));
-    idxOffset_ += sizeof(rec);
+    if (idx_ >= nrRecords_) return false;
+    rec = getRec(idx_);
+    idx_++;
     return true;
 }
 
+/**
+ * Only the block headers are read here.
+ * The checksum of a block is verified when it is decoded.
+ */
+void IndexedDiffReader::readCompactBlocks(size_t nrRecords)
+{
+    blkV_.clear();
+    blkRecV_.clear();
+    blkIdx_ = SIZE_MAX;
+    size_t off = idxBgnOffset_;
+    size_t recIdx = 0;
+    while (off < idxEndOffset_) {
+        const walb_diff_compact_index_block blk =
+            readDiffCompactIndexBlockHeader(&memFile_[off], idxEndOffset_ - off);
+        blkV_.push_back({off, recIdx});
+        recIdx += blk.n_records;
+        off += blk.size;
+    }
+    if (recIdx != nrRecords) {
+        throw cybozu::Exception(NAME) << "invalid number of records" << recIdx << nrRecords;
+    }
+    nrRecords_ = nrRecords;
+}
+
+void IndexedDiffReader::loadCompactBlock(size_t idx) const
+{
+    assert(idx < nrRecords_);
+    auto it = std::upper_bound(
+        blkV_.begin(), blkV_.end(), idx,
+        [](size_t i, const CompactBlock &blk) { return i < blk.recIdx; });
+    assert(it != blkV_.begin());
+    --it;
+    decodeDiffCompactIndexBlock(&memFile_[it->offset], idxEndOffset_ - it->offset, blkRecV_);
+    blkIdx_ = it - blkV_.begin();
+}
+
+/**
+ * Uncompress the IO data of rec and the next records not in the cache in parallel.
+ * The total size is limited not to evict the data from the cache before they are read.
+ * RETURN:
+ *   the IO data of rec.
+ */
+IndexedDiffCache::DataPtr IndexedDiffReader::loadDataBatch(const IndexedDiffRecord &rec)
+{
+    std::vector<IndexedDiffRecord> recV{rec};
+    std::vector<IndexedDiffCache::Key> keyV{getCacheKey(rec)};
+    size_t bytes = rec.orig_blocks * LOGICAL_BLOCK_SIZE;
+    const size_t maxBytes = cache_->getMaxSize() / 4;
+    const size_t end = std::min(nrRecords_, idx_ + readAheadNr_);
+    for (size_t i = idx_; i < end && bytes < maxBytes; i++) {
+        const IndexedDiffRecord r = getRec(i);
+        if (!r.isNormal()) continue;
+        const IndexedDiffCache::Key key = getCacheKey(r);
+        const bool found = std::any_of(keyV.begin(), keyV.end(), [&](const IndexedDiffCache::Key &k) {
+                return k.addr == key.addr && k.csum == key.csum;
+            });
+        if (found || cache_->contains(key)) continue;
+        recV.push_back(r);
+        keyV.push_back(key);
+        bytes += r.orig_blocks * LOGICAL_BLOCK_SIZE;
+    }
+    for (const IndexedDiffRecord &r : recV) {
+        decompP_->push(IndexedDiffRecord(r));
+    }
+    IndexedDiffCache::DataPtr ret;
+    for (size_t i = 0; i < recV.size(); i++) {
+        IndexedDiffCache::DataPtr p;
+        if (!decompP_->pop(p)) {
+            throw cybozu::Exception(NAME) << "BUG: decompressor stopped";
+        }
+        if (i == 0) ret = p;
+        cache_->add(keyV[i], std::move(p));
+    }
+    return ret;
+}
+
+/**
+ * Advise the data extents of the records in [idx_, idx_ + readAheadNr_)
+ * not advised yet when half of them have been read.
+ */
+void IndexedDiffReader::adviseReadAhead()
+{
+    if (idx_ + readAheadNr_ / 2 < raIdx_) return;
+    const size_t bgn = std::max(raIdx_, idx_);
+    const size_t end = std::min(nrRecords_, idx_ + readAheadNr_);
+    std::vector<std::pair<uint64_t, uint64_t> > v; // [bgn, end) in the file.
+    for (size_t i = bgn; i < end; i++) {
+        const IndexedDiffRecord rec = getRec(i);
+        if (!rec.isNormal()) continue;
+        v.emplace_back(rec.data_offset, rec.data_offset + rec.data_size);
+    }
+    raIdx_ = end;
+    if (v.empty()) return;
+    std::sort(v.begin(), v.end());
+    /* Merge extents not far from each other. */
+    const uint64_t gap = 4 * KIBI;
+    uint64_t rangeB = v[0].first, rangeE = v[0].second;
+    for (size_t i = 1; i < v.size(); i++) {
+        if (v[i].first <= rangeE + gap) {
+            rangeE = std::max(rangeE, v[i].second);
+            continue;
+        }
+        adviseWillNeed(rangeB, rangeE);
+        rangeB = v[i].first;
+        rangeE = v[i].second;
+    }
+    adviseWillNeed(rangeB, rangeE);
+}
+
+/**
+ * Read-ahead failure is not an error because the data will be read anyway.
+ */
+void IndexedDiffReader::adviseWillNeed(uint64_t bgn, uint64_t end)
+{
+    if (memFile_.advise(bgn, end - bgn, MADV_WILLNEED)) return;
+    const char *const name = NAME; // to avoid undefined reference.
+    LOGs.debug() << name << "madvise failed" << bgn << end << cybozu::ErrorNo().toString();
+}
+
 bool IndexedDiffReader::verifyIoData(uint64_t offset, uint32_t size, uint32_t csum, bool throwError) const
 {
     if (cybozu::util::calcChecksum(&memFile_[offset], size, 0) == csum) {
@@ -4,10 +4,16 @@
  * @brief walb diff utiltities for files.
  */
 #include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <atomic>
 #include "walb_diff_pack.hpp"
 #include "walb_diff_stat.hpp"
+#include "walb_diff_compact_index.hpp"
 #include "uuid.hpp"
 #include "mmap_file.hpp"
+#include "thread_util.hpp"
+#include "tmp_file.hpp"
 #include "cybozu/exception.hpp"
 
 namespace walb {
@@ -54,6 +60,18 @@ struct DiffFileHeader : walb_diff_file_header
 
     bool isIndexed() const;
     std::string typeStr() const;
+    /**
+     * Sorted wdiff files with the flag have a pack index at the end.
+     */
+    bool hasPackIndex() const {
+        return type == WALB_DIFF_TYPE_SORTED && (flags & WALB_DIFF_FILE_FLAG_PACK_INDEX) != 0;
+    }
+    /**
+     * Indexed wdiff files of version 3 have compact index blocks instead of index records.
+     */
+    bool hasCompactIndex() const {
+        return type == WALB_DIFF_TYPE_INDEXED && version == WALB_DIFF_VERSION_COMPACT_INDEX;
+    }
 
     void init() {
         ::memset(this, 0, getSize());
@@ -72,11 +90,15 @@ struct DiffFileHeader : walb_diff_file_header
     }
 };
 
+/**
+ * @hasPackIndex the pack index must be written after the end pack if true.
+ */
 template <class Writer>
-void writeDiffFileHeader(Writer& writer, const cybozu::Uuid &uuid)
+void writeDiffFileHeader(Writer& writer, const cybozu::Uuid &uuid, bool hasPackIndex = false)
 {
     DiffFileHeader fileH;
     fileH.setUuid(uuid);
+    if (hasPackIndex) fileH.flags |= WALB_DIFF_FILE_FLAG_PACK_INDEX;
     fileH.writeTo(writer);
 }
 
@@ -90,8 +112,64 @@ void writeDiffEofPack(Writer& writer)
     pack.writeTo(writer);
 }
 
+/**
+ * Pack index of a sorted wdiff file with WALB_DIFF_FILE_FLAG_PACK_INDEX.
+ * It maps the first IO address of each pack to the offset of the pack.
+ * Packs can be located without reading the packs before them.
+ */
+class DiffPackIndex /* final */
+{
+private:
+    std::vector<walb_diff_pack_index_record> recV_;
+public:
+    void clear() { recV_.clear(); }
+    size_t size() const { return recV_.size(); }
+    const walb_diff_pack_index_record &operator[](size_t i) const { return recV_[i]; }
+    /**
+     * @pack pack header. Empty packs are ignored.
+     * @offset [byte] offset of the pack header in the file.
+     */
+    void add(const DiffPackHeader &pack, uint64_t offset) {
+        if (pack.n_records == 0) return;
+        walb_diff_pack_index_record rec;
+        rec.io_address = pack[0].io_address;
+        rec.offset = offset;
+        recV_.push_back(rec);
+    }
+    /**
+     * Write the index and its super block.
+     * @offset [byte] offset of the index in the file, that is just after the end pack.
+     */
+    template <typename Writer>
+    void writeTo(Writer &writer, uint64_t offset) const {
+        const size_t size = recV_.size() * sizeof(walb_diff_pack_index_record);
+        DiffPackIndexSuper super;
+        super.init();
+        super.index_offset = offset;
+        super.n_records = recV_.size();
+        super.index_checksum = cybozu::util::calcChecksum(recV_.data(), size, 0);
+        super.updateChecksum();
+        if (size > 0) writer.write(recV_.data(), size);
+        writer.write(&super, sizeof(super));
+    }
+    /**
+     * Read the index at the end of the file.
+     * The file position will be restored.
+     */
+    void readFrom(cybozu::util::File &fileR);
+    /**
+     * RETURN:
+     *   index of the last pack of which first IO address <= addr,
+     *   or 0 if there is no such pack.
+     *   IOs in the packs before it all end at or before addr
+     *   since IOs are sorted and not overlapped.
+     */
+    size_t find(uint64_t addr) const;
+};
+
 /**
  * Walb diff writer.
+ * The pack index is written after the end pack and its flag is set in the header.
  */
 class SortedDiffWriter /* final */
 {
@@ -99,6 +177,8 @@ private:
     cybozu::util::File fileW_;
     bool isWrittenHeader_;
     bool isClosed_;
+    uint64_t offset_; // [byte] written size from the beginning of the header.
+    DiffPackIndex packIdx_;
 
     /* Buffers. */
     ExtendedDiffPackHeader edp_;
@@ -183,6 +263,8 @@ private:
 
     void writeEof() {
         writeDiffEofPack(fileW_);
+        offset_ += WALB_DIFF_PACK_SIZE;
+        packIdx_.writeTo(fileW_, offset_);
     }
     void checkWrittenHeader() const {
         if (!isWrittenHeader_) {
@@ -213,6 +295,7 @@ private:
     DiffPackHeader &pack_;
     uint16_t recIdx_;
     uint32_t totalSize_;
+    DiffPackIndex packIdx_;
 
     DiffStatistics stat_;
 
@@ -287,6 +370,28 @@ public:
     bool readAndUncompressDiff(DiffRecord &rec, AlignedArray &buf, bool calcChecksum = true);
 
     bool prepareRead();
+    /**
+     * Read the pack index of a file with the flag
+     * so that seek() jumps to the target pack directly.
+     * The file must be seekable.
+     */
+    void readPackIndex() {
+        packIdx_.readFrom(fileR_);
+    }
+    /**
+     * Skip IOs that end at or before addr.
+     * Packs all of which IOs are skipped are seeked over without reading their IO data.
+     * If the pack index has been read, the packs before the target one are not read at all.
+     * Call this before reading any IO.
+     */
+    void seek(uint64_t addr);
+    /**
+     * Skip IO data of the rest of the current pack and read the next pack header.
+     * This is useful to scan the records without reading IO data.
+     * RETURN:
+     *   nullptr if the input stream reached the end.
+     */
+    const DiffPackHeader* readNextPackHeader();
     /**
      * Read a diff IO.
      * @rec diff record.
@@ -303,70 +408,182 @@ private:
 };
 
 
+/**
+ * In-memory index of an indexed diff file.
+ *
+ * Records are appended to a flat vector as they come,
+ * and overlaps are resolved in one pass when the index is used:
+ * sort the records by address and sweep them with a heap of the newest covering record.
+ * This avoids a heap allocation and a tree search per record.
+ *
+ * If setSpill() is called, the resolved records are appended to a temporary file
+ * as a run whenever the records in memory exceed the size,
+ * and writeTo() merges the runs, where newer runs win at overlapped blocks.
+ * The memory usage is then bounded regardless of the number of records.
+ */
 class DiffIndexMem
 {
 private:
-    using Map = std::map<uint64_t, IndexedDiffRecord>;
-    Map index_; // key: io_address.
+    /*
+     * Appended records. The order is the order of add().
+     * If isResolved_ is true, they are sorted and not overlapped.
+     */
+    mutable std::vector<IndexedDiffRecord> recV_;
+    mutable bool isResolved_;
     uint32_t maxIoBlocks_;
 
-    void addDetail(const IndexedDiffRecord &rec);
+    struct Run
+    {
+        uint64_t offset; // [record] in the run file.
+        uint64_t nr; // number of records.
+    };
+    std::string tmpDir_;
+    size_t maxMemSize_; // 0 means unlimited.
+    std::unique_ptr<cybozu::TmpFile> runFile_;
+    std::vector<Run> runV_; // older runs first.
+    uint64_t nRunRecs_;
+
+    using Output = std::function<void(const IndexedDiffRecord *, size_t)>;
+
+    void resolve() const;
+    void spill();
+    void mergeRuns(const Output& output) const;
 public:
-    DiffIndexMem() : index_(), maxIoBlocks_(DEFAULT_MAX_IO_LB) {}
+    DiffIndexMem()
+        : recV_(), isResolved_(true), maxIoBlocks_(DEFAULT_MAX_IO_LB)
+        , tmpDir_(), maxMemSize_(0), runFile_(), runV_(), nRunRecs_(0) {
+    }
     void setMaxIoBlocks(uint32_t maxIoBlocks) { maxIoBlocks_ = maxIoBlocks; }
+    /**
+     * Spill runs to a temporary file in tmpDir
+     * when the records in memory exceed maxMemSize [byte]. 0 means unlimited.
+     */
+    void setSpill(const std::string &tmpDir, size_t maxMemSize) {
+        tmpDir_ = tmpDir;
+        maxMemSize_ = maxMemSize;
+    }
     void add(const IndexedDiffRecord &rec) {
-        for (const IndexedDiffRecord& r : rec.split(maxIoBlocks_)) {
-            addDetail(r);
-        }
+        recV_.push_back(rec);
+        isResolved_ = false;
+        if (maxMemSize_ > 0 && recV_.size() * sizeof(IndexedDiffRecord) >= maxMemSize_) spill();
     }
     void clear() {
-        index_.clear();
+        recV_.clear();
+        isResolved_ = true;
+        runFile_.reset();
+        runV_.clear();
+        nRunRecs_ = 0;
     }
+    /**
+     * isCompact: write compact index blocks instead of the records.
+     * RETURN:
+     *   number of written records.
+     */
     template<class Writer>
-    void writeTo(Writer& writer, DiffStatistics *stat = nullptr) const {
-        for (const Map::value_type& pair : index_) {
-            const IndexedDiffRecord& rec = pair.second;
-            writer.write(&rec, sizeof(rec));
-            if (stat) stat->update(rec);
+    size_t writeTo(Writer& writer, DiffStatistics *stat = nullptr, bool isCompact = false) {
+        size_t nr = 0;
+        DiffCompactIndexEncoder encoder;
+        auto output = [&](const IndexedDiffRecord *recs, size_t n) {
+            if (isCompact) {
+                encoder.add(writer, recs, n);
+            } else {
+                writer.write(recs, sizeof(IndexedDiffRecord) * n);
+            }
+            if (stat) {
+                for (size_t i = 0; i < n; i++) stat->update(recs[i]);
+            }
+            nr += n;
+        };
+        if (runV_.empty()) {
+            resolve();
+            if (!recV_.empty()) output(recV_.data(), recV_.size());
+        } else {
+            if (!recV_.empty()) spill();
+            mergeRuns(output);
         }
+        encoder.flush(writer);
+        return nr;
     }
-    size_t size() const { return index_.size(); }
+    /**
+     * Number of records in memory.
+     */
+    size_t size() const {
+        resolve();
+        return recV_.size();
+    }
+    size_t getNRuns() const { return runV_.size(); }
 
     /**
      * for debug and test.
+     * Spilled records are not checked.
      */
     void checkNoOverlappedAndSorted() const;
 
     /**
      * For debug and test.
+     * Spilled records are not included.
      */
-    std::vector<IndexedDiffRecord> getAsVec() const;
+    std::vector<IndexedDiffRecord> getAsVec() const {
+        resolve();
+        return recV_;
+    }
 };
 
 
+namespace indexed_diff_local {
+
+/**
+ * An IO to be compressed by a worker of IndexedDiffWriter.
+ */
+struct Task
+{
+    IndexedDiffRecord rec;
+    AlignedArray data;
+    bool doCompress;
+    int type;
+    int level;
+};
+
+using Converter = cybozu::thread::ParallelConverter<Task, Task>;
+
+} // namespace indexed_diff_local
+
+
 /**
  * Indexed diff writer.
+ *
+ * Call start() to compress IO data by worker threads.
+ * IOs are written to the file in the order of push
+ * so data_offset of each record is the same as synchronous mode.
  */
 class IndexedDiffWriter /* final */
 {
 private:
+    using Task = indexed_diff_local::Task;
+
     cybozu::util::File fileW_;
     bool isWrittenHeader_;
     bool isClosed_;
     uint64_t offset_;
     uint64_t n_data_;
     DiffIndexMem indexMem_;
+    bool isCompactIndex_;
     DiffStatistics stat_;
     AlignedArray buf_;
 
+    std::unique_ptr<indexed_diff_local::Converter> convP_;
+    cybozu::thread::ThreadRunner writerTh_;
+
 public:
-    IndexedDiffWriter() {
+    IndexedDiffWriter() : isCompactIndex_(false) {
         init();
     }
-    ~IndexedDiffWriter() noexcept try {
-        finalize();
-    } catch (...) {
-    }
+    /**
+     * IOs in flight will be waited for if finalize() has not been called.
+     * If they can not be written, the index will not be written either,
+     * so the file will not look valid.
+     */
+    ~IndexedDiffWriter() noexcept;
     void setFd(int fd) {
         init();
         fileW_.setFd(fd);
@@ -382,6 +599,21 @@ public:
         fileW_.open(diffPath, flags, mode);
         isClosed_ = false;
     }
+    /**
+     * Start worker threads to compress IO data and a thread to write them in order.
+     * Call this after writeHeader().
+     * queueSize: max number of IOs waiting for a worker or the writer.
+     *            0 means concurrency * 2.
+     */
+    void start(size_t concurrency, size_t queueSize = 0);
+    /**
+     * Stop threads started by start() in error cases.
+     * IOs not written yet will be discarded.
+     */
+    void fail() noexcept;
+    /**
+     * This will wait for the IOs pushed before.
+     */
     void finalize();
     void writeHeader(DiffFileHeader &header);
     /**
@@ -394,12 +626,32 @@ public:
      */
     void compressAndWriteDiff(const IndexedDiffRecord &rec, const char *data,
                               int type = ::WALB_DIFF_CMPR_SNAPPY, int level = 0);
+    /**
+     * This will avoid copying the data in asynchronous mode.
+     */
+    void compressAndWriteDiff(const IndexedDiffRecord &rec, AlignedArray &&data,
+                              int type = ::WALB_DIFF_CMPR_SNAPPY, int level = 0);
 
+    /**
+     * Call this after finalize() in asynchronous mode.
+     */
     const DiffStatistics& getStat() const {
         return stat_;
     }
 
     void setMaxIoBlocks(uint32_t maxIoBlocks) { indexMem_.setMaxIoBlocks(maxIoBlocks); }
+    /**
+     * Write compact index blocks instead of index records.
+     * The file version will be WALB_DIFF_VERSION_COMPACT_INDEX.
+     * Call this before writeHeader().
+     */
+    void setCompactIndex(bool isCompactIndex) { isCompactIndex_ = isCompactIndex; }
+    /**
+     * Bound the memory to build the index. See DiffIndexMem::setSpill().
+     */
+    void setIndexSpill(const std::string &tmpDir, size_t maxMemSize) {
+        indexMem_.setSpill(tmpDir, maxMemSize);
+    }
 
     /**
      * for debug and test.
@@ -412,64 +664,133 @@ public:
 
 private:
     void init();
-    void writeSuper();
+    void writeSuper(size_t nRecords);
     void checkWrittenHeader() const {
         if (!isWrittenHeader_) {
             throw cybozu::Exception(NAME) <<
                 "checkWrittenHeader: call writeHeader() before writeDiff().";
         }
     }
+    void push(Task &&task);
+    static void compressTask(Task &task);
+    void writeDiffDetail(const IndexedDiffRecord &rec, const char *data);
+    void runWriter();
+    void throwWriterErrorOrRethrow();
 };
 
 
+/**
+ * Cache of uncompressed IO data of indexed diff files.
+ *
+ * This is thread-safe and shared by readers of any files in a process.
+ * See getSharedIndexedDiffCache().
+ * Items are distributed to shards by the key hash.
+ * Each shard has its own lock and LRU list so that threads rarely wait for each other.
+ * The max size is divided equally among the shards.
+ */
 class IndexedDiffCache /* final */
 {
 public:
     struct Key {
-        const void *tag;
-        uint64_t addr;
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t addr; // data offset in the file.
+        uint32_t csum; // io_checksum. This avoids stale data of a removed file of the same inode number.
 
         friend inline std::ostream& operator<<(std::ostream& os, const Key& key) {
-            os << "(" << key.tag << "," << key.addr << ")";
+            os << "(" << key.dev << "," << key.ino << "," << key.addr << "," << key.csum << ")";
             return os;
         }
     };
+    using DataPtr = std::shared_ptr<const AlignedArray>;
+
+    struct Stat {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t size; // [byte]
+        size_t maxSize; // [byte]
+
+        std::string str() const;
+    };
 private:
     struct HashKey {
-        size_t operator()(Key key) const {
-            size_t h0 = std::hash<uintptr_t>()(uintptr_t(key.tag));
-            size_t h1 = std::hash<uint64_t>()(key.addr);
-            // like boost::hash_combine().
-            return h0 ^ (h1 + 0x9e3779b9 + (h0 << 6) + (h0 >> 2));
+        size_t operator()(const Key &key) const {
+            size_t h = std::hash<uint64_t>()(key.dev);
+            for (uint64_t v : {key.ino, key.addr, uint64_t(key.csum)}) {
+                // like boost::hash_combine().
+                h ^= std::hash<uint64_t>()(v) + 0x9e3779b9 + (h << 6) + (h >> 2);
+            }
+            return h;
         }
     };
     struct EqualKey {
-        bool operator()(Key lhs, Key rhs) const {
-            return lhs.tag == rhs.tag && lhs.addr == rhs.addr;
+        bool operator()(const Key &lhs, const Key &rhs) const {
+            return lhs.dev == rhs.dev && lhs.ino == rhs.ino &&
+                lhs.addr == rhs.addr && lhs.csum == rhs.csum;
         }
     };
     struct Item {
         Key key;
-        std::unique_ptr<AlignedArray> dataPtr;
+        DataPtr dataPtr;
     };
 
     using ListIt = std::list<Item>::iterator;
 
-    size_t maxBytes_;
-    size_t curBytes_;
-    std::list<Item> lruList_;
-    std::unordered_map<Key, ListIt, HashKey, EqualKey> map_;
+    struct Shard {
+        mutable std::mutex mu;
+        size_t curBytes;
+        std::list<Item> lruList;
+        std::unordered_map<Key, ListIt, HashKey, EqualKey> map;
+
+        Shard() : mu(), curBytes(0), lruList(), map() {}
+    };
+    static constexpr size_t NR_SHARDS = 16;
+
+    std::atomic<size_t> maxBytes_;
+    Shard shards_[NR_SHARDS];
+    std::atomic<uint64_t> hits_, misses_, evictions_;
+
+    using AutoLock = std::lock_guard<std::mutex>;
 
 public:
-    IndexedDiffCache() : maxBytes_(0), curBytes_(0), lruList_(), map_() {}
-    void setMaxSize(size_t bytes) { maxBytes_ = bytes; }
-    AlignedArray* find(Key key);
-    void add(Key key, std::unique_ptr<AlignedArray> &&dataPtr);
+    explicit IndexedDiffCache(size_t maxBytes = 0)
+        : maxBytes_(maxBytes), shards_(), hits_(0), misses_(0), evictions_(0) {}
+    void setMaxSize(size_t bytes);
+    /**
+     * RETURN:
+     *   nullptr if not found.
+     */
+    DataPtr find(const Key &key);
+    /**
+     * This does not change the LRU order and the statistics.
+     */
+    bool contains(const Key &key) const;
+    size_t getMaxSize() const { return maxBytes_; }
+    /**
+     * Nothing will be done if the key has been added by another thread.
+     */
+    void add(const Key &key, DataPtr &&dataPtr);
     void clear();
+    Stat getStat() const;
 private:
-    void evictOne();
+    Shard& getShard(const Key &key) {
+        return shards_[HashKey()(key) % NR_SHARDS];
+    }
+    const Shard& getShard(const Key &key) const {
+        return shards_[HashKey()(key) % NR_SHARDS];
+    }
+    size_t getMaxShardSize() const {
+        return maxBytes_.load() / NR_SHARDS;
+    }
+    void evict(Shard &shard, size_t maxShardSize);
 };
 
+/**
+ * The cache shared by all the readers in the process.
+ * Its max size is INDEXED_DIFF_CACHE_SIZE by default.
+ */
+IndexedDiffCache& getSharedIndexedDiffCache();
 
 
 /**
@@ -481,33 +802,90 @@ private:
     cybozu::util::MmappedFile memFile_;
 
     DiffFileHeader header_;
+    uint64_t dev_, ino_; // identify the file in the cache.
     size_t idxBgnOffset_;
     size_t idxEndOffset_;
-    size_t idxOffset_;
+    size_t nrRecords_;
+    size_t idx_; // index of the next record.
+
+    /*
+     * Compact index blocks.
+     * Records of a block are decoded when one of them is accessed.
+     */
+    struct CompactBlock
+    {
+        size_t offset; // [byte] in the file.
+        size_t recIdx; // index of the first record.
+    };
+    std::vector<CompactBlock> blkV_;
+    mutable std::vector<IndexedDiffRecord> blkRecV_;
+    mutable size_t blkIdx_; // index of the decoded block in blkV_.
 
     IndexedDiffCache *cache_;
     DiffStatistics stat_;
 
+    /*
+     * Read-ahead.
+     * Data extents of records before raIdx_ have been advised.
+     */
+    size_t readAheadNr_;
+    size_t raIdx_;
+    using Decompressor = cybozu::thread::ParallelConverter<IndexedDiffRecord, IndexedDiffCache::DataPtr>;
+    std::unique_ptr<Decompressor> decompP_;
+
 public:
     constexpr static const char *NAME = "IndexedDiffReader";
     IndexedDiffReader()
-        : memFile_(), header_(), idxBgnOffset_(), idxEndOffset_()
-        , idxOffset_(), cache_(nullptr), stat_() {}
+        : memFile_(), header_(), dev_(), ino_(), idxBgnOffset_(), idxEndOffset_()
+        , nrRecords_(), idx_(), blkV_(), blkRecV_(), blkIdx_()
+        , cache_(nullptr), stat_(), readAheadNr_(0), raIdx_(0), decompP_() {}
     void setFile(cybozu::util::File &&fileR, IndexedDiffCache &cache);
+    /**
+     * Change the cache. Call this before reading any IO.
+     */
+    void setCache(IndexedDiffCache &cache) { cache_ = &cache; }
     const DiffFileHeader& header() const { return header_; }
+    /**
+     * Read ahead the IO data of the next nr records.
+     * Their data extents are advised to the kernel by madvise(MADV_WILLNEED)
+     * so that page faults of a cold file do not block each IO.
+     * If nrThreads > 0, when an IO data is not in the cache,
+     * the not-cached IO data of the next nr records are also uncompressed
+     * by nrThreads threads in a batch and put in the cache.
+     * nr: 0 means no read-ahead (default).
+     * Call this after setFile().
+     */
+    void setReadAhead(size_t nr, size_t nrThreads = 0);
 
     bool readDiffRecord(IndexedDiffRecord &rec, bool doVerify = true);
     /**
      * data will be uncompressed data.
      */
     void readDiffIo(const IndexedDiffRecord &rec, AlignedArray &data);
+    /**
+     * Read the IO data as stored in the file, which may be compressed.
+     * This is possible only if rec covers the whole IO written.
+     * The cache is not used.
+     * RETURN:
+     *   false if rec is a part of the IO written.
+     */
+    bool readStoredDiffIo(const IndexedDiffRecord &rec, AlignedArray &data) const;
     bool readDiff(IndexedDiffRecord &rec, AlignedArray &data) {
         if (!readDiffRecord(rec)) return false;
         readDiffIo(rec, data);
         return true;
     }
+    /**
+     * Move the current position to the first record that ends after addr.
+     * The index is sorted and not overlapped so this uses binary search.
+     */
+    void seek(uint64_t addr);
+    size_t getNrRecords() const { return nrRecords_; }
     const DiffStatistics& getStat() const { return stat_; }
-    void close() { memFile_.reset(); }
+    void close() {
+        decompP_.reset();
+        memFile_.reset();
+    }
 
     /*
      * isOnCache() and loadToCache() are special interface for wdiff-show command.
@@ -515,7 +893,32 @@ public:
     bool isOnCache(const IndexedDiffRecord &rec) const;
     bool loadToCache(const IndexedDiffRecord &rec, bool throwError = true);
 private:
+    IndexedDiffRecord getRec(size_t idx) const {
+        if (!header_.hasCompactIndex()) {
+            IndexedDiffRecord rec;
+            ::memcpy(&rec, &memFile_[idxBgnOffset_ + idx * sizeof(rec)], sizeof(rec));
+            return rec;
+        }
+        if (blkIdx_ >= blkV_.size() || idx < blkV_[blkIdx_].recIdx ||
+            blkV_[blkIdx_].recIdx + blkRecV_.size() <= idx) {
+            loadCompactBlock(idx);
+        }
+        return blkRecV_[idx - blkV_[blkIdx_].recIdx];
+    }
+    void readCompactBlocks(size_t nrRecords);
+    void loadCompactBlock(size_t idx) const;
     bool getNextRec(IndexedDiffRecord& rec);
+    IndexedDiffCache::Key getCacheKey(const IndexedDiffRecord &rec) const {
+        return {dev_, ino_, rec.data_offset, rec.io_checksum};
+    }
+    /**
+     * RETURN:
+     *   nullptr if the data is invalid and throwError is false.
+     */
+    IndexedDiffCache::DataPtr loadData(const IndexedDiffRecord &rec, bool throwError) const;
+    IndexedDiffCache::DataPtr loadDataBatch(const IndexedDiffRecord &rec);
+    void adviseReadAhead();
+    void adviseWillNeed(uint64_t bgn, uint64_t end);
     bool verifyIoData(uint64_t offset, uint32_t size, uint32_t csum, bool throwError) const;
 };
 
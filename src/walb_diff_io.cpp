@@ -68,4 +68,91 @@ void issueDiffPack(cybozu::util::File& file, DiscardType discardType, MemoryDiff
     }
 }
 
+AsyncDiffApplier::AsyncDiffApplier(
+    const std::string& bdevPath, DiscardType discardType, size_t bufferSize, size_t maxIoSize)
+    : file_(bdevPath, O_RDWR | O_DIRECT)
+    , writer_(file_.fd(), bufferSize)
+    , discardType_(discardType)
+    , maxIoSize_(maxIoSize)
+    , pendAddr_(0), pendLb_(0), pendBuf_()
+{
+    if (maxIoSize_ < LOGICAL_BLOCK_SIZE) {
+        throw cybozu::Exception("AsyncDiffApplier:too small maxIoSize") << maxIoSize_;
+    }
+    const uint32_t lbs = cybozu::util::getLogicalBlockSize(file_.fd());
+    if (lbs != LOGICAL_BLOCK_SIZE) {
+        throw cybozu::Exception("AsyncDiffApplier:direct IOs are not aligned to the logical block size")
+            << bdevPath << lbs;
+    }
+}
+
+bool AsyncDiffApplier::isApplicable(const std::string& bdevPath)
+{
+    cybozu::util::File file(bdevPath, O_RDONLY);
+    return cybozu::util::getLogicalBlockSize(file.fd()) == LOGICAL_BLOCK_SIZE;
+}
+
+void AsyncDiffApplier::add(const DiffRecord& rec, const char *iodata)
+{
+    assert(!rec.isCompressed());
+    const int type = decideIoType(rec, discardType_);
+    if (type == Ignore) return;
+    if (type == Discard) {
+        flush();
+        if (!writer_.discard(rec.io_address, rec.io_blocks)) {
+            throw cybozu::Exception("AsyncDiffApplier:out of range") << rec.io_address << rec.io_blocks;
+        }
+        return;
+    }
+    const size_t ioSizeB = rec.io_blocks * LOGICAL_BLOCK_SIZE;
+    if (pendLb_ > 0 && (pendAddr_ + pendLb_ != rec.io_address
+                        || maxIoSize_ < pendLb_ * LOGICAL_BLOCK_SIZE + ioSizeB)) {
+        flush();
+    }
+    if (pendLb_ == 0) pendAddr_ = rec.io_address;
+    const size_t pendSize = pendLb_ * LOGICAL_BLOCK_SIZE;
+    if (pendBuf_.size() < pendSize + ioSizeB) {
+        /* Grow geometrically so that coalesced data are copied a few times at most. */
+        AlignedArray buf(std::max(pendSize + ioSizeB, std::min(pendBuf_.size() * 2, maxIoSize_)), false);
+        ::memcpy(buf.data(), pendBuf_.data(), pendSize);
+        pendBuf_ = std::move(buf);
+    }
+    char *p = pendBuf_.data() + pendSize;
+    if (type == Zero) {
+        ::memset(p, 0, ioSizeB);
+    } else {
+        assert(type == Normal);
+        assert(iodata != nullptr);
+        ::memcpy(p, iodata, ioSizeB);
+    }
+    pendLb_ += rec.io_blocks;
+}
+
+void AsyncDiffApplier::sync()
+{
+    flush();
+    writer_.waitForAll();
+    file_.fdatasync();
+}
+
+void AsyncDiffApplier::finalize()
+{
+    sync();
+    file_.close();
+}
+
+void AsyncDiffApplier::flush()
+{
+    if (pendLb_ == 0) return;
+    /* The buffer is passed to the writer as it is and a new one will be allocated for the next. */
+    AlignedArray buf;
+    buf.swap(pendBuf_);
+    buf.resize(pendLb_ * LOGICAL_BLOCK_SIZE); // shrinking does not reallocate.
+    if (!writer_.prepare(pendAddr_, pendLb_, std::move(buf))) {
+        throw cybozu::Exception("AsyncDiffApplier:out of range") << pendAddr_ << pendLb_;
+    }
+    writer_.submit();
+    pendLb_ = 0;
+}
+
 } // namespace walb
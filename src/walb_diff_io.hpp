@@ -7,6 +7,7 @@
 #include "walb_diff_base.hpp"
 #include "walb_diff_pack.hpp"
 #include "discard_type.hpp"
+#include "bdev_writer.hpp"
 #include "cybozu/exception.hpp"
 
 namespace walb {
@@ -20,4 +21,51 @@ IoType decideIoType(const DiffRecord& rec, DiscardType discardType);
 void issueIo(cybozu::util::File& file, DiscardType discardType, const DiffRecord& rec, const char *iodata, AlignedArray& zero);
 void issueDiffPack(cybozu::util::File& file, DiscardType discardType, MemoryDiffPack& pack, AlignedArray& zero);
 
+/**
+ * Apply diff IOs to a block device with asynchronous direct IOs.
+ * Adjacent normal and all-zero IOs are coalesced into a write of up to maxIoSize.
+ * IOs should be added in the address order without overlap as DiffMerger outputs.
+ */
+class AsyncDiffApplier
+{
+private:
+    cybozu::util::File file_;
+    AsyncBdevWriter writer_;
+    const DiscardType discardType_;
+    const size_t maxIoSize_;
+
+    /* coalesced IO not prepared yet. */
+    uint64_t pendAddr_;
+    uint32_t pendLb_;
+    AlignedArray pendBuf_; // data of the coalesced IO. its size is the capacity.
+
+public:
+    /**
+     * @bufferSize max total size of IOs in flight [byte].
+     * @maxIoSize max size of a coalesced IO [byte].
+     */
+    AsyncDiffApplier(const std::string& bdevPath, DiscardType discardType,
+                     size_t bufferSize = DEFAULT_APPLY_AIO_BUFFER_SIZE, size_t maxIoSize = DIFF_APPLY_MAX_IO_SIZE);
+    /**
+     * Direct IOs of LOGICAL_BLOCK_SIZE are required,
+     * so the logical block size of the device must be LOGICAL_BLOCK_SIZE.
+     */
+    static bool isApplicable(const std::string& bdevPath);
+    /**
+     * rec must not be compressed. iodata is copied.
+     */
+    void add(const DiffRecord& rec, const char *iodata);
+    /**
+     * Wait for all the IOs added so far and sync the device.
+     */
+    void sync();
+    /**
+     * Sync and close the device.
+     */
+    void finalize();
+    const WriteIoStatistics& getStat() const { return writer_.getStat(); }
+private:
+    void flush();
+};
+
 } // namespace walb
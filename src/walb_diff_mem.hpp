@@ -16,7 +16,8 @@ namespace walb {
 
 /**
  * Diff record and its IO data.
- * Data compression is not supported.
+ * Data compression is not supported
+ * except whole IOs passed through by DiffMerger.
  * Checksum is not calculated.
  */
 class DiffRecIo /* final */
@@ -1,4 +1,6 @@
 #include "walb_diff_merge.hpp"
+#include "thread_util.hpp"
+#include "tmp_file.hpp"
 
 namespace walb {
 
@@ -18,6 +20,28 @@ void DiffMerger::Wdiff::setFile(cybozu::util::File &&file, IndexedDiffCache *cac
     }
 }
 
+void DiffMerger::Wdiff::setAddressRange(uint64_t bgnAddr, uint64_t endAddr)
+{
+    assert(!isFilled_ && !isEnd_);
+    if (bgnAddr > 0) {
+        if (isIndexed_) {
+            iReader_.seek(bgnAddr);
+        } else {
+            if (header_.hasPackIndex()) sReader_.readPackIndex();
+            sReader_.seek(bgnAddr);
+        }
+    }
+    endAddr_ = endAddr;
+}
+
+void DiffMerger::Wdiff::startPrefetch(size_t queueSize)
+{
+    assert(!isFilled_ && !isEnd_ && !queP_);
+    queP_.reset(new Queue(queueSize));
+    readerTh_.set([this]() { runPrefetch(); });
+    readerTh_.start();
+}
+
 void DiffMerger::Wdiff::getAndRemoveIo(AlignedArray &buf)
 {
     verifyNotEnd(__func__);
@@ -41,42 +65,110 @@ void DiffMerger::Wdiff::fill() const
     if (isEnd_ || isFilled_) return;
 
     bool success;
-    if (isIndexed_) {
-        success = readIndexedDiff();
+    if (queP_) {
+        success = popPrefetched();
     } else {
-        success = sReader_.readAndUncompressDiff(rec_, buf_, false);
+        success = readNext(rec_, buf_);
+        if (success && mem_) mem_->add(buf_.size());
     }
     if (success) {
         isFilled_ = true;
     } else {
+        buf_.clear();
         isEnd_ = true;
     }
 }
 
-bool DiffMerger::Wdiff::readIndexedDiff() const
+bool DiffMerger::Wdiff::readNext(DiffRecord &rec, AlignedArray &buf) const
+{
+    bool success;
+    if (isIndexed_) {
+        success = readIndexedDiff(rec, buf);
+    } else if (keepsCompressed_) {
+        success = sReader_.readDiff(rec, buf);
+    } else {
+        success = sReader_.readAndUncompressDiff(rec, buf, false);
+    }
+    return success && rec.io_address < endAddr_;
+}
+
+bool DiffMerger::Wdiff::readIndexedDiff(DiffRecord &rec, AlignedArray &buf) const
 {
     IndexedDiffRecord irec;
-    if (!iReader_.readDiff(irec, buf_)) return false;
+    if (!iReader_.readDiffRecord(irec)) return false;
 
     // Convert IndexedDiffRecord to DiffRecord.
-    rec_.init();
-    rec_.io_address = irec.io_address;
-    rec_.io_blocks = irec.io_blocks;
-    rec_.flags = irec.flags;
-    if (!irec.isNormal()) return true;
+    rec.init();
+    rec.io_address = irec.io_address;
+    rec.io_blocks = irec.io_blocks;
+    rec.flags = irec.flags;
+    if (!irec.isNormal()) {
+        buf.clear();
+        return true;
+    }
+    if (keepsCompressed_ && irec.isCompressed() && iReader_.readStoredDiffIo(irec, buf)) {
+        rec.compression_type = irec.compression_type;
+        rec.data_offset = 0; // updated later.
+        rec.data_size = irec.data_size;
+        rec.checksum = irec.io_checksum;
+        return true;
+    }
+    iReader_.readDiffIo(irec, buf);
 
-    rec_.compression_type = ::WALB_DIFF_CMPR_NONE;
-    rec_.data_offset = 0; // updated later.
-    rec_.data_size = irec.io_blocks * LOGICAL_BLOCK_SIZE;
-    rec_.checksum = irec.io_checksum; // not set.
+    rec.compression_type = ::WALB_DIFF_CMPR_NONE;
+    rec.data_offset = 0; // updated later.
+    rec.data_size = irec.io_blocks * LOGICAL_BLOCK_SIZE;
+    rec.checksum = irec.io_checksum; // not set.
 
-    assert(buf_.size() == rec_.data_size);
+    assert(buf.size() == rec.data_size);
+
+    return true;
+}
 
+bool DiffMerger::Wdiff::popPrefetched() const
+{
+    Item item;
+    bool success;
+    try {
+        success = queP_->pop(item);
+    } catch (...) {
+        readerTh_.join(); // throws the error of the reader thread if any.
+        throw;
+    }
+    if (!success) {
+        readerTh_.join();
+        return false;
+    }
+    rec_ = item.rec;
+    buf_ = std::move(item.buf);
+    if (!buf_.empty() && (queuedSize_ -= buf_.size()) == 0) {
+        mem_->notify(); // the reader thread may wait for the queue to be empty.
+    }
     return true;
 }
 
+void DiffMerger::Wdiff::runPrefetch()
+{
+    try {
+        Item item;
+        while (readNext(item.rec, item.buf)) {
+            const size_t size = item.buf.size();
+            /* The merger may wait for this input only if the queue is empty. */
+            mem_->acquire(size, [this]() { return isStopping_ || queuedSize_ == 0; });
+            queuedSize_ += size;
+            queP_->push(std::move(item));
+            item.buf = AlignedArray();
+        }
+        queP_->sync();
+    } catch (...) {
+        queP_->fail();
+        throw;
+    }
+}
+
 void DiffMerger::mergeToFd(int outFd)
 {
+    if (!isHeaderPrepared_) passThroughCompressed_ = true;
     prepare();
     SortedDiffWriter writer;
     writer.setFd(outFd);
@@ -89,64 +181,36 @@ void DiffMerger::mergeToFd(int outFd)
     }
 
     writer.close();
-    assert(wdiffs_.empty());
-    assert(diffMem_.empty());
+    assert(nAlive_ == 0);
     statOut_.update(writer.getStat());
 }
 
-void DiffMerger::mergeToFdInParallel(int outFd, const CompressOpt& cmpr)
-{
-    cybozu::util::File file(outFd);
-    DiffFileHeader header;
-    header.type = ::WALB_DIFF_TYPE_SORTED;
-    header.writeTo(file);
-
-    prepare();
-    const size_t maxPushedNr = cmpr.numCpu * 2 + 1;
-    ConverterQueue conv(maxPushedNr, cmpr.numCpu, true, cmpr.type, cmpr.level);
-
-    DiffRecIo d;
-    DiffPacker packer;
-    size_t pushedNr = 0;
-    while (getAndRemove(d)) {
-        assert(d.isValid());
-        const DiffRecord& rec = d.record();
-        const AlignedArray& buf = d.io();
-        if (packer.add(rec, buf.data())) continue;
-        conv.push(packer.getPackAsArray());
-        pushedNr++;
-        packer.clear();
-        packer.add(rec, buf.data());
-        if (pushedNr < maxPushedNr) continue;
-        AlignedArray pack(conv.pop());
-        file.write(pack.data(), pack.size());
-        pushedNr--;
-    }
-    if (!packer.empty()) {
-        conv.push(packer.getPackAsArray());
-    }
-    conv.quit();
-    for (AlignedArray pack = conv.pop(); !pack.empty(); pack = conv.pop()) {
-        file.write(pack.data(), pack.size());
-    }
-
-    writeDiffEofPack(file);
-}
-
 void DiffMerger::prepare()
 {
     if (!isHeaderPrepared_) {
-        if (wdiffs_.empty()) {
+        if (inputV_.empty()) {
             throw cybozu::Exception(__func__) << "Wdiffs are not set.";
         }
-        const cybozu::Uuid uuid = wdiffs_.back()->header().getUuid();
+        const cybozu::Uuid uuid = inputV_.back().wdiff->header().getUuid();
         if (shouldValidateUuid_) verifyUuid(uuid);
 
         wdiffH_.init();
         wdiffH_.setUuid(uuid);
 
-        removeEndedWdiffs();
-        doneAddr_ = getMinimumAddr();
+        if (bgnAddr_ > 0 || endAddr_ < UINT64_MAX) {
+            for (Input &in : inputV_) in.wdiff->setAddressRange(bgnAddr_, endAddr_);
+        }
+        if (passThroughCompressed_) {
+            for (Input &in : inputV_) in.wdiff->keepCompressed();
+        }
+        for (Input &in : inputV_) in.wdiff->setMemoryBudget(mem_);
+        if (readAheadNr_ > 0) {
+            for (Input &in : inputV_) in.wdiff->setReadAhead(readAheadNr_, readAheadThreads_);
+        }
+        if (prefetchQueueSize_ > 0) {
+            for (Input &in : inputV_) in.wdiff->startPrefetch(prefetchQueueSize_);
+        }
+        for (size_t i = 0; i < inputV_.size(); i++) nextRec(i);
         isHeaderPrepared_ = true;
     }
 }
@@ -155,183 +219,398 @@ bool DiffMerger::getAndRemove(DiffRecIo &recIo)
 {
     assert(isHeaderPrepared_);
     while (mergedQ_.empty()) {
-        moveToDiffMemory();
-        if (!moveToMergedQueue()) {
-            assert(wdiffs_.empty());
+        if (!step()) {
+            assert(nAlive_ == 0);
             return false;
         }
     }
     recIo = std::move(mergedQ_.front());
     mergedQ_.pop();
+    mem_.release(recIo.io().size());
     return true;
 }
 
-uint64_t DiffMerger::getMinimumAddr() const
+void DiffMerger::nextRec(uint32_t idx)
 {
-    uint64_t addr = UINT64_MAX;
-    WdiffPtrList::const_iterator it = wdiffs_.begin();
-    while (it != wdiffs_.end()) {
-        Wdiff &wdiff = **it;
-        DiffRecord rec = wdiff.getFrontRec();
-        addr = std::min(addr, rec.io_address);
-        ++it;
-    }
-    return addr;
+    Input &in = inputV_[idx];
+    mem_.release(in.buf.size());
+    in.buf.clear();
+    in.hasRec = false;
+    if (!in.wdiff) return;
+    Wdiff &wdiff = *in.wdiff;
+    if (wdiff.isEnd()) {
+        statIn_.update(wdiff.getStat());
+        in.wdiff.reset();
+        nAlive_--;
+        return;
+    }
+    in.rec = wdiff.getFrontRec();
+    wdiff.getAndRemoveIo(in.buf);
+    clipRec(in);
+    in.hasRec = true;
+    evQ_.push(Event(uint64_t(in.rec.io_address), idx));
 }
 
-void DiffMerger::moveToDiffMemory()
+void DiffMerger::clipRec(Input &in)
 {
-    size_t nr = tryMoveToDiffMemory();
-    if (nr == 0 && !wdiffs_.empty()) {
-        // Retry with enlarged searchLen_.
-        nr = tryMoveToDiffMemory();
-    }
-    if (!wdiffs_.empty()) {
-        // It must progress.
-        (void)nr;
-        assert(nr > 0);
+    DiffRecord &rec = in.rec;
+    const uint64_t bgn = std::max<uint64_t>(rec.io_address, bgnAddr_);
+    const uint64_t end = std::min<uint64_t>(rec.endIoAddress(), endAddr_);
+    if (bgn == rec.io_address && end == rec.endIoAddress()) return;
+    assert(bgn < end);
+    uncompressRec(in);
+    if (rec.isNormal()) {
+        const size_t off = (bgn - rec.io_address) * LOGICAL_BLOCK_SIZE;
+        AlignedArray buf;
+        util::assignAlignedArray(buf, in.buf.data() + off, (end - bgn) * LOGICAL_BLOCK_SIZE);
+        replaceBuf(in, std::move(buf));
+        rec.data_size = in.buf.size();
     }
+    rec.io_address = bgn;
+    rec.io_blocks = end - bgn;
 }
 
-namespace walb_diff_merge_local {
+void DiffMerger::uncompressRec(Input &in)
+{
+    if (!in.rec.isNormal() || !in.rec.isCompressed()) return;
+    DiffRecord rec;
+    AlignedArray buf;
+    uncompressDiffIo(in.rec, in.buf.data(), rec, buf, false);
+    in.rec = rec;
+    replaceBuf(in, std::move(buf));
+}
 
-struct Range
+void DiffMerger::replaceBuf(Input &in, AlignedArray &&buf)
 {
-    uint64_t bgn;
-    uint64_t end;
+    mem_.add(buf.size());
+    mem_.release(in.buf.size());
+    in.buf = std::move(buf);
+}
 
-    Range() : bgn(0), end(0) {
+bool DiffMerger::step()
+{
+    if (evQ_.empty()) return false;
+    const uint64_t addr = evQ_.top().first;
+    while (!evQ_.empty() && evQ_.top().first == addr) {
+        const uint32_t idx = evQ_.top().second;
+        evQ_.pop();
+        Input &in = inputV_[idx];
+        assert(in.hasRec);
+        if (in.isActive) {
+            /* The current record ends. */
+            if (hasOwner_ && owner_ == idx) {
+                emitOwner(addr);
+                hasOwner_ = false;
+            }
+            in.isActive = false;
+            activeS_.erase(idx);
+            nextRec(idx); // its begin address may be addr.
+        } else {
+            /* The current record begins. */
+            in.isActive = true;
+            activeS_.insert(idx);
+            evQ_.push(Event(in.rec.endIoAddress(), idx));
+        }
     }
-    Range(uint64_t bgn, uint64_t end)
-        : bgn(bgn), end(end) {
+    const bool hasNext = !activeS_.empty();
+    const uint32_t next = hasNext ? *activeS_.rbegin() : 0;
+    if (hasOwner_ && (!hasNext || next != owner_)) {
+        emitOwner(addr);
+        hasOwner_ = false;
     }
-    explicit Range(const DiffRecord &rec) {
-        set(rec);
+    if (hasNext && !hasOwner_) {
+        owner_ = next;
+        ownerAddr_ = addr;
+        hasOwner_ = true;
+    }
+    return true;
+}
+
+void DiffMerger::emitOwner(uint64_t addr)
+{
+    Input &in = inputV_[owner_];
+    const DiffRecord &rec = in.rec;
+    assert(rec.io_address <= ownerAddr_ && ownerAddr_ < addr && addr <= rec.endIoAddress());
+
+    const bool isWhole = ownerAddr_ == rec.io_address && addr == rec.endIoAddress();
+    const bool shouldSplit = maxIoBlocks_ > 0 && maxIoBlocks_ < addr - ownerAddr_;
+    if (rec.isCompressed() && (!isWhole || shouldSplit)) {
+        uncompressRec(in);
     }
-    void set(const DiffRecord &rec) {
-        bgn = rec.io_address;
-        end = rec.endIoAddress();
+
+    DiffRecord r = rec;
+    r.io_address = ownerAddr_;
+    r.io_blocks = addr - ownerAddr_;
+    AlignedArray buf;
+    if (rec.isNormal()) {
+        if (isWhole) {
+            /* The whole record will not be used anymore. It may be compressed. */
+            buf = std::move(in.buf);
+            in.buf.clear();
+        } else {
+            r.data_size = r.io_blocks * LOGICAL_BLOCK_SIZE;
+            const size_t off = (ownerAddr_ - rec.io_address) * LOGICAL_BLOCK_SIZE;
+            util::assignAlignedArray(buf, in.buf.data() + off, r.data_size);
+            mem_.add(buf.size());
+        }
     }
-    bool isOverlapped(const Range &rhs) const {
-        return bgn < rhs.end && rhs.bgn < end;
+    DiffRecIo recIo(r, std::move(buf));
+    if (shouldSplit) {
+        for (DiffRecIo &r1 : recIo.splitAll(maxIoBlocks_)) {
+            mergedQ_.push(std::move(r1));
+        }
+    } else {
+        mergedQ_.push(std::move(recIo));
     }
-    bool isLeftRight(const Range &rhs) const {
-        return end <= rhs.bgn;
+}
+
+void DiffMerger::verifyUuid(const cybozu::Uuid &uuid) const
+{
+    for (const Input &in : inputV_) {
+        const cybozu::Uuid uuid1 = in.wdiff->header().getUuid();
+        if (uuid1 != uuid) {
+            throw cybozu::Exception(__func__) << "uuid differ" << uuid1 << uuid;
+        }
     }
-    void merge(const Range &rhs) {
-        bgn = std::min(bgn, rhs.bgn);
-        end = std::max(end, rhs.end);
+}
+
+namespace diff_merge_local {
+
+/**
+ * Open the file again to get another file description
+ * of which file position is independent of the original one.
+ */
+cybozu::util::File reopenFile(const cybozu::util::File &file)
+{
+    return cybozu::util::File(cybozu::util::formatString("/proc/self/fd/%d", file.fd()), O_RDONLY);
+}
+
+/**
+ * An address and the amount of input IOs from it.
+ */
+using Sample = std::pair<uint64_t, uint64_t>;
+
+const size_t MAX_SAMPLES_PER_WDIFF = 4096;
+
+template <typename Rec>
+uint64_t getWeight(const Rec &rec)
+{
+    return (rec.isNormal() ? rec.io_blocks : 0) + 1;
+}
+
+/**
+ * The file position must be just after the file header.
+ * A sample per pack.
+ */
+void sampleSortedDiff(cybozu::util::File &&file, std::vector<Sample> &sampleV, DiffStatistics &stat)
+{
+    SortedDiffReader reader(std::move(file));
+    reader.dontReadHeader(false);
+    while (const DiffPackHeader *pack = reader.readNextPackHeader()) {
+        if (pack->n_records == 0) continue;
+        uint64_t weight = 0;
+        for (size_t i = 0; i < pack->n_records; i++) weight += getWeight((*pack)[i]);
+        sampleV.emplace_back(uint64_t((*pack)[0].io_address), weight);
     }
-    size_t size() const {
-        assert(end - bgn <= SIZE_MAX);
-        return end - bgn;
+    stat = reader.getStat();
+}
+
+void sampleIndexedDiff(cybozu::util::File &&file, std::vector<Sample> &sampleV, DiffStatistics &stat)
+{
+    IndexedDiffCache cache; // IO data are not read.
+    IndexedDiffReader reader;
+    reader.setFile(std::move(file), cache);
+    const size_t step = std::max<size_t>(reader.getNrRecords() / MAX_SAMPLES_PER_WDIFF, 1);
+    IndexedDiffRecord rec;
+    for (size_t i = 0; reader.readDiffRecord(rec); i++) {
+        if (i % step == 0) sampleV.emplace_back(uint64_t(rec.io_address), 0);
+        sampleV.back().second += getWeight(rec);
     }
-    friend inline std::ostream &operator<<(std::ostream &os, const Range &range) {
-        os << "(" << range.bgn << ", " << range.end << ")";
-        return os;
+    stat = reader.getStat();
+}
+
+/**
+ * Copy the packs of a sorted wdiff file except for the end pack.
+ * @offset [byte] output file offset, which will be advanced.
+ * @packIdx the copied packs will be added.
+ */
+void copyDiffPacks(cybozu::util::File &fileR, cybozu::util::File &fileW,
+                   uint64_t &offset, DiffPackIndex &packIdx)
+{
+    DiffFileHeader header;
+    header.readFrom(fileR);
+    ExtendedDiffPackHeader edp;
+    DiffPackHeader &pack = edp.header;
+    AlignedArray buf;
+    for (;;) {
+        pack.readFrom(fileR);
+        if (pack.isEnd()) break;
+        packIdx.add(pack, offset);
+        pack.writeTo(fileW);
+        buf.resize(pack.total_size);
+        fileR.read(buf.data(), buf.size());
+        fileW.write(buf.data(), buf.size());
+        offset += pack.wholePackSize();
     }
-};
+}
 
-} // namespace walb_diff_merge_local
+} // namespace diff_merge_local
 
-size_t DiffMerger::tryMoveToDiffMemory()
+void ParallelDiffMerger::prepare()
 {
-    using Range = walb_diff_merge_local::Range;
-
-    size_t nr = 0;
-    uint64_t nextDoneAddr = UINT64_MAX;
-    uint64_t minAddr = UINT64_MAX;
-    if (wdiffs_.empty()) {
-        doneAddr_ = nextDoneAddr;
-        return 0;
-    }
-    WdiffPtrList::iterator it = wdiffs_.begin();
-    Range range(wdiffs_.front()->getFrontRec());
-    while (it != wdiffs_.end()) {
-        bool goNext = true;
-        Wdiff &wdiff = **it;
-        DiffRecord rec = wdiff.getFrontRec();
-        minAddr = std::min(minAddr, rec.io_address);
-        Range curRange(rec);
-        while (shouldMerge(rec, nextDoneAddr)) {
-            nr++;
-            curRange.merge(Range(rec));
-            AlignedArray buf;
-            wdiff.getAndRemoveIo(buf);
-            mergeIo(rec, std::move(buf));
-            if (wdiff.isEnd()) {
-                statIn_.update(wdiff.getStat());
-                it = wdiffs_.erase(it);
-                goNext = false;
-                break;
-            }
-            rec = wdiff.getFrontRec();
-        }
-        if (range.isOverlapped(curRange)) {
-            range.merge(curRange);
-        } else if (curRange.isLeftRight(range)) {
-            range = curRange;
+    using namespace diff_merge_local;
+    if (isPrepared_) return;
+    if (fileV_.empty()) {
+        throw cybozu::Exception(__func__) << "Wdiffs are not set.";
+    }
+    const size_t maxNrRanges = getMaxNrRanges();
+    std::vector<cybozu::Uuid> uuidV;
+    std::vector<Sample> sampleV;
+    statIn_.clear();
+    for (const cybozu::util::File &file0 : fileV_) {
+        cybozu::util::File file = reopenFile(file0);
+        DiffFileHeader header;
+        header.readFrom(file);
+        uuidV.push_back(header.getUuid());
+        /* A single range does not need samples, and statIn_ will be set by its merger. */
+        if (maxNrRanges == 1) continue;
+        DiffStatistics stat;
+        if (header.isIndexed()) {
+            file.lseek(0);
+            sampleIndexedDiff(std::move(file), sampleV, stat);
         } else {
-            assert(range.isLeftRight(curRange));
-            // do nothing
+            sampleSortedDiff(std::move(file), sampleV, stat);
         }
-        if (goNext) {
-            nextDoneAddr = std::min(nextDoneAddr, wdiff.currentAddress());
-            ++it;
+        statIn_.update(stat);
+    }
+    const cybozu::Uuid &uuid = uuidV.back();
+    if (shouldValidateUuid_) {
+        for (const cybozu::Uuid &uuid1 : uuidV) {
+            if (uuid1 != uuid) {
+                throw cybozu::Exception(__func__) << "uuid differ" << uuid1 << uuid;
+            }
         }
     }
-    if (minAddr != UINT64_MAX) {
-        assert(minAddr == range.bgn);
-    }
-    searchLen_ = std::max(searchLen_, range.size());
-#if 0 // debug code
-    std::cout << "nr " << nr << " "
-              << "doneAddr_ " << doneAddr_ << " "
-              << "nextDoneAddr " << (nextDoneAddr == UINT64_MAX ? "-" : cybozu::itoa(nextDoneAddr)) << " "
-              << "searchLen_ " << searchLen_ << " "
-              << "minAddr " << minAddr << " "
-              << "range " << range << std::endl;
-#endif
-    doneAddr_ = nextDoneAddr;
-    return nr;
-}
-
-bool DiffMerger::moveToMergedQueue()
-{
-    if (diffMem_.empty()) return false;
-    DiffMemory::Map& map = diffMem_.getMap();
-    DiffMemory::Map::iterator i = map.begin();
-    while (i != map.end()) {
-        DiffRecIo& recIo = i->second;
-        if (recIo.record().endIoAddress() > doneAddr_) break;
-        mergedQ_.push(std::move(recIo));
-        diffMem_.eraseFromMap(i);
+    wdiffH_.init();
+    wdiffH_.setUuid(uuid);
+
+    /* Border k is the first sample address where the amount before it reaches k/n of the total. */
+    std::sort(sampleV.begin(), sampleV.end());
+    uint64_t total = 0;
+    for (const Sample &sample : sampleV) total += sample.second;
+    addrV_.clear();
+    addrV_.push_back(0);
+    uint64_t sum = 0;
+    for (const Sample &sample : sampleV) {
+        const size_t k = addrV_.size();
+        if (k >= maxNrRanges) break;
+        if (sum >= total * k / maxNrRanges && sample.first > addrV_.back()) {
+            addrV_.push_back(sample.first);
+        }
+        sum += sample.second;
     }
-    return true;
+    addrV_.push_back(UINT64_MAX);
+    isPrepared_ = true;
 }
 
-void DiffMerger::removeEndedWdiffs()
+bool ParallelDiffMerger::run(const Func &func)
 {
-    WdiffPtrList::iterator it = wdiffs_.begin();
-    while (it != wdiffs_.end()) {
-        const Wdiff &wdiff = **it;
-        if (wdiff.isEnd()) {
-            statIn_.update(wdiff.getStat());
-            it = wdiffs_.erase(it);
-        } else {
-            ++it;
+    using namespace diff_merge_local;
+    prepare();
+    const size_t nr = getNrRanges();
+    if (fileV_.empty()) {
+        throw cybozu::Exception(__func__) << "already run";
+    }
+    /* nr * fileV_.size() files are opened in total. */
+    std::vector<std::vector<cybozu::util::File> > fileVV(nr);
+    for (size_t i = 1; i < nr; i++) {
+        for (const cybozu::util::File &file : fileV_) {
+            fileVV[i].push_back(reopenFile(file));
         }
     }
+    for (cybozu::util::File &file : fileV_) file.lseek(0);
+    fileVV[0] = std::move(fileV_);
+    fileV_.clear();
+    std::vector<char> retV(nr, false);
+    isStopping_ = false;
+    cybozu::thread::ThreadRunnerSet thS;
+    for (size_t i = 0; i < nr; i++) {
+        thS.add([&, i]() {
+                if (isStopping_) return;
+                DiffMerger merger;
+                merger.setMaxIoBlocks(maxIoBlocks_);
+                merger.setPrefetchQueueSize(prefetchQueueSize_);
+                merger.setReadAhead(readAheadNr_, readAheadThreads_);
+                merger.setPassThroughCompressed(passThroughCompressed_);
+                merger.setMemoryBudget(mem_);
+                merger.setAddressRange(addrV_[i], addrV_[i + 1]);
+                merger.addWdiffs(std::move(fileVV[i]));
+                try {
+                    merger.prepare();
+                    retV[i] = func(i, merger);
+                } catch (...) {
+                    isStopping_ = true;
+                    throw;
+                }
+                if (!retV[i]) isStopping_ = true;
+                if (nr == 1 && retV[i]) statIn_ = merger.statIn();
+            });
+    }
+    thS.start();
+    for (std::exception_ptr ep : thS.join()) {
+        if (ep) std::rethrow_exception(ep);
+    }
+    return std::all_of(retV.begin(), retV.end(), [](char ret) { return ret; });
 }
 
-void DiffMerger::verifyUuid(const cybozu::Uuid &uuid) const
+bool ParallelDiffMerger::mergeToFd(int outFd, const CompressOpt &cmpr, const std::string &tmpDir,
+                                   const std::function<bool()> &shouldStop)
 {
-    for (const WdiffPtr &wdiffP : wdiffs_) {
-        const cybozu::Uuid uuid1 = wdiffP->header().getUuid();
-        if (uuid1 != uuid) {
-            throw cybozu::Exception(__func__) << "uuid differ" << uuid1 << uuid;
+    prepare();
+    passThroughCompressed_ = true;
+    const size_t nr = getNrRanges();
+    std::vector<std::unique_ptr<cybozu::TmpFile> > tmpFileV;
+    if (nr > 1) {
+        for (size_t i = 0; i < nr; i++) tmpFileV.emplace_back(new cybozu::TmpFile(tmpDir));
+    }
+    std::vector<DiffStatistics> statV(nr);
+    const bool ret = run([&](size_t i, DiffMerger &merger) {
+            /* A single range is written to outFd directly. */
+            SortedDiffWriter writer(nr == 1 ? outFd : tmpFileV[i]->fd());
+            DiffFileHeader wdiffH = merger.header();
+            writer.writeHeader(wdiffH);
+            DiffRecIo d;
+            while (merger.getAndRemove(d)) {
+                if (isStopping() || (shouldStop && shouldStop())) return false;
+                assert(d.isValid());
+                writer.compressAndWriteDiff(d.record(), d.io().data(), cmpr.type, cmpr.level);
+            }
+            writer.close();
+            statV[i] = writer.getStat();
+            return true;
+        });
+    if (!ret) return false;
+
+    if (nr > 1) {
+        cybozu::util::File fileW(outFd);
+        DiffFileHeader wdiffH = wdiffH_;
+        wdiffH.type = ::WALB_DIFF_TYPE_SORTED;
+        wdiffH.flags |= WALB_DIFF_FILE_FLAG_PACK_INDEX;
+        wdiffH.writeTo(fileW);
+        uint64_t offset = wdiffH.getSize();
+        DiffPackIndex packIdx;
+        for (std::unique_ptr<cybozu::TmpFile> &tmpFile : tmpFileV) {
+            cybozu::util::File fileR(tmpFile->fd());
+            fileR.lseek(0);
+            diff_merge_local::copyDiffPacks(fileR, fileW, offset, packIdx);
         }
+        writeDiffEofPack(fileW);
+        packIdx.writeTo(fileW, offset + WALB_DIFF_PACK_SIZE);
     }
+    statOut_.clear();
+    for (const DiffStatistics &stat : statV) statOut_.update(stat);
+    statOut_.wdiffNr = 1;
+    return true;
 }
 
 } //namespace walb
@@ -7,10 +7,12 @@
  * (C) 2013 Cybozu Labs, Inc.
  */
 #include <memory>
+#include <functional>
 #include <string>
 #include <vector>
 #include <queue>
-#include <list>
+#include <set>
+#include <atomic>
 #include <cassert>
 #include <cstring>
 
@@ -19,8 +21,10 @@
 #include "walb_diff_mem.hpp"
 #include "walb_diff_stat.hpp"
 #include "walb_diff_compressor.hpp"
+#include "memory_budget.hpp"
 #include "host_info.hpp"
 #include "fileio.hpp"
+#include "thread_util.hpp"
 
 namespace walb {
 
@@ -28,7 +32,8 @@ namespace walb {
  * To merge walb diff files.
  *
  * Usage:
- *   (1) call setMaxIoBlocks() and setShouldValidateUuid() if necessary.
+ *   (1) call setMaxIoBlocks(), setShouldValidateUuid(), setPrefetchQueueSize()
+ *       and setMaxMemSize() if necessary.
  *   (2) add wdiffs by calling addWdiff() or addWdiffs().
  *   (3a) call mergeToFd() to write out the merged diff data.
  *   (3b) call prepare(), then call header() and getAndRemove() multiple times for other purpose.
@@ -46,11 +51,38 @@ private:
         mutable AlignedArray buf_;
         mutable bool isFilled_;
         mutable bool isEnd_;
+        uint64_t endAddr_; // IOs at or after this address are not read.
+        bool keepsCompressed_; // do not uncompress IOs if possible.
+        MemoryBudget *mem_; // IO data read from the file are counted.
+
+        /*
+         * Prefetching.
+         * The reader thread reads, verifies and uncompresses IOs ahead into the queue.
+         */
+        struct Item {
+            DiffRecord rec;
+            AlignedArray buf;
+        };
+        using Queue = cybozu::thread::BoundedQueue<Item>;
+        std::unique_ptr<Queue> queP_; // null if not prefetching.
+        mutable cybozu::thread::ThreadRunner readerTh_;
+        mutable std::atomic<size_t> queuedSize_; // total IO data size in the queue.
+        std::atomic<bool> isStopping_;
 
     public:
         constexpr static const char *NAME = "DiffMerger::Wdiff";
         Wdiff() : sReader_(), iReader_(), isIndexed_(false)
-                , header_(), rec_(), buf_(), isFilled_(false), isEnd_(false) {
+                , header_(), rec_(), buf_(), isFilled_(false), isEnd_(false)
+                , endAddr_(UINT64_MAX), keepsCompressed_(false), mem_(nullptr)
+                , queP_(), readerTh_(), queuedSize_(0), isStopping_(false) {
+        }
+        ~Wdiff() noexcept {
+            if (queP_) {
+                isStopping_ = true;
+                if (mem_) mem_->notify();
+                queP_->fail();
+            }
+            readerTh_.joinNoThrow();
         }
         void open(const std::string &wdiffPath, IndexedDiffCache *cache) {
             setFile(cybozu::util::File(wdiffPath, O_RDONLY), cache);
@@ -60,8 +92,48 @@ private:
          * isIndexed_ will be set.
          */
         void setFile(cybozu::util::File &&file, IndexedDiffCache *cache);
+        /**
+         * Read only IOs overlapping [bgnAddr, endAddr).
+         * Call this before reading any IO.
+         */
+        void setAddressRange(uint64_t bgnAddr, uint64_t endAddr);
+        /**
+         * Read IOs without uncompressing them if possible.
+         * IOs of indexed wdiffs are kept compressed only if they are not split in the index.
+         * Call this before reading any IO.
+         */
+        void keepCompressed() {
+            assert(!isFilled_ && !isEnd_);
+            keepsCompressed_ = true;
+        }
+        /**
+         * IO data read from the file will be counted by the budget.
+         * Call this before reading any IO.
+         */
+        void setMemoryBudget(MemoryBudget &mem) {
+            assert(!isFilled_ && !isEnd_);
+            mem_ = &mem;
+        }
+        /**
+         * Start a thread to read IOs ahead.
+         * @queueSize max number of IOs read ahead.
+         * The thread waits while the memory budget is exceeded unless the queue is empty.
+         * Call this before reading any IO.
+         */
+        void startPrefetch(size_t queueSize);
+        /**
+         * See IndexedDiffReader::setReadAhead().
+         * Sorted wdiffs ignore it.
+         */
+        void setReadAhead(size_t nr, size_t nrThreads) {
+            assert(!isFilled_ && !isEnd_);
+            if (isIndexed_) iReader_.setReadAhead(nr, nrThreads);
+        }
 
         const DiffFileHeader &header() const { return header_; }
+        /**
+         * The record may be compressed if keepCompressed() has been called.
+         */
         DiffRecord getFrontRec() const {
             verifyNotEnd(__func__);
             fill();
@@ -92,7 +164,15 @@ private:
         }
     private:
         void fill() const;
-        bool readIndexedDiff() const;
+        /**
+         * Read the next IO from the file.
+         * RETURN:
+         *   false if reached the end or endAddr_.
+         */
+        bool readNext(DiffRecord &rec, AlignedArray &buf) const;
+        bool readIndexedDiff(DiffRecord &rec, AlignedArray &buf) const;
+        bool popPrefetched() const;
+        void runPrefetch();
 #ifdef DEBUG
         void verifyNotEnd(const char *msg) const {
             if (isEnd()) throw cybozu::Exception(msg) << "reached to end";
@@ -108,39 +188,60 @@ private:
 #endif
     };
     bool shouldValidateUuid_;
+    uint32_t maxIoBlocks_;
+    size_t prefetchQueueSize_;
+    size_t readAheadNr_;
+    size_t readAheadThreads_;
+    bool passThroughCompressed_;
+    uint64_t bgnAddr_;
+    uint64_t endAddr_;
 
     DiffFileHeader wdiffH_;
     bool isHeaderPrepared_;
 
+    /**
+     * IO data held by the merger: current and next IOs of the inputs,
+     * IOs read ahead, and merged IOs not taken yet.
+     * This must be destructed after the inputs that use it.
+     */
+    MemoryBudget mem_;
+
     using WdiffPtr = std::unique_ptr<Wdiff>;
-    using WdiffPtrList = std::list<WdiffPtr>;
-    WdiffPtrList wdiffs_;
-    DiffMemory diffMem_;
-    std::queue<DiffRecIo> mergedQ_;
-    uint64_t doneAddr_;
-    size_t searchLen_;
-    IndexedDiffCache cache_; // shared by indexed diff files.
 
     /**
-     * Diff recIos will be read from wdiffs_,
-     * then added to diffMem_ (and merged inside it),
-     * then pushed to mergedQ_ finally.
-     *
-     * The point of the algorithm is which wdiff will be chosen to get recIos.
-     * See moveToDiffMemory() for detail.
-     *
-     * doneAddr_ is the minimum address in all the input wdiff streams.
-     * There is no overlapped IOs which endAddr is <= doneAddr in all the streams.
-     * so such IOs in diffMem_ can be put out safely.
-     *
-     * searchLen_ is required length [block size] as a buffer to merge wdiffs.
-     * Ex. with the following diffs, we need to merge them at once.
-     *
-     * diff2     XXXXX
-     * diff1        XXXXX
-     * diff0          XXXXX
-     * required  <-------->
+     * An input wdiff and its current record.
+     * The current record has been removed from the wdiff.
      */
+    struct Input
+    {
+        WdiffPtr wdiff; // null after reaching the end.
+        DiffRecord rec;
+        AlignedArray buf;
+        bool hasRec;
+        bool isActive; // the current record covers the sweep address.
+    };
+    std::vector<Input> inputV_; // older wdiffs first.
+    size_t nAlive_; // number of inputs that have not reached the end.
+
+    /**
+     * The inputs are merged by a sweep line from the lowest address.
+     * evQ_ has the next event of each input:
+     * the begin address of its current record if the record is not active,
+     * the end address otherwise.
+     * activeS_ has the inputs of which current record covers the sweep address,
+     * and the newest one (the largest index) owns the address.
+     * Each input is sorted and not overlapped so it has at most one active record.
+     * Each step costs O(log k) where k is the number of inputs.
+     */
+    using Event = std::pair<uint64_t, uint32_t>; // address and input index.
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event> > evQ_;
+    std::set<uint32_t> activeS_;
+    bool hasOwner_;
+    uint32_t owner_; // valid if hasOwner_ is true.
+    uint64_t ownerAddr_; // the address where owner_ started to own.
+
+    std::queue<DiffRecIo> mergedQ_;
+    IndexedDiffCache *cache_; // for indexed diff files.
 
     /**
      * statIn: input wdiffs statistics.
@@ -150,19 +251,23 @@ private:
     mutable DiffStatistics statIn_, statOut_;
 
 public:
-    explicit DiffMerger(size_t initSearchLen = DEFAULT_MERGE_BUFFER_LB)
+    DiffMerger()
         : shouldValidateUuid_(false)
+        , maxIoBlocks_(DEFAULT_MAX_IO_LB)
+        , prefetchQueueSize_(0)
+        , readAheadNr_(0), readAheadThreads_(0)
+        , passThroughCompressed_(false)
+        , bgnAddr_(0), endAddr_(UINT64_MAX)
         , wdiffH_()
         , isHeaderPrepared_(false)
-        , wdiffs_()
-        , diffMem_()
-        , mergedQ_()
-        , doneAddr_(0)
-        , searchLen_(initSearchLen)
+        , mem_()
+        , inputV_(), nAlive_(0)
+        , evQ_(), activeS_(), hasOwner_(false), owner_(0), ownerAddr_(0)
+        , mergedQ_(), cache_(&getSharedIndexedDiffCache())
         , statIn_(), statOut_() {
     }
     void setMaxIoBlocks(uint32_t maxIoBlocks) {
-        diffMem_.setMaxIoBlocks(maxIoBlocks);
+        maxIoBlocks_ = maxIoBlocks;
     }
     /**
      * @shouldValidateUuid validate that all wdiff's uuid are the same if true,
@@ -170,16 +275,92 @@ public:
     void setShouldValidateUuid(bool shouldValidateUuid) {
         shouldValidateUuid_ = shouldValidateUuid;
     }
-    void setMaxCacheSize(size_t bytes) {
-        cache_.setMaxSize(bytes);
+    /**
+     * The cache of IO data of indexed diff files.
+     * The process-wide shared cache is used by default.
+     * Call this before adding wdiffs.
+     */
+    void setCache(IndexedDiffCache &cache) {
+        cache_ = &cache;
+    }
+    /**
+     * Read IOs ahead by a thread per input wdiff.
+     * It overlaps file IO and uncompression of the inputs with merging.
+     * Each input holds at most queueSize uncompressed IOs in addition.
+     * 0 means no prefetching (default).
+     * Call this before prepare().
+     */
+    void setPrefetchQueueSize(size_t queueSize) {
+        assert(!isHeaderPrepared_);
+        prefetchQueueSize_ = queueSize;
+    }
+    /**
+     * Read ahead IO data of indexed input wdiffs.
+     * @nr number of index records to read ahead.
+     *   The file pages of their IO data are advised to be read by the kernel.
+     * @nrThreads number of threads to uncompress the IOs read ahead in a batch.
+     *   0 means no batch uncompression.
+     * Call this before prepare().
+     */
+    void setReadAhead(size_t nr, size_t nrThreads = 0) {
+        assert(!isHeaderPrepared_);
+        readAheadNr_ = nr;
+        readAheadThreads_ = nrThreads;
+    }
+    /**
+     * Limit the size of IO data held by the merger [byte].
+     * The prefetching threads wait while the limit is exceeded,
+     * which applies backpressure to reading ahead.
+     * The current and next IOs of each input and the merged IOs not taken yet
+     * are always held to make progress, so they may exceed the limit.
+     * Without prefetching, the size is only counted.
+     * 0 means unlimited (default).
+     * Call this before prepare().
+     */
+    void setMaxMemSize(size_t bytes) {
+        assert(!isHeaderPrepared_);
+        mem_.setMaxSize(bytes);
+    }
+    /**
+     * Count the IO data also by a budget shared with other mergers.
+     * Its limit is applied as well. The budget must outlive the merger.
+     * Call this before prepare().
+     */
+    void setMemoryBudget(MemoryBudget &budget) {
+        assert(!isHeaderPrepared_);
+        mem_.setParent(&budget);
+    }
+    /**
+     * Output compressed IOs as they are if they are not overlapped by other IOs nor split.
+     * Only overlapped or split IOs are uncompressed, so the CPU time is saved
+     * when the output will be compressed again.
+     * getAndRemove() then may return compressed IOs of which checksum is valid.
+     * Uncompressed IOs may not have valid checksum as before.
+     * Call this before prepare().
+     */
+    void setPassThroughCompressed(bool passThroughCompressed) {
+        assert(!isHeaderPrepared_);
+        passThroughCompressed_ = passThroughCompressed;
+    }
+    /**
+     * Merge only IOs in [bgnAddr, endAddr). IOs across the borders are clipped.
+     * Indexed wdiffs are located by their indexes and sorted wdiffs skip packs before bgnAddr.
+     * Reading stops at endAddr.
+     * statIn() will count the IOs read including skipped ones partially.
+     * Call this before prepare().
+     */
+    void setAddressRange(uint64_t bgnAddr, uint64_t endAddr) {
+        assert(!isHeaderPrepared_);
+        assert(bgnAddr < endAddr);
+        bgnAddr_ = bgnAddr;
+        endAddr_ = endAddr;
     }
     /**
      * Add a diff file.
      * Newer wdiff file must be added later.
      */
     void addWdiff(const std::string& wdiffPath) {
-        wdiffs_.emplace_back(new Wdiff());
-        wdiffs_.back()->open(wdiffPath, &cache_);
+        addInput()->open(wdiffPath, cache_);
     }
     /**
      * Add diff files.
@@ -191,19 +372,18 @@ public:
     }
     void addWdiffs(std::vector<cybozu::util::File> &&fileV) {
         for (cybozu::util::File &file : fileV) {
-            wdiffs_.emplace_back(new Wdiff());
-            wdiffs_.back()->setFile(std::move(file), &cache_);
+            addInput()->setFile(std::move(file), cache_);
         }
         fileV.clear();
     }
     /**
      * Merge input wdiff files and put them into output fd.
      * The last wdiff's uuid will be used for output wdiff.
+     * Compressed IOs are passed through if prepare() has not been called.
      *
      * @outFd file descriptor for output wdiff.
      */
     void mergeToFd(int outFd);
-    void mergeToFdInParallel(int outFd, const CompressOpt& cmpr);
     /**
      * Prepare wdiff header and variables.
      */
@@ -223,54 +403,237 @@ public:
     bool getAndRemove(DiffRecIo &recIo);
 
     const DiffStatistics& statIn() const {
-        assert(wdiffs_.empty());
+        assert(nAlive_ == 0);
         return statIn_;
     }
     /**
      * Use this only if you used mergeToFd().
      */
     const DiffStatistics& statOut() const {
-        assert(wdiffs_.empty());
+        assert(nAlive_ == 0);
         return statOut_;
     }
+    /**
+     * Current and peak size of IO data held by the merger.
+     * getMemSize() can be called by other threads.
+     */
+    size_t getMemSize() const { return mem_.getSize(); }
+    size_t getPeakMemSize() const { return mem_.getPeakSize(); }
     std::string memUsageStr() const {
-        return cybozu::itoa(searchLen_ * LBS / KIBI) + "KiB";
+        return cybozu::itoa(getPeakMemSize() / KIBI) + "KiB";
     }
 private:
-    uint64_t getMinimumAddr() const;
-    void moveToDiffMemory();
-
+    Wdiff* addInput() {
+        inputV_.emplace_back();
+        Input &in = inputV_.back();
+        in.wdiff.reset(new Wdiff());
+        in.hasRec = false;
+        in.isActive = false;
+        nAlive_++;
+        return in.wdiff.get();
+    }
     /**
-     * Try to get Ios from wdiffs and add to wdiffMem_.
-     *
-     * minimum current address among wdiffs will be set to doneAddr_.
-     * UINT64_MAX if there is no wdiffs.
-     *
+     * Make the next record of the input current and push its begin event.
+     */
+    void nextRec(uint32_t idx);
+    /**
+     * Clip the current record of the input to [bgnAddr_, endAddr_).
+     */
+    void clipRec(Input &in);
+    void uncompressRec(Input &in);
+    /**
+     * Replace the IO data of the input and count the size difference.
+     */
+    void replaceBuf(Input &in, AlignedArray &&buf);
+    /**
+     * Process the events at the lowest address.
      * RETURN:
-     *   the number of merged IOs.
+     *   false if there is no event anymore.
+     */
+    bool step();
+    /**
+     * Put the blocks [ownerAddr_, addr) of the owner's current record to mergedQ_.
      */
-    size_t tryMoveToDiffMemory();
+    void emitOwner(uint64_t addr);
 
-    bool shouldMerge(const DiffRecord& rec, uint64_t minAddr) const {
-        return (rec.io_address < doneAddr_ + searchLen_)
-            && (rec.endIoAddress() <= minAddr);
+    void verifyUuid(const cybozu::Uuid &uuid) const;
+};
+
+/**
+ * To merge walb diff files by multiple threads.
+ *
+ * The address space is partitioned into ranges with about the same amount of input IOs,
+ * and each range is merged by its own DiffMerger with setAddressRange().
+ * The partition is decided by the indexes of indexed wdiffs and the pack headers of sorted wdiffs.
+ * Each range opens the input files again to have its own file positions.
+ *
+ * Usage:
+ *   (1) call setNrThreads(), setMaxIoBlocks() and setShouldValidateUuid() if necessary.
+ *   (2) add wdiffs by calling addWdiff() or addWdiffs().
+ *   (3a) call mergeToFd() to write out the merged diff data.
+ *   (3b) call run() to consume the merged IOs of each range for other purpose.
+ */
+class ParallelDiffMerger /* final */
+{
+    size_t nrThreads_;
+    size_t maxOpenFiles_; // 0 means unlimited.
+    bool shouldValidateUuid_;
+    uint32_t maxIoBlocks_;
+    size_t prefetchQueueSize_;
+    size_t readAheadNr_;
+    size_t readAheadThreads_;
+    bool passThroughCompressed_;
+    std::vector<cybozu::util::File> fileV_; // older wdiffs first.
+
+    DiffFileHeader wdiffH_;
+    bool isPrepared_;
+    std::vector<uint64_t> addrV_; // range i is [addrV_[i], addrV_[i + 1]).
+
+    DiffStatistics statIn_, statOut_;
+    MemoryBudget mem_; // shared by the mergers of the ranges.
+    std::atomic<bool> isStopping_; // set when a range failed or stopped.
+
+public:
+    /**
+     * Run for each range in parallel with a prepared DiffMerger.
+     * Returning false means force-stopped.
+     */
+    using Func = std::function<bool(size_t rangeIdx, DiffMerger &merger)>;
+
+    ParallelDiffMerger()
+        : nrThreads_(1), maxOpenFiles_(0), shouldValidateUuid_(false), maxIoBlocks_(DEFAULT_MAX_IO_LB)
+        , prefetchQueueSize_(0), readAheadNr_(0), readAheadThreads_(0)
+        , passThroughCompressed_(false), fileV_(), wdiffH_(), isPrepared_(false), addrV_()
+        , statIn_(), statOut_(), mem_(), isStopping_(false) {
+    }
+    void setNrThreads(size_t nrThreads) {
+        nrThreads_ = std::max<size_t>(nrThreads, 1);
+    }
+    /**
+     * Each range opens all the inputs.
+     * The number of ranges will be reduced so that
+     * the files opened by all the ranges together do not exceed maxOpenFiles.
+     * 0 means unlimited.
+     */
+    void setMaxOpenFiles(size_t maxOpenFiles) {
+        maxOpenFiles_ = maxOpenFiles;
+    }
+    void setMaxIoBlocks(uint32_t maxIoBlocks) {
+        maxIoBlocks_ = maxIoBlocks;
+    }
+    void setShouldValidateUuid(bool shouldValidateUuid) {
+        shouldValidateUuid_ = shouldValidateUuid;
+    }
+    /**
+     * See DiffMerger::setPrefetchQueueSize().
+     */
+    void setPrefetchQueueSize(size_t queueSize) {
+        prefetchQueueSize_ = queueSize;
+    }
+    /**
+     * See DiffMerger::setReadAhead().
+     */
+    void setReadAhead(size_t nr, size_t nrThreads = 0) {
+        readAheadNr_ = nr;
+        readAheadThreads_ = nrThreads;
+    }
+    /**
+     * See DiffMerger::setMaxMemSize().
+     * The limit is shared by all the ranges.
+     */
+    void setMaxMemSize(size_t bytes) {
+        mem_.setMaxSize(bytes);
+    }
+    /**
+     * See DiffMerger::setMemoryBudget().
+     */
+    void setMemoryBudget(MemoryBudget &budget) {
+        mem_.setParent(&budget);
+    }
+    /**
+     * See DiffMerger::setPassThroughCompressed().
+     * mergeToFd() always enables it.
+     */
+    void setPassThroughCompressed(bool passThroughCompressed) {
+        passThroughCompressed_ = passThroughCompressed;
+    }
+    /**
+     * Newer wdiff file must be added later.
+     */
+    void addWdiff(const std::string& wdiffPath) {
+        fileV_.emplace_back(wdiffPath, O_RDONLY);
+    }
+    void addWdiffs(const StrVec &wdiffPaths) {
+        for (const std::string &s : wdiffPaths) {
+            addWdiff(s);
+        }
+    }
+    void addWdiffs(std::vector<cybozu::util::File> &&fileV) {
+        for (cybozu::util::File &file : fileV) {
+            fileV_.push_back(std::move(file));
+        }
+        fileV.clear();
+    }
+    /**
+     * Read the indexes and pack headers of the inputs, and decide the ranges.
+     */
+    void prepare();
+    const DiffFileHeader &header() const {
+        assert(isPrepared_);
+        return wdiffH_;
+    }
+    size_t getNrRanges() const {
+        assert(isPrepared_);
+        return addrV_.size() - 1;
     }
     /**
-     * Move all IOs which ioAddress + ioBlocks <= doneAddr
-     * from diffMem_ to the mergedQ_.
+     * The first range uses the added files and the others open them again.
+     * Call this once.
+     * When func returns false or throws an exception for a range,
+     * the ranges not started yet are skipped and isStopping() becomes true.
+     * func should check it periodically to stop the other ranges.
+     * RETURN:
+     *   false if func returned false for a range.
+     */
+    bool run(const Func &func);
+    bool isStopping() const { return isStopping_; }
+    /**
+     * Merge input wdiff files and put them into output fd as a sorted wdiff.
+     * Each range is compressed by its thread and written to a temporary file in tmpDir,
+     * then they are concatenated.
      *
+     * @shouldStop called for each IO. Return true to stop merging.
      * RETURN:
-     *   false if there is no Io to move.
+     *   false if stopped.
      */
-    bool moveToMergedQueue();
-    void removeEndedWdiffs();
+    bool mergeToFd(int outFd, const CompressOpt &cmpr, const std::string &tmpDir,
+                   const std::function<bool()> &shouldStop = nullptr);
 
-    void mergeIo(const DiffRecord &rec, AlignedArray &&buf) {
-        assert(!rec.isCompressed());
-        diffMem_.add(rec, std::move(buf));
+    /**
+     * Statistics of all the inputs.
+     * This is meaningful after run() or mergeToFd() finished if there is a single thread.
+     */
+    const DiffStatistics& statIn() const {
+        assert(isPrepared_);
+        return statIn_;
+    }
+    /**
+     * Use this only if you used mergeToFd().
+     */
+    const DiffStatistics& statOut() const {
+        return statOut_;
+    }
+    /**
+     * Peak size of IO data held by all the ranges together.
+     */
+    std::string memUsageStr() const {
+        return cybozu::itoa(mem_.getPeakSize() / KIBI) + "KiB";
+    }
+private:
+    size_t getMaxNrRanges() const {
+        if (maxOpenFiles_ == 0) return nrThreads_;
+        return std::max<size_t>(std::min(nrThreads_, maxOpenFiles_ / fileV_.size()), 1);
     }
-
-    void verifyUuid(const cybozu::Uuid &uuid) const;
 };
 
 } //namespace walb
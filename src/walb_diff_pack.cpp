@@ -100,14 +100,10 @@ void MemoryDiffPack::verify(bool doChecksum) const
     }
 }
 
-bool DiffPacker::add(uint64_t ioAddr, uint32_t ioBlocks, const char *data)
-{
-    assert(ioBlocks != 0);
-    assert(ioBlocks <= UINT16_MAX);
-    uint32_t dSize = ioBlocks * LOGICAL_BLOCK_SIZE;
-    if (!pack_->canAdd(dSize)) return false;
+namespace {
 
-    bool isZero = isAllZero(data, dSize);
+DiffRecord makeDiffRecord(uint64_t ioAddr, uint32_t ioBlocks, bool isZero)
+{
     DiffRecord rec;
     rec.io_address = ioAddr;
     rec.io_blocks = ioBlocks;
@@ -118,9 +114,54 @@ bool DiffPacker::add(uint64_t ioAddr, uint32_t ioBlocks, const char *data)
         rec.data_size = 0;
     } else {
         rec.setNormal();
-        rec.data_size = dSize;
+        rec.data_size = ioBlocks * LOGICAL_BLOCK_SIZE;
     }
-    return add(rec, data);
+    return rec;
+}
+
+} // namespace
+
+bool DiffPacker::add(uint64_t ioAddr, uint32_t ioBlocks, const char *data)
+{
+    assert(ioBlocks != 0);
+    assert(ioBlocks <= UINT16_MAX);
+    uint32_t dSize = ioBlocks * LOGICAL_BLOCK_SIZE;
+    if (!pack_->canAdd(dSize)) return false;
+
+    if (cybozu::util::isAllZero(data, dSize)) {
+        return add(makeDiffRecord(ioAddr, ioBlocks, true), data);
+    }
+    if (0 < minZeroRunLb_ && minZeroRunLb_ < ioBlocks
+        && addSplittingZeroRuns(ioAddr, ioBlocks, data)) {
+        return true;
+    }
+    return add(makeDiffRecord(ioAddr, ioBlocks, false), data);
+}
+
+/**
+ * RETURN:
+ *   false if the IO has no zero run to split or the pack can not hold the split records.
+ *   Nothing has been added then.
+ */
+bool DiffPacker::addSplittingZeroRuns(uint64_t ioAddr, uint32_t ioBlocks, const char *data)
+{
+    const std::vector<DiffIoRun> runV = splitZeroRuns(data, ioBlocks, minZeroRunLb_);
+    if (runV.empty()) return false;
+    uint32_t normalLb = 0;
+    for (const DiffIoRun &run : runV) {
+        if (!run.isAllZero) normalLb += run.ioBlocks;
+    }
+    if (MAX_N_RECORDS_IN_WALB_DIFF_PACK < pack_->n_records + runV.size()
+        || WALB_DIFF_PACK_MAX_SIZE < pack_->total_size + normalLb * LOGICAL_BLOCK_SIZE) {
+        return false;
+    }
+    for (const DiffIoRun &run : runV) {
+        const DiffRecord rec = makeDiffRecord(ioAddr + run.offLb, run.ioBlocks, run.isAllZero);
+        const bool r = add(rec, data + run.offLb * LOGICAL_BLOCK_SIZE);
+        unusedVar(r);
+        assert(r);
+    }
+    return true;
 }
 
 bool DiffPacker::add(const DiffRecord &rec, const char *data)
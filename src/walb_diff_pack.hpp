@@ -139,11 +139,13 @@ class DiffPacker
 private:
     AppendBuffer abuf_;
     DiffPackHeader *pack_;
+    uint32_t minZeroRunLb_;
 
 public:
     DiffPacker()
         : abuf_()
-        , pack_() {
+        , pack_()
+        , minZeroRunLb_(DIFF_PACK_MIN_ZERO_RUN_LB) {
         abuf_.append(::WALB_DIFF_PACK_SIZE);
         setPackPtr();
         pack_->clear();
@@ -151,12 +153,20 @@ public:
     /**
      * You must care about IO insertion order and overlap.
      * Checksum will not be calculated.
+     * Zero runs in the IO will be added as all-zero records
+     * if they are not shorter than the min zero run.
      *
      * RETURN:
      *   false: failed. You need to create another pack.
      */
     bool add(uint64_t ioAddr, uint32_t ioBlocks, const char *data);
     bool add(const DiffRecord &rec, const char *data);
+    /**
+     * 0 means IOs are not split.
+     */
+    void setMinZeroRunBlocks(uint32_t minZeroRunLb) {
+        minZeroRunLb_ = minZeroRunLb;
+    }
     bool empty() const;
     void verify() const {
 #ifndef NDEBUG
@@ -194,12 +204,7 @@ public:
         return abuf_.totalSize();
     }
 private:
-    static bool isAllZero(const char *data, size_t size) {
-        for (size_t i = 0; i < size; i++) {
-            if (data[i] != 0) return false;
-        }
-        return true;
-    }
+    bool addSplittingZeroRuns(uint64_t ioAddr, uint32_t ioBlocks, const char *data);
     void extendAndCopy(const char *data, size_t size) {
         assert(data);
         abuf_.append(data, size);
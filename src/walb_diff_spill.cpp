@@ -0,0 +1,82 @@
+#include "walb_diff_spill.hpp"
+#include "walb_diff_merge.hpp"
+#include "file_path.hpp"
+
+namespace walb {
+
+void SpillingDiffMemory::add(const DiffRecord& rec, AlignedArray &&buf)
+{
+    memSize_ += buf.size() + IO_OVERHEAD_SIZE;
+    mem_.add(rec, std::move(buf));
+    if (maxMemSize_ == 0 || memSize_ <= maxMemSize_) return;
+
+    /* Overwritten data may have been freed. */
+    refreshMemSize();
+    if (memSize_ < maxMemSize_ / 4 * 3) return;
+    spill();
+}
+
+void SpillingDiffMemory::writeTo(int outFd, int cmprType)
+{
+    if (runV_.empty()) {
+        mem_.header() = fileH_;
+        mem_.writeTo(outFd, cmprType);
+        mem_.clear();
+        memSize_ = 0;
+        return;
+    }
+    if (!mem_.empty()) spill();
+
+    DiffMerger merger;
+    merger.setMaxIoBlocks(maxIoBlocks_);
+    merger.setPassThroughCompressed(cmprType != ::WALB_DIFF_CMPR_NONE && cmprType == runCmprType_);
+    std::vector<cybozu::util::File> fileV;
+    for (std::unique_ptr<cybozu::TmpFile> &run : runV_) {
+        cybozu::util::File file(run->fd()); // not owned.
+        file.lseek(0, SEEK_SET);
+        fileV.push_back(std::move(file));
+    }
+    merger.addWdiffs(std::move(fileV));
+    merger.prepare();
+
+    SortedDiffWriter writer;
+    writer.setFd(outFd);
+    writer.writeHeader(fileH_);
+    DiffRecIo r;
+    while (merger.getAndRemove(r)) {
+        assert(r.isValid());
+        if (cmprType != ::WALB_DIFF_CMPR_NONE) {
+            writer.compressAndWriteDiff(r.record(), r.io().data(), cmprType);
+        } else {
+            DiffRecord rec = r.record();
+            rec.checksum = calcDiffIoChecksum(r.io());
+            writer.writeDiff(rec, r.io().data());
+        }
+    }
+    writer.close();
+}
+
+void SpillingDiffMemory::refreshMemSize()
+{
+    size_t size = 0;
+    for (const DiffMemory::Map::value_type &pair : mem_.getMap()) {
+        size += pair.second.io().size() + IO_OVERHEAD_SIZE;
+    }
+    memSize_ = size;
+}
+
+void SpillingDiffMemory::spill()
+{
+    if (tmpDir_.empty()) {
+        throw cybozu::Exception("SpillingDiffMemory:spill:tmpDir is not set");
+    }
+    std::unique_ptr<cybozu::TmpFile> run(new cybozu::TmpFile(tmpDir_));
+    mem_.header() = fileH_;
+    mem_.writeTo(run->fd(), runCmprType_);
+    nSpilledBytes_ += cybozu::FileStat(run->fd()).size();
+    runV_.push_back(std::move(run));
+    mem_.clear();
+    memSize_ = 0;
+}
+
+} //namespace walb
@@ -0,0 +1,92 @@
+#pragma once
+/**
+ * @file
+ * @brief walb diff in main memory with a memory budget.
+ */
+#include <memory>
+#include <string>
+#include <vector>
+#include "walb_diff_mem.hpp"
+#include "tmp_file.hpp"
+
+namespace walb {
+
+/**
+ * DiffMemory that spills its contents to temporary wdiff files.
+ *
+ * When the estimated memory usage exceeds maxMemSize,
+ * all the contents (sorted and overlap-resolved) are written to a new temporary
+ * sorted wdiff file called a run, then the memory is cleared.
+ * writeTo() merges the runs and the remaining contents with DiffMerger.
+ * The runs are removed at destruction.
+ *
+ * Usage:
+ *   (1) call setTmpDir() and setMaxMemSize() to enable spilling.
+ *   (2) call add() multiple times.
+ *   (3) call writeTo().
+ */
+class SpillingDiffMemory /* final */
+{
+    /*
+     * Estimated memory usage of an IO except for its data.
+     * Tree node of DiffMemory::Map and DiffRecIo.
+     */
+    static constexpr size_t IO_OVERHEAD_SIZE = 128;
+
+    DiffMemory mem_;
+    DiffFileHeader fileH_;
+    uint32_t maxIoBlocks_;
+    std::string tmpDir_;
+    size_t maxMemSize_; // 0 means unlimited.
+    int runCmprType_;
+    /*
+     * Upper bound of the memory usage of mem_.
+     * Overwritten data are not subtracted until refreshMemSize() is called.
+     */
+    size_t memSize_;
+    std::vector<std::unique_ptr<cybozu::TmpFile> > runV_;
+    uint64_t nSpilledBytes_;
+
+public:
+    SpillingDiffMemory()
+        : mem_(), fileH_(), maxIoBlocks_(DEFAULT_MAX_IO_LB)
+        , tmpDir_(), maxMemSize_(0), runCmprType_(::WALB_DIFF_CMPR_SNAPPY)
+        , memSize_(0), runV_(), nSpilledBytes_(0) {
+        fileH_.init();
+    }
+    void setMaxIoBlocks(uint32_t maxIoBlocks) {
+        maxIoBlocks_ = maxIoBlocks;
+        mem_.setMaxIoBlocks(maxIoBlocks);
+    }
+    /**
+     * Directory to put runs.
+     */
+    void setTmpDir(const std::string &tmpDir) { tmpDir_ = tmpDir; }
+    /**
+     * maxMemSize: 0 means unlimited. tmpDir must be set if it is not 0.
+     */
+    void setMaxMemSize(size_t maxMemSize) { maxMemSize_ = maxMemSize; }
+    void setRunCompressionType(int cmprType) { runCmprType_ = cmprType; }
+    DiffFileHeader& header() { return fileH_; }
+
+    void add(const DiffRecord& rec, AlignedArray &&buf);
+    /**
+     * Write all the added data as a sorted wdiff.
+     * This must be called only once.
+     */
+    void writeTo(int outFd, int cmprType = ::WALB_DIFF_CMPR_SNAPPY);
+
+    size_t getNRuns() const { return runV_.size(); }
+    uint64_t getNSpilledBytes() const { return nSpilledBytes_; }
+    /**
+     * Statistics of data in memory.
+     */
+    uint64_t getNBlocks() const { return mem_.getNBlocks(); }
+    uint64_t getNIos() const { return mem_.getNIos(); }
+    void checkNoOverlappedAndSorted() const { mem_.checkNoOverlappedAndSorted(); }
+private:
+    void refreshMemSize();
+    void spill();
+};
+
+} //namespace walb
@@ -1,4 +1,5 @@
 #include "walb_diff_virt.hpp"
+#include "bdev_util.hpp"
 
 namespace walb {
 
@@ -146,4 +147,274 @@ void VirtualFullScanner::fillDiffIo()
     }
 }
 
+namespace virt_local {
+
+/**
+ * Thread-safe read that does not use the file position.
+ */
+void preadAll(int fd, void *data, size_t size, uint64_t off)
+{
+    char *p = (char *)data;
+    while (size > 0) {
+        const ssize_t r = ::pread(fd, p, size, off);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            throw cybozu::Exception(__func__) << "pread failed" << fd << off << cybozu::ErrorNo();
+        }
+        if (r == 0) throw cybozu::util::EofError();
+        p += r;
+        size -= r;
+        off += r;
+    }
+}
+
+cybozu::util::File dupFile(const cybozu::util::File &file)
+{
+    const int fd = ::dup(file.fd());
+    if (fd < 0) throw cybozu::Exception(__func__) << "dup failed" << cybozu::ErrorNo();
+    return cybozu::util::File(fd, true);
+}
+
+} // namespace virt_local
+
+void VirtualFullImage::init(cybozu::util::File&& base, std::vector<cybozu::util::File>&& fileV, uint64_t sizeLb)
+{
+    base_ = std::move(base);
+    if (!base_.seekable()) {
+        throw cybozu::Exception("VirtualFullImage") << "base image must be seekable";
+    }
+    baseSizeLb_ = cybozu::util::getBlockDeviceSize(base_.fd()) / LOGICAL_BLOCK_SIZE;
+    sizeLb_ = sizeLb == 0 ? baseSizeLb_ : sizeLb;
+    fileV_.clear();
+    ioV_.clear();
+    map_.clear();
+    statIn_.clear();
+    statIn_.wdiffNr = fileV.size();
+
+    for (cybozu::util::File &file : fileV) {
+        struct stat st;
+        cybozu::util::fstat(file.fd(), st);
+        DiffFileHeader header;
+        header.readFrom(file);
+        const size_t fileIdx = fileV_.size();
+        if (header.isIndexed()) {
+            cybozu::util::File dup = virt_local::dupFile(file);
+            fileV_.push_back({std::move(dup), uint64_t(st.st_dev), uint64_t(st.st_ino)});
+            addIndexedDiff(fileIdx, std::move(file));
+        } else {
+            fileV_.push_back({std::move(file), uint64_t(st.st_dev), uint64_t(st.st_ino)});
+            addSortedDiff(fileIdx);
+        }
+    }
+}
+
+void VirtualFullImage::init(cybozu::util::File&& base, const StrVec &wdiffPaths, uint64_t sizeLb)
+{
+    std::vector<cybozu::util::File> fileV;
+    for (const std::string &path : wdiffPaths) {
+        fileV.emplace_back(path, O_RDONLY);
+    }
+    init(std::move(base), std::move(fileV), sizeLb);
+}
+
+void VirtualFullImage::read(uint64_t addr, size_t blks, void *data) const
+{
+    if (addr + blks > sizeLb_) {
+        throw cybozu::Exception("VirtualFullImage:read") << "out of range" << addr << blks << sizeLb_;
+    }
+    char *p = (char *)data;
+    const uint64_t endAddr = addr + blks;
+    std::map<uint64_t, Piece>::const_iterator it = map_.upper_bound(addr);
+    if (it != map_.begin()) {
+        std::map<uint64_t, Piece>::const_iterator prev = std::prev(it);
+        if (prev->first + prev->second.blks > addr) it = prev;
+    }
+    while (addr < endAddr) {
+        size_t blks0;
+        if (it == map_.end() || it->first >= endAddr) {
+            blks0 = endAddr - addr;
+            readBase(addr, blks0, p);
+        } else if (addr < it->first) {
+            blks0 = it->first - addr;
+            readBase(addr, blks0, p);
+        } else {
+            const uint32_t offInPiece = addr - it->first;
+            blks0 = std::min<uint64_t>(endAddr - addr, it->second.blks - offInPiece);
+            readPiece(it->second, offInPiece, blks0, p);
+            ++it;
+        }
+        addr += blks0;
+        p += blks0 * LOGICAL_BLOCK_SIZE;
+    }
+}
+
+void VirtualFullImage::addSortedDiff(size_t fileIdx)
+{
+    cybozu::util::File &file = fileV_[fileIdx].file;
+    ExtendedDiffPackHeader edp;
+    DiffPackHeader &pack = edp.header;
+    /* Records are accessed through the whole pack buffer, not the zero-length array. */
+    const DiffRecord *recs = reinterpret_cast<const DiffRecord *>(&edp.buf[offsetof(walb_diff_pack, record)]);
+    for (;;) {
+        const uint64_t packOffset = file.lseek(0, SEEK_CUR);
+        pack.readFrom(file);
+        if (pack.isEnd()) break;
+        for (size_t i = 0; i < pack.n_records; i++) {
+            const DiffRecord &rec = recs[i];
+            rec.verify();
+            statIn_.update(rec);
+            const size_t ioIdx = ioV_.size();
+            ioV_.push_back({uint32_t(fileIdx), getDiffRecType(rec), rec.compression_type,
+                    rec.io_blocks, rec.data_size, rec.checksum,
+                    packOffset + WALB_DIFF_PACK_SIZE + rec.data_offset});
+            addIo(rec.io_address, rec.io_blocks, 0, ioIdx);
+        }
+        file.lseek(packOffset + pack.wholePackSize());
+    }
+}
+
+void VirtualFullImage::addIndexedDiff(size_t fileIdx, cybozu::util::File &&file)
+{
+    IndexedDiffReader reader;
+    reader.setFile(std::move(file), *cache_);
+    IndexedDiffRecord rec;
+    while (reader.readDiffRecord(rec)) {
+        statIn_.update(rec);
+        /* Records split from an IO share the IO data. */
+        if (!rec.isNormal() || ioV_.empty() || ioV_.back().fileIdx != fileIdx ||
+            ioV_.back().type != DiffRecType::NORMAL || ioV_.back().dataOffset != rec.data_offset) {
+            ioV_.push_back({uint32_t(fileIdx), getDiffRecType(rec), rec.compression_type,
+                    rec.orig_blocks, rec.data_size, rec.io_checksum, rec.data_offset});
+        }
+        addIo(rec.io_address, rec.io_blocks, rec.io_offset, ioV_.size() - 1);
+    }
+}
+
+void VirtualFullImage::addIo(uint64_t addr, uint32_t blks, uint32_t offInIo, size_t ioIdx)
+{
+    const uint64_t endAddr = addr + blks;
+    std::map<uint64_t, Piece>::iterator it = map_.lower_bound(addr);
+    if (it != map_.begin()) {
+        std::map<uint64_t, Piece>::iterator prev = std::prev(it);
+        Piece &piece = prev->second;
+        const uint64_t pieceEnd = prev->first + piece.blks;
+        if (pieceEnd > addr) {
+            if (pieceEnd > endAddr) {
+                /* The tail remains. */
+                const uint32_t off = endAddr - prev->first;
+                map_.emplace(endAddr, Piece{uint32_t(pieceEnd - endAddr), piece.offInIo + off, piece.ioIdx});
+            }
+            piece.blks = addr - prev->first;
+        }
+    }
+    while (it != map_.end() && it->first < endAddr) {
+        const Piece &piece = it->second;
+        const uint64_t pieceEnd = it->first + piece.blks;
+        if (pieceEnd > endAddr) {
+            const uint32_t off = endAddr - it->first;
+            const Piece tail{uint32_t(pieceEnd - endAddr), piece.offInIo + off, piece.ioIdx};
+            map_.erase(it);
+            map_.emplace(endAddr, tail);
+            break;
+        }
+        it = map_.erase(it);
+    }
+    map_.emplace(addr, Piece{blks, offInIo, ioIdx});
+}
+
+void VirtualFullImage::readBase(uint64_t addr, size_t blks, char *data) const
+{
+    if (addr < baseSizeLb_) {
+        const size_t blks0 = std::min<uint64_t>(blks, baseSizeLb_ - addr);
+        virt_local::preadAll(base_.fd(), data, blks0 * LOGICAL_BLOCK_SIZE, addr * LOGICAL_BLOCK_SIZE);
+        data += blks0 * LOGICAL_BLOCK_SIZE;
+        blks -= blks0;
+    }
+    ::memset(data, 0, blks * LOGICAL_BLOCK_SIZE);
+}
+
+void VirtualFullImage::readPiece(const Piece &piece, uint32_t offInPiece, size_t blks, char *data) const
+{
+    assert(offInPiece + blks <= piece.blks);
+    const DiffIo &io = ioV_[piece.ioIdx];
+    if (io.type != DiffRecType::NORMAL) {
+        /* Read zero image for both ALL_ZERO and DISCARD as VirtualFullScanner does. */
+        ::memset(data, 0, blks * LOGICAL_BLOCK_SIZE);
+        return;
+    }
+    const IndexedDiffCache::DataPtr p = loadData(io);
+    const size_t off = (piece.offInIo + offInPiece) * LOGICAL_BLOCK_SIZE;
+    assert(off + blks * LOGICAL_BLOCK_SIZE <= p->size());
+    ::memcpy(data, p->data() + off, blks * LOGICAL_BLOCK_SIZE);
+}
+
+IndexedDiffCache::DataPtr VirtualFullImage::loadData(const DiffIo &io) const
+{
+    const DiffFile &diffFile = fileV_[io.fileIdx];
+    const IndexedDiffCache::Key key{diffFile.dev, diffFile.ino, io.dataOffset, io.checksum};
+    IndexedDiffCache::DataPtr p = cache_->find(key);
+    if (p) return p;
+
+    AlignedArray stored(io.dataSize, false);
+    virt_local::preadAll(diffFile.file.fd(), stored.data(), stored.size(), io.dataOffset);
+    if (calcDiffIoChecksum(stored) != io.checksum) {
+        throw cybozu::Exception("VirtualFullImage") << "IO data invalid" << io.fileIdx << io.dataOffset << io.dataSize;
+    }
+    std::shared_ptr<AlignedArray> data;
+    if (io.cmprType == ::WALB_DIFF_CMPR_NONE) {
+        data = std::make_shared<AlignedArray>(std::move(stored));
+    } else {
+        data = std::make_shared<AlignedArray>();
+        data->resize(io.origBlocks * LOGICAL_BLOCK_SIZE, false);
+        uncompressData(stored.data(), stored.size(), *data, io.cmprType);
+    }
+    p = data;
+    cache_->add(key, IndexedDiffCache::DataPtr(p));
+    return p;
+}
+
+VirtualFullMaterializer::VirtualFullMaterializer(const VirtualFullImage &image, cybozu::util::File &&out, size_t bufSize)
+    : image_(image), out_(std::move(out))
+    , bufLb_(std::max<size_t>(bufSize / LOGICAL_BLOCK_SIZE, 1))
+    , progressLb_(0), shouldStop_(false), runner_()
+{
+}
+
+void VirtualFullMaterializer::start()
+{
+    shouldStop_ = false;
+    runner_.set([this]() { run(); });
+    runner_.start();
+}
+
+void VirtualFullMaterializer::read(uint64_t addr, size_t blks, void *data) const
+{
+    char *p = (char *)data;
+    const uint64_t progressLb = progressLb_.load(std::memory_order_acquire);
+    if (addr < progressLb) {
+        const size_t blks0 = std::min<uint64_t>(blks, progressLb - addr);
+        virt_local::preadAll(out_.fd(), p, blks0 * LOGICAL_BLOCK_SIZE, addr * LOGICAL_BLOCK_SIZE);
+        addr += blks0;
+        blks -= blks0;
+        p += blks0 * LOGICAL_BLOCK_SIZE;
+    }
+    if (blks > 0) image_.read(addr, blks, p);
+}
+
+void VirtualFullMaterializer::run()
+{
+    const uint64_t sizeLb = image_.sizeLb();
+    AlignedArray buf(bufLb_ * LOGICAL_BLOCK_SIZE, false);
+    uint64_t addr = progressLb_.load();
+    out_.lseek(addr * LOGICAL_BLOCK_SIZE);
+    while (addr < sizeLb && !shouldStop_) {
+        const size_t blks = std::min<uint64_t>(bufLb_, sizeLb - addr);
+        image_.read(addr, blks, buf.data());
+        out_.write(buf.data(), blks * LOGICAL_BLOCK_SIZE);
+        addr += blks;
+        if (addr == sizeLb) out_.fdatasync();
+        progressLb_.store(addr, std::memory_order_release);
+    }
+}
+
 } //namespace walb
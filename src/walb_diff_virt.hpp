@@ -10,12 +10,15 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <map>
+#include <atomic>
 #include "cybozu/option.hpp"
 #include "fileio.hpp"
 #include "walb_diff_base.hpp"
 #include "walb_diff_file.hpp"
 #include "walb_diff_mem.hpp"
 #include "walb_diff_merge.hpp"
+#include "thread_util.hpp"
 
 namespace walb {
 
@@ -140,4 +143,137 @@ private:
     }
 };
 
+/**
+ * Random-access virtual full image.
+ *
+ * Only the records of the wdiffs are loaded to memory.
+ * The address map tells the newest IO of each block,
+ * and its data are read from the wdiff file on demand
+ * and kept in the IndexedDiffCache uncompressed.
+ * Both sorted and indexed wdiff files are supported.
+ *
+ * read() is thread-safe.
+ */
+class VirtualFullImage
+{
+private:
+    /* An IO stored in a wdiff file. */
+    struct DiffIo {
+        uint32_t fileIdx;
+        DiffRecType type;
+        uint8_t cmprType;
+        uint32_t origBlocks;
+        uint32_t dataSize;
+        uint32_t checksum;
+        uint64_t dataOffset; /* [byte] in the file. */
+    };
+    /* A part of an IO, which is not overwritten by newer IOs. */
+    struct Piece {
+        uint32_t blks;
+        uint32_t offInIo; /* [logical block] */
+        size_t ioIdx; /* index in ioV_. */
+    };
+    struct DiffFile {
+        cybozu::util::File file;
+        uint64_t dev, ino; /* identify the file in the cache. */
+    };
+
+    cybozu::util::File base_;
+    uint64_t baseSizeLb_;
+    uint64_t sizeLb_;
+    std::vector<DiffFile> fileV_;
+    std::vector<DiffIo> ioV_;
+    std::map<uint64_t, Piece> map_; /* key: address [logical block]. Pieces are not overlapped. */
+    IndexedDiffCache *cache_;
+    DiffStatistics statIn_;
+
+public:
+    VirtualFullImage()
+        : base_(), baseSizeLb_(0), sizeLb_(0), fileV_(), ioV_(), map_()
+        , cache_(&getSharedIndexedDiffCache()), statIn_() {}
+    /**
+     * Call this before init().
+     */
+    void setCache(IndexedDiffCache &cache) { cache_ = &cache; }
+    /**
+     * @base a seekable base full image: a raw image file or a block device.
+     * @fileV wdiff files sorted by time.
+     * @sizeLb image size [logical block]. 0 means the size of the base image.
+     *   The base image is regarded as zero-filled beyond its end.
+     */
+    void init(cybozu::util::File&& base, std::vector<cybozu::util::File>&& fileV, uint64_t sizeLb = 0);
+    void init(cybozu::util::File&& base, const StrVec &wdiffPaths, uint64_t sizeLb = 0);
+
+    uint64_t sizeLb() const { return sizeLb_; }
+    size_t getNrPieces() const { return map_.size(); }
+    const DiffStatistics& statIn() const { return statIn_; }
+
+    /**
+     * @addr [logical block].
+     * @blks [logical block]. addr + blks must be <= sizeLb().
+     * @data buffer of blks * LOGICAL_BLOCK_SIZE bytes.
+     */
+    void read(uint64_t addr, size_t blks, void *data) const;
+private:
+    void addSortedDiff(size_t fileIdx);
+    void addIndexedDiff(size_t fileIdx, cybozu::util::File &&file);
+    /**
+     * Newer IOs must be added later.
+     */
+    void addIo(uint64_t addr, uint32_t blks, uint32_t offInIo, size_t ioIdx);
+    void readBase(uint64_t addr, size_t blks, char *data) const;
+    void readPiece(const Piece &piece, uint32_t offInPiece, size_t blks, char *data) const;
+    IndexedDiffCache::DataPtr loadData(const DiffIo &io) const;
+};
+
+/**
+ * Materialize a virtual full image to a device in background
+ * while serving reads of the image.
+ *
+ * Reads of the written area are served from the device
+ * so that the IO data need not be read from the wdiffs and uncompressed again.
+ * read() is thread-safe.
+ */
+class VirtualFullMaterializer
+{
+private:
+    const VirtualFullImage &image_;
+    cybozu::util::File out_;
+    size_t bufLb_;
+    std::atomic<uint64_t> progressLb_;
+    std::atomic<bool> shouldStop_;
+    cybozu::thread::ThreadRunner runner_;
+
+public:
+    /**
+     * @image it must be alive while the materializer is used.
+     * @out output device or file, which must be readable and writable.
+     * @bufSize IO size to write [byte].
+     */
+    VirtualFullMaterializer(const VirtualFullImage &image, cybozu::util::File &&out, size_t bufSize);
+    ~VirtualFullMaterializer() noexcept {
+        shouldStop_ = true;
+        runner_.joinNoThrow();
+    }
+    void start();
+    /**
+     * Stop the materialization. The progress is kept.
+     * The error of the background thread will be thrown.
+     */
+    void stop() {
+        shouldStop_ = true;
+        runner_.join();
+    }
+    /**
+     * Wait for the whole image to be written and synced.
+     * The error of the background thread will be thrown.
+     */
+    void join() { runner_.join(); }
+    uint64_t progressLb() const { return progressLb_.load(std::memory_order_acquire); }
+    bool isDone() const { return progressLb() == image_.sizeLb(); }
+    void read(uint64_t addr, size_t blks, void *data) const;
+private:
+    void run();
+};
+
 } //namespace walb
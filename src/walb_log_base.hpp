@@ -366,12 +366,30 @@ inline bool readLogPackHeader(Reader &reader, LogPackHeader &packH, uint64_t lsi
 }
 
 
+/**
+ * Verify log IO data read by readLogIo().
+ * Padding data is always valid.
+ */
+inline bool verifyLogIoChecksum(const WlogRecord &lrec, const void *data, uint32_t salt)
+{
+    if (!lrec.hasDataForChecksum()) {
+        assert(!lrec.hasData() || lrec.isPadding());
+        return true;
+    }
+    const size_t ioSizeB = lrec.ioSizeLb() * LOGICAL_BLOCK_SIZE;
+    const uint32_t csum = cybozu::util::calcChecksum(data, ioSizeB, salt);
+    return lrec.checksum == csum;
+}
+
+
 /**
  * data size will be multiples of physical blocks.
  * padding IO data will also be set.
+ * If doVerify is false, you must call verifyLogIoChecksum() by yourself.
  */
 template <typename Reader>
-inline bool readLogIo(Reader &reader, const LogPackHeader &packH, size_t idx, AlignedArray &data)
+inline bool readLogIo(Reader &reader, const LogPackHeader &packH, size_t idx, AlignedArray &data,
+                      bool doVerify = true)
 {
     const WlogRecord &lrec = packH.record(idx);
     if (!lrec.hasData()) return true;
@@ -381,16 +399,8 @@ inline bool readLogIo(Reader &reader, const LogPackHeader &packH, size_t idx, Al
     const size_t ioSizePb = lrec.ioSizePb(pbs);
     data.resize(ioSizePb * pbs);
     reader.read(data.data(), data.size()); // physical blocks.
-    if (!lrec.hasDataForChecksum()) {
-        assert(lrec.isPadding());
-        // keep padding data.
-        return true;
-    }
-
-    // checksum.
-    const size_t ioSizeB = lrec.ioSizeLb() * LOGICAL_BLOCK_SIZE;
-    const uint32_t csum = cybozu::util::calcChecksum(data.data(), ioSizeB, packH.salt());
-    return lrec.checksum == csum;
+    if (!doVerify) return true;
+    return verifyLogIoChecksum(lrec, data.data(), packH.salt());
 }
 
 /**
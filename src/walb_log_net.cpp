@@ -2,9 +2,34 @@
 
 namespace walb {
 
+namespace wlog_net_local {
+
+void verifyIoChecksum(const WlogRecord &rec, const char *data, uint32_t salt, const char *msg)
+{
+    if (!verifyLogIoChecksum(rec, data, salt)) {
+        const size_t ioSizeB = rec.ioSizeLb() * LBS;
+        const uint32_t csum = cybozu::util::calcChecksum(data, ioSizeB, salt);
+        throw cybozu::Exception(msg) << "invalid checksum" << rec << salt << csum;
+    }
+}
+
+} // namespace wlog_net_local
+
+void WlogSender::start(size_t concurrency, size_t inQueueSize, size_t outQueueSize)
+{
+    if (convP_) throw cybozu::Exception(NAME()) << "already started";
+    cmprStat_.setConcurrency(concurrency);
+    convP_.reset(new wlog_net_local::Converter([this](Task &&task) {
+                return convert(std::move(task));
+            }));
+    convP_->start(concurrency, inQueueSize, outQueueSize);
+    writerTh_.set([this]() { runWriter(); });
+    writerTh_.start();
+}
+
 void WlogSender::process(CompressedData& cd, bool doCompress) try
 {
-    if (doCompress) cd.compress();
+    if (doCompress) cd.compress(cmpr_);
     ctrl_.next();
     cd.send(packet_);
 } catch (std::exception& e) {
@@ -19,14 +44,62 @@ void WlogSender::process(CompressedData& cd, bool doCompress) try
  */
 void WlogSender::pushIo(const LogPackHeader &header, uint16_t recIdx, const char *data)
 {
-    verifyPbsAndSalt(header);
     const WlogRecord &rec = header.record(recIdx);
     if (!rec.hasData()) return;
 
     const size_t size = rec.ioSizePb(pbs_) * pbs_;
+    AlignedArray buf(size, false);
+    ::memcpy(buf.data(), data, size);
+    pushIo(header, recIdx, std::move(buf));
+}
+
+void WlogSender::pushIo(const LogPackHeader &header, uint16_t recIdx, AlignedArray &&data)
+{
+    const WlogRecord &rec = header.record(recIdx);
+    if (!rec.hasData()) return;
+
     CompressedData cd;
-    cd.compressFrom(data, size);
-    process(cd, false);
+    cd.setUncompressed(std::move(data));
+    pushIo(header, recIdx, std::move(cd));
+}
+
+void WlogSender::pushIo(const LogPackHeader &header, uint16_t recIdx, CompressedData &&cd)
+{
+    verifyPbsAndSalt(header);
+    const WlogRecord &rec = header.record(recIdx);
+    if (!rec.hasData()) return;
+
+    const size_t size = rec.ioSizePb(pbs_) * pbs_;
+    if (cd.isCompressed() || cd.rawSize() != size) {
+        throw cybozu::Exception(NAME()) << "invalid IO data" << rec << cd.isCompressed() << cd.rawSize() << size;
+    }
+    Task task;
+    task.cd = std::move(cd);
+    task.isIo = true;
+    task.rec = rec;
+    push(std::move(task));
+}
+
+void WlogSender::sync()
+{
+    if (convP_) {
+        try {
+            convP_->sync();
+        } catch (...) {
+            throwWriterErrorOrRethrow();
+        }
+        writerTh_.join();
+        convP_.reset();
+    }
+    ctrl_.end();
+}
+
+void WlogSender::fail() noexcept
+{
+    if (!convP_) return;
+    convP_->fail();
+    writerTh_.joinNoThrow();
+    convP_.reset();
 }
 
 void WlogSender::verifyPbsAndSalt(const LogPackHeader &header) const
@@ -39,12 +112,98 @@ void WlogSender::verifyPbsAndSalt(const LogPackHeader &header) const
     }
 }
 
+void WlogSender::push(Task &&task)
+{
+    if (!convP_) {
+        CompressedData cd = convert(std::move(task));
+        StageStat::Scope scope(sendStat_);
+        scope.add(cd.rawSize());
+        process(cd, false);
+        return;
+    }
+    try {
+        convP_->push(std::move(task));
+    } catch (...) {
+        throwWriterErrorOrRethrow();
+    }
+}
+
+CompressedData WlogSender::convert(Task &&task)
+{
+    StageStat::Scope scope(cmprStat_);
+    scope.add(task.cd.rawSize());
+    if (task.isIo) {
+        wlog_net_local::verifyIoChecksum(task.rec, task.cd.rawData(), salt_, "WlogSender:convert");
+    }
+    task.cd.compress(cmpr_);
+    return std::move(task.cd);
+}
+
+void WlogSender::runWriter()
+{
+    try {
+        CompressedData cd;
+        while (convP_->pop(cd)) {
+            StageStat::Scope scope(sendStat_);
+            scope.add(cd.rawSize());
+            ctrl_.next();
+            cd.send(packet_);
+        }
+    } catch (std::exception& e) {
+        try {
+            packet::StreamControl(packet_.sock()).error();
+        } catch (...) {}
+        logger_.error() << "WlogSender:runWriter" << e.what();
+        convP_->fail();
+        throw;
+    }
+}
+
+/**
+ * Call this in a catch block.
+ * The error of the writer thread is preferred because it is the cause.
+ */
+void WlogSender::throwWriterErrorOrRethrow()
+{
+    convP_->fail();
+    std::exception_ptr ep = writerTh_.joinNoThrow();
+    if (ep) std::rethrow_exception(ep);
+    throw;
+}
+
+
+WlogReceiver::~WlogReceiver() noexcept
+{
+    if (!convP_) return;
+    convP_->fail();
+    readerTh_.joinNoThrow();
+}
+
+void WlogReceiver::start(size_t concurrency, size_t inQueueSize, size_t outQueueSize)
+{
+    if (convP_) throw cybozu::Exception(NAME()) << "already started";
+    const uint32_t salt = salt_;
+    Uncompressor &uncmpr = uncmpr_;
+    convP_.reset(new wlog_net_local::Converter([salt, &uncmpr](Task &&task) {
+                task.cd.uncompress(uncmpr);
+                if (task.isIo) {
+                    wlog_net_local::verifyIoChecksum(
+                        task.rec, task.cd.rawData(), salt, "WlogReceiver:convert");
+                }
+                return std::move(task.cd);
+            }));
+    convP_->start(concurrency, inQueueSize, outQueueSize);
+    readerTh_.set([this]() { runReader(); });
+    readerTh_.start();
+}
 
 bool WlogReceiver::process(CompressedData& cd)
 {
+    if (convP_) return popUncompressed(cd);
+
     if (ctrl_.isNext()) {
         cd.recv(packet_);
-        cd.uncompress();
+        cd.uncompress(uncmpr_);
         ctrl_.reset();
         return true;
     }
@@ -84,13 +243,68 @@ void WlogReceiver::popIo(const WlogRecord &rec, AlignedArray &data)
     }
     assert(!cd.isCompressed());
     cd.moveTo(data);
-    if (!rec.hasDataForChecksum()) return;
+    if (convP_) return; // a worker has verified it.
+    wlog_net_local::verifyIoChecksum(rec, data.data(), salt_, "WlogReceiver:popIo");
+}
+
+/**
+ * Receive data and dispatch them to workers.
+ * Logpack headers are uncompressed here to know the records of the following IOs.
+ */
+void WlogReceiver::runReader()
+{
+    const char *const FUNC = "WlogReceiver:runReader";
+    try {
+        LogPackHeader packH(pbs_, salt_);
+        size_t recIdx = 0;
+        bool isIo = false;
+        for (;;) {
+            if (!ctrl_.isNext()) {
+                if (ctrl_.isError()) throw cybozu::Exception(FUNC) << "isError";
+                break;
+            }
+            Task task;
+            task.cd.recv(packet_);
+            ctrl_.reset();
+            if (isIo) {
+                while (!packH.record(recIdx).hasData()) recIdx++;
+                task.isIo = true;
+                task.rec = packH.record(recIdx++);
+            } else {
+                task.cd.uncompress(uncmpr_);
+                if (task.cd.rawSize() != pbs_) {
+                    throw cybozu::Exception(FUNC) << "invalid pack header size" << task.cd.rawSize() << pbs_;
+                }
+                packH.copyFrom(task.cd.rawData(), pbs_);
+                task.isIo = false;
+                recIdx = 0;
+            }
+            size_t i = recIdx;
+            while (i < packH.nRecords() && !packH.record(i).hasData()) i++;
+            isIo = i < packH.nRecords();
+            convP_->push(std::move(task));
+        }
+        convP_->sync();
+    } catch (...) {
+        convP_->fail();
+        throw;
+    }
+}
 
-    const size_t ioSizeB = rec.ioSizeLb() * LBS;
-    const uint32_t csum = cybozu::util::calcChecksum(data.data(), ioSizeB, salt_);
-    if (csum != rec.checksum) {
-        throw cybozu::Exception("WlogReceiver:popIo:invalid checksum") << rec << salt_ << csum;
+/**
+ * The error of the reader thread is preferred because it is the cause.
+ */
+bool WlogReceiver::popUncompressed(CompressedData &cd)
+{
+    try {
+        if (convP_->pop(cd)) return true;
+    } catch (...) {
+        std::exception_ptr ep = readerTh_.joinNoThrow();
+        if (ep) std::rethrow_exception(ep);
+        throw;
     }
+    readerTh_.join();
+    return false;
 }
 
 } //namespace walb
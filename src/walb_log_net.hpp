@@ -13,35 +13,78 @@
 #include "walb_log_file.hpp"
 #include "compressed_data.hpp"
 #include "walb_logger.hpp"
+#include "thread_util.hpp"
+#include "throughput_util.hpp"
 
 namespace walb {
 
 constexpr size_t Q_SIZE = 16;
 
+namespace wlog_net_local {
+
+/**
+ * A header or IO data to be (un)compressed by a worker.
+ */
+struct Task
+{
+    CompressedData cd;
+    bool isIo;
+    WlogRecord rec; // valid if isIo is true.
+};
+
+using Converter = cybozu::thread::ParallelConverter<Task, CompressedData>;
+
+void verifyIoChecksum(const WlogRecord &rec, const char *data, uint32_t salt, const char *msg);
+
+} // namespace wlog_net_local
+
 /**
  * Walb log sender via TCP/IP connection.
  * This will send packets only, never receive packets.
  *
  * Usage:
- *   (1) call setParams() to set parameters.
- *   (2) call start() to start worker threads.
- *   (3) call pushHeader() and corresponding pushIo() multiple times.
- *   (4) repeat (3).
- *   (5) call sync() for normal finish, or fail().
+ *   (1) call start() to start worker threads if you want to compress data in parallel.
+ *   (2) call pushHeader() and corresponding pushIo() multiple times.
+ *   (3) repeat (2).
+ *   (4) call sync() for normal finish, or fail().
  */
 class WlogSender
 {
 private:
+    using Task = wlog_net_local::Task;
+
     packet::Packet packet_;
     packet::StreamControl ctrl_;
     Logger &logger_;
     uint32_t pbs_;
     uint32_t salt_;
+    Compressor cmpr_;
+
+    std::unique_ptr<wlog_net_local::Converter> convP_;
+    cybozu::thread::ThreadRunner writerTh_;
+    StageStat cmprStat_;
+    StageStat sendStat_;
 public:
     static constexpr const char *NAME() { return "WlogSender"; }
-    WlogSender(cybozu::Socket &sock, Logger &logger, uint32_t pbs, uint32_t salt)
-        : packet_(sock), ctrl_(sock), logger_(logger), pbs_(pbs), salt_(salt) {
+    /**
+     * cmprType and cmprLevel must be the ones the receiver has agreed with.
+     */
+    WlogSender(cybozu::Socket &sock, Logger &logger, uint32_t pbs, uint32_t salt,
+               int cmprType = ::WALB_DIFF_CMPR_SNAPPY, size_t cmprLevel = 0)
+        : packet_(sock), ctrl_(sock), logger_(logger), pbs_(pbs), salt_(salt)
+        , cmpr_(cmprType, cmprLevel, true)
+        , convP_(), writerTh_(), cmprStat_(), sendStat_() {
+    }
+    ~WlogSender() noexcept {
+        fail();
     }
+    /**
+     * Start worker threads to verify and compress data,
+     * and a thread to send them in order.
+     * inQueueSize: max number of headers and IOs waiting for a worker.
+     * outQueueSize: max number of compressed data waiting to be sent.
+     */
+    void start(size_t concurrency, size_t inQueueSize = Q_SIZE, size_t outQueueSize = Q_SIZE);
     void process(CompressedData& cd, bool doCompress);
 
     /**
@@ -50,47 +93,83 @@ public:
      */
     void pushHeader(const LogPackHeader &header) {
         verifyPbsAndSalt(header);
-        CompressedData cd;
-        cd.setUncompressed(header.rawData(), pbs_);
-        process(cd, true);
+        Task task;
+        task.cd.setUncompressed(header.rawData(), pbs_);
+        task.isIo = false;
+        push(std::move(task));
     }
     /**
      * You must call this for discard/padding record also.
+     * IO data will be verified with its checksum.
      */
     void pushIo(const LogPackHeader &header, uint16_t recIdx, const char *data);
+    /**
+     * data size must be ioSizePb * pbs. This will avoid copying the data.
+     */
+    void pushIo(const LogPackHeader &header, uint16_t recIdx, AlignedArray &&data);
+    /**
+     * cd must be uncompressed data of ioSizePb * pbs.
+     * Lent data (see CompressedData::setLent()) will be verified, compressed
+     * and sent without copying. Incompressible ones will be written to the socket directly.
+     */
+    void pushIo(const LogPackHeader &header, uint16_t recIdx, CompressedData &&cd);
 
     /**
      * Notify the end of input.
      */
-    void sync() {
-        ctrl_.end();
-    }
+    void sync();
+    /**
+     * Stop threads started by start() in error cases.
+     */
+    void fail() noexcept;
+
+    const StageStat& compressStat() const { return cmprStat_; }
+    const StageStat& sendStat() const { return sendStat_; }
 private:
     void verifyPbsAndSalt(const LogPackHeader &header) const;
+    void push(Task &&task);
+    CompressedData convert(Task &&task);
+    void runWriter();
+    void throwWriterErrorOrRethrow();
 };
 
 /**
  * Walb log receiver via TCP/IP connection.
  *
  * Usage:
- *   (1) call setParams() to set parameters.
- *   (2) call start() to start worker threads.
- *   (3) call popHeader() and corresponding popIo() multiple times.
- *   (4) repeat (3) while popHeader() returns true.
+ *   (1) call start() to start worker threads if you want to uncompress data in parallel.
+ *   (2) call popHeader() and corresponding popIo() multiple times.
+ *   (3) repeat (2) while popHeader() returns true.
  *   popHeader() will throw an error if something is wrong.
  */
 class WlogReceiver
 {
 private:
+    using Task = wlog_net_local::Task;
+
     packet::Packet packet_;
     packet::StreamControl ctrl_;
     uint32_t pbs_;
     uint32_t salt_;
+    Uncompressor uncmpr_;
+
+    std::unique_ptr<wlog_net_local::Converter> convP_;
+    cybozu::thread::ThreadRunner readerTh_;
 public:
     static constexpr const char *NAME() { return "WlogReceiver"; }
-    WlogReceiver(cybozu::Socket &sock, uint32_t pbs, uint32_t salt)
-        : packet_(sock), ctrl_(sock), pbs_(pbs), salt_(salt) {
+    WlogReceiver(cybozu::Socket &sock, uint32_t pbs, uint32_t salt,
+                 int cmprType = ::WALB_DIFF_CMPR_SNAPPY)
+        : packet_(sock), ctrl_(sock), pbs_(pbs), salt_(salt)
+        , uncmpr_(cmprType)
+        , convP_(), readerTh_() {
     }
+    ~WlogReceiver() noexcept;
+    /**
+     * Start a thread to receive data and worker threads
+     * to uncompress and verify them.
+     * Data will be popped in order.
+     */
+    void start(size_t concurrency, size_t inQueueSize = Q_SIZE, size_t outQueueSize = Q_SIZE);
     bool process(CompressedData& cd);
 
     /**
@@ -107,6 +186,9 @@ public:
      * You must call this for discard/padding record also.
      */
     void popIo(const WlogRecord &rec, AlignedArray &data);
+private:
+    void runReader();
+    bool popUncompressed(CompressedData &cd);
 };
 
 } //namespace walb
@@ -249,6 +249,16 @@ inline void verifyNotZero(const IntType &t, const char *msg)
     }
 }
 
+/**
+ * cybozu::thread::BoundedQueue requires 2 or more.
+ */
+inline void verifyQueueSize(size_t size, const char *msg)
+{
+    if (size < 2) {
+        throw cybozu::Exception(msg) << "must be 2 or more." << size;
+    }
+}
+
 inline std::string getElapsedTimeStr(double elapsedSec)
 {
     return cybozu::util::formatString("elapsed_time %.3f sec", elapsedSec);
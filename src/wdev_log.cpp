@@ -125,8 +125,57 @@ bool SuperBlock::isValid(bool isChecksum) const
 }
 
 
+uint64_t AsyncWldevReader::LentAreas::add(size_t size, bool isReleased)
+{
+    std::lock_guard<std::mutex> lk(mu);
+    const uint64_t id = bgnId + q.size();
+    q.emplace_back(size, isReleased);
+    if (q.size() == 1 && isReleased) {
+        releasedSize += size;
+        q.pop_front();
+        bgnId++;
+    }
+    return id;
+}
+
+
+void AsyncWldevReader::LentAreas::release(uint64_t id)
+{
+    std::lock_guard<std::mutex> lk(mu);
+    assert(bgnId <= id && id < bgnId + q.size());
+    q[id - bgnId].second = true;
+    const size_t s0 = releasedSize;
+    while (!q.empty() && q.front().second) {
+        releasedSize += q.front().first;
+        q.pop_front();
+        bgnId++;
+    }
+    if (releasedSize != s0) cv.notify_all();
+}
+
+
+void AsyncWldevReader::LentAreas::waitForRelease()
+{
+    std::unique_lock<std::mutex> lk(mu);
+    cv.wait(lk, [this]() { return releasedSize > 0; });
+}
+
+
+size_t AsyncWldevReader::LentAreas::takeReleasedSize()
+{
+    std::lock_guard<std::mutex> lk(mu);
+    const size_t s = releasedSize;
+    releasedSize = 0;
+    return s;
+}
+
+
 void AsyncWldevReader::reset(uint64_t lsid, uint64_t maxSizePb)
 {
+    applyReleased();
+    if (ringBuf_.getLentSize() > 0) {
+        throw cybozu::Exception(NAME()) << "lent data remain" << ringBuf_.getLentSize();
+    }
     /* Wait for all pending aio(s). */
     while (!ioQ_.empty()) {
         waitForIo();
@@ -143,7 +192,9 @@ void AsyncWldevReader::read(void *data, size_t size)
     char *ptr = (char *)data;
     while (size > 0) {
         prepareReadableData();
+        const bool isBehindLent = ringBuf_.getLentSize() > 0;
         const size_t s = ringBuf_.read(ptr, size);
+        keepConsumedIfBehindLent(isBehindLent, s);
         ptr += s;
         size -= s;
         readAhead();
@@ -155,13 +206,44 @@ void AsyncWldevReader::skip(size_t size)
 {
     while (size > 0) {
         prepareReadableData();
+        const bool isBehindLent = ringBuf_.getLentSize() > 0;
         const size_t s = ringBuf_.skip(size);
+        keepConsumedIfBehindLent(isBehindLent, s);
         size -= s;
         readAhead();
     }
 }
 
 
+std::shared_ptr<const char> AsyncWldevReader::lend(size_t size)
+{
+    applyReleased();
+    /*
+     * Keep enough free space for read-ahead without waiting for release
+     * because the lent data may be released only after the reader thread goes ahead.
+     */
+    const size_t maxLentSize = (ringBuf_.getBufferSize() - maxIoSize_) / 2;
+    if (size == 0 || ringBuf_.getLentSize() + size > maxLentSize) return nullptr;
+
+    prepareReadableData();
+    while (ringBuf_.getReadableSize() < size) {
+        if (!ringBuf_.canExtendReadableContiguously()) return nullptr;
+        if (ioQ_.empty()) readAhead();
+        if (ioQ_.empty()) return nullptr;
+        ringBuf_.complete(waitForIo());
+    }
+    const char *ptr;
+    const size_t s = ringBuf_.lend(size, &ptr);
+    assert(s == size); unusedVar(s);
+    const uint64_t id = lentAreas_->add(size, false);
+    std::shared_ptr<LentAreas> areas = lentAreas_;
+    readAhead();
+    return std::shared_ptr<const char>(ptr, [areas, id](const char *) {
+            areas->release(id);
+        });
+}
+
+
 bool AsyncWldevReader::prepareAheadIo()
 {
     if (aio_.isQueueFull()) return false;
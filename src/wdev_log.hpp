@@ -6,6 +6,9 @@
 #include <cassert>
 #include <memory>
 #include <queue>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 #include <cstdlib>
 #include <functional>
 #include <type_traits>
@@ -253,6 +256,33 @@ private:
 };
 
 
+/**
+ * Read-ahead parameters of AsyncWldevReader.
+ */
+struct WldevReadAheadParams
+{
+    size_t bufferSize; // ring buffer size [byte].
+    size_t maxIoSize; // [byte].
+    size_t queueDepth; // max number of IOs in flight.
+
+    bool operator==(const WldevReadAheadParams &rhs) const {
+        return bufferSize == rhs.bufferSize && maxIoSize == rhs.maxIoSize
+            && queueDepth == rhs.queueDepth;
+    }
+    bool operator!=(const WldevReadAheadParams &rhs) const {
+        return !(*this == rhs);
+    }
+    std::string str() const {
+        return cybozu::util::formatString(
+            "buf %zuKiB io %zuKiB qd %zu", bufferSize / KIBI, maxIoSize / KIBI, queueDepth);
+    }
+    friend inline std::ostream &operator<<(std::ostream &os, const WldevReadAheadParams &p) {
+        os << p.str();
+        return os;
+    }
+};
+
+
 /**
  * Walb log device reader using aio.
  */
@@ -262,6 +292,7 @@ private:
     cybozu::util::File file_;
     const size_t pbs_;
     const size_t maxIoSize_;
+    const size_t queueDepth_;
 
     SuperBlock super_;
     cybozu::aio::Aio aio_;
@@ -277,39 +308,74 @@ private:
 
     uint64_t readAheadPb_; // read ahead size [physical block]
 
+    /*
+     * Lent areas of ringBuf_ in order.
+     * release() may be called by any thread in any order,
+     * and the released size will be given back to ringBuf_ by the reader thread.
+     */
+    struct LentAreas
+    {
+        std::mutex mu;
+        std::condition_variable cv;
+        uint64_t bgnId; // id of q.front().
+        std::deque<std::pair<size_t, bool> > q; // size and whether released.
+        size_t releasedSize;
+
+        LentAreas() : mu(), cv(), bgnId(0), q(), releasedSize(0) {}
+        uint64_t add(size_t size, bool isReleased);
+        void release(uint64_t id);
+        size_t takeReleasedSize();
+        void waitForRelease();
+    };
+    std::shared_ptr<LentAreas> lentAreas_;
+
+public:
     static constexpr size_t DEFAULT_BUFFER_SIZE = 4U << 20; /* 4MiB */
     static constexpr size_t DEFAULT_MAX_IO_SIZE = 64U << 10; /* 64KiB. */
-public:
+    static constexpr size_t DEFAULT_QUEUE_DEPTH = DEFAULT_BUFFER_SIZE / DEFAULT_MAX_IO_SIZE;
+
     static constexpr const char *NAME() { return "AsyncWldevReader"; }
     /**
      * @wldevPath walb log device path.
      * @bufferSize buffer size to read ahead [byte].
      * @maxIoSize max IO size [byte].
+     * @queueDepth max number of IOs in flight. 0 means it is limited by bufferSize only.
      */
     AsyncWldevReader(cybozu::util::File &&wldevFile,
                      size_t bufferSize = DEFAULT_BUFFER_SIZE,
-                     size_t maxIoSize = DEFAULT_MAX_IO_SIZE)
+                     size_t maxIoSize = DEFAULT_MAX_IO_SIZE,
+                     size_t queueDepth = 0)
         : file_(std::move(wldevFile))
         , pbs_(cybozu::util::getPhysicalBlockSize(file_.fd()))
         , maxIoSize_(maxIoSize)
+        , queueDepth_(queueDepth == 0 ? bufferSize / pbs_ + 1 : queueDepth)
         , super_()
-        , aio_(file_.fd(), bufferSize / pbs_ + 1)
+        , aio_(file_.fd(), queueDepth_)
         , aheadLsid_(0)
         , ringBuf_()
         , ioQ_()
-        , readAheadPb_(UINT64_MAX) {
+        , readAheadPb_(UINT64_MAX)
+        , lentAreas_(std::make_shared<LentAreas>()) {
         assert(pbs_ != 0);
         verifyMultiple(bufferSize, pbs_, "bad bufferSize");
         verifyMultiple(maxIoSize_, pbs_, "bad maxIoSize");
+        if (bufferSize < maxIoSize_ * 2) {
+            throw cybozu::Exception(NAME()) << "too small bufferSize" << bufferSize << maxIoSize_;
+        }
         super_.read(file_.fd());
         ringBuf_.init(bufferSize);
+        aio_.registerBuffer(ringBuf_.getBuffer(), ringBuf_.getBufferSize());
     }
     AsyncWldevReader(const std::string &wldevPath,
                      size_t bufferSize = DEFAULT_BUFFER_SIZE,
-                     size_t maxIoSize = DEFAULT_MAX_IO_SIZE)
+                     size_t maxIoSize = DEFAULT_MAX_IO_SIZE,
+                     size_t queueDepth = 0)
         : AsyncWldevReader(
             cybozu::util::File(wldevPath, O_RDONLY | O_DIRECT),
-            bufferSize, maxIoSize) {
+            bufferSize, maxIoSize, queueDepth) {
+    }
+    AsyncWldevReader(const std::string &wldevPath, const WldevReadAheadParams &params)
+        : AsyncWldevReader(wldevPath, params.bufferSize, params.maxIoSize, params.queueDepth) {
     }
     ~AsyncWldevReader() noexcept {
         while (!ioQ_.empty()) {
@@ -320,12 +386,29 @@ public:
         }
     }
     SuperBlock &super() { return super_; }
+    WldevReadAheadParams params() const {
+        return {ringBuf_.getBufferSize(), maxIoSize_, aio_.queueSize()};
+    }
     /**
      * Reset current IOs and start read from a lsid.
      */
     void reset(uint64_t lsid, uint64_t maxSizePb = UINT64_MAX);
     void read(void *data, size_t size);
     void skip(size_t size);
+    /**
+     * Get the next data of the size without copying.
+     * The returned pointer refers the internal buffer directly and
+     * the area will be released when the pointer (and its copies) are destroyed.
+     * Release may be done by any thread.
+     * All the lent data must be released before calling reset() or destroying the reader.
+     * read(), skip() and lend() will wait for lent data to be released
+     * when they occupy the buffer, so do not hold them in the reading thread.
+     *
+     * RETURN:
+     *   nullptr if the data can not be lent: it is not contiguous in the buffer or
+     *   too much data have been lent. Call read() instead in that case.
+     */
+    std::shared_ptr<const char> lend(size_t size);
 private:
     void verifyMultiple(uint64_t size, size_t pbs, const char *msg) const {
         if (size == 0 || size % pbs != 0) {
@@ -342,6 +425,11 @@ private:
     void prepareReadableData() {
         if (ringBuf_.getReadableSize() > 0) return;
         if (ioQ_.empty()) readAhead();
+        while (ioQ_.empty() && readAheadPb_ > 0 && ringBuf_.getLentSize() > 0) {
+            /* The free space is occupied by lent data. */
+            lentAreas_->waitForRelease();
+            readAhead();
+        }
         if (ioQ_.empty()) {
             assert(readAheadPb_ == 0);
             throw cybozu::Exception(NAME()) << "reached max read size.";
@@ -350,12 +438,24 @@ private:
         ringBuf_.complete(waitForIo());
     }
     void readAhead() {
+        applyReleased();
         size_t n = 0;
         while (prepareAheadIo()) n++;
         if (n > 0) aio_.submit();
     }
     bool prepareAheadIo();
     size_t decideIoSize() const;
+    void applyReleased() {
+        const size_t s = lentAreas_->takeReleasedSize();
+        if (s > 0) ringBuf_.release(s);
+    }
+    /**
+     * Call this after read()/skip() of the ring buffer
+     * with isBehindLent = ringBuf_.getLentSize() > 0 before it.
+     */
+    void keepConsumedIfBehindLent(bool isBehindLent, size_t size) {
+        if (isBehindLent && size > 0) lentAreas_->add(size, true);
+    }
 };
 
 
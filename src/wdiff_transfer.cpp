@@ -137,9 +137,8 @@ bool wdiffTransferNoMergeClient(
     if (fileH.isIndexed()) {
         CompressOpt cmpr; // default value.
         IndexedDiffReader reader;
-        IndexedDiffCache cache;
-        cache.setMaxSize(32 * MEBI);
-        reader.setFile(std::move(fileR), cache);
+        reader.setFile(std::move(fileR), getSharedIndexedDiffCache());
+        reader.setReadAhead(INDEXED_DIFF_READ_AHEAD_NR);
         return indexedWdiffTransferNoMergeClient(pkt, reader, cmpr, stopState, ps);
     } else {
         // This does not touch (compressed) IO data.
@@ -157,6 +156,8 @@ bool wdiffTransferServer(
     AlignedArray buf;
     packet::StreamControl ctrl(pkt.sock());
     uint64_t writeSize = 0;
+    uint64_t offset = sizeof(walb_diff_file_header);
+    DiffPackIndex packIdx;
     while (ctrl.isNext()) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
             return false;
@@ -167,7 +168,9 @@ bool wdiffTransferServer(
         buf.resize(size);
         pkt.read(buf.data(), buf.size());
         verifyDiffPack(buf.data(), buf.size(), true);
+        packIdx.add(*reinterpret_cast<const DiffPackHeader *>(buf.data()), offset);
         fileW.write(buf.data(), buf.size());
+        offset += buf.size();
         writeSize += buf.size();
         if (writeSize >= fsyncIntervalSize) {
             fileW.fdatasync();
@@ -179,6 +182,7 @@ bool wdiffTransferServer(
         throw cybozu::Exception(FUNC) << "bad ctrl not end";
     }
     writeDiffEofPack(fileW);
+    packIdx.writeTo(fileW, offset + WALB_DIFF_PACK_SIZE);
     return true;
 }
 
@@ -39,7 +39,8 @@ bool wdiffTransferNoMergeClient(
     const std::atomic<int> &stopState, const ProcessStatus &ps);
 
 /**
- * Wdiff header must have been written already before calling this.
+ * Wdiff header must have been written already before calling this,
+ * with hasPackIndex since the pack index will be written after the end pack.
  *
  * RETURN:
  *   false if force stopped.
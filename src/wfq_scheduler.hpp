@@ -0,0 +1,150 @@
+#pragma once
+/**
+ * @file
+ * @brief Weighted fair queuing of a bandwidth shared by flows.
+ */
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <algorithm>
+#include <cinttypes>
+#include "cybozu/exception.hpp"
+#include "util.hpp"
+
+namespace walb {
+
+/**
+ * Threads acquire a size of the bandwidth for their flows before using it.
+ * The bandwidth is given to waiting requests in the order of their finish tags
+ * (self-clocked fair queuing), so each busy flow gets the share of its weight
+ * and idle flows do not accumulate credits.
+ *
+ * Clock is replaceable for tests.
+ *
+ * This is thread-safe.
+ */
+template <typename Clock>
+class WfqSchedulerT
+{
+    using TimePoint = typename Clock::time_point;
+    using UniqueLock = std::unique_lock<std::mutex>;
+    using Key = std::pair<double, uint64_t>; // finish tag and arrival order.
+
+    struct Flow
+    {
+        double finishTag;
+        uint64_t grantedSize;
+    };
+
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    uint64_t bytesPerSec_; // 0 means unlimited.
+    double virtualTime_;
+    TimePoint nextTime_; // the bandwidth is free after this time.
+    std::map<std::string, Flow> flows_;
+    std::set<Key> waiting_;
+    uint64_t arrival_;
+
+    static constexpr size_t CHECK_INTERVAL_MS = 100;
+
+public:
+    explicit WfqSchedulerT(uint64_t bytesPerSec = 0)
+        : mu_(), cv_(), bytesPerSec_(bytesPerSec), virtualTime_(0), nextTime_(Clock::now())
+        , flows_(), waiting_(), arrival_(0) {
+    }
+    /**
+     * bytesPerSec: 0 means unlimited.
+     */
+    void setBytesPerSec(uint64_t bytesPerSec) {
+        UniqueLock lk(mu_);
+        bytesPerSec_ = bytesPerSec;
+        cv_.notify_all();
+    }
+    uint64_t getBytesPerSec() const {
+        UniqueLock lk(mu_);
+        return bytesPerSec_;
+    }
+    /**
+     * Wait for the turn of the flow to use the size.
+     * weight: must be positive. Larger weights get more bandwidth.
+     * isCanceled: checked periodically while waiting if specified.
+     * RETURN:
+     *   false if canceled.
+     */
+    bool acquire(const std::string &flowId, uint64_t size, double weight,
+                 const std::function<bool()> &isCanceled = nullptr) {
+        if (weight <= 0) throw cybozu::Exception("WfqScheduler:acquire:bad weight") << weight;
+        if (size == 0) return true;
+        UniqueLock lk(mu_);
+        Flow &flow = flows_[flowId];
+        if (bytesPerSec_ == 0) {
+            flow.grantedSize += size;
+            return true;
+        }
+        const double tag = std::max(virtualTime_, flow.finishTag) + size / weight;
+        flow.finishTag = tag;
+        /* Do not use flow after waiting because removeFlow() may be called meanwhile. */
+        const Key key(tag, arrival_++);
+        waiting_.insert(key);
+        TimePoint now;
+        for (;;) {
+            now = Clock::now();
+            if (bytesPerSec_ == 0) break;
+            const bool isHead = *waiting_.begin() == key;
+            if (isHead && nextTime_ <= now) break;
+            if (isCanceled && isCanceled()) {
+                waiting_.erase(key);
+                cv_.notify_all();
+                return false;
+            }
+            const size_t intervalMs = CHECK_INTERVAL_MS; // to avoid undefined reference.
+            TimePoint until = now + std::chrono::milliseconds(intervalMs);
+            if (isHead) until = std::min(until, nextTime_);
+            cv_.wait_until(lk, until);
+        }
+        waiting_.erase(key);
+        virtualTime_ = tag;
+        if (bytesPerSec_ > 0) {
+            const uint64_t us = size * 1000000 / bytesPerSec_;
+            nextTime_ = std::max(nextTime_, now) + std::chrono::microseconds(us);
+        }
+        flows_[flowId].grantedSize += size;
+        cv_.notify_all();
+        return true;
+    }
+    /**
+     * Total size granted to the flow.
+     */
+    uint64_t getGrantedSize(const std::string &flowId) const {
+        UniqueLock lk(mu_);
+        typename std::map<std::string, Flow>::const_iterator it = flows_.find(flowId);
+        if (it == flows_.cend()) return 0;
+        return it->second.grantedSize;
+    }
+    size_t getNumWaiting() const {
+        UniqueLock lk(mu_);
+        return waiting_.size();
+    }
+    /**
+     * Forget the flow of a volume that will not use the bandwidth for a while.
+     * A flow removed while acquiring is added again with no credit.
+     */
+    void removeFlow(const std::string &flowId) {
+        UniqueLock lk(mu_);
+        flows_.erase(flowId);
+    }
+    std::string str() const {
+        UniqueLock lk(mu_);
+        return cybozu::util::formatString(
+            "bytesPerSec %" PRIu64 " flows %zu waiting %zu"
+            , bytesPerSec_, flows_.size(), waiting_.size());
+    }
+};
+
+using WfqScheduler = WfqSchedulerT<std::chrono::steady_clock>;
+
+} // namespace walb
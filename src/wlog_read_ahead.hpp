@@ -0,0 +1,257 @@
+#pragma once
+/**
+ * @file
+ * @brief Adaptive read-ahead settings of log devices for wlog-transfer.
+ */
+#include <mutex>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cinttypes>
+#include "wdev_log.hpp"
+
+namespace walb {
+
+/**
+ * This chooses read-ahead parameters of AsyncWldevReader for a volume.
+ *
+ * The parameters are on a ladder starting from the defaults of AsyncWldevReader.
+ * Each step doubles the buffer size and doubles the IO size or the queue depth alternately,
+ * so the size of IOs in flight is about a half of the buffer.
+ * Each value stops growing at its cap, and a cap smaller than the default is used from the start.
+ * The IO size does not exceed a half of the buffer as AsyncWldevReader requires.
+ *
+ * The tuner climbs the ladder while the throughput of the level is better
+ * than that of the previous level by IMPROVEMENT_RATIO,
+ * and goes back to the previous level and settles otherwise.
+ * The throughput of a level is measured with at least sampleSize() bytes
+ * so that short wlog-transfers do not affect it too much.
+ * A settled tuner will try the next level again after REPROBE_INTERVAL measurements.
+ *
+ * This is not thread-safe.
+ */
+class WldevReadAheadTuner
+{
+public:
+    using Params = device::WldevReadAheadParams;
+
+    static constexpr double IMPROVEMENT_RATIO = 1.1;
+    static constexpr uint64_t MIN_SAMPLE_SIZE = 64 * MEBI;
+    static constexpr size_t SAMPLE_BUFFER_RATIO = 16;
+    static constexpr size_t REPROBE_INTERVAL = 16;
+    static constexpr size_t MAX_LEVEL = 32;
+
+private:
+    struct Sample
+    {
+        uint64_t bytes;
+        double sec;
+    };
+
+    Params maxP_;
+    size_t maxLevel_;
+    size_t level_;
+    bool isProbing_;
+    double prevBps_; // throughput of the previous level while probing [byte/sec].
+    double lastBps_; // the latest measured throughput [byte/sec].
+    std::vector<Sample> sampleV_; // index: level.
+    size_t nSettled_;
+
+public:
+    /**
+     * maxP: caps of the parameters.
+     */
+    explicit WldevReadAheadTuner(const Params &maxP)
+        : maxP_(maxP), maxLevel_(0), level_(0), isProbing_(true)
+        , prevBps_(0), lastBps_(0), sampleV_(), nSettled_(0) {
+        while (maxLevel_ < MAX_LEVEL && getLevelParams(maxLevel_ + 1) != getLevelParams(maxLevel_)) {
+            maxLevel_++;
+        }
+        sampleV_.resize(maxLevel_ + 1, Sample{0, 0});
+    }
+    static Params getDefaultParams() {
+        using Reader = device::AsyncWldevReader;
+        return {Reader::DEFAULT_BUFFER_SIZE, Reader::DEFAULT_MAX_IO_SIZE, Reader::DEFAULT_QUEUE_DEPTH};
+    }
+    /**
+     * Verify caps given by options.
+     * AsyncWldevReader requires a buffer of two IOs at least.
+     */
+    static void verifyParams(const Params &p, const char *msg) {
+        if (p.bufferSize == 0 || p.maxIoSize == 0 || p.queueDepth == 0) {
+            throw cybozu::Exception(msg) << "must not be 0" << p;
+        }
+        if (p.bufferSize < p.maxIoSize * 2) {
+            throw cybozu::Exception(msg) << "buffer size must be twice the IO size or more" << p;
+        }
+    }
+    Params getLevelParams(size_t level) const {
+        const Params p = getDefaultParams();
+        const size_t bufferSize = shiftWithin(p.bufferSize, level, maxP_.bufferSize);
+        const size_t maxIoSize = shiftWithin(p.maxIoSize, (level + 1) / 2, maxP_.maxIoSize);
+        return {bufferSize,
+                std::min(maxIoSize, bufferSize / 2),
+                shiftWithin(p.queueDepth, level / 2, maxP_.queueDepth)};
+    }
+    /**
+     * Parameters to use for the next read.
+     * maxBufferSize: the buffer size will not exceed it unless it is the level 0's one.
+     */
+    Params get(size_t maxBufferSize = SIZE_MAX) const {
+        size_t level = level_;
+        while (level > 0 && getLevelParams(level).bufferSize > maxBufferSize) level--;
+        return getLevelParams(level);
+    }
+    /**
+     * Add a measurement.
+     * p: parameters that have been used.
+     *    The measurement is recorded for the level of the parameters,
+     *    which may be lower than the current level when get() was limited by maxBufferSize.
+     *    It will be ignored if no level has the parameters.
+     * bytes: read size [byte].
+     * sec: elapsed time [sec].
+     */
+    void add(const Params &p, uint64_t bytes, double sec) {
+        size_t level;
+        if (!findLevel(p, level) || sec <= 0) return;
+        Sample &sample = sampleV_[level];
+        sample.bytes += bytes;
+        sample.sec += sec;
+        if (sample.bytes < sampleSize(level)) return;
+
+        const double bps = sample.bytes / sample.sec;
+        sample = Sample{0, 0};
+        lastBps_ = bps;
+        if (level != level_) {
+            /* The previous level is the baseline of probing. */
+            if (isProbing_ && level + 1 == level_) prevBps_ = bps;
+            return;
+        }
+        if (!isProbing_) {
+            nSettled_++;
+            if (nSettled_ < REPROBE_INTERVAL || level_ == maxLevel_) return;
+            isProbing_ = true;
+            prevBps_ = bps;
+            level_++;
+            return;
+        }
+        if (prevBps_ == 0 || bps >= prevBps_ * IMPROVEMENT_RATIO) {
+            prevBps_ = bps;
+            if (level_ < maxLevel_) {
+                level_++;
+            } else {
+                settle();
+            }
+        } else {
+            assert(level_ > 0);
+            level_--;
+            settle();
+        }
+    }
+    uint64_t sampleSize(size_t level) const {
+        const uint64_t minSize = MIN_SAMPLE_SIZE; // to avoid undefined reference.
+        return std::max<uint64_t>(minSize, getLevelParams(level).bufferSize * SAMPLE_BUFFER_RATIO);
+    }
+    uint64_t sampleSize() const { return sampleSize(level_); }
+    size_t level() const { return level_; }
+    size_t maxLevel() const { return maxLevel_; }
+    bool isProbing() const { return isProbing_; }
+    std::string str() const {
+        return cybozu::util::formatString(
+            "level %zu/%zu %s lastThroughput %.1fMiB/s"
+            , level_, maxLevel_, isProbing_ ? "probing" : "settled", lastBps_ / MEBI);
+    }
+private:
+    /**
+     * v is reduced to maxV first if it is larger.
+     */
+    static size_t shiftWithin(size_t v, size_t shift, size_t maxV) {
+        v = std::min(v, maxV);
+        for (size_t i = 0; i < shift && v * 2 <= maxV; i++) v *= 2;
+        return v;
+    }
+    bool findLevel(const Params &p, size_t &level) const {
+        for (size_t i = 0; i <= maxLevel_; i++) {
+            if (getLevelParams(i) == p) {
+                level = i;
+                return true;
+            }
+        }
+        return false;
+    }
+    void settle() {
+        isProbing_ = false;
+        nSettled_ = 0;
+    }
+};
+
+
+/**
+ * Read-ahead buffer memory shared by all the volumes of a server.
+ * This is thread-safe.
+ */
+class WldevReadAheadBudget
+{
+    mutable std::mutex mu_;
+    size_t capSize_;
+    size_t usedSize_;
+
+    using AutoLock = std::lock_guard<std::mutex>;
+public:
+    WldevReadAheadBudget() : mu_(), capSize_(SIZE_MAX), usedSize_(0) {
+    }
+    void setCap(size_t capSize) {
+        AutoLock lk(mu_);
+        capSize_ = capSize;
+    }
+    /**
+     * Reserve up to the size.
+     * minSize will be always reserved even if it exceeds the cap,
+     * so that a wlog-transfer never waits for others.
+     * RETURN:
+     *   reserved size.
+     */
+    size_t reserve(size_t size, size_t minSize) {
+        AutoLock lk(mu_);
+        const size_t avail = usedSize_ < capSize_ ? capSize_ - usedSize_ : 0;
+        const size_t s = std::min(size, std::max(avail, minSize));
+        usedSize_ += s;
+        return s;
+    }
+    void release(size_t size) {
+        AutoLock lk(mu_);
+        assert(size <= usedSize_);
+        usedSize_ -= size;
+    }
+    std::string str() const {
+        AutoLock lk(mu_);
+        return cybozu::util::formatString("used %zuMiB cap %zuMiB", usedSize_ / MEBI, capSize_ / MEBI);
+    }
+
+    /**
+     * RAII for reserve() and release().
+     */
+    class Reservation
+    {
+        WldevReadAheadBudget &budget_;
+        size_t size_;
+    public:
+        Reservation(WldevReadAheadBudget &budget, size_t size, size_t minSize)
+            : budget_(budget), size_(budget.reserve(size, minSize)) {
+        }
+        ~Reservation() noexcept {
+            budget_.release(size_);
+        }
+        size_t size() const { return size_; }
+        /**
+         * Give back the reserved size over the new size.
+         */
+        void shrink(size_t size) {
+            if (size >= size_) return;
+            budget_.release(size_ - size);
+            size_ = size;
+        }
+    };
+};
+
+} // namespace walb
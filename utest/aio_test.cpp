@@ -264,3 +264,48 @@ CYBOZU_TEST_AUTO(testAioWaitOne)
     std::sort(s1.begin(), s1.end());
     CYBOZU_TEST_ASSERT(s0 == s1);
 }
+
+void testAioBackend(AioBackend backend, bool doRegister)
+{
+    cybozu::TmpFile tmpF = prepareTmpFile(128);
+    Aio aio(tmpF.fd(), 8, backend);
+    if (aio.backend() == AioBackend::Libaio) {
+        ::printf("io_uring is not available: %s\n", aioBackendToStr(backend));
+        return;
+    }
+
+    AArray v0(LBS * 128);
+    AArray v1(LBS * 128);
+    if (doRegister) {
+        CYBOZU_TEST_ASSERT(aio.registerBuffer(v0.data(), v0.size()));
+        CYBOZU_TEST_ASSERT(aio.registerBuffer(v1.data(), v1.size()));
+    }
+    fillArray(v0);
+    writeArray(aio, v0);
+    readArray(aio, v1);
+    CYBOZU_TEST_EQUAL(::memcmp(v0.data(), v1.data(), v0.size()), 0);
+
+    /* Batched submission. */
+    ::memset(v1.data(), 0, v1.size());
+    std::queue<uint32_t> q;
+    for (size_t i = 0; i < 128; i += 8) {
+        for (size_t j = 0; j < 8; j++) {
+            const off_t oft = LBS * (i + j);
+            CYBOZU_TEST_ASSERT(aio.prepareRead(oft, LBS, &v1[oft]) != 0);
+        }
+        aio.submit();
+        aio.wait(8, q);
+    }
+    CYBOZU_TEST_EQUAL(q.size(), 128U);
+    CYBOZU_TEST_EQUAL(::memcmp(v0.data(), v1.data(), v0.size()), 0);
+}
+
+CYBOZU_TEST_AUTO(testAioIoUring)
+{
+    for (AioBackend backend : {AioBackend::IoUring, AioBackend::IoUringSqPoll}) {
+        testAioBackend(backend, false);
+        testAioBackend(backend, true);
+    }
+    CYBOZU_TEST_ASSERT(parseAioBackend("iouring-sqpoll") == AioBackend::IoUringSqPoll);
+    CYBOZU_TEST_EXCEPTION(parseAioBackend("xxx"), std::exception);
+}
@@ -49,3 +49,50 @@ CYBOZU_TEST_AUTO(testAsyncBdevReader)
     test(tmpFile.path(), 1, bufSize, maxIoSize, buf0.data(), devSize);
     test(tmpFile.path(), (4 << 20) / LBS, bufSize, maxIoSize, buf0.data(), devSize); /* 4MiB */
 }
+
+CYBOZU_TEST_AUTO(testRingBufferForSeqReadLend)
+{
+    const size_t bufSize = 8 * LBS;
+    RingBufferForSeqRead rb;
+    rb.init(bufSize);
+
+    char *p = rb.prepare(4 * LBS);
+    for (size_t i = 0; i < 4 * LBS; i++) p[i] = char(i);
+    rb.complete(4 * LBS);
+    CYBOZU_TEST_EQUAL(rb.getFreeSize(), 4 * LBS);
+
+    const char *lent0;
+    CYBOZU_TEST_EQUAL(rb.lend(LBS, &lent0), LBS);
+    CYBOZU_TEST_ASSERT(lent0 == p);
+    AArray buf(LBS);
+    CYBOZU_TEST_EQUAL(rb.read(buf.data(), LBS), LBS);
+    CYBOZU_TEST_EQUAL(::memcmp(buf.data(), p + LBS, LBS), 0);
+    const char *lent1;
+    CYBOZU_TEST_EQUAL(rb.lend(LBS, &lent1), LBS);
+    CYBOZU_TEST_ASSERT(lent1 == p + 2 * LBS);
+
+    /* Consumed data behind the lent area are not freed. */
+    CYBOZU_TEST_EQUAL(rb.getLentSize(), 3 * LBS);
+    CYBOZU_TEST_EQUAL(rb.getFreeSize(), 4 * LBS);
+
+    /* Fill the buffer to the right edge and then wrap around. */
+    CYBOZU_TEST_EQUAL(rb.getAvailableSize(), 4 * LBS);
+    rb.prepare(4 * LBS);
+    CYBOZU_TEST_EQUAL(rb.getFreeSize(), 0);
+    rb.release(2 * LBS);
+    CYBOZU_TEST_EQUAL(rb.getFreeSize(), 2 * LBS);
+    CYBOZU_TEST_EQUAL(rb.getAvailableSize(), 2 * LBS);
+    rb.release(LBS);
+    CYBOZU_TEST_EQUAL(rb.getLentSize(), 0);
+    CYBOZU_TEST_EQUAL(rb.getFreeSize(), 3 * LBS);
+
+    /* Readable data reach the right edge. */
+    rb.complete(4 * LBS);
+    CYBOZU_TEST_ASSERT(!rb.canExtendReadableContiguously());
+    const char *lent2;
+    CYBOZU_TEST_EQUAL(rb.lend(8 * LBS, &lent2), 5 * LBS);
+    CYBOZU_TEST_ASSERT(lent2 == p + 3 * LBS);
+    CYBOZU_TEST_EQUAL(rb.getFreeSize(), 3 * LBS);
+    rb.release(5 * LBS);
+    CYBOZU_TEST_EQUAL(rb.getFreeSize(), bufSize);
+}
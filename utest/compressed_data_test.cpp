@@ -38,6 +38,55 @@ CYBOZU_TEST_AUTO(compressedData)
     }
 }
 
+CYBOZU_TEST_AUTO(compressedDataWithCodec)
+{
+    cybozu::util::Random<uint32_t> rand;
+    for (int type : {::WALB_DIFF_CMPR_LZ4, ::WALB_DIFF_CMPR_ZSTD, ::WALB_DIFF_CMPR_GZIP}) {
+        Compressor cmpr(type, 1);
+        Uncompressor uncmpr(type);
+        for (size_t i = 0; i < 10; i++) {
+            AlignedArray v(rand.get16() + 32);
+            rand.fill(&v[0], 32);
+            CompressedData cd0, cd1;
+            cd0.setUncompressed(v.data(), v.size());
+            cd1 = cd0;
+            cd1.compress(cmpr);
+            CYBOZU_TEST_ASSERT(cd1.isCompressed());
+            cd1.uncompress(uncmpr);
+            CYBOZU_TEST_EQUAL(cd0.rawSize(), cd1.rawSize());
+            CYBOZU_TEST_ASSERT(::memcmp(cd0.rawData(), cd1.rawData(), cd0.rawSize()) == 0);
+        }
+    }
+}
+
+CYBOZU_TEST_AUTO(compressedDataLent)
+{
+    const size_t size = 4096;
+    AlignedArray buf(size);
+    ::memset(buf.data(), 'a', size);
+    bool isReleased = false;
+    std::shared_ptr<const char> lent(buf.data(), [&](const char *) { isReleased = true; });
+
+    CompressedData cd0, cd1;
+    cd0.setLent(std::move(lent), size);
+    CYBOZU_TEST_ASSERT(cd0.isLent());
+    CYBOZU_TEST_ASSERT(cd0.rawData() == buf.data());
+    CYBOZU_TEST_EQUAL(cd0.rawSize(), size);
+    cd1 = cd0;
+    Compressor cmpr(::WALB_DIFF_CMPR_ZSTD);
+    cd0.compress(cmpr);
+    CYBOZU_TEST_ASSERT(cd0.isCompressed());
+    CYBOZU_TEST_ASSERT(!isReleased);
+    AlignedArray out;
+    cd1.moveTo(out);
+    CYBOZU_TEST_ASSERT(isReleased);
+    CYBOZU_TEST_EQUAL(out.size(), size);
+    CYBOZU_TEST_EQUAL(::memcmp(out.data(), buf.data(), size), 0);
+    Uncompressor uncmpr(::WALB_DIFF_CMPR_ZSTD);
+    cd0.uncompress(uncmpr);
+    CYBOZU_TEST_EQUAL(::memcmp(cd0.rawData(), buf.data(), size), 0);
+}
+
 void throwErrorIf(std::vector<std::exception_ptr> &&ev)
 {
     bool isError = false;
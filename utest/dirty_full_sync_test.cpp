@@ -0,0 +1,214 @@
+#include "cybozu/test.hpp"
+#include "dirty_full_sync.hpp"
+#include "thread_util.hpp"
+#include "tmp_file.hpp"
+#include "random.hpp"
+#include "protocol.hpp"
+#include <thread>
+
+using namespace walb;
+
+cybozu::util::Random<size_t> g_rand;
+
+CYBOZU_TEST_AUTO(splitFullSyncRange)
+{
+    const uint64_t bulkLb = 128;
+    for (size_t i = 0; i < 100; i++) {
+        const uint64_t sizeLb = g_rand() % (bulkLb * 16) + 1;
+        const size_t nr = g_rand() % 8 + 1;
+        const FullSyncRangeVec v = splitFullSyncRange(sizeLb, bulkLb, nr);
+        CYBOZU_TEST_ASSERT(isValidFullSyncRange(v, sizeLb));
+        CYBOZU_TEST_ASSERT(v.size() <= nr);
+        CYBOZU_TEST_EQUAL(v.size(), std::min<uint64_t>(nr, (sizeLb + bulkLb - 1) / bulkLb));
+        for (const FullSyncRange &r : v) {
+            CYBOZU_TEST_EQUAL(r.bgnLb % bulkLb, 0U);
+            CYBOZU_TEST_ASSERT(r.bgnLb < r.endLb);
+            CYBOZU_TEST_ASSERT(!r.isDone());
+        }
+        CYBOZU_TEST_EQUAL(getFullSyncDoneLb(v), 0U);
+    }
+    FullSyncRangeVec v = splitFullSyncRange(1000, 10, 3);
+    v[1].progressLb = v[1].endLb + 1;
+    CYBOZU_TEST_ASSERT(!isValidFullSyncRange(v, 1000));
+    v[1].progressLb = v[1].endLb;
+    CYBOZU_TEST_ASSERT(isValidFullSyncRange(v, 1000));
+    CYBOZU_TEST_ASSERT(!isValidFullSyncRange(v, 1010));
+    CYBOZU_TEST_EQUAL(getFullSyncDoneLb(v), v[1].endLb - v[1].bgnLb);
+}
+
+CYBOZU_TEST_AUTO(FullReplState)
+{
+    FullReplState st0;
+    st0.metaSt = MetaState(MetaSnap(10), 12345);
+    st0.rangeV = splitFullSyncRange(1000, 10, 4);
+    st0.rangeV[2].progressLb += 30;
+    st0.progressLb = getFullSyncDoneLb(st0.rangeV);
+    st0.timestamp = 12345;
+
+    std::stringstream ss;
+    cybozu::save(ss, st0);
+    FullReplState st1;
+    cybozu::load(st1, ss);
+    CYBOZU_TEST_EQUAL(st0.str(), st1.str());
+    CYBOZU_TEST_EQUAL(st1.progressLb, 30U);
+    CYBOZU_TEST_ASSERT(isValidFullSyncRange(st1.rangeV, 1000));
+}
+
+/**
+ * The primary connection and additional ones are accepted by a server thread in order.
+ */
+CYBOZU_TEST_AUTO(dirtyFullSyncMulti)
+{
+    const uint64_t sizeLb = 8 * MEBI / LOGICAL_BLOCK_SIZE + g_rand() % 64;
+    const uint64_t bulkLb = 64 * KIBI / LOGICAL_BLOCK_SIZE;
+    AlignedArray data(sizeLb * LOGICAL_BLOCK_SIZE);
+    g_rand.fill(data.data(), data.size());
+    /* All-zero bulks are sent as empty. */
+    for (uint64_t lb = 0; lb < sizeLb; lb += bulkLb) {
+        if (g_rand() % 3 != 0) continue;
+        const uint64_t lb2 = std::min(lb + bulkLb, sizeLb);
+        ::memset(&data[lb * LOGICAL_BLOCK_SIZE], 0, (lb2 - lb) * LOGICAL_BLOCK_SIZE);
+    }
+    cybozu::TmpFile src("."), dst(".");
+    {
+        cybozu::util::File file(src.fd());
+        file.write(data.data(), data.size());
+        cybozu::util::File file2(dst.fd());
+        file2.ftruncate(data.size());
+    }
+    FullSyncRangeVec rangeV = splitFullSyncRange(sizeLb, bulkLb, 4);
+    CYBOZU_TEST_EQUAL(rangeV.size(), 4U);
+    /* Resume: a range has been done and another has been done partially. */
+    rangeV[1].progressLb = rangeV[1].endLb;
+    rangeV[2].progressLb += bulkLb;
+    const uint64_t initDoneLb = getFullSyncDoneLb(rangeV);
+    {
+        cybozu::util::File file(dst.path(), O_RDWR);
+        for (const FullSyncRange &r : rangeV) {
+            file.pwrite(&data[r.bgnLb * LOGICAL_BLOCK_SIZE], r.doneLb() * LOGICAL_BLOCK_SIZE, r.bgnLb * LOGICAL_BLOCK_SIZE);
+        }
+    }
+
+    const std::atomic<int> stopState(NotStopping);
+    ProcessStatus ps;
+    std::atomic<uint64_t> progressLb(initDoneLb);
+    FullSyncRangeVec savedV;
+    std::mutex mu;
+    FullSyncSessionMap map;
+    std::shared_ptr<FullSyncSession> sessP(new FullSyncSession(
+        rangeV, bulkLb, false, MEBI, stopState, ps, progressLb, [&](const FullSyncRangeVec &v) {
+            std::lock_guard<std::mutex> lk(mu);
+            savedV = v;
+        }));
+    FullSyncSessionRegistration reg(map, sessP);
+    CYBOZU_TEST_EQUAL(sessP->getPendingIndexes().size(), 3U);
+
+    const uint16_t port = 20000 + g_rand() % 20000;
+    cybozu::Socket ssock;
+    ssock.bind(port);
+    cybozu::thread::ThreadRunner server([&]() {
+            cybozu::Socket sock;
+            ssock.accept(sock);
+            packet::Packet pkt(sock);
+            cybozu::thread::ThreadRunnerSet thS;
+            for (size_t i = 1; i < sessP->getPendingIndexes().size(); i++) {
+                cybozu::Socket sock2;
+                ssock.accept(sock2);
+                std::shared_ptr<cybozu::Socket> sockP(new cybozu::Socket());
+                *sockP = std::move(sock2);
+                thS.add([&, sockP]() {
+                        packet::Packet pkt2(*sockP);
+                        ProtocolLogger logger("server", "client");
+                        dirtyFullSyncStreamServer(pkt2, map, logger);
+                    });
+            }
+            thS.start();
+            reg.get().start(dst.path());
+            CYBOZU_TEST_ASSERT(reg.get().receive(pkt, reg.get().getPendingIndexes()[0]));
+            CYBOZU_TEST_ASSERT(reg.get().waitForAll(10));
+            for (std::exception_ptr ep : thS.join()) std::rethrow_exception(ep);
+        });
+    server.start();
+
+    cybozu::Socket sock;
+    sock.connect("localhost", port);
+    packet::Packet pkt(sock);
+    const std::atomic<uint64_t> maxLbPerSec(0);
+    const FullSyncConnectFunc connectF = [&](cybozu::Socket &sock2) {
+        sock2.connect("localhost", port);
+    };
+    CYBOZU_TEST_ASSERT(dirtyFullSyncClientMulti(
+                           pkt, connectF, reg.getId(), rangeV, src.path(), bulkLb, stopState, ps, maxLbPerSec));
+    server.join();
+
+    CYBOZU_TEST_EQUAL(progressLb.load(), sizeLb);
+    CYBOZU_TEST_ASSERT(isValidFullSyncRange(savedV, sizeLb));
+    CYBOZU_TEST_EQUAL(getFullSyncDoneLb(savedV), sizeLb);
+    cybozu::util::File file(dst.path(), O_RDONLY);
+    AlignedArray buf(data.size());
+    file.read(buf.data(), buf.size());
+    CYBOZU_TEST_ASSERT(::memcmp(buf.data(), data.data(), data.size()) == 0);
+    CYBOZU_TEST_ASSERT(map.get(reg.getId() + 1) == nullptr);
+}
+
+/**
+ * A failure of a range stops the other ranges on both sides.
+ */
+CYBOZU_TEST_AUTO(dirtyFullSyncAbort)
+{
+    const uint64_t bulkLb = 4 * KIBI / LOGICAL_BLOCK_SIZE;
+    const uint64_t sizeLb = bulkLb * 64;
+    cybozu::TmpFile src("."), dst(".");
+    {
+        cybozu::util::File file(src.fd());
+        file.ftruncate(sizeLb * LOGICAL_BLOCK_SIZE);
+        cybozu::util::File file2(dst.fd());
+        file2.ftruncate(sizeLb * LOGICAL_BLOCK_SIZE);
+    }
+    const std::atomic<int> stopState(NotStopping);
+    ProcessStatus ps;
+    const std::atomic<uint64_t> maxLbPerSec(0);
+
+    /* The sender stops before sending anything. */
+    std::atomic<bool> abort(true);
+    cybozu::Socket sock0;
+    packet::Packet pkt0(sock0);
+    CYBOZU_TEST_ASSERT(!dirtyFullSyncClient(
+                           pkt0, src.path(), 0, sizeLb, bulkLb, stopState, ps, maxLbPerSec, 1, &abort));
+
+    std::atomic<uint64_t> progressLb(0);
+    const FullSyncRangeVec rangeV = splitFullSyncRange(sizeLb, bulkLb, 2);
+    std::shared_ptr<FullSyncSession> sessP(new FullSyncSession(
+        rangeV, bulkLb, false, MEBI, stopState, ps, progressLb));
+    sessP->start(dst.path());
+
+    const uint16_t port = 20000 + g_rand() % 20000;
+    cybozu::Socket ssock;
+    ssock.bind(port);
+    cybozu::thread::ThreadRunner server([&]() {
+            cybozu::Socket sock;
+            ssock.accept(sock);
+            packet::Packet pkt(sock);
+            CYBOZU_TEST_EXCEPTION(sessP->receive(pkt, 0), cybozu::Exception);
+        });
+    server.start();
+
+    cybozu::Socket sock;
+    sock.connect("localhost", port);
+    packet::Packet pkt(sock);
+    /* The receiver fails in the middle of the range when the session is canceled. */
+    pkt.write(size_t(0));
+    pkt.flush();
+    while (progressLb < bulkLb) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    sessP->cancel();
+    pkt.write(size_t(0));
+    pkt.flush();
+    server.join();
+    CYBOZU_TEST_ASSERT(progressLb < rangeV[0].endLb);
+
+    /* The other range fails without receiving anything. */
+    cybozu::Socket sock2;
+    packet::Packet pkt2(sock2);
+    CYBOZU_TEST_EXCEPTION(sessP->receive(pkt2, 1), cybozu::Exception);
+    CYBOZU_TEST_EXCEPTION(sessP->waitForAll(10), cybozu::Exception);
+}
@@ -0,0 +1,162 @@
+#include "cybozu/test.hpp"
+#include "nbd_server.hpp"
+#include "thread_util.hpp"
+#include "random.hpp"
+#include <endian.h>
+#include <netinet/tcp.h>
+#include <thread>
+#include <chrono>
+
+using namespace walb;
+
+cybozu::util::Random<size_t> g_rand;
+
+template <typename T>
+T recvBe(cybozu::Socket &sock)
+{
+    T v;
+    sock.read(&v, sizeof(v));
+    if (sizeof(T) == 2) return be16toh(v);
+    if (sizeof(T) == 4) return be32toh(v);
+    return be64toh(v);
+}
+
+template <typename T>
+void sendBe(cybozu::Socket &sock, T v)
+{
+    if (sizeof(T) == 2) v = htobe16(v);
+    if (sizeof(T) == 4) v = htobe32(v);
+    if (sizeof(T) == 8) v = htobe64(v);
+    sock.write(&v, sizeof(v));
+}
+
+void sendOpt(cybozu::Socket &sock, uint32_t opt, const std::string &data)
+{
+    sendBe<uint64_t>(sock, nbd::IHAVEOPT);
+    sendBe<uint32_t>(sock, opt);
+    sendBe<uint32_t>(sock, data.size());
+    sock.write(data.data(), data.size());
+}
+
+/**
+ * RETURN:
+ *   reply type.
+ */
+uint32_t recvOptReply(cybozu::Socket &sock, uint32_t opt, std::string &data)
+{
+    CYBOZU_TEST_EQUAL(recvBe<uint64_t>(sock), nbd::OPT_REPLY_MAGIC);
+    CYBOZU_TEST_EQUAL(recvBe<uint32_t>(sock), opt);
+    const uint32_t type = recvBe<uint32_t>(sock);
+    data.resize(recvBe<uint32_t>(sock));
+    if (!data.empty()) sock.read(&data[0], data.size());
+    return type;
+}
+
+std::string makeGoData(const std::string &name)
+{
+    std::string data;
+    const uint32_t len = htobe32(name.size());
+    data.append((const char *)&len, sizeof(len));
+    data += name;
+    data.append(2, '\0'); // no info request.
+    return data;
+}
+
+/**
+ * RETURN:
+ *   error in the reply.
+ */
+uint32_t sendCmd(cybozu::Socket &sock, uint16_t type, uint64_t offset, uint32_t len, std::string &data)
+{
+    sendBe<uint32_t>(sock, nbd::REQUEST_MAGIC);
+    sendBe<uint16_t>(sock, 0);
+    sendBe<uint16_t>(sock, type);
+    const uint64_t handle = g_rand.get64();
+    sock.write(&handle, sizeof(handle));
+    sendBe<uint64_t>(sock, offset);
+    sendBe<uint32_t>(sock, len);
+    if (type == nbd::CMD_WRITE) sock.write(data.data(), len);
+    if (type == nbd::CMD_DISC) return 0;
+
+    CYBOZU_TEST_EQUAL(recvBe<uint32_t>(sock), nbd::SIMPLE_REPLY_MAGIC);
+    const uint32_t error = recvBe<uint32_t>(sock);
+    uint64_t handle2;
+    sock.read(&handle2, sizeof(handle2));
+    CYBOZU_TEST_EQUAL(handle, handle2);
+    if (type == nbd::CMD_READ && error == 0) {
+        data.resize(len);
+        sock.read(&data[0], len);
+    }
+    return error;
+}
+
+CYBOZU_TEST_AUTO(ReadOnlyServer)
+{
+    const std::string name("vol0");
+    std::string image(MEBI, '\0');
+    g_rand.fill(&image[0], image.size());
+    nbd::ReadOnlyServer server(name, image.size(), [&](uint64_t offset, size_t size, void *data) {
+            CYBOZU_TEST_EQUAL(offset % LOGICAL_BLOCK_SIZE, 0U);
+            CYBOZU_TEST_EQUAL(size % LOGICAL_BLOCK_SIZE, 0U);
+            ::memcpy(data, &image[offset], size);
+        });
+    std::atomic<bool> shouldStop(false);
+    const uint16_t port = 20000 + g_rand() % 20000;
+    cybozu::thread::ThreadRunner runner([&]() {
+            server.run("localhost", port, 2, [&]() { return shouldStop.load(); });
+        });
+    runner.start();
+    struct Stopper {
+        std::atomic<bool> &shouldStop;
+        ~Stopper() { shouldStop = true; }
+    } stopper{shouldStop};
+
+    cybozu::Socket sock;
+    for (size_t i = 0;; i++) {
+        try {
+            cybozu::Socket sock0;
+            sock0.connect("localhost", port);
+            sock = std::move(sock0);
+            sock.setSocketOption(TCP_NODELAY, 1, IPPROTO_TCP);
+            break;
+        } catch (...) {
+            if (i > 100) throw;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    CYBOZU_TEST_EQUAL(recvBe<uint64_t>(sock), nbd::NBDMAGIC);
+    CYBOZU_TEST_EQUAL(recvBe<uint64_t>(sock), nbd::IHAVEOPT);
+    CYBOZU_TEST_ASSERT((recvBe<uint16_t>(sock) & nbd::FLAG_FIXED_NEWSTYLE) != 0);
+    sendBe<uint32_t>(sock, nbd::FLAG_FIXED_NEWSTYLE | nbd::FLAG_NO_ZEROES);
+
+    std::string data;
+    sendOpt(sock, 100, "");
+    CYBOZU_TEST_EQUAL(recvOptReply(sock, 100, data), nbd::REP_ERR_UNSUP);
+    sendOpt(sock, nbd::OPT_GO, makeGoData("unknown"));
+    CYBOZU_TEST_EQUAL(recvOptReply(sock, nbd::OPT_GO, data), nbd::REP_ERR_UNKNOWN);
+    sendOpt(sock, nbd::OPT_GO, makeGoData(name));
+    CYBOZU_TEST_EQUAL(recvOptReply(sock, nbd::OPT_GO, data), nbd::REP_INFO);
+    CYBOZU_TEST_EQUAL(data.size(), 12U);
+    uint64_t sizeB;
+    ::memcpy(&sizeB, &data[2], sizeof(sizeB));
+    CYBOZU_TEST_EQUAL(be64toh(sizeB), image.size());
+    CYBOZU_TEST_EQUAL(recvOptReply(sock, nbd::OPT_GO, data), nbd::REP_ACK);
+
+    /* Unaligned reads are also served. */
+    for (size_t i = 0; i < 100; i++) {
+        const uint64_t offset = g_rand() % image.size();
+        const uint32_t len = g_rand() % std::min<uint64_t>(image.size() - offset, 64 * KIBI) + 1;
+        CYBOZU_TEST_EQUAL(sendCmd(sock, nbd::CMD_READ, offset, len, data), 0U);
+        CYBOZU_TEST_ASSERT(data == image.substr(offset, len));
+    }
+    CYBOZU_TEST_EQUAL(sendCmd(sock, nbd::CMD_READ, image.size() - 1, 2, data), nbd::ERR_INVAL);
+    data.assign(LOGICAL_BLOCK_SIZE, 'x');
+    CYBOZU_TEST_EQUAL(sendCmd(sock, nbd::CMD_WRITE, 0, data.size(), data), nbd::ERR_PERM);
+    CYBOZU_TEST_EQUAL(sendCmd(sock, nbd::CMD_FLUSH, 0, 0, data), 0U);
+    sendCmd(sock, nbd::CMD_DISC, 0, 0, data);
+    sock.close();
+
+    shouldStop = true;
+    runner.join();
+    CYBOZU_TEST_EQUAL(server.getNrConnections(), 0U);
+}
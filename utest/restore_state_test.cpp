@@ -0,0 +1,153 @@
+#include "cybozu/test.hpp"
+#include "cybozu/file.hpp"
+#include "restore_state.hpp"
+#include "walb_util.hpp"
+#include "constant.hpp"
+
+using namespace walb;
+
+const uint64_t alignLb = MEBI / LBS;
+
+void verifyShards(const std::vector<RestoreShardState> &shardV, size_t nr, const MetaState &st0)
+{
+    CYBOZU_TEST_EQUAL(shardV.size(), nr);
+    uint64_t lb = 0;
+    for (const RestoreShardState &shard : shardV) {
+        CYBOZU_TEST_EQUAL(shard.bgnLb, lb);
+        CYBOZU_TEST_EQUAL(shard.bgnLb % alignLb, 0U);
+        CYBOZU_TEST_ASSERT(shard.bgnLb < shard.endLb);
+        CYBOZU_TEST_EQUAL(shard.progressLb, shard.bgnLb);
+        CYBOZU_TEST_ASSERT(shard.metaSt == st0);
+        lb = shard.endLb;
+    }
+    CYBOZU_TEST_EQUAL(lb, UINT64_MAX);
+}
+
+CYBOZU_TEST_AUTO(makeRestoreShards)
+{
+    const MetaState st0(MetaSnap(3), 100);
+    std::vector<RestoreShardState> shardV;
+
+    shardV = makeRestoreShards(st0, 10, 100 * alignLb, 8, alignLb);
+    verifyShards(shardV, 8, st0);
+    for (size_t i = 0; i + 1 < shardV.size(); i++) {
+        const uint64_t sizeLb = shardV[i].endLb - shardV[i].bgnLb;
+        CYBOZU_TEST_ASSERT(12 * alignLb <= sizeLb && sizeLb <= 13 * alignLb);
+        CYBOZU_TEST_ASSERT(!shardV[i].isDone);
+    }
+
+    /* A snapshot smaller than the alignment is a single shard. */
+    shardV = makeRestoreShards(st0, 10, 100, 8, alignLb);
+    verifyShards(shardV, 1, st0);
+
+    /* Shards are not smaller than the alignment. */
+    shardV = makeRestoreShards(st0, 10, 2 * alignLb + 1, 8, alignLb);
+    verifyShards(shardV, 3, st0);
+
+    /* The origin is already the target. */
+    shardV = makeRestoreShards(st0, 3, 100 * alignLb, 8, alignLb);
+    verifyShards(shardV, 8, st0);
+    for (const RestoreShardState &shard : shardV) {
+        CYBOZU_TEST_ASSERT(shard.isDone);
+    }
+}
+
+CYBOZU_TEST_AUTO(canResume)
+{
+    const MetaState st0(MetaSnap(3), 100);
+    const uint64_t sizeLb = 100 * alignLb;
+    RestoreState restoreSt;
+    restoreSt.metaSt = st0;
+    restoreSt.sizeLb = sizeLb;
+    restoreSt.shardV = makeRestoreShards(st0, 10, sizeLb, 4, alignLb);
+    restoreSt.timestamp = 100;
+    CYBOZU_TEST_ASSERT(restoreSt.canResume(st0, sizeLb));
+
+    CYBOZU_TEST_ASSERT(!restoreSt.canResume(MetaState(MetaSnap(4), 100), sizeLb));
+    CYBOZU_TEST_ASSERT(!restoreSt.canResume(st0, sizeLb + alignLb));
+
+    RestoreState st = restoreSt;
+    st.shardV[1].progressLb = st.shardV[1].endLb + 1;
+    CYBOZU_TEST_ASSERT(!st.canResume(st0, sizeLb));
+
+    /* A shard in the middle of a batch needs the diffs of the batch. */
+    st = restoreSt;
+    st.shardV[1].progressLb = st.shardV[1].bgnLb + 10;
+    CYBOZU_TEST_ASSERT(!st.canResume(st0, sizeLb));
+    st.shardV[1].batchV.emplace_back(3, 5);
+    st.shardV[1].batchV.emplace_back(5, 10);
+    CYBOZU_TEST_ASSERT(st.canResume(st0, sizeLb));
+    st.shardV[1].batchV.erase(st.shardV[1].batchV.begin());
+    CYBOZU_TEST_ASSERT(!st.canResume(st0, sizeLb));
+
+    st = restoreSt;
+    st.shardV.pop_back();
+    CYBOZU_TEST_ASSERT(!st.canResume(st0, sizeLb));
+    st.shardV.clear();
+    CYBOZU_TEST_ASSERT(!st.canResume(st0, sizeLb));
+}
+
+CYBOZU_TEST_AUTO(saveAndLoadRestoreState)
+{
+    const MetaState st0(MetaSnap(3), 100);
+    const uint64_t sizeLb = 100 * alignLb;
+    RestoreState st1;
+    st1.metaSt = st0;
+    st1.sizeLb = sizeLb;
+    st1.shardV = makeRestoreShards(st0, 10, sizeLb, 4, alignLb);
+    st1.timestamp = 200;
+    /* Shards progress independently. */
+    st1.shardV[0].metaSt = MetaState(MetaSnap(7), 150);
+    st1.shardV[0].progressLb = st1.shardV[0].bgnLb + 123;
+    st1.shardV[0].batchV.emplace_back(7, 9, true, 160);
+    st1.shardV[0].batchV.emplace_back(9, 10, true, 170);
+    st1.shardV[2].metaSt = MetaState(MetaSnap(10), 180);
+    st1.shardV[2].isDone = true;
+
+    const cybozu::FilePath dir(".");
+    const uint64_t gid = 10;
+    const std::string fname = getRestoreStateFileName(gid);
+    CYBOZU_TEST_EQUAL(fname, "10.restore");
+    util::saveFile(dir, fname, st1);
+    RestoreState st2;
+    util::loadFile(dir, fname, st2);
+    cybozu::RemoveFile(fname);
+
+    CYBOZU_TEST_ASSERT(st2.metaSt == st1.metaSt);
+    CYBOZU_TEST_EQUAL(st2.sizeLb, st1.sizeLb);
+    CYBOZU_TEST_EQUAL(st2.timestamp, st1.timestamp);
+    CYBOZU_TEST_EQUAL(st2.shardV.size(), st1.shardV.size());
+    for (size_t i = 0; i < st1.shardV.size() && i < st2.shardV.size(); i++) {
+        const RestoreShardState &s1 = st1.shardV[i], &s2 = st2.shardV[i];
+        CYBOZU_TEST_EQUAL(s2.bgnLb, s1.bgnLb);
+        CYBOZU_TEST_EQUAL(s2.endLb, s1.endLb);
+        CYBOZU_TEST_ASSERT(s2.metaSt == s1.metaSt);
+        CYBOZU_TEST_EQUAL(s2.progressLb, s1.progressLb);
+        CYBOZU_TEST_EQUAL(s2.isDone, s1.isDone);
+        CYBOZU_TEST_EQUAL(s2.batchV.size(), s1.batchV.size());
+        for (size_t j = 0; j < s1.batchV.size() && j < s2.batchV.size(); j++) {
+            CYBOZU_TEST_ASSERT(s2.batchV[j] == s1.batchV[j]);
+        }
+    }
+    /* The loaded state resumes the restore from the same origin. */
+    CYBOZU_TEST_ASSERT(st2.canResume(st0, sizeLb));
+}
+
+CYBOZU_TEST_AUTO(getRestoreMaxOpenDiffs)
+{
+    CYBOZU_TEST_EQUAL(getRestoreMaxOpenDiffs(0, 8), 0U);
+    CYBOZU_TEST_EQUAL(getRestoreMaxOpenDiffs(4, 8), 1U);
+    CYBOZU_TEST_EQUAL(getRestoreMaxOpenDiffs(16, 4), 4U);
+
+    /* All the diffs are restored by a single batch with the default options. */
+    MetaDiffManager mgr;
+    for (uint64_t gid = 0; gid < 10; gid++) {
+        mgr.add(MetaDiff(gid, gid + 1, true, 1000 + gid));
+    }
+    const MetaState st0(MetaSnap(0), 100);
+    const size_t maxOpenDiffs = getRestoreMaxOpenDiffs(DEFAULT_MAX_OPEN_DIFFS, 8);
+    const MetaDiffVec diffV = mgr.getDiffListToRestore(st0, 10, maxOpenDiffs);
+    CYBOZU_TEST_EQUAL(diffV.size(), 10U);
+    CYBOZU_TEST_ASSERT(isRestoreDone(apply(st0, diffV), 10));
+    CYBOZU_TEST_EQUAL(mgr.getDiffListToRestore(st0, 10, getRestoreMaxOpenDiffs(8, 4)).size(), 2U);
+}
@@ -212,3 +212,73 @@ CYBOZU_TEST_AUTO(BoundedQueueResize)
 
     CYBOZU_TEST_EQUAL(total, n);
 }
+
+CYBOZU_TEST_AUTO(ParallelConverter)
+{
+    cybozu::thread::ParallelConverter<size_t, size_t> pconv([](size_t&& i) {
+            if (i % 7 == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            return i * 2;
+        });
+    pconv.start(4, 3, 5);
+    const size_t n = 1000;
+    std::exception_ptr ep;
+    std::thread th([&]() {
+            try {
+                for (size_t i = 0; i < n; i++) {
+                    pconv.push(size_t(i));
+                }
+                pconv.sync();
+            } catch (...) {
+                ep = std::current_exception();
+                pconv.fail();
+            }
+        });
+    size_t v, i = 0;
+    while (pconv.pop(v)) {
+        CYBOZU_TEST_EQUAL(v, i * 2);
+        i++;
+    }
+    th.join();
+    CYBOZU_TEST_ASSERT(!ep);
+    CYBOZU_TEST_EQUAL(i, n);
+}
+
+CYBOZU_TEST_AUTO(ParallelConverterError)
+{
+    cybozu::thread::ParallelConverter<size_t, size_t> pconv([](size_t&& i) {
+            if (i == 100) throw std::runtime_error("converter error");
+            return i;
+        });
+    pconv.start(2);
+    std::thread th([&]() {
+            try {
+                for (size_t i = 0; i < 1000; i++) {
+                    pconv.push(size_t(i));
+                }
+                pconv.sync();
+            } catch (...) {
+                pconv.fail();
+            }
+        });
+    size_t v;
+    std::string msg;
+    try {
+        while (pconv.pop(v)) {}
+    } catch (std::exception& e) {
+        msg = e.what();
+    }
+    th.join();
+    CYBOZU_TEST_EQUAL(msg, "converter error");
+}
+
+CYBOZU_TEST_AUTO(BoundedQueueFailDiscards)
+{
+    cybozu::thread::BoundedQueue<std::shared_ptr<int> > q(4);
+    std::shared_ptr<int> p = std::make_shared<int>(0);
+    for (size_t i = 0; i < 3; i++) q.push(p);
+    CYBOZU_TEST_EQUAL(p.use_count(), 4);
+    q.fail();
+    CYBOZU_TEST_EQUAL(p.use_count(), 1);
+}
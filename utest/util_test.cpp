@@ -1,3 +1,4 @@
+#include <functional>
 #include "cybozu/test.hpp"
 #include "random.hpp"
 #include "util.hpp"
@@ -191,6 +192,34 @@ CYBOZU_TEST_AUTO(isAllZero)
     }
 }
 
+CYBOZU_TEST_AUTO(isAllZeroKernels)
+{
+    namespace zl = cybozu::util::zero_local;
+    std::vector<std::function<bool(const char *, size_t)> > fV;
+    fV.push_back(zl::isAllZeroScalar);
+#ifdef CYBOZU_UTIL_USE_X86_SIMD
+    fV.push_back(zl::isAllZeroSse2);
+    if (zl::hasAvx2()) fV.push_back(zl::isAllZeroAvx2);
+#endif
+    const size_t s = 300;
+    std::vector<char> v(s + 32);
+    for (auto &f : fV) {
+        for (size_t off = 0; off < 32; off += 7) {
+            for (size_t size = 0; size <= s; size++) {
+                CYBOZU_TEST_ASSERT(f(&v[off], size));
+            }
+            /* Every non-zero position must be detected. */
+            for (size_t size = 1; size <= s; size += 13) {
+                for (size_t i = 0; i < size; i++) {
+                    v[off + i] = 0x80;
+                    CYBOZU_TEST_ASSERT(!f(&v[off], size));
+                    v[off + i] = 0;
+                }
+            }
+        }
+    }
+}
+
 CYBOZU_TEST_AUTO(moveToTail)
 {
     std::vector<std::string> expected = { "abc", "def", "ghi", "123", "456", "79", "0" };
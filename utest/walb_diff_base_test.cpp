@@ -1,5 +1,7 @@
 #include "cybozu/test.hpp"
 #include "walb_diff_base.hpp"
+#include "walb_diff_pack.hpp"
+#include "walb_diff_converter.hpp"
 #include "random.hpp"
 
 using namespace walb;
@@ -25,3 +27,109 @@ CYBOZU_TEST_AUTO(IndexedDiffRecord)
     CYBOZU_TEST_EQUAL(recV[2].io_blocks, 2U);
     CYBOZU_TEST_EQUAL(recV[3].io_blocks, 1U);
 }
+
+CYBOZU_TEST_AUTO(DiffPackerZeroRun)
+{
+    const uint32_t ioBlocks = 32;
+    AlignedArray buf(ioBlocks * LOGICAL_BLOCK_SIZE, true);
+    /* Blocks [4, 16) and [17, 20) are zero. */
+    for (uint32_t i = 0; i < ioBlocks; i++) {
+        if ((4 <= i && i < 16) || (17 <= i && i < 20)) continue;
+        buf[i * LOGICAL_BLOCK_SIZE + LOGICAL_BLOCK_SIZE - 1] = i + 1;
+    }
+    struct Expected {
+        uint64_t addr;
+        uint32_t blks;
+        bool isZero;
+    };
+    auto verify = [&](DiffPacker &packer, const std::vector<Expected> &expV) {
+        const AlignedArray ary = packer.getPackAsArray();
+        MemoryDiffPack pack(ary.data(), ary.size());
+        pack.verify(false);
+        const DiffPackHeader &header = pack.header();
+        CYBOZU_TEST_EQUAL(header.n_records, expV.size());
+        for (size_t i = 0; i < expV.size() && i < header.n_records; i++) {
+            const DiffRecord &rec = header[i];
+            const uint64_t addr = rec.io_address;
+            const uint32_t blks = rec.io_blocks;
+            CYBOZU_TEST_EQUAL(addr, expV[i].addr);
+            CYBOZU_TEST_EQUAL(blks, expV[i].blks);
+            CYBOZU_TEST_EQUAL(rec.isAllZero(), expV[i].isZero);
+            if (rec.isNormal()) {
+                const size_t off = (addr - 100) * LOGICAL_BLOCK_SIZE;
+                CYBOZU_TEST_EQUAL(rec.data_size, blks * LOGICAL_BLOCK_SIZE);
+                CYBOZU_TEST_ASSERT(::memcmp(pack.data(i), &buf[off], rec.data_size) == 0);
+            }
+        }
+    };
+
+    DiffPacker packer;
+    CYBOZU_TEST_ASSERT(packer.add(100, ioBlocks, buf.data()));
+    verify(packer, {{100, 4, false}, {104, 12, true}, {116, 16, false}});
+
+    packer.setMinZeroRunBlocks(0);
+    CYBOZU_TEST_ASSERT(packer.add(100, ioBlocks, buf.data()));
+    verify(packer, {{100, 32, false}});
+
+    packer.setMinZeroRunBlocks(3);
+    CYBOZU_TEST_ASSERT(packer.add(100, ioBlocks, buf.data()));
+    verify(packer, {{100, 4, false}, {104, 12, true}, {116, 1, false}, {117, 3, true}, {120, 12, false}});
+
+    const AlignedArray zero(ioBlocks * LOGICAL_BLOCK_SIZE, true);
+    CYBOZU_TEST_ASSERT(packer.add(100, ioBlocks, zero.data()));
+    verify(packer, {{100, 32, true}});
+}
+
+CYBOZU_TEST_AUTO(convertLogToDiffSplittingZeroRuns)
+{
+    const uint32_t ioBlocks = 32;
+    AlignedArray buf(ioBlocks * LOGICAL_BLOCK_SIZE, true);
+    /* Blocks [8, 24) are zero. */
+    for (uint32_t i = 0; i < ioBlocks; i++) {
+        if (8 <= i && i < 24) continue;
+        buf[i * LOGICAL_BLOCK_SIZE] = i + 1;
+    }
+    WlogRecord lrec;
+    lrec.clear();
+    lrec.setExist();
+    lrec.offset = 100;
+    lrec.io_size = ioBlocks;
+
+    std::vector<IndexedDiffRecord> recV;
+    std::vector<AlignedArray> bufV;
+    convertLogToDiffSplittingZeroRuns<IndexedDiffRecord>(
+        lrec, AlignedArray(buf), [&](const IndexedDiffRecord &rec, AlignedArray &&data) {
+            recV.push_back(rec);
+            bufV.push_back(std::move(data));
+        });
+    CYBOZU_TEST_EQUAL(recV.size(), 3U);
+    const uint64_t addrV[] = {100, 108, 124};
+    const uint32_t blksV[] = {8, 16, 8};
+    for (size_t i = 0; i < recV.size() && i < 3; i++) {
+        const uint64_t addr = recV[i].io_address;
+        const uint32_t blks = recV[i].io_blocks;
+        CYBOZU_TEST_EQUAL(addr, addrV[i]);
+        CYBOZU_TEST_EQUAL(blks, blksV[i]);
+        CYBOZU_TEST_EQUAL(recV[i].isAllZero(), i == 1);
+        if (!recV[i].isNormal()) {
+            CYBOZU_TEST_ASSERT(bufV[i].empty());
+            continue;
+        }
+        CYBOZU_TEST_EQUAL(recV[i].orig_blocks, blks);
+        CYBOZU_TEST_EQUAL(bufV[i].size(), blks * LOGICAL_BLOCK_SIZE);
+        const size_t off = (addr - 100) * LOGICAL_BLOCK_SIZE;
+        CYBOZU_TEST_ASSERT(::memcmp(bufV[i].data(), &buf[off], bufV[i].size()) == 0);
+    }
+
+    /* An IO without long zero runs is passed as it is. */
+    buf[12 * LOGICAL_BLOCK_SIZE] = 1;
+    buf[18 * LOGICAL_BLOCK_SIZE] = 1;
+    std::vector<DiffRecord> recV2;
+    convertLogToDiffSplittingZeroRuns<DiffRecord>(
+        lrec, AlignedArray(buf), [&](const DiffRecord &rec, AlignedArray &&data) {
+            recV2.push_back(rec);
+            CYBOZU_TEST_EQUAL(data.size(), buf.size());
+        });
+    CYBOZU_TEST_EQUAL(recV2.size(), 1U);
+    CYBOZU_TEST_ASSERT(recV2[0].isNormal());
+}
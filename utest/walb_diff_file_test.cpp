@@ -4,6 +4,7 @@
 #include "random.hpp"
 #include "for_walb_diff_test.hpp"
 #include <sstream>
+#include <thread>
 
 using namespace walb;
 
@@ -83,6 +84,77 @@ CYBOZU_TEST_AUTO(IndexedDiffMem)
     CYBOZU_TEST_ASSERT(recV[0].isAllZero());
 }
 
+struct IndexedDiffRecordVecWriter
+{
+    std::vector<IndexedDiffRecord> recV;
+    void write(const void *data, size_t size) {
+        const IndexedDiffRecord *recs = (const IndexedDiffRecord *)data;
+        recV.insert(recV.end(), recs, recs + size / sizeof(IndexedDiffRecord));
+    }
+};
+
+/**
+ * maxMemSize: 0 means no spill.
+ */
+void testIndexedDiffMemRandom(size_t maxMemSize)
+{
+    /* Compare the result with the newest record of each block. */
+    const uint64_t nrBlocks = 512;
+    const size_t nrRecs = 2000;
+    DiffIndexMem im;
+    im.setMaxIoBlocks(16);
+    if (maxMemSize > 0) im.setSpill(".", maxMemSize);
+    std::vector<int64_t> ownerV(nrBlocks, -1); // owner data_offset of each block.
+    std::vector<uint32_t> offV(nrBlocks); // io_offset of each block.
+    for (size_t i = 0; i < nrRecs; i++) {
+        const uint64_t addr = g_rand() % nrBlocks;
+        const uint32_t blks = std::min<uint64_t>(g_rand() % 64 + 1, nrBlocks - addr);
+        IndexedDiffRecord rec = makeIrec(addr, blks, DiffRecType::NORMAL);
+        rec.data_offset = i;
+        rec.io_offset = g_rand() % 8;
+        im.add(rec);
+        for (uint64_t j = 0; j < blks; j++) {
+            ownerV[addr + j] = i;
+            offV[addr + j] = rec.io_offset + j;
+        }
+        if (i % 500 == 0) im.checkNoOverlappedAndSorted(); // resolve in the middle.
+    }
+    im.checkNoOverlappedAndSorted();
+    if (maxMemSize > 0) CYBOZU_TEST_ASSERT(im.getNRuns() > 0);
+    IndexedDiffRecordVecWriter writer;
+    const size_t nr = im.writeTo(writer);
+    CYBOZU_TEST_EQUAL(nr, writer.recV.size());
+    const IndexedDiffRecord *prev = nullptr;
+    std::vector<int64_t> ownerV1(nrBlocks, -1);
+    std::vector<uint32_t> offV1(nrBlocks);
+    for (const IndexedDiffRecord& rec : writer.recV) {
+        if (prev) CYBOZU_TEST_ASSERT(prev->endIoAddress() <= rec.io_address);
+        prev = &rec;
+        CYBOZU_TEST_ASSERT(rec.io_blocks <= 16);
+        CYBOZU_TEST_ASSERT(isAlignedIo(rec.io_address, rec.io_blocks));
+        CYBOZU_TEST_ASSERT(rec.isValid());
+        for (uint64_t j = 0; j < rec.io_blocks; j++) {
+            ownerV1[rec.io_address + j] = rec.data_offset;
+            offV1[rec.io_address + j] = rec.io_offset + j;
+        }
+    }
+    for (uint64_t addr = 0; addr < nrBlocks; addr++) {
+        CYBOZU_TEST_EQUAL(ownerV1[addr], ownerV[addr]);
+        if (ownerV[addr] >= 0) CYBOZU_TEST_EQUAL(offV1[addr], offV[addr]);
+    }
+}
+
+CYBOZU_TEST_AUTO(IndexedDiffMemRandom)
+{
+    testIndexedDiffMemRandom(0);
+}
+
+CYBOZU_TEST_AUTO(IndexedDiffMemSpill)
+{
+    testIndexedDiffMemRandom(sizeof(IndexedDiffRecord) * 100);
+    testIndexedDiffMemRandom(sizeof(IndexedDiffRecord) * 400);
+}
+
 void verifyRecIoEquality(const DiffRecord& rec0, const AlignedArray& data0, const DiffRecord& rec1, const AlignedArray& data1)
 {
     CYBOZU_TEST_EQUAL(rec0.io_address, rec1.io_address);
@@ -143,9 +215,12 @@ void testRandomDiffFile(int cmprType, size_t nrIos)
     }
 }
 
-void testRandomIndexedDiffFile(int cmprType, size_t nrIos)
+/**
+ * concurrency: 0 means synchronous mode.
+ */
+void testRandomIndexedDiffFile(int cmprType, size_t nrIos, size_t concurrency = 0, bool isCompactIndex = false)
 {
-    ::printf("cmprType %s\n", compressionTypeToStr(cmprType).c_str());
+    ::printf("cmprType %s concurrency %zu\n", compressionTypeToStr(cmprType).c_str(), concurrency);
     cybozu::TmpFile tmpFile0(".");
 
     DiffFileHeader header0;
@@ -165,15 +240,19 @@ void testRandomIndexedDiffFile(int cmprType, size_t nrIos)
     {
         IndexedDiffWriter iWriter;
         iWriter.setFd(tmpFile0.fd());
+        iWriter.setCompactIndex(isCompactIndex);
         iWriter.writeHeader(header0);
+        if (concurrency > 0) iWriter.start(concurrency);
         for (size_t i = 0; i < nrIos; i++) {
             IndexedDiffRecord& iRec = recV0[i];
             AlignedArray& iData = dataV0[i];
             if (cmprType == ::WALB_DIFF_CMPR_NONE) {
                 iRec.io_checksum = iRec.isNormal() ? calcDiffIoChecksum(iData) : 0;
                 iWriter.writeDiff(iRec, iData.data());
-            } else {
+            } else if (i % 2 == 0) {
                 iWriter.compressAndWriteDiff(iRec, iData.data(), cmprType);
+            } else {
+                iWriter.compressAndWriteDiff(iRec, std::move(iData), cmprType);
             }
         }
         iWriter.finalize();
@@ -237,3 +316,329 @@ CYBOZU_TEST_AUTO(RandomIndexedDiffFile)
     testRandomIndexedDiffFile(::WALB_DIFF_CMPR_LZ4, nr);
     testRandomIndexedDiffFile(::WALB_DIFF_CMPR_ZSTD, nr);
 }
+
+CYBOZU_TEST_AUTO(RandomIndexedDiffFileAsync)
+{
+    size_t nr = 100;
+    testRandomIndexedDiffFile(::WALB_DIFF_CMPR_NONE, nr, 4);
+    testRandomIndexedDiffFile(::WALB_DIFF_CMPR_SNAPPY, nr, 1);
+    testRandomIndexedDiffFile(::WALB_DIFF_CMPR_ZSTD, nr, 4);
+    testRandomIndexedDiffFile(::WALB_DIFF_CMPR_LZ4, nr, 4);
+}
+
+CYBOZU_TEST_AUTO(RandomCompactIndexedDiffFile)
+{
+    testRandomIndexedDiffFile(::WALB_DIFF_CMPR_NONE, 1, 0, true);
+    testRandomIndexedDiffFile(::WALB_DIFF_CMPR_NONE, 100, 0, true);
+    testRandomIndexedDiffFile(::WALB_DIFF_CMPR_SNAPPY, 100, 0, true);
+    testRandomIndexedDiffFile(::WALB_DIFF_CMPR_ZSTD, 1000, 4, true);
+}
+
+CYBOZU_TEST_AUTO(IndexedDiffWriterAsyncWithoutFinalize)
+{
+    const size_t nrRecs = 1000;
+    cybozu::TmpFile tmpFile(".");
+    {
+        IndexedDiffWriter writer;
+        writer.setFd(tmpFile.fd());
+        DiffFileHeader header;
+        writer.writeHeader(header);
+        writer.start(4);
+        for (size_t i = 0; i < nrRecs; i++) {
+            IndexedDiffRecord rec = makeIrec(i * 16, 8, DiffRecType::NORMAL);
+            AlignedArray data(8 * LOGICAL_BLOCK_SIZE);
+            ::memset(data.data(), int(i), data.size());
+            writer.compressAndWriteDiff(rec, std::move(data));
+        }
+        /* The destructor must wait for the IOs in flight. */
+    }
+    cybozu::util::File file(tmpFile.fd());
+    file.lseek(0);
+    IndexedDiffReader reader;
+    IndexedDiffCache cache;
+    cache.setMaxSize(32 * MEBI);
+    reader.setFile(std::move(file), cache);
+    CYBOZU_TEST_EQUAL(reader.getNrRecords(), nrRecs);
+}
+
+void writeIndexedDiffForIndexTest(int fd, const std::vector<IndexedDiffRecord>& recV, bool isCompactIndex)
+{
+    IndexedDiffWriter writer;
+    writer.setFd(fd);
+    writer.setMaxIoBlocks(16);
+    writer.setCompactIndex(isCompactIndex);
+    DiffFileHeader header;
+    writer.writeHeader(header);
+    AlignedArray data;
+    for (IndexedDiffRecord rec : recV) {
+        if (rec.isNormal()) {
+            data.resize(rec.io_blocks * LOGICAL_BLOCK_SIZE);
+            ::memset(data.data(), 0, data.size());
+            for (size_t i = 0; i < data.size(); i += LOGICAL_BLOCK_SIZE) data[i] = rec.io_address;
+            rec.io_checksum = calcDiffIoChecksum(data);
+        }
+        writer.writeDiff(rec, data.data());
+    }
+    writer.finalize();
+}
+
+CYBOZU_TEST_AUTO(CompactIndexedDiffFile)
+{
+    const uint64_t nrBlocks = 1 << 16;
+    const size_t nrRecs = 3000;
+    std::vector<IndexedDiffRecord> recV;
+    for (size_t i = 0; i < nrRecs; i++) {
+        const uint64_t addr = g_rand() % nrBlocks;
+        const uint32_t blks = std::min<uint64_t>(g_rand() % 32 + 1, nrBlocks - addr);
+        const size_t r = g_rand() % 10;
+        const DiffRecType type = r == 0 ? DiffRecType::ALLZERO : r == 1 ? DiffRecType::DISCARD : DiffRecType::NORMAL;
+        IndexedDiffRecord rec = makeIrec(addr, blks, type);
+        rec.data_size = rec.isNormal() ? blks * LOGICAL_BLOCK_SIZE : 0;
+        rec.orig_blocks = rec.isNormal() ? blks : 0;
+        recV.push_back(rec);
+    }
+    cybozu::TmpFile tmpFile0("."), tmpFile1(".");
+    writeIndexedDiffForIndexTest(tmpFile0.fd(), recV, false);
+    writeIndexedDiffForIndexTest(tmpFile1.fd(), recV, true);
+
+    cybozu::util::File file0(tmpFile0.fd()), file1(tmpFile1.fd());
+    const uint64_t size0 = file0.lseek(0, SEEK_END);
+    const uint64_t size1 = file1.lseek(0, SEEK_END);
+    file0.lseek(0);
+    file1.lseek(0);
+    IndexedDiffReader reader0, reader1;
+    IndexedDiffCache cache;
+    cache.setMaxSize(32 * MEBI);
+    reader0.setFile(std::move(file0), cache);
+    reader1.setFile(std::move(file1), cache);
+    CYBOZU_TEST_ASSERT(!reader0.header().hasCompactIndex());
+    CYBOZU_TEST_ASSERT(reader1.header().hasCompactIndex());
+    CYBOZU_TEST_EQUAL(reader0.getNrRecords(), reader1.getNrRecords());
+    const uint64_t idxSize0 = reader0.getNrRecords() * sizeof(IndexedDiffRecord);
+    ::printf("index size %" PRIu64 " compact index size %" PRIu64 "\n", idxSize0, size1 - (size0 - idxSize0));
+    CYBOZU_TEST_ASSERT(size1 < size0);
+
+    auto verifyEqual = [](IndexedDiffRecord rec0, IndexedDiffRecord rec1) {
+        CYBOZU_TEST_EQUAL(rec1.rec_checksum, 0U);
+        rec0.rec_checksum = 0;
+        CYBOZU_TEST_ASSERT(::memcmp(&rec0, &rec1, sizeof(rec0)) == 0);
+    };
+    IndexedDiffRecord rec0, rec1;
+    AlignedArray data0, data1;
+    size_t nr = 0;
+    while (reader0.readDiff(rec0, data0)) {
+        CYBOZU_TEST_ASSERT(reader1.readDiff(rec1, data1));
+        verifyEqual(rec0, rec1);
+        CYBOZU_TEST_EQUAL(data0.size(), data1.size());
+        CYBOZU_TEST_ASSERT(::memcmp(data0.data(), data1.data(), data0.size()) == 0);
+        nr++;
+    }
+    CYBOZU_TEST_ASSERT(!reader1.readDiffRecord(rec1));
+    CYBOZU_TEST_EQUAL(nr, reader1.getNrRecords());
+
+    for (size_t i = 0; i < 100; i++) {
+        const uint64_t addr = g_rand() % (nrBlocks + 16);
+        reader0.seek(addr);
+        reader1.seek(addr);
+        for (size_t j = 0; j < 3; j++) {
+            const bool ret = reader0.readDiffRecord(rec0);
+            CYBOZU_TEST_EQUAL(reader1.readDiffRecord(rec1), ret);
+            if (!ret) break;
+            verifyEqual(rec0, rec1);
+        }
+    }
+}
+
+void readAllIndexedDiff(int fd, IndexedDiffCache &cache, std::vector<IndexedDiffRecord> &recV, std::vector<AlignedArray> &dataV,
+                        size_t readAheadNr = 0, size_t readAheadThreads = 0)
+{
+    cybozu::util::File file(::dup(fd));
+    file.lseek(0);
+    IndexedDiffReader reader;
+    reader.setFile(std::move(file), cache);
+    if (readAheadNr > 0) reader.setReadAhead(readAheadNr, readAheadThreads);
+    IndexedDiffRecord rec;
+    AlignedArray data;
+    recV.clear();
+    dataV.clear();
+    while (reader.readDiff(rec, data)) {
+        recV.push_back(rec);
+        dataV.push_back(rec.isNormal() ? data : AlignedArray());
+    }
+}
+
+CYBOZU_TEST_AUTO(SharedIndexedDiffCache)
+{
+    std::vector<IndexedDiffRecord> recV;
+    for (size_t i = 0; i < 1000; i++) {
+        const uint64_t addr = g_rand() % 4096;
+        const uint32_t blks = g_rand() % 16 + 1;
+        IndexedDiffRecord rec = makeIrec(addr, blks, DiffRecType::NORMAL);
+        rec.data_size = blks * LOGICAL_BLOCK_SIZE;
+        rec.orig_blocks = blks;
+        recV.push_back(rec);
+    }
+    cybozu::TmpFile tmpFile(".");
+    writeIndexedDiffForIndexTest(tmpFile.fd(), recV, false);
+
+    /* The second reader of the same file hits the data cached by the first one. */
+    IndexedDiffCache cache(64 * MEBI);
+    std::vector<IndexedDiffRecord> recV0, recV1;
+    std::vector<AlignedArray> dataV0, dataV1;
+    readAllIndexedDiff(tmpFile.fd(), cache, recV0, dataV0);
+    const IndexedDiffCache::Stat stat0 = cache.getStat();
+    CYBOZU_TEST_ASSERT(stat0.misses > 0);
+    CYBOZU_TEST_ASSERT(stat0.size > 0);
+    readAllIndexedDiff(tmpFile.fd(), cache, recV1, dataV1);
+    const IndexedDiffCache::Stat stat1 = cache.getStat();
+    CYBOZU_TEST_EQUAL(stat1.misses, stat0.misses);
+    CYBOZU_TEST_EQUAL(stat1.hits, stat0.hits + recV1.size());
+    CYBOZU_TEST_EQUAL(recV0.size(), recV1.size());
+
+    /* Readers in several threads share a small cache. */
+    cache.setMaxSize(64 * KIBI);
+    CYBOZU_TEST_ASSERT(cache.getStat().size <= 64 * KIBI + 16 * 16 * LOGICAL_BLOCK_SIZE);
+    std::vector<std::thread> thV;
+    std::vector<std::vector<IndexedDiffRecord> > recVV(4);
+    std::vector<std::vector<AlignedArray> > dataVV(4);
+    for (size_t i = 0; i < 4; i++) {
+        thV.emplace_back([&, i]() {
+                readAllIndexedDiff(tmpFile.fd(), cache, recVV[i], dataVV[i]);
+            });
+    }
+    for (std::thread &th : thV) th.join();
+    for (size_t i = 0; i < 4; i++) {
+        CYBOZU_TEST_EQUAL(recVV[i].size(), recV0.size());
+        for (size_t j = 0; j < recV0.size() && j < recVV[i].size(); j++) {
+            CYBOZU_TEST_EQUAL(dataVV[i][j].size(), dataV0[j].size());
+            CYBOZU_TEST_ASSERT(::memcmp(dataVV[i][j].data(), dataV0[j].data(), dataV0[j].size()) == 0);
+        }
+    }
+    CYBOZU_TEST_ASSERT(cache.getStat().evictions > 0);
+}
+
+CYBOZU_TEST_AUTO(IndexedDiffReadAhead)
+{
+    std::vector<IndexedDiffRecord> recV;
+    for (size_t i = 0; i < 1000; i++) {
+        const uint64_t addr = g_rand() % 8192;
+        const uint32_t blks = g_rand() % 16 + 1;
+        const size_t r = g_rand() % 10;
+        const DiffRecType type = r == 0 ? DiffRecType::ALLZERO : r == 1 ? DiffRecType::DISCARD : DiffRecType::NORMAL;
+        IndexedDiffRecord rec = makeIrec(addr, blks, type);
+        rec.data_size = rec.isNormal() ? blks * LOGICAL_BLOCK_SIZE : 0;
+        rec.orig_blocks = rec.isNormal() ? blks : 0;
+        recV.push_back(rec);
+    }
+    cybozu::TmpFile tmpFile(".");
+    writeIndexedDiffForIndexTest(tmpFile.fd(), recV, false);
+
+    std::vector<IndexedDiffRecord> recV0;
+    std::vector<AlignedArray> dataV0;
+    {
+        IndexedDiffCache cache(64 * MEBI);
+        readAllIndexedDiff(tmpFile.fd(), cache, recV0, dataV0);
+    }
+    auto verify = [&](const std::vector<IndexedDiffRecord> &recV1, const std::vector<AlignedArray> &dataV1) {
+        CYBOZU_TEST_EQUAL(recV1.size(), recV0.size());
+        for (size_t i = 0; i < recV0.size() && i < recV1.size(); i++) {
+            CYBOZU_TEST_ASSERT(::memcmp(&recV0[i], &recV1[i], sizeof(IndexedDiffRecord)) == 0);
+            CYBOZU_TEST_EQUAL(dataV1[i].size(), dataV0[i].size());
+            CYBOZU_TEST_ASSERT(::memcmp(dataV1[i].data(), dataV0[i].data(), dataV0[i].size()) == 0);
+        }
+    };
+    for (size_t nrThreads : {0, 1, 4}) {
+        /* A small cache evicts some IOs uncompressed in a batch before they are read. */
+        for (size_t cacheSize : {64 * MEBI, 64 * KIBI}) {
+            IndexedDiffCache cache(cacheSize);
+            std::vector<IndexedDiffRecord> recV1;
+            std::vector<AlignedArray> dataV1;
+            readAllIndexedDiff(tmpFile.fd(), cache, recV1, dataV1, 16, nrThreads);
+            verify(recV1, dataV1);
+        }
+    }
+
+    /* Read ahead restarts after seek. */
+    cybozu::util::File file(::dup(tmpFile.fd()));
+    file.lseek(0);
+    IndexedDiffCache cache(64 * MEBI);
+    IndexedDiffReader reader;
+    reader.setFile(std::move(file), cache);
+    reader.setReadAhead(16, 4);
+    IndexedDiffRecord rec;
+    AlignedArray data;
+    for (size_t i = 0; i < 20; i++) {
+        const size_t idx = g_rand() % recV0.size();
+        reader.seek(recV0[idx].io_address);
+        for (size_t j = idx; j < recV0.size() && j < idx + 40; j++) {
+            CYBOZU_TEST_ASSERT(reader.readDiff(rec, data));
+            CYBOZU_TEST_ASSERT(::memcmp(&rec, &recV0[j], sizeof(rec)) == 0);
+            if (rec.isNormal()) {
+                CYBOZU_TEST_EQUAL(data.size(), dataV0[j].size());
+                CYBOZU_TEST_ASSERT(::memcmp(data.data(), dataV0[j].data(), data.size()) == 0);
+            }
+        }
+    }
+}
+
+CYBOZU_TEST_AUTO(SortedDiffFilePackIndex)
+{
+    cybozu::TmpFile tmpFile(".");
+    const size_t nrIos = MAX_N_RECORDS_IN_WALB_DIFF_PACK * 5 + 3;
+    const uint32_t ioBlocks = 2;
+    const uint64_t gap = 3;
+    {
+        SortedDiffWriter writer(tmpFile.fd());
+        DiffFileHeader header;
+        writer.writeHeader(header);
+        AlignedArray data(ioBlocks * LOGICAL_BLOCK_SIZE);
+        for (size_t i = 0; i < nrIos; i++) {
+            DiffRecord rec;
+            rec.init();
+            rec.io_address = i * gap;
+            rec.io_blocks = ioBlocks;
+            rec.setNormal();
+            rec.data_size = data.size();
+            ::memcpy(data.data(), &i, sizeof(i));
+            rec.checksum = calcDiffIoChecksum(data);
+            writer.writeDiff(rec, data.data());
+        }
+        writer.close();
+    }
+    for (uint64_t addr : {uint64_t(0), uint64_t(1), uint64_t(2), gap * MAX_N_RECORDS_IN_WALB_DIFF_PACK,
+                gap * MAX_N_RECORDS_IN_WALB_DIFF_PACK * 3 - 1, gap * (nrIos - 1), gap * nrIos}) {
+        for (bool useIndex : {false, true}) {
+            cybozu::util::File file(tmpFile.fd());
+            file.lseek(0);
+            DiffFileHeader header;
+            header.readFrom(file);
+            CYBOZU_TEST_ASSERT(header.hasPackIndex());
+            /* Readers of version 2 can read the file. */
+            CYBOZU_TEST_EQUAL(header.version, WALB_DIFF_VERSION);
+            SortedDiffReader reader(std::move(file));
+            reader.dontReadHeader();
+            if (useIndex) reader.readPackIndex();
+            reader.seek(addr);
+            DiffRecord rec;
+            AlignedArray data;
+            if (addr >= gap * (nrIos - 1) + ioBlocks) {
+                CYBOZU_TEST_ASSERT(!reader.readDiff(rec, data));
+                continue;
+            }
+            CYBOZU_TEST_ASSERT(reader.readDiff(rec, data));
+            const size_t i = (addr + gap - ioBlocks) / gap;
+            CYBOZU_TEST_EQUAL(rec.io_address, i * gap);
+            size_t j;
+            ::memcpy(&j, data.data(), sizeof(j));
+            CYBOZU_TEST_EQUAL(i, j);
+        }
+    }
+    /* The index can be read from a file that has been read to the end. */
+    cybozu::util::File file(tmpFile.fd());
+    DiffPackIndex packIdx;
+    packIdx.readFrom(file);
+    CYBOZU_TEST_EQUAL(packIdx.size(), 6u);
+    CYBOZU_TEST_EQUAL(packIdx.find(0), 0u);
+    CYBOZU_TEST_EQUAL(packIdx.find(gap * MAX_N_RECORDS_IN_WALB_DIFF_PACK), 1u);
+    CYBOZU_TEST_EQUAL(packIdx.find(UINT64_MAX), 5u);
+}
@@ -0,0 +1,81 @@
+#include "cybozu/test.hpp"
+#include "walb_diff_io.hpp"
+#include "tmp_file.hpp"
+#include "random.hpp"
+
+using namespace walb;
+
+cybozu::util::Random<uint64_t> g_rand;
+
+std::string readAll(const std::string& path, size_t size)
+{
+    cybozu::util::File file(path, O_RDONLY);
+    std::string s(size, '\0');
+    file.read(&s[0], size);
+    return s;
+}
+
+void testAsyncDiffApplier(DiscardType discardType)
+{
+    const uint64_t devLb = 8192; /* 4MiB */
+    AlignedArray init(devLb * LOGICAL_BLOCK_SIZE);
+    g_rand.fill(init.data(), init.size());
+    cybozu::TmpFile tmpFile0("."), tmpFile1(".");
+    for (int fd : {tmpFile0.fd(), tmpFile1.fd()}) {
+        cybozu::util::File file(fd);
+        file.write(init.data(), init.size());
+        file.fdatasync();
+    }
+
+    /* Sorted and not overlapped IOs as DiffMerger outputs. Many of them are adjacent. */
+    std::vector<DiffRecord> recV;
+    std::vector<AlignedArray> dataV;
+    uint64_t addr = 0;
+    for (;;) {
+        addr += g_rand() % 3 == 0 ? g_rand() % 16 : 0;
+        const uint32_t blks = g_rand() % 64 + 1;
+        if (addr + blks > devLb) break;
+        DiffRecord rec;
+        rec.io_address = addr;
+        rec.io_blocks = blks;
+        const size_t r = g_rand() % 10;
+        AlignedArray data;
+        if (r == 0) {
+            rec.setAllZero();
+            rec.data_size = 0;
+        } else if (r == 1) {
+            rec.setDiscard();
+            rec.data_size = 0;
+        } else {
+            rec.setNormal();
+            rec.data_size = blks * LOGICAL_BLOCK_SIZE;
+            data.resize(rec.data_size);
+            g_rand.fill(data.data(), data.size());
+        }
+        recV.push_back(rec);
+        dataV.push_back(std::move(data));
+        addr += blks;
+    }
+
+    AsyncDiffApplier applier(tmpFile0.path(), discardType, 256 * KIBI, 64 * KIBI);
+    cybozu::util::File file1(tmpFile1.path(), O_RDWR);
+    AlignedArray zero;
+    for (size_t i = 0; i < recV.size(); i++) {
+        applier.add(recV[i], dataV[i].data());
+        issueIo(file1, discardType, recV[i], dataV[i].data(), zero);
+    }
+    applier.finalize();
+    file1.fdatasync();
+
+    CYBOZU_TEST_ASSERT(readAll(tmpFile0.path(), init.size()) == readAll(tmpFile1.path(), init.size()));
+    /* Adjacent IOs must have been coalesced. */
+    const WriteIoStatistics& stat = applier.getStat();
+    CYBOZU_TEST_ASSERT(stat.writtenNr < recV.size() / 2);
+    CYBOZU_TEST_EQUAL(stat.clippedNr, 0U);
+}
+
+CYBOZU_TEST_AUTO(AsyncDiffApplier)
+{
+    testAsyncDiffApplier(DiscardType::Zero);
+    testAsyncDiffApplier(DiscardType::Ignore);
+}
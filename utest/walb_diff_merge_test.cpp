@@ -5,6 +5,9 @@
 #include "random.hpp"
 #include "for_walb_diff_test.hpp"
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 using namespace walb;
 struct TmpDiffFile;
@@ -26,7 +29,7 @@ CYBOZU_TEST_AUTO(Setup)
     setRandForTest(g_rand);
 }
 
-void verifyMergedDiff(size_t len, TmpDiffFileVec &d)
+void verifyMergedDiff(size_t len, TmpDiffFileVec &d, size_t prefetchQueueSize = 0, size_t maxMemSize = 0)
 {
     TmpDisk disk0(len), disk1(len);
 
@@ -35,11 +38,19 @@ void verifyMergedDiff(size_t len, TmpDiffFileVec &d)
     }
 
     TmpDiffFile merged;
-    DiffMerger merger(0);
-    for (size_t i = 0; i < d.size(); i++) {
-        merger.addWdiff(d[i].path());
+    MemoryBudget budget;
+    {
+        DiffMerger merger;
+        merger.setPrefetchQueueSize(prefetchQueueSize);
+        merger.setMaxMemSize(maxMemSize);
+        merger.setMemoryBudget(budget);
+        for (size_t i = 0; i < d.size(); i++) {
+            merger.addWdiff(d[i].path());
+        }
+        merger.mergeToFd(merged.fd());
+        CYBOZU_TEST_EQUAL(merger.getMemSize(), 0u);
     }
-    merger.mergeToFd(merged.fd());
+    CYBOZU_TEST_EQUAL(budget.getSize(), 0u);
     disk1.apply(merged.path());
 
     disk0.verifyEquals(disk1);
@@ -345,6 +356,11 @@ void testMerge2(size_t len, const Recipe &recipe)
     verifyMergedDiff(len, d0);
     verifyMergedDiff(len, d1);
     verifyDiffEquality(len, d0, d1);
+    verifyMergedDiff(len, d0, 4);
+    verifyMergedDiff(len, d1, 4);
+    /* The limit is smaller than an IO so the readers can read ahead only into empty queues. */
+    verifyMergedDiff(len, d0, 4, LOGICAL_BLOCK_SIZE);
+    verifyMergedDiff(len, d1, 4, LOGICAL_BLOCK_SIZE);
 }
 
 CYBOZU_TEST_AUTO(wdiffMergeRandom)
@@ -365,3 +381,202 @@ CYBOZU_TEST_AUTO(wdiffMergeRandom)
         testMerge2(len, recipe);
     }
 }
+
+void verifyParallelMergedDiff(size_t len, TmpDiffFileVec &d, size_t nrThreads, size_t maxOpenFiles = 0)
+{
+    TmpDisk disk0(len), disk1(len);
+    for (size_t i = 0; i < d.size(); i++) {
+        disk0.apply(d[i].path());
+    }
+
+    TmpDiffFile merged;
+    ParallelDiffMerger merger;
+    merger.setNrThreads(nrThreads);
+    merger.setMaxOpenFiles(maxOpenFiles);
+    for (size_t i = 0; i < d.size(); i++) {
+        merger.addWdiff(d[i].path());
+    }
+    CYBOZU_TEST_ASSERT(merger.mergeToFd(merged.fd(), CompressOpt(), "."));
+    CYBOZU_TEST_ASSERT(merger.getNrRanges() <= nrThreads);
+    if (maxOpenFiles > 0) {
+        CYBOZU_TEST_ASSERT(merger.getNrRanges() <= std::max<size_t>(maxOpenFiles / d.size(), 1));
+    } else if (nrThreads > 1) {
+        CYBOZU_TEST_ASSERT(merger.getNrRanges() > 1);
+    }
+    disk1.apply(merged.path());
+
+    disk0.verifyEquals(disk1);
+}
+
+CYBOZU_TEST_AUTO(wdiffMergeParallel)
+{
+    const size_t len = 4096;
+    const size_t ioNr = 256;
+    const size_t diffNr = 8;
+    for (size_t i = 0; i < 5; i++) {
+        Recipe recipe;
+        for (size_t j = 0; j < diffNr; j++) {
+            recipe.emplace_back();
+            for (size_t k = 0; k < ioNr; k++) {
+                const uint64_t ioAddr = g_rand() % len;
+                const uint32_t ioBlocks = std::min(g_rand() % 16 + 1, len - ioAddr);
+                recipe.back().push_back({ioAddr, ioBlocks});
+            }
+        }
+        SioListVec slv = generateSioListVec(recipe);
+        TmpDiffFileVec d0(diffNr), d1(diffNr), d2(diffNr);
+        makeSortedWdiffs2(d0, slv);
+        makeIndexedWdiffs(d1, slv);
+        /* sorted and indexed wdiffs mixed. */
+        for (size_t j = 0; j < diffNr; j++) {
+            if (j % 2 == 0) {
+                makeSortedWdiff2(d2[j], slv[j]);
+            } else {
+                makeIndexedWdiff(d2[j], slv[j]);
+            }
+        }
+        for (size_t nrThreads : {1, 3, 4}) {
+            verifyParallelMergedDiff(len, d0, nrThreads);
+            verifyParallelMergedDiff(len, d1, nrThreads);
+            verifyParallelMergedDiff(len, d2, nrThreads);
+        }
+        /* -maxopen limits the num of ranges. */
+        for (size_t maxOpenFiles : {diffNr, diffNr * 2 + 1}) {
+            verifyParallelMergedDiff(len, d2, 4, maxOpenFiles);
+        }
+    }
+}
+
+CYBOZU_TEST_AUTO(wdiffMergeParallelStop)
+{
+    const size_t len = 4096;
+    const size_t diffNr = 4;
+    Recipe recipe;
+    for (size_t j = 0; j < diffNr; j++) {
+        recipe.emplace_back();
+        for (size_t k = 0; k < 256; k++) {
+            const uint64_t ioAddr = g_rand() % len;
+            const uint32_t ioBlocks = std::min(g_rand() % 16 + 1, len - ioAddr);
+            recipe.back().push_back({ioAddr, ioBlocks});
+        }
+    }
+    SioListVec slv = generateSioListVec(recipe);
+    TmpDiffFileVec d(diffNr);
+    makeSortedWdiffs2(d, slv);
+
+    ParallelDiffMerger merger;
+    merger.setNrThreads(4);
+    for (size_t i = 0; i < d.size(); i++) {
+        merger.addWdiff(d[i].path());
+    }
+    merger.prepare();
+    CYBOZU_TEST_ASSERT(merger.getNrRanges() > 1);
+    /* The other ranges must not run to the end after the first range failed. */
+    std::atomic<size_t> nrCompleted(0);
+    CYBOZU_TEST_EXCEPTION(merger.run([&](size_t rangeIdx, DiffMerger &) {
+                if (rangeIdx == 0) throw cybozu::Exception("wdiffMergeParallelStop");
+                for (size_t i = 0; i < 1000; i++) {
+                    if (merger.isStopping()) return false;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+                nrCompleted++;
+                return true;
+            }), cybozu::Exception);
+    CYBOZU_TEST_ASSERT(merger.isStopping());
+    CYBOZU_TEST_EQUAL(nrCompleted.load(), 0);
+}
+
+void verifyPassThroughMergedDiff(size_t len, TmpDiffFileVec &d, uint32_t maxIoBlocks)
+{
+    TmpDisk disk0(len), disk1(len);
+    for (size_t i = 0; i < d.size(); i++) {
+        disk0.apply(d[i].path());
+    }
+
+    DiffMerger merger;
+    merger.setMaxIoBlocks(maxIoBlocks);
+    merger.setPassThroughCompressed(true);
+    for (size_t i = 0; i < d.size(); i++) {
+        merger.addWdiff(d[i].path());
+    }
+    merger.prepare();
+
+    TmpDiffFile merged;
+    SortedDiffWriter writer(merged.fd());
+    DiffFileHeader header = merger.header();
+    writer.writeHeader(header);
+    DiffRecIo recIo;
+    while (merger.getAndRemove(recIo)) {
+        const DiffRecord &rec = recIo.record();
+        if (maxIoBlocks > 0) CYBOZU_TEST_ASSERT(rec.io_blocks <= maxIoBlocks);
+        writer.compressAndWriteDiff(rec, recIo.io().data());
+    }
+    writer.close();
+    disk1.apply(merged.path());
+
+    disk0.verifyEquals(disk1);
+}
+
+CYBOZU_TEST_AUTO(wdiffMergePassThrough)
+{
+    const size_t len = 4096;
+    const size_t ioNr = 64;
+    const size_t diffNr = 4;
+    for (size_t i = 0; i < 5; i++) {
+        /* disjoint IOs: each wdiff owns its own address slice. */
+        Recipe recipe0, recipe1;
+        const uint64_t slice = len / diffNr;
+        for (size_t j = 0; j < diffNr; j++) {
+            recipe0.emplace_back();
+            recipe1.emplace_back();
+            for (size_t k = 0; k < ioNr; k++) {
+                const uint64_t ioAddr = g_rand() % len;
+                const uint32_t ioBlocks = std::min(g_rand() % 16 + 1, len - ioAddr);
+                recipe1.back().push_back({ioAddr, ioBlocks});
+            }
+            const uint64_t ioAddr = slice * j + g_rand() % (slice / 2);
+            recipe0.back().push_back({ioAddr, uint32_t(g_rand() % 16 + 1)});
+        }
+        for (const Recipe *recipe : {&recipe0, &recipe1}) {
+            SioListVec slv = generateSioListVec(*recipe);
+            TmpDiffFileVec d0(diffNr), d1(diffNr);
+            makeSortedWdiffs2(d0, slv);
+            makeIndexedWdiffs(d1, slv);
+            for (uint32_t maxIoBlocks : {0, 4}) {
+                verifyPassThroughMergedDiff(len, d0, maxIoBlocks);
+                verifyPassThroughMergedDiff(len, d1, maxIoBlocks);
+            }
+        }
+    }
+}
+
+CYBOZU_TEST_AUTO(memoryBudget)
+{
+    MemoryBudget parent(100);
+    {
+        MemoryBudget child;
+        child.setParent(&parent);
+        child.add(60);
+        CYBOZU_TEST_EQUAL(parent.getSize(), 60u);
+
+        /* acquire() waits until the parent has room. */
+        std::atomic<bool> done(false);
+        std::thread th([&]() {
+                child.acquire(50, []() { return false; });
+                done = true;
+            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        CYBOZU_TEST_ASSERT(!done);
+        child.release(20);
+        th.join();
+        CYBOZU_TEST_ASSERT(done);
+        CYBOZU_TEST_EQUAL(child.getSize(), 90u);
+        CYBOZU_TEST_EQUAL(parent.getPeakSize(), 90u);
+
+        /* add() never waits. */
+        child.add(50);
+        CYBOZU_TEST_EQUAL(parent.getSize(), 140u);
+    }
+    /* The remaining size is released at destruction. */
+    CYBOZU_TEST_EQUAL(parent.getSize(), 0u);
+}
@@ -0,0 +1,80 @@
+#include "cybozu/test.hpp"
+#include "walb_diff_spill.hpp"
+#include "tmp_file.hpp"
+#include "random.hpp"
+#include "for_walb_diff_test.hpp"
+
+using namespace walb;
+
+cybozu::util::Random<size_t> g_rand;
+
+CYBOZU_TEST_AUTO(Setup)
+{
+#if 0
+    g_rand.setSeed(1093247411);
+#endif
+    ::printf("random number generator seed: %zu\n", g_rand.getSeed());
+    setRandForTest(g_rand);
+}
+
+void testSpillingDiffMemory(size_t diskLen, size_t nIos, size_t maxMemSize, int cmprType)
+{
+    SpillingDiffMemory spillM;
+    spillM.setTmpDir(".");
+    spillM.setMaxMemSize(maxMemSize);
+    spillM.setMaxIoBlocks(16);
+    DiffMemory diffM;
+    diffM.setMaxIoBlocks(16);
+
+    for (size_t i = 0; i < nIos; i++) {
+        const uint32_t ioBlocks = g_rand() % 32 + 1;
+        const uint64_t ioAddr = g_rand() % (diskLen - ioBlocks);
+        const size_t x = g_rand() % 10;
+        const DiffRecType type = x < 8 ? DiffRecType::NORMAL : (x < 9 ? DiffRecType::ALLZERO : DiffRecType::DISCARD);
+        Sio sio;
+        sio.setRandomly(ioAddr, ioBlocks, type);
+        DiffRecord rec;
+        AlignedArray data0, data1;
+        sio.copyTo(rec, data0);
+        sio.copyTo(rec, data1);
+        diffM.add(rec, std::move(data0));
+        spillM.add(rec, std::move(data1));
+    }
+    cybozu::TmpFile file0("."), file1(".");
+    diffM.writeTo(file0.fd(), cmprType);
+    spillM.writeTo(file1.fd(), cmprType);
+    if (maxMemSize > 0) {
+        CYBOZU_TEST_ASSERT(spillM.getNRuns() > 1);
+    } else {
+        CYBOZU_TEST_EQUAL(spillM.getNRuns(), 0);
+    }
+
+    TmpDisk disk0(diskLen), disk1(diskLen);
+    disk0.apply(file0.path());
+    disk1.apply(file1.path());
+    disk0.verifyEquals(disk1);
+}
+
+CYBOZU_TEST_AUTO(NoSpill)
+{
+    testSpillingDiffMemory(1024, 1000, 0, ::WALB_DIFF_CMPR_SNAPPY);
+}
+
+CYBOZU_TEST_AUTO(Spill)
+{
+    testSpillingDiffMemory(1024, 1000, 64 * KIBI, ::WALB_DIFF_CMPR_SNAPPY);
+    testSpillingDiffMemory(1024, 1000, 64 * KIBI, ::WALB_DIFF_CMPR_NONE);
+    testSpillingDiffMemory(16 * 1024, 3000, 256 * KIBI, ::WALB_DIFF_CMPR_ZSTD);
+}
+
+CYBOZU_TEST_AUTO(SpillWithoutTmpDir)
+{
+    SpillingDiffMemory spillM;
+    spillM.setMaxMemSize(KIBI);
+    Sio sio;
+    sio.setRandomly(0, 8, DiffRecType::NORMAL);
+    DiffRecord rec;
+    AlignedArray data;
+    sio.copyTo(rec, data);
+    CYBOZU_TEST_EXCEPTION(spillM.add(rec, std::move(data)), cybozu::Exception);
+}
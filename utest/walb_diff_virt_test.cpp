@@ -0,0 +1,144 @@
+#include "cybozu/test.hpp"
+#include "walb_diff_virt.hpp"
+#include "tmp_file.hpp"
+#include "random.hpp"
+#include "for_walb_diff_test.hpp"
+
+using namespace walb;
+
+cybozu::util::Random<size_t> g_rand;
+
+const uint64_t DEV_LB = 4096;
+
+CYBOZU_TEST_AUTO(Setup)
+{
+    ::printf("random number generator seed: %zu\n", g_rand.getSeed());
+    setRandForTest(g_rand);
+}
+
+/**
+ * Sorted and not overlapped IOs in a wdiff.
+ */
+SioList generateSortedSioList(uint64_t devLb)
+{
+    SioList sl;
+    uint64_t addr = g_rand() % 64;
+    for (;;) {
+        const uint32_t blks = g_rand() % 64 + 1;
+        if (addr + blks > devLb) break;
+        sl.emplace_back();
+        sl.back().setRandomly(addr, blks);
+        addr += blks + g_rand() % 128;
+    }
+    return sl;
+}
+
+void makeWdiff(cybozu::TmpFile &file, const SioList &sl, bool isIndexed)
+{
+    DiffFileHeader header;
+    if (isIndexed) {
+        IndexedDiffWriter writer;
+        writer.setFd(file.fd());
+        writer.writeHeader(header);
+        for (const Sio &sio : sl) {
+            IndexedDiffRecord rec;
+            AlignedArray data;
+            sio.copyTo(rec, data);
+            writer.compressAndWriteDiff(rec, data.data(), ::WALB_DIFF_CMPR_SNAPPY);
+        }
+        writer.finalize();
+    } else {
+        SortedDiffWriter writer(file.fd());
+        writer.writeHeader(header);
+        for (const Sio &sio : sl) {
+            DiffRecord rec;
+            AlignedArray data;
+            sio.copyTo(rec, data);
+            writer.compressAndWriteDiff(rec, data.data(), ::WALB_DIFF_CMPR_SNAPPY);
+        }
+        writer.close();
+    }
+}
+
+std::vector<cybozu::util::File> openFiles(const std::vector<std::unique_ptr<cybozu::TmpFile> > &tmpV)
+{
+    std::vector<cybozu::util::File> fileV;
+    for (const std::unique_ptr<cybozu::TmpFile> &tmp : tmpV) {
+        fileV.emplace_back(tmp->path(), O_RDONLY);
+    }
+    return fileV;
+}
+
+std::string readAll(const std::string& path, size_t size)
+{
+    cybozu::util::File file(path, O_RDONLY);
+    std::string s(size, '\0');
+    file.read(&s[0], size);
+    return s;
+}
+
+CYBOZU_TEST_AUTO(VirtualFullImage)
+{
+    AlignedArray init(DEV_LB * LOGICAL_BLOCK_SIZE);
+    g_rand.fill(init.data(), init.size());
+    cybozu::TmpFile base(".");
+    {
+        cybozu::util::File file(base.fd());
+        file.write(init.data(), init.size());
+    }
+    /* Newer wdiffs overwrite older ones partially. Both formats are mixed. */
+    std::vector<std::unique_ptr<cybozu::TmpFile> > tmpV;
+    for (size_t i = 0; i < 4; i++) {
+        tmpV.emplace_back(new cybozu::TmpFile("."));
+        makeWdiff(*tmpV.back(), generateSortedSioList(DEV_LB), i % 2 == 1);
+    }
+
+    std::string expected(init.size(), '\0');
+    {
+        VirtualFullScanner virt;
+        virt.init(cybozu::util::File(base.path(), O_RDONLY), openFiles(tmpV));
+        virt.read(&expected[0], expected.size());
+    }
+
+    VirtualFullImage image;
+    IndexedDiffCache cache(MEBI);
+    image.setCache(cache);
+    image.init(cybozu::util::File(base.path(), O_RDONLY), openFiles(tmpV));
+    CYBOZU_TEST_EQUAL(image.sizeLb(), DEV_LB);
+    CYBOZU_TEST_ASSERT(image.getNrPieces() > 0);
+
+    AlignedArray buf(init.size());
+    image.read(0, DEV_LB, buf.data());
+    CYBOZU_TEST_ASSERT(::memcmp(buf.data(), expected.data(), expected.size()) == 0);
+    for (size_t i = 0; i < 1000; i++) {
+        const uint64_t addr = g_rand() % DEV_LB;
+        const size_t blks = g_rand() % std::min<uint64_t>(DEV_LB - addr, 256) + 1;
+        image.read(addr, blks, buf.data());
+        CYBOZU_TEST_ASSERT(::memcmp(buf.data(), &expected[addr * LOGICAL_BLOCK_SIZE], blks * LOGICAL_BLOCK_SIZE) == 0);
+    }
+    /* Beyond the base image is zero. */
+    VirtualFullImage image2;
+    image2.init(cybozu::util::File(base.path(), O_RDONLY), openFiles(tmpV), DEV_LB + 8);
+    image2.read(DEV_LB - 8, 16, buf.data());
+    CYBOZU_TEST_ASSERT(::memcmp(buf.data(), &expected[(DEV_LB - 8) * LOGICAL_BLOCK_SIZE], 8 * LOGICAL_BLOCK_SIZE) == 0);
+    CYBOZU_TEST_ASSERT(cybozu::util::isAllZero(buf.data() + 8 * LOGICAL_BLOCK_SIZE, 8 * LOGICAL_BLOCK_SIZE));
+    CYBOZU_TEST_EXCEPTION(image.read(DEV_LB - 1, 2, buf.data()), cybozu::Exception);
+
+    /* Reads are served while the image is being materialized. */
+    cybozu::TmpFile out(".");
+    {
+        VirtualFullMaterializer mat(image, cybozu::util::File(out.path(), O_RDWR), 64 * LOGICAL_BLOCK_SIZE);
+        mat.start();
+        for (size_t i = 0; i < 100; i++) {
+            const uint64_t addr = g_rand() % DEV_LB;
+            const size_t blks = g_rand() % std::min<uint64_t>(DEV_LB - addr, 256) + 1;
+            mat.read(addr, blks, buf.data());
+            CYBOZU_TEST_ASSERT(::memcmp(buf.data(), &expected[addr * LOGICAL_BLOCK_SIZE], blks * LOGICAL_BLOCK_SIZE) == 0);
+        }
+        mat.join();
+        CYBOZU_TEST_ASSERT(mat.isDone());
+        mat.read(0, DEV_LB, buf.data());
+        CYBOZU_TEST_ASSERT(::memcmp(buf.data(), expected.data(), expected.size()) == 0);
+    }
+    CYBOZU_TEST_ASSERT(readAll(out.path(), expected.size()) == expected);
+}
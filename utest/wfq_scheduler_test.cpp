@@ -0,0 +1,171 @@
+#include "cybozu/test.hpp"
+#include "wfq_scheduler.hpp"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <string>
+
+using namespace walb;
+
+CYBOZU_TEST_AUTO(wfqUnlimited)
+{
+    WfqScheduler sched;
+    for (size_t i = 0; i < 1000; i++) {
+        CYBOZU_TEST_ASSERT(sched.acquire("a", 1 << 20, 1.0));
+    }
+    CYBOZU_TEST_EQUAL(sched.getGrantedSize("a"), 1000ULL << 20);
+    CYBOZU_TEST_EQUAL(sched.getGrantedSize("b"), 0);
+    CYBOZU_TEST_EXCEPTION(sched.acquire("a", 1, 0.0), cybozu::Exception);
+}
+
+namespace {
+
+/**
+ * Time goes on only by advance().
+ */
+struct FakeClock
+{
+    using duration = std::chrono::microseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point<FakeClock>;
+    static constexpr bool is_steady = true;
+
+    static std::atomic<rep> nowUs;
+    static time_point now() { return time_point(duration(nowUs.load())); }
+    static void advance(rep us) { nowUs += us; }
+};
+
+std::atomic<FakeClock::rep> FakeClock::nowUs(0);
+
+using FakeWfqScheduler = WfqSchedulerT<FakeClock>;
+
+const uint64_t fakeBytesPerSec = 64 << 20;
+const uint64_t fakeSize = 64 << 10;
+const FakeClock::rep fakeSizeUs = fakeSize * 1000000 / fakeBytesPerSec;
+
+/**
+ * Busy flows each of which has a thread to acquire the bandwidth repeatedly.
+ */
+class Flows
+{
+    FakeWfqScheduler &sched_;
+    std::atomic<bool> quit_;
+    std::vector<std::string> idV_;
+    std::vector<std::thread> thV_;
+public:
+    explicit Flows(FakeWfqScheduler &sched) : sched_(sched), quit_(false), idV_(), thV_() {}
+    ~Flows() noexcept {
+        quit_ = true;
+        sched_.setBytesPerSec(0); // release all the waiting threads.
+        for (std::thread &th : thV_) th.join();
+    }
+    void add(const std::string &id, double weight) {
+        idV_.push_back(id);
+        thV_.emplace_back([this, id, weight]() {
+                while (!quit_) sched_.acquire(id, fakeSize, weight);
+            });
+    }
+    uint64_t getTotal() const {
+        uint64_t total = 0;
+        for (const std::string &id : idV_) total += sched_.getGrantedSize(id);
+        return total;
+    }
+    /**
+     * Advance the clock to grant one request after all the flows are waiting,
+     * so the order of grants depends on the finish tags only.
+     */
+    void grantOnce() {
+        waitFor([&]() { return sched_.getNumWaiting() == idV_.size(); });
+        const uint64_t total = getTotal();
+        FakeClock::advance(fakeSizeUs);
+        waitFor([&]() { return getTotal() > total; });
+    }
+private:
+    template <typename Pred>
+    static void waitFor(Pred pred) {
+        for (size_t i = 0; i < 100000; i++) {
+            if (pred()) return;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        throw cybozu::Exception("Flows:waitFor:timeout");
+    }
+};
+
+} // namespace
+
+CYBOZU_TEST_AUTO(wfqWeight)
+{
+    FakeWfqScheduler sched(fakeBytesPerSec);
+    Flows flows(sched);
+    flows.add("a", 1.0);
+    flows.add("b", 3.0);
+    for (size_t i = 0; i < 4; i++) flows.grantOnce();
+
+    const uint64_t a0 = sched.getGrantedSize("a");
+    const uint64_t b0 = sched.getGrantedSize("b");
+    for (size_t i = 0; i < 40; i++) flows.grantOnce();
+    const uint64_t a = (sched.getGrantedSize("a") - a0) / fakeSize;
+    const uint64_t b = (sched.getGrantedSize("b") - b0) / fakeSize;
+    CYBOZU_TEST_EQUAL(a + b, 40);
+    /* 1:3. Ties of finish tags may shift one grant. */
+    CYBOZU_TEST_ASSERT(9 <= a && a <= 11);
+}
+
+CYBOZU_TEST_AUTO(wfqIdleFlowHasNoCredit)
+{
+    FakeWfqScheduler sched(fakeBytesPerSec);
+    Flows flows(sched);
+    /* Flow "a" uses the bandwidth alone for a while. */
+    flows.add("a", 1.0);
+    for (size_t i = 0; i < 64; i++) flows.grantOnce();
+
+    flows.add("b", 1.0);
+    const uint64_t a0 = sched.getGrantedSize("a");
+    for (size_t i = 0; i < 20; i++) flows.grantOnce();
+    const uint64_t a = (sched.getGrantedSize("a") - a0) / fakeSize;
+    const uint64_t b = sched.getGrantedSize("b") / fakeSize;
+    CYBOZU_TEST_EQUAL(a + b, 20);
+    /* "a" must not wait for "b" to catch up with its past usage. */
+    CYBOZU_TEST_ASSERT(9 <= a && a <= 11);
+}
+
+CYBOZU_TEST_AUTO(wfqCancel)
+{
+    WfqScheduler sched(1 << 10);
+    CYBOZU_TEST_ASSERT(sched.acquire("a", 1 << 20, 1.0)); // The bandwidth is busy for 1024 sec.
+    std::atomic<bool> canceled(false);
+    std::thread th([&]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            canceled = true;
+        });
+    CYBOZU_TEST_ASSERT(!sched.acquire("b", 1, 1.0, [&]() { return canceled.load(); }));
+    th.join();
+    sched.setBytesPerSec(0);
+    CYBOZU_TEST_ASSERT(sched.acquire("b", 1, 1.0));
+}
+
+CYBOZU_TEST_AUTO(wfqRemoveFlow)
+{
+    WfqScheduler sched(1 << 10);
+    CYBOZU_TEST_ASSERT(sched.acquire("a", 1, 1.0));
+    CYBOZU_TEST_ASSERT(sched.acquire("b", 1, 1.0));
+    CYBOZU_TEST_EQUAL(sched.getGrantedSize("a"), 1);
+    sched.removeFlow("a");
+    CYBOZU_TEST_EQUAL(sched.getGrantedSize("a"), 0);
+    CYBOZU_TEST_EQUAL(sched.getGrantedSize("b"), 1);
+    CYBOZU_TEST_ASSERT(sched.str().find("flows 1 ") != std::string::npos);
+
+    /* Removing a waiting flow must not break its request. */
+    CYBOZU_TEST_ASSERT(sched.acquire("b", 1 << 10, 1.0)); // The bandwidth is busy for 1 sec.
+    std::thread th([&]() {
+            while (sched.getNumWaiting() == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            sched.removeFlow("c");
+        });
+    CYBOZU_TEST_ASSERT(sched.acquire("c", 1, 1.0));
+    th.join();
+    CYBOZU_TEST_EQUAL(sched.getGrantedSize("c"), 1);
+}
@@ -0,0 +1,127 @@
+#include "cybozu/test.hpp"
+#include "wlog_read_ahead.hpp"
+
+using namespace walb;
+using Params = device::WldevReadAheadParams;
+
+namespace {
+
+/**
+ * Add measurements of the current level until the tuner decides something.
+ */
+void measure(WldevReadAheadTuner &tuner, double bytesPerSec)
+{
+    const Params p = tuner.get();
+    const size_t level = tuner.level();
+    const bool isProbing = tuner.isProbing();
+    const uint64_t bytes = 16 * MEBI;
+    for (size_t i = 0; i < 1000; i++) {
+        tuner.add(p, bytes, bytes / bytesPerSec);
+        if (tuner.level() != level || tuner.isProbing() != isProbing) return;
+    }
+}
+
+} // namespace
+
+CYBOZU_TEST_AUTO(tunerLevels)
+{
+    WldevReadAheadTuner tuner({32 * MEBI, 256 * KIBI, 256});
+    CYBOZU_TEST_EQUAL(tuner.getLevelParams(0), WldevReadAheadTuner::getDefaultParams());
+    CYBOZU_TEST_EQUAL(tuner.getLevelParams(1), Params({8 * MEBI, 128 * KIBI, 64}));
+    CYBOZU_TEST_EQUAL(tuner.getLevelParams(2), Params({16 * MEBI, 128 * KIBI, 128}));
+    CYBOZU_TEST_EQUAL(tuner.getLevelParams(3), Params({32 * MEBI, 256 * KIBI, 128}));
+    CYBOZU_TEST_EQUAL(tuner.getLevelParams(4), Params({32 * MEBI, 256 * KIBI, 256}));
+    CYBOZU_TEST_EQUAL(tuner.maxLevel(), 4);
+
+    /* Caps smaller than the defaults. */
+    WldevReadAheadTuner tuner2({MEBI, 4 * KIBI, 1});
+    CYBOZU_TEST_EQUAL(tuner2.maxLevel(), 0);
+    CYBOZU_TEST_EQUAL(tuner2.get(), Params({MEBI, 4 * KIBI, 1}));
+
+    /* The IO size is limited by the buffer size. */
+    WldevReadAheadTuner tuner3({MEBI, MEBI, 512});
+    for (size_t i = 0; i <= tuner3.maxLevel(); i++) {
+        const Params p = tuner3.getLevelParams(i);
+        CYBOZU_TEST_ASSERT(p.maxIoSize * 2 <= p.bufferSize);
+    }
+    CYBOZU_TEST_EQUAL(tuner3.getLevelParams(tuner3.maxLevel()), Params({MEBI, 512 * KIBI, 512}));
+
+    WldevReadAheadTuner::verifyParams({4 * MEBI, 2 * MEBI, 1}, "test");
+    CYBOZU_TEST_EXCEPTION(WldevReadAheadTuner::verifyParams({4 * MEBI, 4 * MEBI, 1}, "test"), cybozu::Exception);
+    CYBOZU_TEST_EXCEPTION(WldevReadAheadTuner::verifyParams({4 * MEBI, MEBI, 0}, "test"), cybozu::Exception);
+}
+
+CYBOZU_TEST_AUTO(tunerClimbAndSettle)
+{
+    WldevReadAheadTuner tuner({64 * MEBI, MEBI, 512});
+    const double bps[] = {100 * MEBI, 200 * MEBI, 300 * MEBI, 310 * MEBI};
+
+    for (size_t i = 0; i < 3; i++) {
+        CYBOZU_TEST_EQUAL(tuner.level(), i);
+        CYBOZU_TEST_ASSERT(tuner.isProbing());
+        measure(tuner, bps[i]);
+    }
+    CYBOZU_TEST_EQUAL(tuner.level(), 3);
+    measure(tuner, bps[3]); // not improved enough.
+    CYBOZU_TEST_EQUAL(tuner.level(), 2);
+    CYBOZU_TEST_ASSERT(!tuner.isProbing());
+
+    /* Try the next level again after a while. */
+    measure(tuner, bps[2]);
+    CYBOZU_TEST_EQUAL(tuner.level(), 3);
+    CYBOZU_TEST_ASSERT(tuner.isProbing());
+
+    /* Measurements with other parameters are ignored. */
+    tuner.add(tuner.getLevelParams(0), GIBI, 1.0);
+    CYBOZU_TEST_EQUAL(tuner.level(), 3);
+}
+
+CYBOZU_TEST_AUTO(tunerWithinBuffer)
+{
+    WldevReadAheadTuner tuner({64 * MEBI, MEBI, 512});
+    for (size_t i = 0; i < 4; i++) measure(tuner, (i + 1) * 100 * MEBI);
+    CYBOZU_TEST_EQUAL(tuner.level(), 4);
+    CYBOZU_TEST_EQUAL(tuner.get().bufferSize, 64 * MEBI);
+    CYBOZU_TEST_EQUAL(tuner.get(20 * MEBI), tuner.getLevelParams(2));
+    CYBOZU_TEST_EQUAL(tuner.get(MEBI), WldevReadAheadTuner::getDefaultParams());
+}
+
+CYBOZU_TEST_AUTO(tunerLowerLevelUsed)
+{
+    WldevReadAheadTuner tuner({64 * MEBI, MEBI, 512});
+    measure(tuner, 100 * MEBI);
+    CYBOZU_TEST_EQUAL(tuner.level(), 1);
+
+    /* The memory budget is short so the level 0 is used. */
+    const Params p0 = tuner.get(WldevReadAheadTuner::getDefaultParams().bufferSize);
+    CYBOZU_TEST_EQUAL(p0, tuner.getLevelParams(0));
+    const uint64_t bytes = 16 * MEBI;
+    for (size_t i = 0; i < 16; i++) {
+        tuner.add(p0, bytes, bytes / double(300 * MEBI));
+    }
+    CYBOZU_TEST_EQUAL(tuner.level(), 1);
+    CYBOZU_TEST_ASSERT(tuner.isProbing());
+
+    /* The level 1 is compared with the latest throughput of the level 0. */
+    measure(tuner, 200 * MEBI);
+    CYBOZU_TEST_EQUAL(tuner.level(), 0);
+    CYBOZU_TEST_ASSERT(!tuner.isProbing());
+}
+
+CYBOZU_TEST_AUTO(budget)
+{
+    WldevReadAheadBudget budget;
+    budget.setCap(16 * MEBI);
+    {
+        WldevReadAheadBudget::Reservation r0(budget, 8 * MEBI, 4 * MEBI);
+        CYBOZU_TEST_EQUAL(r0.size(), 8 * MEBI);
+        WldevReadAheadBudget::Reservation r1(budget, 16 * MEBI, 4 * MEBI);
+        CYBOZU_TEST_EQUAL(r1.size(), 8 * MEBI);
+        /* The minimum size is always available. */
+        WldevReadAheadBudget::Reservation r2(budget, 8 * MEBI, 4 * MEBI);
+        CYBOZU_TEST_EQUAL(r2.size(), 4 * MEBI);
+        r1.shrink(4 * MEBI);
+    }
+    WldevReadAheadBudget::Reservation r3(budget, 32 * MEBI, 4 * MEBI);
+    CYBOZU_TEST_EQUAL(r3.size(), 16 * MEBI);
+}